@@ -0,0 +1,145 @@
+/**
+ * Transfers accelerator plugin for Orthanc
+ * Copyright (C) 2018-2021 Osimis S.A., Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Affero General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+#include "ByteRanges.h"
+
+#include <OrthancException.h>
+
+#include <cassert>
+
+
+namespace OrthancPlugins
+{
+  void ByteRanges::Clear()
+  {
+    ranges_.clear();
+    coveredSize_ = 0;
+  }
+
+  
+  void ByteRanges::Add(size_t offset,
+                       size_t size)
+  {
+    if (size == 0)
+    {
+      return;
+    }
+
+    size_t start = offset;
+    size_t end = offset + size;
+
+    // Merge with the range that starts before "offset", if it
+    // overlaps or touches the new range
+    Ranges::iterator it = ranges_.upper_bound(start);
+    if (it != ranges_.begin())
+    {
+      Ranges::iterator previous = it;
+      --previous;
+
+      if (previous->second >= start)
+      {
+        if (previous->second >= end)
+        {
+          return;  // Already covered
+        }
+
+        start = previous->first;
+        coveredSize_ -= previous->second - previous->first;
+        ranges_.erase(previous);
+      }
+    }
+
+    // Merge with the ranges that start inside the new range
+    it = ranges_.lower_bound(start);
+    while (it != ranges_.end() &&
+           it->first <= end)
+    {
+      if (it->second > end)
+      {
+        end = it->second;
+      }
+
+      coveredSize_ -= it->second - it->first;
+      ranges_.erase(it++);
+    }
+
+    ranges_[start] = end;
+    coveredSize_ += end - start;
+  }
+
+
+  bool ByteRanges::IsCovered(size_t offset,
+                             size_t size) const
+  {
+    if (size == 0)
+    {
+      return true;
+    }
+
+    Ranges::const_iterator it = ranges_.upper_bound(offset);
+    if (it == ranges_.begin())
+    {
+      return false;
+    }
+    else
+    {
+      --it;
+      assert(it->first <= offset);
+      return it->second >= offset + size;
+    }
+  }
+
+
+  void ByteRanges::Serialize(Json::Value& target) const
+  {
+    target = Json::arrayValue;
+
+    for (Ranges::const_iterator it = ranges_.begin(); it != ranges_.end(); ++it)
+    {
+      target.append(static_cast<Json::UInt64>(it->first));
+      target.append(static_cast<Json::UInt64>(it->second));
+    }
+  }
+
+
+  void ByteRanges::Unserialize(const Json::Value& source)
+  {
+    if (source.type() != Json::arrayValue ||
+        source.size() % 2 != 0)
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_BadFileFormat);
+    }
+
+    Clear();
+
+    for (Json::Value::ArrayIndex i = 0; i < source.size(); i += 2)
+    {
+      if (!source[i].isUInt64() ||
+          !source[i + 1].isUInt64() ||
+          source[i].asUInt64() > source[i + 1].asUInt64())
+      {
+        throw Orthanc::OrthancException(Orthanc::ErrorCode_BadFileFormat);
+      }
+
+      size_t start = static_cast<size_t>(source[i].asUInt64());
+      size_t end = static_cast<size_t>(source[i + 1].asUInt64());
+      Add(start, end - start);
+    }
+  }
+}
@@ -0,0 +1,70 @@
+/**
+ * Transfers accelerator plugin for Orthanc
+ * Copyright (C) 2018-2021 Osimis S.A., Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Affero General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+#pragma once
+
+#include <json/value.h>
+#include <map>
+#include <stddef.h>
+
+namespace OrthancPlugins
+{
+  /**
+   * Set of the byte ranges of a file that have already been received.
+   * Adjacent or overlapping ranges are merged.
+   **/
+  class ByteRanges
+  {
+  private:
+    typedef std::map<size_t, size_t>  Ranges;  // Start -> end (exclusive)
+
+    Ranges  ranges_;
+    size_t  coveredSize_;
+
+  public:
+    ByteRanges() :
+      coveredSize_(0)
+    {
+    }
+
+    void Clear();
+
+    void Add(size_t offset,
+             size_t size);
+
+    // Number of distinct bytes that are covered by the ranges
+    size_t GetCoveredSize() const
+    {
+      return coveredSize_;
+    }
+
+    size_t GetRangesCount() const
+    {
+      return ranges_.size();
+    }
+
+    bool IsCovered(size_t offset,
+                   size_t size) const;
+
+    // Flat array of "[start, end[" pairs
+    void Serialize(Json::Value& target) const;
+
+    void Unserialize(const Json::Value& source);
+  };
+}
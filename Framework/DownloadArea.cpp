@@ -19,30 +19,53 @@
 
 #include "DownloadArea.h"
 
+#include "FileRegionReader.h"
+
 #include "../Resources/Orthanc/Plugins/OrthancPluginCppWrapper.h"
 
-#include <Compression/GzipCompressor.h>
+#include <Compatibility.h>  // For std::unique_ptr
+#include <Compression/ZipWriter.h>
 #include <Logging.h>
 #include <SystemToolbox.h>
 
 #include <boost/filesystem.hpp>
 #include <boost/filesystem/fstream.hpp>
+#include <boost/thread.hpp>
+#include <zlib.h>
+
+#if !defined(_WIN32)
+#  include <errno.h>
+#  include <fcntl.h>
+#  include <sys/stat.h>
+#  include <unistd.h>
+#endif
+
+static const char* const STATE_FILENAME = "state.json";
+static const char* const TRANSFER_FILENAME = "transfer.dat";
+static const char* const KEY_TRANSFER_FILE_SIZE = "TransferFileSize";
+
+// Size of the buffer that receives the inflated content of a bucket
+static const size_t GZIP_WINDOW_SIZE = 256 * 1024;
+
+// Upper bound on the size of the ZIP archive that imports a batch of
+// instances with one single call to the REST API of Orthanc
+static const size_t MAX_COMMIT_BATCH_SIZE = 64 * 1024 * 1024;
 
 namespace OrthancPlugins
 {
-  class DownloadArea::Instance::Writer : public boost::noncopyable
+  class DownloadArea::Writer : public boost::noncopyable
   {
   private:
     boost::filesystem::ofstream stream_;
         
   public:
-    Writer(Orthanc::TemporaryFile& f,
+    Writer(const std::string& path,
            bool create) 
     {
       if (create)
       {
         // Create the file.
-        stream_.open(f.GetPath(), std::ofstream::out | std::ofstream::binary);
+        stream_.open(path, std::ofstream::out | std::ofstream::binary);
       }
       else
       {
@@ -50,12 +73,12 @@ namespace OrthancPlugins
         // necessary, otherwise previous content is lost by
         // truncation (as an ofstream defaults to std::ios::trunc,
         // the flag to truncate the existing content).
-        stream_.open(f.GetPath(), std::ofstream::in | std::ofstream::out | std::ofstream::binary);
+        stream_.open(path, std::ofstream::in | std::ofstream::out | std::ofstream::binary);
       }
 
       if (!stream_.good())
       {
-        throw Orthanc::OrthancException(Orthanc::ErrorCode_CannotWriteFile, std::string("Unable to write to ") + f.GetPath());
+        throw Orthanc::OrthancException(Orthanc::ErrorCode_CannotWriteFile, "Unable to write to " + path);
       }
     }
 
@@ -69,252 +92,1949 @@ namespace OrthancPlugins
   };
 
 
-  DownloadArea::Instance::Instance(const DicomInstanceInfo& info) :
-    info_(info)
+  /**
+   * Inflates a gzip buffer piece by piece, which avoids holding the
+   * whole uncompressed content of a bucket in RAM. The format is the
+   * one of "Orthanc::GzipCompressor", without the uncompressed size
+   * as a prefix.
+   **/
+  class GzipInflater : public boost::noncopyable
   {
-    Writer writer(file_, true);
+  private:
+    z_stream  stream_;
+    bool      isEnd_;
 
-    // Create a sparse file of expected size
-    if (info_.GetSize() != 0)
+  public:
+    GzipInflater(const void* data,
+                 size_t size) :
+      isEnd_(false)
     {
-      writer.Write(info_.GetSize() - 1, "", 1);
-    }
-  }
+      memset(&stream_, 0, sizeof(stream_));
+      stream_.next_in = const_cast<Bytef*>(reinterpret_cast<const Bytef*>(data));
+      stream_.avail_in = static_cast<uInt>(size);
 
+      if (static_cast<size_t>(stream_.avail_in) != size)
+      {
+        throw Orthanc::OrthancException(Orthanc::ErrorCode_NotEnoughMemory, "Bucket is too large to be inflated");
+      }
 
-  void DownloadArea::Instance::WriteChunk(size_t offset,
-                                          const void* data,
-                                          size_t size)
-  {
-    if (offset + size > info_.GetSize())
-    {
-      throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange, "WriteChunk out of bounds");
+      // "16 + MAX_WBITS" means a gzip header
+      if (inflateInit2(&stream_, 16 + MAX_WBITS) != Z_OK)
+      {
+        throw Orthanc::OrthancException(Orthanc::ErrorCode_InternalError, "Cannot initialize zlib");
+      }
     }
-    else if (size > 0)
+
+    ~GzipInflater()
     {
-      Writer writer(file_, false);
-      writer.Write(offset, data, size);
+      inflateEnd(&stream_);
     }
-  }
-
-  
-  void DownloadArea::Instance::Commit(bool simulate) const
-  {
-    std::string content;
-    Orthanc::SystemToolbox::ReadFile(content, file_.GetPath());
-
-    std::string md5;
-    Orthanc::Toolbox::ComputeMD5(md5, content);
 
-    if (md5 == info_.GetMD5())
+    // Returns the number of bytes that were inflated, which is smaller
+    // than "size" only if the end of the stream is reached
+    size_t Read(void* target,
+                size_t size)
     {
-      if (!simulate)
+      stream_.next_out = reinterpret_cast<Bytef*>(target);
+      stream_.avail_out = static_cast<uInt>(size);
+
+      while (!isEnd_ &&
+             stream_.avail_out > 0)
       {
-        Json::Value result;
-        if (!RestApiPost(result, "/instances", 
-                         content.empty() ? NULL : content.c_str(), content.size(),
-                         false))
+        int code = inflate(&stream_, Z_NO_FLUSH);
+
+        if (code == Z_STREAM_END)
+        {
+          isEnd_ = true;
+        }
+        else if (code != Z_OK ||
+                 (stream_.avail_in == 0 && stream_.avail_out > 0))
         {
-          LOG(ERROR) << "Cannot import a transfered DICOM instance into Orthanc: "
-                     << info_.GetId();
-          throw Orthanc::OrthancException(Orthanc::ErrorCode_CorruptedFile);
+          throw Orthanc::OrthancException(Orthanc::ErrorCode_BadFileFormat, "Corrupted gzip bucket");
         }
       }
+
+      return size - stream_.avail_out;
     }
-    else
+
+    bool IsEnd() const
     {
-      LOG(ERROR) << "Bad MD5 sum in a transfered DICOM instance: " << info_.GetId();
-      throw Orthanc::OrthancException(Orthanc::ErrorCode_CorruptedFile);
+      return isEnd_;
     }
-  }
+  };
 
 
-  void DownloadArea::Clear()
+  static void CheckInstanceMD5(const DicomInstanceInfo& info,
+                               const void* content,
+                               size_t size)
   {
-    for (Instances::iterator it = instances_.begin(); 
-         it != instances_.end(); ++it)
+    std::string md5;
+    Orthanc::Toolbox::ComputeMD5(md5, content, size);
+
+    if (md5 != info.GetMD5())
     {
-      if (it->second != NULL)
-      {
-        delete it->second;
-        it->second = NULL;
-      }
+      LOG(ERROR) << "Bad MD5 sum in a transfered DICOM instance: " << info.GetId();
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_CorruptedFile);
     }
-
-    instances_.clear();
   }
 
 
-  DownloadArea::Instance& DownloadArea::LookupInstance(const std::string& id)
+  /**
+   * Gives a read-only access to the content of an instance, which is
+   * either in RAM, or in a file that is mapped into memory.
+   **/
+  class DownloadArea::Instance::Reader : public boost::noncopyable
   {
-    Instances::iterator it = instances_.find(id);
+  private:
+    std::unique_ptr<FileRegionReader>  file_;
+    const void*                        data_;
+    size_t                             size_;
 
-    if (it == instances_.end())
+  public:
+    explicit Reader(const Instance& instance) :
+      data_(NULL),
+      size_(0)
     {
-      throw Orthanc::OrthancException(Orthanc::ErrorCode_UnknownResource, "Unknown instance");
+      if (instance.IsInMemory())
+      {
+        data_ = instance.memory_.empty() ? NULL : &instance.memory_[0];
+        size_ = instance.memory_.size();
+      }
+      else if (instance.hasFile_ &&
+               instance.info_.GetSize() != 0)
+      {
+        file_.reset(new FileRegionReader(instance.path_, instance.fileOffset_, instance.info_.GetSize()));
+        data_ = file_->GetData();
+        size_ = file_->GetSize();
+      }
+      else
+      {
+        // No chunk was received, which is only valid for an empty instance
+      }
     }
-    else if (it->first != id ||
-             it->second == NULL)
+
+    const void* GetData() const
     {
-      throw Orthanc::OrthancException(Orthanc::ErrorCode_InternalError);
+      return data_;
     }
-    else
+
+    size_t GetSize() const
     {
-      return *it->second;
+      return size_;
     }
-  }
+  };
 
 
-  void DownloadArea::WriteUncompressedBucket(const TransferBucket& bucket,
-                                             const void* data,
-                                             size_t size)
+  /**
+   * File that is shared by all the instances of a download area that
+   * are stored on the disk, each of them at a fixed offset. It is
+   * created as a sparse file when the first chunk is received.
+   **/
+  class DownloadArea::TransferFile : public boost::noncopyable
   {
-    if (size != bucket.GetTotalSize())
+  private:
+    boost::mutex                             mutex_;
+    TemporaryStorage&                        storage_;
+    std::unique_ptr<Orthanc::TemporaryFile>  file_;  // Unset if in the work directory
+    std::string                              path_;
+    size_t                                   size_;
+    bool                                     isResumed_;
+    bool                                     isCreated_;
+
+  public:
+    // "previousSize" is the size of the file that was saved in the
+    // state of the interrupted transfer (0 if none). The file only
+    // grows if new instances are appended to the previous layout.
+    TransferFile(TemporaryStorage& storage,
+                 const std::string& persistentPath,
+                 size_t previousSize,
+                 size_t size) :
+      storage_(storage),
+      path_(persistentPath),
+      size_(size),
+      isResumed_(false),
+      isCreated_(false)
     {
-      throw Orthanc::OrthancException(Orthanc::ErrorCode_NetworkProtocol, 
-        "WriteUncompressedBucket: " + boost::lexical_cast<std::string>(size) + " != " + boost::lexical_cast<std::string>(bucket.GetTotalSize()));
+      assert(previousSize <= size);
+
+      if (!persistentPath.empty() &&
+          boost::filesystem::is_regular_file(persistentPath))
+      {
+        if (previousSize != 0 &&
+            boost::filesystem::file_size(persistentPath) == previousSize)
+        {
+          if (size > previousSize)
+          {
+            Writer writer(path_, false);
+            writer.Write(size - 1, "", 1);
+          }
+
+          isResumed_ = true;
+          isCreated_ = true;
+        }
+        else
+        {
+          LOG(WARNING) << "The layout of an interrupted transfer does not match its state, "
+                       << "its received data is discarded: " << persistentPath;
+        }
+      }
     }
 
-    if (size == 0)
+    // Whether the file was left by an interrupted transfer
+    bool IsResumed() const
     {
-      return;
+      return isResumed_;
     }
 
-    size_t pos = 0;
+    size_t GetSize() const
+    {
+      return size_;
+    }
 
-    for (size_t i = 0; i < bucket.GetChunksCount(); i++)
+    std::string Create()
     {
-      size_t chunkSize = bucket.GetChunkSize(i);
-      size_t offset = bucket.GetChunkOffset(i);
+      boost::mutex::scoped_lock lock(mutex_);
 
-      if (pos + chunkSize > size)
+      if (!isCreated_)
       {
-        throw Orthanc::OrthancException(Orthanc::ErrorCode_InternalError);
-      }
+        if (path_.empty())
+        {
+          file_.reset(storage_.CreateTemporaryFile());
+          path_ = file_->GetPath();
+        }
 
-      Instance& instance = LookupInstance(bucket.GetChunkInstanceId(i));
-      instance.WriteChunk(offset, reinterpret_cast<const char*>(data) + pos, chunkSize);
+        Writer writer(path_, true);
 
-      pos += chunkSize;
-    }
+        if (size_ != 0)
+        {
+          writer.Write(size_ - 1, "", 1);
+        }
 
-    if (pos != size)
-    {
-      throw Orthanc::OrthancException(Orthanc::ErrorCode_InternalError);
+        isCreated_ = true;
+      }
+
+      return path_;
     }
-  }
+  };
 
 
-  void DownloadArea::Setup(const std::vector<DicomInstanceInfo>& instances)
+  class DownloadArea::Committer : public boost::noncopyable
   {
-    totalSize_ = 0;
-      
-    for (size_t i = 0; i < instances.size(); i++)
+  private:
+    typedef std::list<Instance*>  Queue;
+
+    boost::mutex                 mutex_;
+    boost::condition_variable    queueChanged_;
+    boost::condition_variable    completed_;
+    TemporaryStorage*            storage_;   // Can be NULL
+    Queue                        queue_;
+    bool                         isClosed_;  // No more instances will be enqueued
+    size_t                       batchSize_;
+    bool                         continue_;
+    bool                         isFailure_;
+    Orthanc::ErrorCode           error_;
+    size_t                       runningBatches_;
+    size_t                       committedInstancesCount_;
+    uint64_t                     committedSize_;
+    size_t                       previousInstancesCount_;  // Committed before this committer
+    boost::posix_time::ptime     start_;
+    boost::posix_time::ptime     lastUpdate_;
+    std::vector<boost::thread*>  workers_;
+
+    static void ImportArchive(const std::vector<Instance*>& batch,
+                              Orthanc::TemporaryFile& archive)
     {
-      const std::string& id = instances[i].GetId();
-        
-      assert(instances_.find(id) == instances_.end());
-      instances_[id] = new Instance(instances[i]);
+      {
+        Orthanc::ZipWriter writer;
+        writer.SetOutputPath(archive.GetPath().c_str());
+        writer.SetCompressionLevel(0);
+        writer.Open();
 
-      totalSize_ += instances[i].GetSize();
+        for (size_t i = 0; i < batch.size(); i++)
+        {
+          batch[i]->AddToArchive(writer);
+        }
+
+        writer.Close();
+      }
+
+      // Map the archive into memory instead of copying it into the heap
+      FileRegionReader content(archive.GetPath(), 0,
+                               static_cast<size_t>(Orthanc::SystemToolbox::GetFileSize(archive.GetPath())));
+
+      Json::Value result;
+      if (!RestApiPost(result, "/instances", content.GetData(), content.GetSize(), false) ||
+          result.type() != Json::arrayValue ||
+          result.size() != batch.size())
+      {
+        LOG(ERROR) << "Cannot import a ZIP archive of " << batch.size()
+                   << " transfered DICOM instances into Orthanc";
+        throw Orthanc::OrthancException(Orthanc::ErrorCode_CorruptedFile);
+      }
     }
-  }
-    
 
-  void DownloadArea::CommitInternal(bool simulate)
-  {
-    boost::mutex::scoped_lock lock(mutex_);
-      
-    for (Instances::iterator it = instances_.begin(); 
-         it != instances_.end(); ++it)
+    void CommitBatch(const std::vector<Instance*>& batch)
     {
-      if (it->second != NULL)
+      // Upper bound on the size of the ZIP archive of the batch: The
+      // instances are stored without compression, plus their headers
+      static const size_t ARCHIVE_ENTRY_OVERHEAD = 512;
+
+      size_t archiveSize = 0;
+      for (size_t i = 0; i < batch.size(); i++)
       {
-        it->second->Commit(simulate);
-        delete it->second;
-        it->second = NULL;
+        archiveSize += batch[i]->GetInfo().GetSize() + ARCHIVE_ENTRY_OVERHEAD;
+      }
+
+      if (batch.size() == 1)
+      {
+        batch[0]->Commit(false);
+      }
+      else if (storage_ == NULL)
+      {
+        // Import the whole batch with a single call to the REST API
+        // of Orthanc. The DICOM files are not compressed once again.
+        Orthanc::TemporaryFile archive;
+        ImportArchive(batch, archive);
+      }
+      else if (storage_->ReserveDisk(archiveSize, archiveSize))
+      {
+        // The archive is written in the directory of the temporary
+        // storage, and counts in its disk quota while it exists
+        try
+        {
+          std::unique_ptr<Orthanc::TemporaryFile> archive(storage_->CreateTemporaryFile());
+          ImportArchive(batch, *archive);
+        }
+        catch (...)
+        {
+          storage_->ReleaseUnallocatedDisk(archiveSize);
+          storage_->ReleaseDisk(archiveSize);
+          throw;
+        }
+
+        storage_->ReleaseUnallocatedDisk(archiveSize);
+        storage_->ReleaseDisk(archiveSize);
       }
       else
       {
-        throw Orthanc::OrthancException(Orthanc::ErrorCode_InternalError);
+        // No room for the archive in the quota, import the instances
+        // of the batch one by one
+        for (size_t i = 0; i < batch.size(); i++)
+        {
+          batch[i]->Commit(false);
+        }
+      }
+
+      for (size_t i = 0; i < batch.size(); i++)
+      {
+        batch[i]->Release();
       }
     }
-  }
 
+    bool DequeueBatch(std::vector<Instance*>& batch)
+    {
+      boost::mutex::scoped_lock lock(mutex_);
 
-  DownloadArea::DownloadArea(const TransferScheduler& scheduler)
-  {
-    std::vector<DicomInstanceInfo> instances;
-    scheduler.ListInstances(instances);
-    Setup(instances);
-  }
+      batch.clear();
+
+      // In streaming mode, wait for the next complete instance
+      while (continue_ &&
+             !isFailure_ &&
+             !isClosed_ &&
+             queue_.empty())
+      {
+        queueChanged_.wait(lock);
+      }
+        
+      if (!continue_ ||
+          isFailure_)
+      {
+        return false;
+      }
 
+      // The batch is also bounded by the size of its instances, as
+      // the ZIP archive is loaded into RAM to be imported
+      size_t batchBytes = 0;
 
-  void DownloadArea::WriteBucket(const TransferBucket& bucket,
-                                 const void* data,
-                                 size_t size,
-                                 BucketCompression compression)
-  {
-    boost::mutex::scoped_lock lock(mutex_);
-      
-    switch (compression)
-    {
-      case BucketCompression_None:
-        WriteUncompressedBucket(bucket, data, size);
-        break;
-          
-      case BucketCompression_Gzip:
+      while (!queue_.empty() &&
+             batch.size() < batchSize_ &&
+             (batch.empty() ||
+              batchBytes + queue_.front()->GetInfo().GetSize() <= MAX_COMMIT_BATCH_SIZE))
       {
-        std::string uncompressed;
-        Orthanc::GzipCompressor compressor;
-        compressor.Uncompress(uncompressed, data, size);
-        WriteUncompressedBucket(bucket, uncompressed.c_str(), uncompressed.size());
-        break;
+        batchBytes += queue_.front()->GetInfo().GetSize();
+        batch.push_back(queue_.front());
+        queue_.pop_front();
       }
 
-      default:          
-        throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
+      if (batch.empty())
+      {
+        return false;
+      }
+      else
+      {
+        runningBatches_++;
+        return true;
+      }
     }
-  }
-
 
-  void DownloadArea::WriteInstance(const std::string& instanceId,
-                                   const void* data,
-                                   size_t size)
-  {
-    std::string md5;
-    Orthanc::Toolbox::ComputeMD5(md5, data, size);
-      
+    void SignalBatch(const std::vector<Instance*>& batch,
+                     bool success,
+                     Orthanc::ErrorCode error)
     {
       boost::mutex::scoped_lock lock(mutex_);
 
-      Instances::const_iterator it = instances_.find(instanceId);
-      if (it == instances_.end() ||
-          it->second == NULL ||
-          it->second->GetInfo().GetId() != instanceId ||
-          it->second->GetInfo().GetSize() != size ||
-          it->second->GetInfo().GetMD5() != md5)
+      assert(runningBatches_ > 0);
+      runningBatches_--;
+
+      if (success)
       {
-        throw Orthanc::OrthancException(Orthanc::ErrorCode_CorruptedFile);
+        for (size_t i = 0; i < batch.size(); i++)
+        {
+          committedSize_ += batch[i]->GetInfo().GetSize();
+        }
+
+        committedInstancesCount_ += batch.size();
+        lastUpdate_ = boost::posix_time::microsec_clock::local_time();
+      }
+      else if (!isFailure_)
+      {
+        isFailure_ = true;
+        error_ = error;
+        queueChanged_.notify_all();
+      }
+
+      completed_.notify_all();
+    }
+
+    static void Worker(Committer* that)
+    {
+      std::vector<Instance*> batch;
+
+      while (that->DequeueBatch(batch))
+      {
+        try
+        {
+          that->CommitBatch(batch);
+          that->SignalBatch(batch, true, Orthanc::ErrorCode_Success);
+        }
+        catch (Orthanc::OrthancException& e)
+        {
+          LOG(ERROR) << "Error while committing a transfer: " << e.What();
+          that->SignalBatch(batch, false, e.GetErrorCode());
+        }
+      }
+    }
+
+    DownloadArea::CommitStatus GetStatusInternal() const
+    {
+      if (isFailure_)
+      {
+        return CommitStatus_Failure;
+      }
+      else if (isClosed_ &&
+               queue_.empty() &&
+               runningBatches_ == 0)
+      {
+        return CommitStatus_Success;
       }
       else
       {
-        it->second->WriteChunk(0, data, size);
+        return CommitStatus_Running;
       }
     }
-  }
 
+  public:
+    Committer(TemporaryStorage* storage,
+              const Queue& instances,
+              bool isClosed,
+              size_t threadsCount,
+              size_t batchSize,
+              size_t committedInstancesCount,
+              uint64_t committedSize) :
+      storage_(storage),
+      queue_(instances),
+      isClosed_(isClosed),
+      batchSize_(batchSize),
+      continue_(true),
+      isFailure_(false),
+      error_(Orthanc::ErrorCode_Success),
+      runningBatches_(0),
+      committedInstancesCount_(committedInstancesCount),
+      committedSize_(committedSize),
+      previousInstancesCount_(committedInstancesCount),
+      start_(boost::posix_time::microsec_clock::local_time()),
+      lastUpdate_(start_)
+    {
+      if (threadsCount == 0 ||
+          batchSize == 0)
+      {
+        throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
+      }
 
-  void DownloadArea::CheckMD5()
-  {
-    LOG(INFO) << "Checking MD5 sum without committing (testing)";
-    CommitInternal(true);
-  }
+      workers_.resize(threadsCount);
 
+      for (size_t i = 0; i < threadsCount; i++)
+      {
+        workers_[i] = new boost::thread(Worker, this);
+      }
+    }
 
-  void DownloadArea::Commit()
-  {
-    LOG(INFO) << "Importing transfered DICOM files from the temporary download area into Orthanc";
-    CommitInternal(false);
+    ~Committer()
+    {
+      {
+        boost::mutex::scoped_lock lock(mutex_);
+        continue_ = false;
+        queueChanged_.notify_all();
+      }
+
+      for (size_t i = 0; i < workers_.size(); i++)
+      {
+        if (workers_[i] != NULL)
+        {
+          if (workers_[i]->joinable())
+          {
+            workers_[i]->join();
+          }
+
+          delete workers_[i];
+        }
+      }
+    }
+
+    bool IsClosed()
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+      return isClosed_;
+    }
+
+    void Enqueue(Instance& instance)
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+
+      if (!isClosed_)
+      {
+        queue_.push_back(&instance);
+        queueChanged_.notify_one();
+      }
+    }
+
+    void Close(const Queue& remaining)
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+
+      queue_.insert(queue_.end(), remaining.begin(), remaining.end());
+      isClosed_ = true;
+      queueChanged_.notify_all();
+    }
+
+    DownloadArea::CommitStatus WaitComplete(unsigned int timeoutMS)
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+
+      CommitStatus status = GetStatusInternal();
+
+      if (status == CommitStatus_Running)
+      {
+        completed_.timed_wait(lock, boost::posix_time::milliseconds(timeoutMS));
+        return GetStatusInternal();
+      }
+      else
+      {
+        return status;
+      }
+    }
+
+    Orthanc::ErrorCode GetError()
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+      return error_;
+    }
+
+    void GetStatistics(size_t& committedInstancesCount,
+                       uint64_t& committedSize,
+                       float& instancesPerSecond)
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+
+      committedInstancesCount = committedInstancesCount_;
+      committedSize = committedSize_;
+
+      double ms = static_cast<double>((lastUpdate_ - start_).total_milliseconds());
+
+      if (ms < 10.0)
+      {
+        // Prevents division by zero on very quick commits
+        instancesPerSecond = 0;
+      }
+      else
+      {
+        // Only the instances that were imported since this committer
+        // was started are taken into account (e.g. after a resume)
+        assert(committedInstancesCount_ >= previousInstancesCount_);
+        instancesPerSecond = static_cast<float>(
+          static_cast<double>(committedInstancesCount_ - previousInstancesCount_) * 1000.0 /*ms*/ / ms);
+      }
+    }
+  };
+
+
+  void DownloadArea::Instance::ReadChunk(std::string& target,
+                                         size_t offset,
+                                         size_t size) const
+  {
+    assert(offset + size <= info_.GetSize());
+
+    if (IsInMemory())
+    {
+      target.assign(&memory_[offset], size);
+    }
+    else
+    {
+      boost::filesystem::ifstream stream;
+      stream.open(path_, std::ifstream::in | std::ifstream::binary);
+
+      target.resize(size);
+      if (size > 0)
+      {
+        stream.seekg(offset);
+        stream.read(&target[0], size);
+      }
+
+      if (!stream.good())
+      {
+        throw Orthanc::OrthancException(Orthanc::ErrorCode_InexistentFile, "Unable to read back from " + path_);
+      }
+    }
+  }
+
+
+  void DownloadArea::Instance::UpdateDigest(size_t offset,
+                                            const void* data,
+                                            size_t size)
+  {
+    // "statusMutex_" must be locked by the caller
+
+    if (digestStatus_ != DigestStatus_Pending)
+    {
+      // Some bytes have been written twice
+      digestStatus_ = DigestStatus_Unavailable;
+      return;
+    }
+
+    if (offset > md5_.GetSize())
+    {
+      // Out-of-order chunk: It will be hashed once the gap is filled
+      PendingChunks::const_iterator found = pendingChunks_.find(offset);
+      if (found != pendingChunks_.end())
+      {
+        pendingChunks_.clear();
+        digestStatus_ = DigestStatus_Unavailable;
+      }
+      else
+      {
+        pendingChunks_[offset] = size;
+      }
+
+      return;
+    }
+    else if (offset < md5_.GetSize())
+    {
+      pendingChunks_.clear();
+      digestStatus_ = DigestStatus_Unavailable;
+      return;
+    }
+
+    md5_.Append(data, size);
+
+    while (!pendingChunks_.empty())
+    {
+      PendingChunks::iterator next = pendingChunks_.begin();
+
+      if (next->first == md5_.GetSize())
+      {
+        std::string chunk;
+        ReadChunk(chunk, next->first, next->second);
+        md5_.Append(chunk);
+        pendingChunks_.erase(next);
+      }
+      else if (next->first < md5_.GetSize())
+      {
+        // Overlapping chunks
+        pendingChunks_.clear();
+        digestStatus_ = DigestStatus_Unavailable;
+        return;
+      }
+      else
+      {
+        break;
+      }
+    }
+
+    if (md5_.GetSize() == info_.GetSize())
+    {
+      std::string md5;
+      md5_.GetDigest(md5);
+
+      if (md5 == info_.GetMD5())
+      {
+        digestStatus_ = DigestStatus_Valid;
+      }
+      else
+      {
+        LOG(ERROR) << "Bad MD5 sum in a transfered DICOM instance: " << info_.GetId();
+        digestStatus_ = DigestStatus_Invalid;
+      }
+    }
+  }
+
+
+  bool DownloadArea::Instance::UpdateStatus(size_t offset,
+                                            const void* data,
+                                            size_t size)
+  {
+    boost::mutex::scoped_lock lock(statusMutex_);
+
+    bool wasComplete = (received_.GetCoveredSize() == info_.GetSize());
+
+    received_.Add(offset, size);
+    UpdateDigest(offset, data, size);
+
+    return (!wasComplete &&
+            received_.GetCoveredSize() == info_.GetSize());
+  }
+
+
+  DownloadArea::Instance::Instance(const DicomInstanceInfo& info,
+                                   TemporaryStorage* storage,
+                                   bool allowMemory,
+                                   const std::string& persistentPath,
+                                   TransferFile* transferFile,
+                                   size_t fileOffset,
+                                   const Json::Value& previousState) :
+    info_(info),
+    memoryStorage_(NULL),
+    diskStorage_(NULL),
+    isUnallocated_(false),
+    fileStorage_(NULL),
+    transferFile_(transferFile),
+    fileOffset_(transferFile == NULL ? 0 : fileOffset),
+    isOnDisk_(false),
+    isNewFile_(false),
+    isCommitted_(false),
+    hasFile_(false),
+    digestStatus_(DigestStatus_Pending)
+  {
+    if ((!persistentPath.empty() || transferFile != NULL) &&
+        previousState.type() == Json::objectValue)
+    {
+      if (previousState.isMember(KEY_COMMITTED) &&
+          previousState[KEY_COMMITTED].asBool())
+      {
+        // Already stored by Orthanc before the interruption
+        isCommitted_ = true;
+        return;
+      }
+      else if (previousState.isMember(KEY_RANGES) &&
+               (transferFile != NULL ?
+                transferFile->IsResumed() :
+                (boost::filesystem::is_regular_file(persistentPath) &&
+                 boost::filesystem::file_size(persistentPath) == info_.GetSize())))
+      {
+        received_.Unserialize(previousState[KEY_RANGES]);
+        isOnDisk_ = true;
+        hasFile_ = true;
+        path_ = (transferFile != NULL ? transferFile->Create() : persistentPath);
+
+        // The MD5 sum will be computed at the commit
+        digestStatus_ = DigestStatus_Unavailable;
+        return;
+      }
+    }
+
+    if (storage != NULL &&
+        allowMemory &&
+        storage->ReserveMemory(info_.GetSize()))
+    {
+      memoryStorage_ = storage;
+      memory_.resize(info_.GetSize());
+    }
+    else
+    {
+      // Not enough RAM (or RAM is not allowed): Spill to the disk. The
+      // file is created by "CreateFile()", so that huge transfers do
+      // not create thousands of files before receiving any byte.
+      fileStorage_ = storage;
+
+      if (transferFile == NULL)
+      {
+        path_ = persistentPath;  // If empty, a temporary file will be created
+      }
+      isOnDisk_ = true;
+      isNewFile_ = true;
+    }
+  }
+
+
+  void DownloadArea::Instance::CreateFile()
+  {
+    // The caller holds a shared lock on "storageMutex_"
+    boost::mutex::scoped_lock lock(fileMutex_);
+
+    if (hasFile_)
+    {
+      return;
+    }
+
+    if (transferFile_ != NULL)
+    {
+      path_ = transferFile_->Create();
+      Preallocate();
+      ReleaseUnallocated();
+      hasFile_ = true;
+      return;
+    }
+
+    if (path_.empty())
+    {
+      file_.reset(fileStorage_ == NULL ? new Orthanc::TemporaryFile : fileStorage_->CreateTemporaryFile());
+      path_ = file_->GetPath();
+    }
+
+    {
+      Writer writer(path_, true);
+
+      // Create a sparse file of expected size
+      if (info_.GetSize() != 0)
+      {
+        writer.Write(info_.GetSize() - 1, "", 1);
+      }
+    }
+
+    Preallocate();
+    ReleaseUnallocated();
+    hasFile_ = true;
+  }
+
+
+  void DownloadArea::Instance::ReleaseUnallocated()
+  {
+    if (isUnallocated_)
+    {
+      assert(diskStorage_ != NULL);
+      diskStorage_->ReleaseUnallocatedDisk(info_.GetSize());
+      isUnallocated_ = false;
+    }
+  }
+
+
+  DownloadArea::Instance::~Instance()
+  {
+    ReleaseUnallocated();
+
+    if (memoryStorage_ != NULL)
+    {
+      memoryStorage_->ReleaseMemory(info_.GetSize());
+    }
+
+    if (diskStorage_ != NULL)
+    {
+      diskStorage_->ReleaseDisk(info_.GetSize());
+    }
+  }
+
+
+  void DownloadArea::Instance::SetDiskReservation(TemporaryStorage& storage)
+  {
+    if (!IsOnDisk() ||
+        diskStorage_ != NULL)
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_BadSequenceOfCalls);
+    }
+    else
+    {
+      diskStorage_ = &storage;
+
+      // The space of a new file is accounted as reserved on the
+      // filesystem until the file is preallocated
+      isUnallocated_ = isNewFile_;
+    }
+  }
+
+
+  void DownloadArea::Instance::Preallocate()
+  {
+#if defined(__linux__)
+    if (info_.GetSize() == 0)
+    {
+      return;
+    }
+
+    int fd = open(path_.c_str(), O_WRONLY);
+    if (fd < 0)
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_CannotWriteFile, "Unable to write to " + path_);
+    }
+
+    // Contrarily to "posix_fallocate()", "fallocate()" fails instead
+    // of writing zeros if the filesystem has no native support
+    int result = fallocate(fd, 0, fileOffset_, info_.GetSize());
+    int error = errno;
+    close(fd);
+
+    if (result != 0 &&
+        error == ENOSPC)
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_FullStorage,
+                                      "No space left to preallocate a transfered DICOM instance");
+    }
+
+    // Other errors (e.g. EOPNOTSUPP) are ignored: The file stays sparse
+#endif
+  }
+
+
+  bool DownloadArea::Instance::WriteChunk(size_t offset,
+                                          const void* data,
+                                          size_t size)
+  {
+    if (offset + size > info_.GetSize())
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange, "WriteChunk out of bounds");
+    }
+
+    boost::shared_lock<boost::shared_mutex> lock(storageMutex_);
+
+    if (isCommitted_)
+    {
+      // Chunk received twice (e.g. retried HTTP query), whereas the
+      // instance is already stored by Orthanc
+      return false;
+    }
+
+    if (size > 0)
+    {
+      if (IsInMemory())
+      {
+        memcpy(&memory_[offset], data, size);
+      }
+      else
+      {
+        CreateFile();
+
+        Writer writer(path_, false);
+        writer.Write(fileOffset_ + offset, data, size);
+      }
+    }
+
+    return UpdateStatus(offset, data, size);
+  }
+
+
+  bool DownloadArea::Instance::IsVerified()
+  {
+    boost::mutex::scoped_lock lock(statusMutex_);
+    return digestStatus_ == DigestStatus_Valid;
+  }
+
+
+  bool DownloadArea::Instance::IsComplete()
+  {
+    boost::mutex::scoped_lock lock(statusMutex_);
+    return received_.GetCoveredSize() == info_.GetSize();
+  }
+
+
+  bool DownloadArea::Instance::IsCommitted()
+  {
+    boost::shared_lock<boost::shared_mutex> lock(storageMutex_);
+    return isCommitted_;
+  }
+
+
+  size_t DownloadArea::Instance::GetReceivedSize()
+  {
+    boost::mutex::scoped_lock lock(statusMutex_);
+    return received_.GetCoveredSize();
+  }
+
+
+  bool DownloadArea::Instance::IsReceived(size_t offset,
+                                          size_t size)
+  {
+    if (IsCommitted())
+    {
+      return true;
+    }
+    else
+    {
+      boost::mutex::scoped_lock lock(statusMutex_);
+      return received_.IsCovered(offset, size);
+    }
+  }
+
+
+  bool DownloadArea::Instance::SerializeState(Json::Value& target)
+  {
+    bool isCommitted, isInMemory;
+
+    {
+      boost::shared_lock<boost::shared_mutex> lock(storageMutex_);
+      isCommitted = isCommitted_;
+      isInMemory = IsInMemory();
+    }
+
+    target = Json::objectValue;
+    
+    if (isCommitted)
+    {
+      target[KEY_COMMITTED] = true;
+      return true;
+    }
+    else if (isInMemory)
+    {
+      return false;  // Lost if the job is interrupted
+    }
+    else
+    {
+      boost::mutex::scoped_lock lock(statusMutex_);
+
+      if (received_.GetCoveredSize() == 0)
+      {
+        return false;
+      }
+      else
+      {
+        received_.Serialize(target[KEY_RANGES]);
+        return true;
+      }
+    }
+  }
+
+
+  void DownloadArea::Instance::CheckMD5(const void* content,
+                                        size_t size)
+  {
+    try
+    {
+      CheckInstanceMD5(info_, content, size);
+    }
+    catch (Orthanc::OrthancException&)
+    {
+      // Forget about the received bytes, so that the instance is
+      // downloaded again if the job is resumed
+      boost::mutex::scoped_lock lock(statusMutex_);
+      received_.Clear();
+      throw;
+    }
+  }
+
+  
+  bool DownloadArea::Instance::IsDigestToBeChecked()
+  {
+    if (IsCommitted())
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_BadSequenceOfCalls,
+                                      "Instance already committed: " + info_.GetId());
+    }
+
+    boost::mutex::scoped_lock lock(statusMutex_);
+
+    if (digestStatus_ == DigestStatus_Invalid)
+    {
+      LOG(ERROR) << "Bad MD5 sum in a transfered DICOM instance: " << info_.GetId();
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_CorruptedFile);
+    }
+    else
+    {
+      // No need to hash the instance once again if its MD5 sum was
+      // already verified while receiving the chunks
+      return (digestStatus_ != DigestStatus_Valid);
+    }
+  }
+
+  
+  void DownloadArea::Instance::Commit(bool simulate)
+  {
+    bool checkMD5 = IsDigestToBeChecked();
+
+    Reader reader(*this);
+
+    if (checkMD5)
+    {
+      CheckMD5(reader.GetData(), reader.GetSize());
+    }
+
+    if (!simulate)
+    {
+      Json::Value result;
+      if (!RestApiPost(result, "/instances", reader.GetData(), reader.GetSize(), false))
+      {
+        LOG(ERROR) << "Cannot import a transfered DICOM instance into Orthanc: "
+                   << info_.GetId();
+        throw Orthanc::OrthancException(Orthanc::ErrorCode_CorruptedFile);
+      }
+    }
+  }
+
+
+  void DownloadArea::Instance::AddToArchive(Orthanc::ZipWriter& archive)
+  {
+    bool checkMD5 = IsDigestToBeChecked();
+
+    Reader reader(*this);
+
+    if (checkMD5)
+    {
+      CheckMD5(reader.GetData(), reader.GetSize());
+    }
+
+    archive.OpenFile((info_.GetId() + ".dcm").c_str());
+    archive.Write(reader.GetData(), reader.GetSize());
+  }
+
+
+  void DownloadArea::Instance::Release()
+  {
+    boost::unique_lock<boost::shared_mutex> lock(storageMutex_);
+
+    std::vector<char> empty;
+    memory_.swap(empty);
+
+    if (memoryStorage_ != NULL)
+    {
+      memoryStorage_->ReleaseMemory(info_.GetSize());
+      memoryStorage_ = NULL;
+    }
+
+    if (diskStorage_ != NULL)
+    {
+      ReleaseUnallocated();
+      diskStorage_->ReleaseDisk(info_.GetSize());
+      diskStorage_ = NULL;
+    }
+
+    if (file_.get() != NULL)
+    {
+      file_.reset();
+    }
+    else if (hasFile_ &&
+             transferFile_ != NULL)
+    {
+      // The file is shared with other instances, and is removed by
+      // the download area: Only give back its blocks to the filesystem
+#if defined(__linux__) && defined(FALLOC_FL_PUNCH_HOLE)
+      int fd = open(path_.c_str(), O_WRONLY);
+      if (fd >= 0)
+      {
+        fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, fileOffset_, info_.GetSize());
+        close(fd);
+      }
+#endif
+    }
+    else if (hasFile_)
+    {
+      // File in the work directory
+      boost::system::error_code error;
+      boost::filesystem::remove(path_, error);
+    }
+
+    path_.clear();
+    hasFile_ = false;
+    isOnDisk_ = false;
+    isCommitted_ = true;
+  }
+
+
+  void DownloadArea::Clear()
+  {
+    for (Instances::iterator it = instances_.begin(); 
+         it != instances_.end(); ++it)
+    {
+      if (it->second != NULL)
+      {
+        delete it->second;
+        it->second = NULL;
+      }
+    }
+
+    instances_.clear();
+    transferFile_.reset();
+  }
+
+
+  DownloadArea::Instance& DownloadArea::LookupInstance(const std::string& id)
+  {
+    Instances::iterator it = instances_.find(id);
+
+    if (it == instances_.end())
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_UnknownResource, "Unknown instance");
+    }
+    else if (it->first != id ||
+             it->second == NULL)
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_InternalError);
+    }
+    else
+    {
+      return *it->second;
+    }
+  }
+
+
+  void DownloadArea::WriteUncompressedBucket(const TransferBucket& bucket,
+                                             const void* data,
+                                             size_t size)
+  {
+    if (size != bucket.GetTotalSize())
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_NetworkProtocol, 
+        "WriteUncompressedBucket: " + boost::lexical_cast<std::string>(size) + " != " + boost::lexical_cast<std::string>(bucket.GetTotalSize()));
+    }
+
+    if (size == 0)
+    {
+      return;
+    }
+
+    size_t pos = 0;
+
+    for (size_t i = 0; i < bucket.GetChunksCount(); i++)
+    {
+      size_t chunkSize = bucket.GetChunkSize(i);
+      size_t offset = bucket.GetChunkOffset(i);
+
+      if (pos + chunkSize > size)
+      {
+        throw Orthanc::OrthancException(Orthanc::ErrorCode_InternalError);
+      }
+
+      Instance& instance = LookupInstance(bucket.GetChunkInstanceId(i));
+      if (instance.WriteChunk(offset, reinterpret_cast<const char*>(data) + pos, chunkSize) &&
+          committer_.get() != NULL)
+      {
+        // Streaming commit
+        committer_->Enqueue(instance);
+      }
+
+      pos += chunkSize;
+    }
+
+    if (pos != size)
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_InternalError);
+    }
+  }
+
+
+  void DownloadArea::WriteGzipBucket(const TransferBucket& bucket,
+                                     const void* data,
+                                     size_t size)
+  {
+    // The bytes of each chunk are written to their instance as soon as
+    // they are inflated, by pieces of at most "GZIP_WINDOW_SIZE"
+    if (size == 0 &&
+        bucket.GetTotalSize() == 0)
+    {
+      return;
+    }
+
+    GzipInflater inflater(data, size);
+
+    std::string window;
+    window.resize(std::min(GZIP_WINDOW_SIZE, bucket.GetTotalSize()));
+
+    for (size_t i = 0; i < bucket.GetChunksCount(); i++)
+    {
+      const size_t chunkSize = bucket.GetChunkSize(i);
+      const size_t chunkOffset = bucket.GetChunkOffset(i);
+      Instance& instance = LookupInstance(bucket.GetChunkInstanceId(i));
+
+      size_t pos = 0;
+      while (pos < chunkSize)
+      {
+        size_t count = std::min(window.size(), chunkSize - pos);
+        if (inflater.Read(&window[0], count) != count)
+        {
+          throw Orthanc::OrthancException(Orthanc::ErrorCode_NetworkProtocol,
+                                          "WriteGzipBucket: The bucket is smaller than expected");
+        }
+
+        if (instance.WriteChunk(chunkOffset + pos, window.c_str(), count) &&
+            committer_.get() != NULL)
+        {
+          // Streaming commit
+          committer_->Enqueue(instance);
+        }
+
+        pos += count;
+      }
+    }
+
+    char extra;
+    if (inflater.Read(&extra, 1) != 0 ||
+        !inflater.IsEnd())
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_NetworkProtocol,
+                                      "WriteGzipBucket: The bucket is larger than expected");
+    }
+  }
+
+
+  void DownloadArea::SetupInternal(const std::vector<DicomInstanceInfo>& instances,
+                                   TemporaryStorage* storage)
+  {
+    Json::Value previousState = Json::objectValue;
+
+    if (!workDirectory_.empty())
+    {
+      boost::filesystem::path stateFile = boost::filesystem::path(workDirectory_) / STATE_FILENAME;
+
+      if (boost::filesystem::is_regular_file(stateFile))
+      {
+        std::string content;
+        Orthanc::SystemToolbox::ReadFile(content, stateFile.string());
+
+        if (!Orthanc::Toolbox::ReadJson(previousState, content) ||
+            previousState.type() != Json::objectValue)
+        {
+          LOG(WARNING) << "Ignoring corrupted state of an interrupted transfer: " << stateFile.string();
+          previousState = Json::objectValue;
+        }
+      }
+      else
+      {
+        TemporaryStorage::CreateDirectory(workDirectory_);
+      }
+    }
+
+    const Json::Value& previousInstances = (previousState.isMember(KEY_INSTANCES) ?
+                                            previousState[KEY_INSTANCES] : Json::Value::null);
+
+    for (size_t i = 0; i < instances.size(); i++)
+    {
+      totalSize_ += instances[i].GetSize();
+    }
+
+    // Small transfers are assembled in RAM, in order to avoid any
+    // access to the temporary disk
+    bool allowMemory = (storage != NULL &&
+                        storage->IsMemoryAllowed(totalSize_));
+
+    std::vector<size_t> fileOffsets(instances.size(), 0);
+
+    if (storage != NULL &&
+        storage->IsSingleFileLayout())
+    {
+      // Each instance has a fixed offset in the file. The layout is
+      // saved in the state, as the instances that were committed
+      // before an interruption are not part of the resumed transfer:
+      // The remaining instances keep their offset, and the new ones
+      // are appended. The ranges of the instances that are stored in
+      // RAM (or that are committed) are left as holes in the sparse
+      // file.
+      size_t previousSize = 0;
+      if (previousState.isMember(KEY_TRANSFER_FILE_SIZE) &&
+          previousState[KEY_TRANSFER_FILE_SIZE].type() == Json::stringValue)
+      {
+        previousSize = boost::lexical_cast<size_t>(previousState[KEY_TRANSFER_FILE_SIZE].asString());
+      }
+
+      size_t size = previousSize;
+
+      for (size_t i = 0; i < instances.size(); i++)
+      {
+        const std::string& id = instances[i].GetId();
+
+        if (previousInstances.isMember(id) &&
+            previousInstances[id].isMember(KEY_OFFSET) &&
+            previousInstances[id][KEY_OFFSET].type() == Json::stringValue)
+        {
+          fileOffsets[i] = boost::lexical_cast<size_t>(previousInstances[id][KEY_OFFSET].asString());
+
+          if (fileOffsets[i] + instances[i].GetSize() <= previousSize)
+          {
+            continue;
+          }
+        }
+
+        fileOffsets[i] = size;
+        size += instances[i].GetSize();
+      }
+
+      transferFile_.reset(new TransferFile(*storage, workDirectory_.empty() ? "" :
+                                           (boost::filesystem::path(workDirectory_) / TRANSFER_FILENAME).string(),
+                                           previousSize, size));
+    }
+
+    for (size_t i = 0; i < instances.size(); i++)
+    {
+      const std::string& id = instances[i].GetId();
+        
+      assert(instances_.find(id) == instances_.end());
+
+      std::string path;
+      if (!workDirectory_.empty() &&
+          transferFile_.get() == NULL)
+      {
+        // The identifier of the instance comes from the remote peer,
+        // hash it to get a safe filename
+        std::string hash;
+        Orthanc::Toolbox::ComputeMD5(hash, id);
+        path = (boost::filesystem::path(workDirectory_) / hash).string();
+      }
+
+      const Json::Value& state = (previousInstances.isMember(id) ? previousInstances[id] : Json::Value::null);
+      std::unique_ptr<Instance> instance(new Instance(instances[i], storage, allowMemory, path,
+                                                      transferFile_.get(), fileOffsets[i], state));
+
+      if (instance->IsCommitted())
+      {
+        resumedSize_ += instances[i].GetSize();
+      }
+      else
+      {
+        resumedSize_ += instance->GetReceivedSize();
+      }
+
+      if (instance->IsInMemory())
+      {
+        memorySize_ += instances[i].GetSize();
+      }
+
+      instances_[id] = instance.release();
+    }
+
+    if (storage != NULL)
+    {
+      // Reserve the disk space of the whole transfer up front, so that
+      // it fails immediately instead of after hours of download
+      size_t newDiskSize = 0;
+
+      for (Instances::iterator it = instances_.begin(); it != instances_.end(); ++it)
+      {
+        if (it->second->IsOnDisk())
+        {
+          diskSize_ += it->second->GetInfo().GetSize();
+
+          if (it->second->IsNewFile())
+          {
+            newDiskSize += it->second->GetInfo().GetSize();
+          }
+        }
+      }
+
+      if (!storage->ReserveDisk(diskSize_, newDiskSize))
+      {
+        throw Orthanc::OrthancException(Orthanc::ErrorCode_FullStorage,
+                                        "Not enough disk space to receive a transfer of " +
+                                        boost::lexical_cast<std::string>(ConvertToMegabytes(totalSize_)) + "MB");
+      }
+
+      // From now on, the reservation is owned by the instances
+      for (Instances::iterator it = instances_.begin(); it != instances_.end(); ++it)
+      {
+        if (it->second->IsOnDisk())
+        {
+          it->second->SetDiskReservation(*storage);
+        }
+      }
+
+      LOG(INFO) << "Download area of " << ConvertToMegabytes(totalSize_) << "MB, including "
+                << ConvertToMegabytes(memorySize_) << "MB in RAM and "
+                << ConvertToMegabytes(diskSize_) << "MB on the disk";
+    }
+
+    if (resumedSize_ != 0)
+    {
+      LOG(INFO) << "Resuming an interrupted transfer, " << ConvertToMegabytes(resumedSize_)
+                << "MB were already received";
+    }
+  }
+
+
+  void DownloadArea::Setup(const std::vector<DicomInstanceInfo>& instances,
+                           TemporaryStorage* storage,
+                           const std::string& workDirectory)
+  {
+    totalSize_ = 0;
+    memorySize_ = 0;
+    diskSize_ = 0;
+    storage_ = storage;
+    commitThreadsCount_ = 1;
+    commitBatchSize_ = 1;
+    workDirectory_ = workDirectory;
+    resumedSize_ = 0;
+    lastSave_ = boost::posix_time::microsec_clock::local_time();
+
+    try
+    {
+      SetupInternal(instances, storage);
+    }
+    catch (...)
+    {
+      // The destructor is not called if the constructor fails, give
+      // back the reserved RAM and disk space
+      Clear();
+      throw;
+    }
+  }
+
+
+  void DownloadArea::SaveStateInternal()
+  {
+    // The shared lock must be held by the caller
+    assert(!workDirectory_.empty());
+
+    if (!boost::filesystem::is_directory(workDirectory_))
+    {
+      // The work directory has been removed (e.g. the job was
+      // canceled): Don't leave a stray state behind
+      return;
+    }
+
+    Json::Value state = Json::objectValue;
+    state[KEY_INSTANCES] = Json::objectValue;
+
+    if (transferFile_.get() != NULL)
+    {
+      state[KEY_TRANSFER_FILE_SIZE] = boost::lexical_cast<std::string>(transferFile_->GetSize());
+    }
+
+    for (Instances::iterator it = instances_.begin(); 
+         it != instances_.end(); ++it)
+    {
+      assert(it->second != NULL);
+
+      Json::Value item;
+      bool hasState = it->second->SerializeState(item);
+
+      if (transferFile_.get() != NULL)
+      {
+        // The layout of the transfer file must be kept, even for the
+        // instances that are not received yet
+        item[KEY_OFFSET] = boost::lexical_cast<std::string>(it->second->GetFileOffset());
+        hasState = true;
+      }
+
+      if (hasState)
+      {
+        state[KEY_INSTANCES][it->first] = item;
+      }
+    }
+
+    std::string content;
+    Orthanc::Toolbox::WriteFastJson(content, state);
+
+    // Write to a temporary file, then rename it, so that the state
+    // is never left half-written if Orthanc crashes
+    boost::filesystem::path target = boost::filesystem::path(workDirectory_) / STATE_FILENAME;
+    boost::filesystem::path tmp = target;
+    tmp += ".tmp";
+
+    Orthanc::SystemToolbox::WriteFile(content, tmp.string());
+    boost::filesystem::rename(tmp, target);
+
+    lastSave_ = boost::posix_time::microsec_clock::local_time();
+  }
+    
+
+  DownloadArea::DownloadArea(const TransferScheduler& scheduler,
+                             TemporaryStorage& storage)
+  {
+    std::vector<DicomInstanceInfo> instances;
+    scheduler.ListInstances(instances);
+    Setup(instances, &storage, "");
+  }
+
+
+  DownloadArea::DownloadArea(const TransferScheduler& scheduler,
+                             TemporaryStorage& storage,
+                             const std::string& workDirectory)
+  {
+    std::vector<DicomInstanceInfo> instances;
+    scheduler.ListInstances(instances);
+    Setup(instances, &storage, workDirectory);
+  }
+
+
+  DownloadArea::DownloadArea(const std::vector<DicomInstanceInfo>& instances)
+  {
+    Setup(instances, NULL, "");
+  }
+
+
+  DownloadArea::DownloadArea(const std::vector<DicomInstanceInfo>& instances,
+                             TemporaryStorage& storage)
+  {
+    Setup(instances, &storage, "");
+  }
+
+
+  DownloadArea::~DownloadArea()
+  {
+    // Stop the commit threads before removing the instances
+    committer_.reset();
+
+    if (!workDirectory_.empty())
+    {
+      try
+      {
+        boost::shared_lock<boost::shared_mutex> lock(mutex_);
+        SaveStateInternal();
+      }
+      catch (Orthanc::OrthancException& e)
+      {
+        LOG(ERROR) << "Cannot save the state of an interrupted transfer: " << e.What();
+      }
+      catch (boost::filesystem::filesystem_error& e)
+      {
+        LOG(ERROR) << "Cannot save the state of an interrupted transfer: " << e.what();
+      }
+    }
+
+    Clear();
+  }
+
+
+  void DownloadArea::WriteBucket(const TransferBucket& bucket,
+                                 const void* data,
+                                 size_t size,
+                                 BucketCompression compression)
+  {
+    switch (compression)
+    {
+      case BucketCompression_None:
+      {
+        boost::shared_lock<boost::shared_mutex> lock(mutex_);
+        WriteUncompressedBucket(bucket, data, size);
+        break;
+      }
+          
+      case BucketCompression_Gzip:
+      {
+        // The lock is shared, so the buckets received by concurrent
+        // HTTP threads are still inflated in parallel
+        boost::shared_lock<boost::shared_mutex> lock(mutex_);
+        WriteGzipBucket(bucket, data, size);
+        break;
+      }
+
+      default:          
+        throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
+    }
+  }
+
+
+  void DownloadArea::WriteInstance(const std::string& instanceId,
+                                   const void* data,
+                                   size_t size)
+  {
+    std::string md5;
+    Orthanc::Toolbox::ComputeMD5(md5, data, size);
+      
+    {
+      boost::shared_lock<boost::shared_mutex> lock(mutex_);
+
+      Instances::const_iterator it = instances_.find(instanceId);
+      if (it == instances_.end() ||
+          it->second == NULL ||
+          it->second->GetInfo().GetId() != instanceId ||
+          it->second->GetInfo().GetSize() != size ||
+          it->second->GetInfo().GetMD5() != md5)
+      {
+        throw Orthanc::OrthancException(Orthanc::ErrorCode_CorruptedFile);
+      }
+      else if (it->second->WriteChunk(0, data, size) &&
+               committer_.get() != NULL)
+      {
+        committer_->Enqueue(*it->second);
+      }
+    }
+  }
+
+
+  bool DownloadArea::IsBucketReceived(const TransferBucket& bucket)
+  {
+    boost::shared_lock<boost::shared_mutex> lock(mutex_);
+
+    for (size_t i = 0; i < bucket.GetChunksCount(); i++)
+    {
+      Instance& instance = LookupInstance(bucket.GetChunkInstanceId(i));
+      if (!instance.IsReceived(bucket.GetChunkOffset(i), bucket.GetChunkSize(i)))
+      {
+        return false;
+      }
+    }
+
+    return true;
+  }
+
+
+  void DownloadArea::SaveState(bool force)
+  {
+    if (workDirectory_.empty())
+    {
+      return;
+    }
+
+    boost::shared_lock<boost::shared_mutex> lock(mutex_);
+
+    if (force ||
+        boost::posix_time::microsec_clock::local_time() - lastSave_ > boost::posix_time::seconds(5))
+    {
+      SaveStateInternal();
+    }
+  }
+
+
+  size_t DownloadArea::GetVerifiedInstancesCount()
+  {
+    boost::shared_lock<boost::shared_mutex> lock(mutex_);
+
+    size_t count = 0;
+
+    for (Instances::const_iterator it = instances_.begin(); 
+         it != instances_.end(); ++it)
+    {
+      if (it->second != NULL &&
+          it->second->IsVerified())
+      {
+        count++;
+      }
+    }
+
+    return count;
+  }
+
+
+  void DownloadArea::CheckMD5()
+  {
+    LOG(INFO) << "Checking MD5 sum without committing (testing)";
+
+    boost::unique_lock<boost::shared_mutex> lock(mutex_);
+      
+    for (Instances::iterator it = instances_.begin(); 
+         it != instances_.end(); ++it)
+    {
+      if (it->second != NULL)
+      {
+        it->second->Commit(true /* simulate */);
+      }
+      else
+      {
+        throw Orthanc::OrthancException(Orthanc::ErrorCode_InternalError);
+      }
+    }
+  }
+
+
+  void DownloadArea::SetCommitThreadsCount(size_t count)
+  {
+    if (count == 0)
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
+    }
+
+    boost::unique_lock<boost::shared_mutex> lock(mutex_);
+    commitThreadsCount_ = count;
+  }
+
+
+  void DownloadArea::SetCommitBatchSize(size_t size)
+  {
+    if (size == 0)
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
+    }
+
+    boost::unique_lock<boost::shared_mutex> lock(mutex_);
+    commitBatchSize_ = size;
+  }
+
+
+  void DownloadArea::StartStreamingCommit()
+  {
+    boost::unique_lock<boost::shared_mutex> lock(mutex_);
+
+    if (committer_.get() != NULL)
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_BadSequenceOfCalls);
+    }
+
+    std::list<Instance*> complete;
+    size_t committedInstancesCount = 0;
+    uint64_t committedSize = 0;
+
+    for (Instances::iterator it = instances_.begin(); 
+         it != instances_.end(); ++it)
+    {
+      if (it->second == NULL)
+      {
+        throw Orthanc::OrthancException(Orthanc::ErrorCode_InternalError);
+      }
+      else if (it->second->IsCommitted())
+      {
+        committedInstancesCount++;
+        committedSize += it->second->GetInfo().GetSize();
+      }
+      else if (it->second->IsComplete())
+      {
+        complete.push_back(it->second);
+      }
+    }
+
+    committer_.reset(new Committer(storage_, complete, false /* not closed */, commitThreadsCount_, commitBatchSize_,
+                                   committedInstancesCount, committedSize));
+  }
+
+
+  void DownloadArea::StartCommit()
+  {
+    boost::unique_lock<boost::shared_mutex> lock(mutex_);
+
+    LOG(INFO) << "Importing transfered DICOM files from the temporary download area into Orthanc";
+
+    if (committer_.get() != NULL)
+    {
+      if (committer_->IsClosed())
+      {
+        throw Orthanc::OrthancException(Orthanc::ErrorCode_BadSequenceOfCalls);
+      }
+
+      // End of a streaming commit: The complete instances are
+      // already enqueued, add the remaining ones (which will fail
+      // because of their MD5 sum if they are still incomplete)
+      std::list<Instance*> remaining;
+
+      for (Instances::iterator it = instances_.begin(); 
+           it != instances_.end(); ++it)
+      {
+        assert(it->second != NULL);
+        if (!it->second->IsComplete() &&
+            !it->second->IsCommitted())
+        {
+          remaining.push_back(it->second);
+        }
+      }
+
+      committer_->Close(remaining);
+      return;
+    }
+
+    std::list<Instance*> pending;
+    size_t committedInstancesCount = 0;
+    uint64_t committedSize = 0;
+
+    for (Instances::iterator it = instances_.begin(); 
+         it != instances_.end(); ++it)
+    {
+      if (it->second == NULL)
+      {
+        throw Orthanc::OrthancException(Orthanc::ErrorCode_InternalError);
+      }
+      else if (it->second->IsCommitted())
+      {
+        committedInstancesCount++;
+        committedSize += it->second->GetInfo().GetSize();
+      }
+      else
+      {
+        pending.push_back(it->second);
+      }
+    }
+
+    // No need for more threads than instances
+    size_t threadsCount = commitThreadsCount_;
+    if (!pending.empty() &&
+        threadsCount > pending.size())
+    {
+      threadsCount = pending.size();
+    }
+
+    committer_.reset(new Committer(storage_, pending, true /* closed */, threadsCount, commitBatchSize_,
+                                   committedInstancesCount, committedSize));
+  }
+
+
+  boost::shared_ptr<DownloadArea::Committer> DownloadArea::GetCommitter()
+  {
+    boost::shared_lock<boost::shared_mutex> lock(mutex_);
+    return committer_;
+  }
+
+
+  void DownloadArea::StopCommit()
+  {
+    boost::shared_ptr<Committer> committer;
+
+    {
+      boost::unique_lock<boost::shared_mutex> lock(mutex_);
+      committer.swap(committer_);
+    }
+
+    // The batches that are being sent are completed, the remaining
+    // instances will be sent by the next call to "StartCommit()". The
+    // threads are joined without blocking the writers.
+    committer.reset();
+  }
+
+
+  DownloadArea::CommitStatus DownloadArea::WaitCommit(unsigned int timeoutMS)
+  {
+    boost::shared_ptr<Committer> committer = GetCommitter();
+
+    if (committer.get() == NULL)
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_BadSequenceOfCalls);
+    }
+    else
+    {
+      return committer->WaitComplete(timeoutMS);
+    }
+  }
+
+
+  void DownloadArea::GetCommitStatistics(size_t& committedInstancesCount,
+                                         uint64_t& committedSize,
+                                         float& instancesPerSecond)
+  {
+    boost::shared_ptr<Committer> committer = GetCommitter();
+
+    if (committer.get() == NULL)
+    {
+      committedInstancesCount = 0;
+      committedSize = 0;
+      instancesPerSecond = 0;
+    }
+    else
+    {
+      committer->GetStatistics(committedInstancesCount, committedSize, instancesPerSecond);
+    }
+  }
+
+
+  void DownloadArea::Commit()
+  {
+    StartCommit();
+
+    CommitStatus status;
+
+    do
+    {
+      status = WaitCommit(200);
+    }
+    while (status == CommitStatus_Running);
+
+    if (status == CommitStatus_Failure)
+    {
+      Orthanc::ErrorCode error = GetCommitter()->GetError();
+      StopCommit();
+      throw Orthanc::OrthancException(error);
+    }
+    else
+    {
+      StopCommit();
+    }
   }
 }
@@ -19,44 +19,211 @@
 
 #pragma once
 
+#include "ByteRanges.h"
+#include "IncrementalMD5.h"
+#include "TemporaryStorage.h"
 #include "TransferScheduler.h"
 
+#include <Compatibility.h>  // For std::unique_ptr
 #include <TemporaryFile.h>
 
+#include <boost/date_time/posix_time/posix_time.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/shared_mutex.hpp>
+
+namespace Orthanc
+{
+  class ZipWriter;
+}
+
 namespace OrthancPlugins
 {
   class DownloadArea : public boost::noncopyable
   {
   private:
+    class Writer;
+    class TransferFile;
+
     class Instance : public boost::noncopyable
     {
     private:
-      DicomInstanceInfo       info_;
-      Orthanc::TemporaryFile  file_;
+      enum DigestStatus
+      {
+        DigestStatus_Pending,     // Some bytes have not been hashed yet
+        DigestStatus_Valid,
+        DigestStatus_Invalid,
+        DigestStatus_Unavailable  // Overlapping writes, must be recomputed at commit
+      };
+
+      typedef std::map<size_t, size_t>  PendingChunks;  // Offset -> size
+
+      DicomInstanceInfo                        info_;
+
+      // Writing chunks only needs a shared lock, whereas releasing
+      // the storage once committed needs an exclusive lock
+      boost::shared_mutex                      storageMutex_;
+      TemporaryStorage*                        memoryStorage_;  // Only set if stored in RAM
+      std::vector<char>                        memory_;
+      TemporaryStorage*                        diskStorage_;    // Only set if disk space is reserved
+      bool                                     isUnallocated_;  // Reserved, but not preallocated yet
+      TemporaryStorage*                        fileStorage_;    // Where to create the temporary file
+      TransferFile*                            transferFile_;   // Only set if sharing a file
+      size_t                                   fileOffset_;
+      bool                                     isOnDisk_;
+      bool                                     isNewFile_;
+      bool                                     isCommitted_;
+
+      // The file is only created when the first chunk is received
+      boost::mutex                             fileMutex_;
+      bool                                     hasFile_;
+      std::unique_ptr<Orthanc::TemporaryFile>  file_;  // Unset if in the work directory
+      std::string                              path_;
+
+      // The MD5 sum is computed while the chunks are received. The
+      // chunks that are received out-of-order are hashed as soon as
+      // all the bytes before them are available.
+      boost::mutex                             statusMutex_;
+      ByteRanges                               received_;
+      IncrementalMD5                           md5_;
+      PendingChunks                            pendingChunks_;
+      DigestStatus                             digestStatus_;
+
+      class Reader;
+
+      void ReadChunk(std::string& target,
+                     size_t offset,
+                     size_t size) const;
+
+      void UpdateDigest(size_t offset,
+                        const void* data,
+                        size_t size);
+
+      bool UpdateStatus(size_t offset,
+                        const void* data,
+                        size_t size);
+
+      bool IsDigestToBeChecked();
+
+      void CreateFile();
+
+      void Preallocate();
+
+      void ReleaseUnallocated();
 
-      class Writer;
+      void CheckMD5(const void* content,
+                    size_t size);
 
     public:
-      explicit Instance(const DicomInstanceInfo& info);
+      // If "persistentPath" is not empty and the instance is not
+      // stored in RAM, its content is kept in this file after the
+      // destruction. If "transferFile" is not NULL, the instance is
+      // rather stored in this file at the given offset (in which case
+      // "persistentPath" is ignored). "previousState" is the state of
+      // the instance before the job was interrupted (null value if
+      // none).
+      Instance(const DicomInstanceInfo& info,
+               TemporaryStorage* storage /* can be NULL */,
+               bool allowMemory,
+               const std::string& persistentPath,
+               TransferFile* transferFile /* can be NULL */,
+               size_t fileOffset,
+               const Json::Value& previousState);
+
+      ~Instance();
 
       const DicomInstanceInfo& GetInfo() const
       {
         return info_;
       }
 
-      void WriteChunk(size_t offset,
+      bool IsInMemory() const
+      {
+        return memoryStorage_ != NULL;
+      }
+
+      bool IsOnDisk() const
+      {
+        return isOnDisk_;
+      }
+
+      // Offset of the instance in the transfer file (only meaningful
+      // for the single-file layout)
+      size_t GetFileOffset() const
+      {
+        return fileOffset_;
+      }
+
+      // Whether the file is to be created by this download area, or if
+      // it was resumed from an interrupted transfer
+      bool IsNewFile() const
+      {
+        return isNewFile_;
+      }
+
+      // The disk space that was reserved by the download area is given
+      // back to the storage as soon as the instance is committed
+      void SetDiskReservation(TemporaryStorage& storage);
+
+      // Returns "true" iff this chunk completes the instance. The
+      // chunks of an instance that is already committed are ignored.
+      bool WriteChunk(size_t offset,
                       const void* data,
                       size_t size);
 
-      void Commit(bool simulate) const;
+      bool IsVerified();
+
+      bool IsComplete();
+
+      bool IsCommitted();
+
+      size_t GetReceivedSize();
+
+      bool IsReceived(size_t offset,
+                      size_t size);
+
+      // Returns "false" if there is nothing worth saving
+      bool SerializeState(Json::Value& target);
+
+      void Commit(bool simulate);
+
+      // Adds the instance to a ZIP archive that will be imported as a
+      // whole into Orthanc (the MD5 sum is checked beforehand)
+      void AddToArchive(Orthanc::ZipWriter& archive);
+
+      // Frees the RAM or the temporary file once the instance has
+      // been stored by Orthanc
+      void Release();
     };
 
+    class Committer;
+
 
     typedef std::map<std::string, Instance*>   Instances;
 
-    boost::mutex  mutex_;
-    Instances     instances_;
-    size_t        totalSize_;
+    // The set of instances is only modified while the mutex is
+    // exclusively locked (setup, commit and destruction). Writing
+    // chunks only needs a shared lock: Each chunk covers a byte
+    // range of its instance that is disjoint from the other chunks.
+    boost::shared_mutex  mutex_;
+    Instances            instances_;
+    std::unique_ptr<TransferFile>  transferFile_;  // Only set for the single-file layout
+    size_t               totalSize_;
+    size_t               memorySize_;
+    size_t               diskSize_;
+    TemporaryStorage*    storage_;  // Can be NULL
+
+    // Only set for the download areas of the pull jobs, that can be
+    // resumed after an interruption
+    std::string                 workDirectory_;
+    size_t                      resumedSize_;
+    boost::posix_time::ptime    lastSave_;
+
+    // Import of the instances into Orthanc by a pool of threads. The
+    // committer is shared, so that it can be used without holding
+    // the mutex, and stopped without blocking the writers.
+    size_t                        commitThreadsCount_;
+    size_t                        commitBatchSize_;
+    boost::shared_ptr<Committer>  committer_;
 
 
     void Clear();
@@ -67,28 +234,74 @@ namespace OrthancPlugins
                                  const void* data,
                                  size_t size);
 
-    void Setup(const std::vector<DicomInstanceInfo>& instances);
-    
-    void CommitInternal(bool simulate);
+    void WriteGzipBucket(const TransferBucket& bucket,
+                         const void* data,
+                         size_t size);
+
+    void SetupInternal(const std::vector<DicomInstanceInfo>& instances,
+                       TemporaryStorage* storage);
+
+    void Setup(const std::vector<DicomInstanceInfo>& instances,
+               TemporaryStorage* storage /* can be NULL */,
+               const std::string& workDirectory);
+
+    void SaveStateInternal();
+
+    boost::shared_ptr<Committer> GetCommitter();
 
   public:
-    explicit DownloadArea(const TransferScheduler& scheduler);
+    enum CommitStatus
+    {
+      CommitStatus_Running,
+      CommitStatus_Success,
+      CommitStatus_Failure
+    };
+
+    DownloadArea(const TransferScheduler& scheduler,
+                 TemporaryStorage& storage);
+
+    // The instances that are not stored in RAM are written to the
+    // work directory, from which an interrupted transfer is resumed
+    DownloadArea(const TransferScheduler& scheduler,
+                 TemporaryStorage& storage,
+                 const std::string& workDirectory);
+
+    // This constructor always stores the instances in temporary files
+    explicit DownloadArea(const std::vector<DicomInstanceInfo>& instances);
+
+    DownloadArea(const std::vector<DicomInstanceInfo>& instances,
+                 TemporaryStorage& storage);
 
-    explicit DownloadArea(const std::vector<DicomInstanceInfo>& instances)
+    ~DownloadArea();
+
+    size_t GetTotalSize() const
     {
-      Setup(instances);
+      return totalSize_;
     }
 
-    ~DownloadArea()
+    size_t GetMemorySize() const
     {
-      Clear();
+      return memorySize_;
     }
 
-    size_t GetTotalSize() const
+    size_t GetDiskSize() const
     {
-      return totalSize_;
+      return diskSize_;
     }
 
+    // Size of the data that was received before the transfer was
+    // interrupted, and that is not downloaded again
+    size_t GetResumedSize() const
+    {
+      return resumedSize_;
+    }
+
+    bool IsBucketReceived(const TransferBucket& bucket);
+
+    // Saves the received byte ranges into the work directory. Unless
+    // "force" is true, this is done at most once every few seconds.
+    void SaveState(bool force);
+
     void WriteBucket(const TransferBucket& bucket,
                      const void* data,
                      size_t size,
@@ -98,8 +311,39 @@ namespace OrthancPlugins
                        const void* data,
                        size_t size);
 
+    // Number of instances whose MD5 has already been checked while
+    // receiving their chunks
+    size_t GetVerifiedInstancesCount();
+
     void CheckMD5();
 
+    // Number of threads that concurrently send the instances to
+    // Orthanc during the commit
+    void SetCommitThreadsCount(size_t count);
+
+    // If above 1, the instances are imported by ZIP archives of at
+    // most this number of instances (this requires Orthanc >= 1.8.2)
+    void SetCommitBatchSize(size_t size);
+
+    // Starts importing the complete instances in the background,
+    // while the other instances are still being received: Each
+    // instance is imported as soon as its last chunk is written.
+    void StartStreamingCommit();
+
+    // Starts the commit of all the remaining instances in the
+    // background. If the commit was stopped beforehand, only the
+    // instances that are not stored yet by Orthanc are sent.
+    void StartCommit();
+
+    void StopCommit();
+
+    CommitStatus WaitCommit(unsigned int timeoutMS);
+
+    void GetCommitStatistics(size_t& committedInstancesCount,
+                             uint64_t& committedSize,
+                             float& instancesPerSecond);
+
+    // Synchronous version of "StartCommit()" and "WaitCommit()"
     void Commit();
   };
 }
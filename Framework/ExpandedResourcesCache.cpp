@@ -0,0 +1,168 @@
+/**
+ * Transfers accelerator plugin for Orthanc
+ * Copyright (C) 2018-2021 Osimis S.A., Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Affero General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+
+#include "ExpandedResourcesCache.h"
+
+#include "TransferScheduler.h"
+
+#include <Compatibility.h>  // For std::unique_ptr
+#include <OrthancException.h>
+#include <Toolbox.h>
+
+#include <cassert>
+
+namespace OrthancPlugins
+{
+  void ExpandedResourcesCache::RemoveOldest()
+  {
+    const std::string key = index_.RemoveOldest();
+
+    Content::iterator it = content_.find(key);
+    assert(it != content_.end());
+
+    delete it->second;
+    content_.erase(it);
+  }
+
+
+  void ExpandedResourcesCache::RemoveExpired(const boost::posix_time::ptime& now)
+  {
+    // The index is sorted by last use, the oldest list comes first
+    while (!index_.IsEmpty())
+    {
+      Content::const_iterator it = content_.find(index_.GetOldest());
+      assert(it != content_.end());
+
+      if ((now - it->second->lastUse_).total_seconds() < static_cast<int>(ttl_))
+      {
+        return;
+      }
+
+      RemoveOldest();
+    }
+  }
+
+
+  ExpandedResourcesCache::ExpandedResourcesCache(unsigned int ttl,
+                                                 size_t maxCount) :
+    ttl_(ttl),
+    maxCount_(maxCount)
+  {
+    if (maxCount == 0)
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
+    }
+  }
+
+
+  ExpandedResourcesCache::~ExpandedResourcesCache()
+  {
+    for (Content::iterator it = content_.begin(); it != content_.end(); ++it)
+    {
+      assert(it->second != NULL);
+      delete it->second;
+    }
+  }
+
+
+  std::string ExpandedResourcesCache::GetKey(const Json::Value& resources,
+                                             const std::string& token)
+  {
+    std::string key;
+    Orthanc::Toolbox::WriteFastJson(key, resources);
+    return token + "|" + key;
+  }
+
+
+  bool ExpandedResourcesCache::Lookup(std::vector<std::string>& instances,
+                                      const std::string& key,
+                                      const boost::posix_time::ptime& now)
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+
+    RemoveExpired(now);
+
+    Content::iterator it = content_.find(key);
+    if (it == content_.end())
+    {
+      return false;
+    }
+    else
+    {
+      index_.MakeMostRecent(key);
+      it->second->lastUse_ = now;
+      instances = it->second->instances_;
+      return true;
+    }
+  }
+
+
+  void ExpandedResourcesCache::Store(const std::string& key,
+                                     const std::vector<std::string>& instances,
+                                     const boost::posix_time::ptime& now)
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+
+    Content::iterator it = content_.find(key);
+    if (it != content_.end())
+    {
+      // Expanded concurrently by another page of the same lookup
+      index_.MakeMostRecent(key);
+      it->second->lastUse_ = now;
+      return;
+    }
+
+    RemoveExpired(now);
+
+    while (content_.size() >= maxCount_)
+    {
+      RemoveOldest();
+    }
+
+    std::unique_ptr<Item> item(new Item);
+    item->instances_ = instances;
+    item->lastUse_ = now;
+
+    index_.Add(key);
+    content_[key] = item.release();
+  }
+
+
+  size_t ExpandedResourcesCache::GetSize()
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    return content_.size();
+  }
+
+
+  void ExpandedResourcesCache::Expand(std::vector<std::string>& instances,
+                                      const Json::Value& resources,
+                                      const std::string& token)
+  {
+    const std::string key = GetKey(resources, token);
+
+    if (!Lookup(instances, key, boost::posix_time::microsec_clock::universal_time()))
+    {
+      // The REST API is called without holding the mutex
+      TransferScheduler::ExpandListOfResources(instances, resources);
+      Store(key, instances, boost::posix_time::microsec_clock::universal_time());
+    }
+  }
+}
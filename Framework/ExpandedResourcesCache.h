@@ -0,0 +1,91 @@
+/**
+ * Transfers accelerator plugin for Orthanc
+ * Copyright (C) 2018-2021 Osimis S.A., Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Affero General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+
+#pragma once
+
+#include <json/value.h>
+
+#include <Cache/LeastRecentlyUsedIndex.h>
+
+#include <boost/date_time/posix_time/posix_time.hpp>
+#include <boost/thread/mutex.hpp>
+
+#include <map>
+#include <vector>
+
+namespace OrthancPlugins
+{
+  /**
+   * Cache of the sorted lists of instances of the resources whose
+   * lookup is paginated: The resources are only expanded once for all
+   * the pages of one lookup, instead of once per page. The lists are
+   * identified by the resources and by the token of the lookup, and
+   * they are dropped if not read for some time.
+   **/
+  class ExpandedResourcesCache : public boost::noncopyable
+  {
+  private:
+    struct Item
+    {
+      std::vector<std::string>  instances_;
+      boost::posix_time::ptime  lastUse_;
+    };
+
+    typedef Orthanc::LeastRecentlyUsedIndex<std::string>  Index;
+    typedef std::map<std::string, Item*>                  Content;
+
+    boost::mutex   mutex_;
+    Index          index_;
+    Content        content_;
+    unsigned int   ttl_;       // In seconds
+    size_t         maxCount_;
+
+    // The mutex must be locked!
+    void RemoveOldest();
+
+    // The mutex must be locked!
+    void RemoveExpired(const boost::posix_time::ptime& now);
+
+  public:
+    ExpandedResourcesCache(unsigned int ttl,
+                           size_t maxCount);
+
+    ~ExpandedResourcesCache();
+
+    static std::string GetKey(const Json::Value& resources,
+                              const std::string& token);
+
+    bool Lookup(std::vector<std::string>& instances,
+                const std::string& key,
+                const boost::posix_time::ptime& now);
+
+    void Store(const std::string& key,
+               const std::vector<std::string>& instances,
+               const boost::posix_time::ptime& now);
+
+    size_t GetSize();
+
+    // Expands the resources through the REST API of Orthanc, unless
+    // they are already in the cache
+    void Expand(std::vector<std::string>& instances,
+                const Json::Value& resources,
+                const std::string& token);
+  };
+}
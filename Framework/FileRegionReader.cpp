@@ -0,0 +1,128 @@
+/**
+ * Transfers accelerator plugin for Orthanc
+ * Copyright (C) 2018-2021 Osimis S.A., Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Affero General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+
+#include "FileRegionReader.h"
+
+#include <Logging.h>
+#include <OrthancException.h>
+
+#include <boost/filesystem/fstream.hpp>
+
+#if !defined(_WIN32)
+#  include <fcntl.h>
+#  include <sys/mman.h>
+#  include <unistd.h>
+#endif
+
+
+namespace OrthancPlugins
+{
+  bool FileRegionReader::MapFile(const std::string& path,
+                                 size_t offset,
+                                 size_t size)
+  {
+#if defined(_WIN32)
+    return false;
+#else
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd == -1)
+    {
+      return false;
+    }
+
+    // The offset of a mapping must be a multiple of the page size
+    const size_t pageSize = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+    const size_t padding = offset % pageSize;
+
+    void* mapping = mmap(NULL, size + padding, PROT_READ, MAP_PRIVATE, fd, offset - padding);
+    close(fd);  // The mapping remains valid after the file is closed
+
+    if (mapping == MAP_FAILED)
+    {
+      return false;
+    }
+
+    // The MD5 check and the import both read the file from start to end
+    madvise(mapping, size + padding, MADV_SEQUENTIAL);
+
+    mapping_ = mapping;
+    mappingSize_ = size + padding;
+    data_ = reinterpret_cast<const uint8_t*>(mapping) + padding;
+    size_ = size;
+    return true;
+#endif
+  }
+
+
+  void FileRegionReader::ReadFile(const std::string& path,
+                                  size_t offset,
+                                  size_t size)
+  {
+    boost::filesystem::ifstream stream;
+    stream.open(path, std::ifstream::in | std::ifstream::binary);
+
+    content_.resize(size);
+    stream.seekg(offset);
+    stream.read(&content_[0], size);
+
+    if (!stream.good())
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_InexistentFile, "Unable to read from " + path);
+    }
+
+    data_ = content_.c_str();
+    size_ = content_.size();
+  }
+
+
+  FileRegionReader::FileRegionReader(const std::string& path,
+                                     size_t offset,
+                                     size_t size) :
+    mapping_(NULL),
+    mappingSize_(0),
+    data_(NULL),
+    size_(0)
+  {
+    if (size == 0)
+    {
+      return;
+    }
+
+    if (!MapFile(path, offset, size))
+    {
+#if !defined(_WIN32)
+      LOG(INFO) << "Cannot map file into memory, falling back to reading it: " << path;
+#endif
+
+      ReadFile(path, offset, size);
+    }
+  }
+
+
+  FileRegionReader::~FileRegionReader()
+  {
+#if !defined(_WIN32)
+    if (mapping_ != NULL)
+    {
+      munmap(mapping_, mappingSize_);
+    }
+#endif
+  }
+}
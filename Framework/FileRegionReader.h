@@ -0,0 +1,74 @@
+/**
+ * Transfers accelerator plugin for Orthanc
+ * Copyright (C) 2018-2021 Osimis S.A., Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Affero General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+
+#pragma once
+
+#include <boost/noncopyable.hpp>
+#include <string>
+
+namespace OrthancPlugins
+{
+  /**
+   * Gives a read-only access to a region of a file. On POSIX systems,
+   * the file is mapped into memory instead of being copied into the
+   * heap, so that reading a large file only consumes the page cache.
+   **/
+  class FileRegionReader : public boost::noncopyable
+  {
+  private:
+    std::string  content_;
+    void*        mapping_;
+    size_t       mappingSize_;
+    const void*  data_;
+    size_t       size_;
+
+    bool MapFile(const std::string& path,
+                 size_t offset,
+                 size_t size);
+
+    void ReadFile(const std::string& path,
+                  size_t offset,
+                  size_t size);
+
+  public:
+    FileRegionReader(const std::string& path,
+                     size_t offset,
+                     size_t size);
+
+    ~FileRegionReader();
+
+    const void* GetData() const
+    {
+      return data_;
+    }
+
+    size_t GetSize() const
+    {
+      return size_;
+    }
+
+    // Whether the region is mapped into memory, instead of being
+    // copied into the heap
+    bool IsMapped() const
+    {
+      return mapping_ != NULL;
+    }
+  };
+}
@@ -0,0 +1,136 @@
+/**
+ * Transfers accelerator plugin for Orthanc
+ * Copyright (C) 2018-2021 Osimis S.A., Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Affero General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+
+#include "CircuitBreaker.h"
+
+#include <Logging.h>
+#include <OrthancException.h>
+
+
+static const unsigned int MIN_OPEN_DURATION = 1000;   // 1 second
+static const unsigned int MAX_OPEN_DURATION = 60000;  // 1 minute
+
+
+namespace OrthancPlugins
+{
+  CircuitBreaker::CircuitBreaker() :
+    failuresThreshold_(5)
+  {
+  }
+
+
+  void CircuitBreaker::SetFailuresThreshold(unsigned int threshold)
+  {
+    if (threshold == 0)
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
+    }
+
+    boost::mutex::scoped_lock lock(mutex_);
+    failuresThreshold_ = threshold;
+  }
+
+
+  void CircuitBreaker::ReportSuccess(const std::string& peer)
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+
+    Peers::iterator found = peers_.find(peer);
+    if (found != peers_.end())
+    {
+      if (found->second.openDuration_ != 0)
+      {
+        LOG(WARNING) << "Peer \"" << peer << "\" is reachable again";
+      }
+
+      peers_.erase(found);
+    }
+  }
+
+
+  void CircuitBreaker::ReportFailure(const std::string& peer)
+  {
+    const boost::posix_time::ptime now = boost::posix_time::microsec_clock::universal_time();
+
+    boost::mutex::scoped_lock lock(mutex_);
+
+    Peers::iterator found = peers_.find(peer);
+    if (found == peers_.end())
+    {
+      Peer item;
+      item.consecutiveFailures_ = 0;
+      item.openDuration_ = 0;
+      item.openUntil_ = now;
+      found = peers_.insert(std::make_pair(peer, item)).first;
+    }
+
+    Peer& item = found->second;
+    item.consecutiveFailures_ ++;
+
+    if (item.consecutiveFailures_ >= failuresThreshold_ &&
+        now >= item.openUntil_)
+    {
+      // Either the threshold was just reached, or the probe that was
+      // sent after the previous opening has failed
+      if (item.openDuration_ == 0)
+      {
+        item.openDuration_ = MIN_OPEN_DURATION;
+      }
+      else
+      {
+        item.openDuration_ = std::min(MAX_OPEN_DURATION, 2 * item.openDuration_);
+      }
+
+      item.openUntil_ = now + boost::posix_time::milliseconds(item.openDuration_);
+
+      LOG(WARNING) << "Peer \"" << peer << "\" seems to be down, pausing the queries to this peer for "
+                   << item.openDuration_ << "ms";
+    }
+  }
+
+
+  bool CircuitBreaker::IsOpen(const std::string& peer)
+  {
+    return GetRemainingOpenTime(peer) > 0;
+  }
+
+
+  unsigned int CircuitBreaker::GetRemainingOpenTime(const std::string& peer)
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+
+    Peers::const_iterator found = peers_.find(peer);
+    if (found == peers_.end() ||
+        found->second.openDuration_ == 0)
+    {
+      return 0;
+    }
+
+    const boost::posix_time::ptime now = boost::posix_time::microsec_clock::universal_time();
+    if (now >= found->second.openUntil_)
+    {
+      return 0;
+    }
+    else
+    {
+      return static_cast<unsigned int>((found->second.openUntil_ - now).total_milliseconds()) + 1;
+    }
+  }
+}
@@ -0,0 +1,70 @@
+/**
+ * Transfers accelerator plugin for Orthanc
+ * Copyright (C) 2018-2021 Osimis S.A., Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Affero General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+
+#pragma once
+
+#include <boost/date_time/posix_time/posix_time.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/thread/mutex.hpp>
+
+#include <map>
+#include <string>
+
+
+namespace OrthancPlugins
+{
+  /**
+   * Keeps track of the peers that are down. After several
+   * consecutive failures, the breaker of a peer opens and no query is
+   * sent to this peer for some time. The first query that is sent
+   * once this delay has elapsed acts as a probe: If it fails, the
+   * breaker opens again for twice the delay.
+   **/
+  class CircuitBreaker : public boost::noncopyable
+  {
+  private:
+    struct Peer
+    {
+      unsigned int              consecutiveFailures_;
+      unsigned int              openDuration_;   // In milliseconds, 0 if never opened
+      boost::posix_time::ptime  openUntil_;
+    };
+
+    typedef std::map<std::string, Peer>  Peers;
+
+    boost::mutex  mutex_;
+    Peers         peers_;
+    unsigned int  failuresThreshold_;
+
+  public:
+    CircuitBreaker();
+
+    void SetFailuresThreshold(unsigned int threshold);
+
+    void ReportSuccess(const std::string& peer);
+
+    void ReportFailure(const std::string& peer);
+
+    bool IsOpen(const std::string& peer);
+
+    // Milliseconds before the breaker of this peer closes (0 if closed)
+    unsigned int GetRemainingOpenTime(const std::string& peer);
+  };
+}
@@ -82,18 +82,22 @@ namespace OrthancPlugins
                                    size_t threadsCount,
                                    unsigned int timeout)
   {
+    OrthancPlugins::OrthancPeers peers;
     OrthancPlugins::HttpQueriesQueue queue;
 
-    queue.GetOrthancPeers().SetTimeout(timeout);
-    queue.Reserve(queue.GetOrthancPeers().GetPeersCount());
+    queue.SetTimeout(timeout);
+    queue.Reserve(peers.GetPeersCount());
 
-    for (size_t i = 0; i < queue.GetOrthancPeers().GetPeersCount(); i++)
+    for (size_t i = 0; i < peers.GetPeersCount(); i++)
     {
       queue.Enqueue(new OrthancPlugins::DetectTransferPlugin
-                    (result, queue.GetOrthancPeers().GetPeerName(i)));
+                    (result, peers.GetPeerName(i)));
     }
 
     {
+      // Dedicated threads, as the pool would skip the peers that are
+      // considered as down by its circuit breaker, and might be busy
+      // with the running transfers
       OrthancPlugins::HttpQueriesRunner runner(queue, threadsCount);
       queue.WaitComplete();
     }
@@ -0,0 +1,220 @@
+/**
+ * Transfers accelerator plugin for Orthanc
+ * Copyright (C) 2018-2021 Osimis S.A., Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Affero General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+
+#include "HttpBodiesPreparer.h"
+
+#include <Logging.h>
+#include <OrthancException.h>
+
+
+namespace OrthancPlugins
+{
+  HttpBodiesPreparer::Client* HttpBodiesPreparer::PickClient()
+  {
+    for (Clients::iterator it = clients_.begin(); it != clients_.end(); ++it)
+    {
+      if (!it->isRemoved_ &&
+          !it->isIdle_)
+      {
+        // Round-robin: This source is served after the other ones at
+        // the next call
+        clients_.splice(clients_.end(), clients_, it);
+        return &clients_.back();
+      }
+    }
+
+    return NULL;
+  }
+
+
+  void HttpBodiesPreparer::Worker(HttpBodiesPreparer* that)
+  {
+    for (;;)
+    {
+      Client* client = NULL;
+      unsigned int wakeups;
+
+      {
+        boost::mutex::scoped_lock lock(that->mutex_);
+
+        while (that->continue_ &&
+               (client = that->PickClient()) == NULL)
+        {
+          if (!that->changed_.timed_wait(lock, boost::posix_time::milliseconds(100)))
+          {
+            // Safety net against a missed wakeup: Try again all the
+            // sources from time to time
+            for (Clients::iterator it = that->clients_.begin(); it != that->clients_.end(); ++it)
+            {
+              it->isIdle_ = false;
+            }
+          }
+        }
+
+        if (!that->continue_)
+        {
+          return;
+        }
+
+        client->activePreparations_ ++;
+        wakeups = client->wakeups_;
+      }
+
+      bool prepared;
+
+      try
+      {
+        prepared = client->source_->PrepareOneBody();
+      }
+      catch (Orthanc::OrthancException& e)
+      {
+        LOG(ERROR) << "Unhandled exception while preparing HTTP bodies: " << e.What();
+        prepared = false;
+      }
+      catch (std::exception& e)
+      {
+        LOG(ERROR) << "Unhandled exception while preparing HTTP bodies: " << e.what();
+        prepared = false;
+      }
+      catch (...)
+      {
+        LOG(ERROR) << "Native exception while preparing HTTP bodies";
+        prepared = false;
+      }
+
+      {
+        boost::mutex::scoped_lock lock(that->mutex_);
+
+        client->activePreparations_ --;
+
+        if (!prepared &&
+            client->wakeups_ == wakeups)
+        {
+          // Either enough bodies are ready, or there is no more body
+          client->isIdle_ = true;
+        }
+
+        that->changed_.notify_all();
+      }
+    }
+  }
+
+
+  HttpBodiesPreparer::HttpBodiesPreparer(size_t threadsCount) :
+    continue_(true)
+  {
+    if (threadsCount == 0)
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
+    }
+      
+    workers_.resize(threadsCount);
+
+    for (size_t i = 0; i < threadsCount; i++)
+    {
+      workers_[i] = new boost::thread(Worker, this);
+    }
+  }
+
+
+  HttpBodiesPreparer::~HttpBodiesPreparer()
+  {
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+      continue_ = false;
+      changed_.notify_all();
+    }
+
+    for (size_t i = 0; i < workers_.size(); i++)
+    {
+      if (workers_[i] != NULL)
+      {
+        if (workers_[i]->joinable())
+        {
+          workers_[i]->join();
+        }
+
+        delete workers_[i];
+      }
+    }
+
+    if (!clients_.empty())
+    {
+      LOG(ERROR) << "Some sources are still registered in the bodies preparer";
+    }
+  }
+
+
+  void HttpBodiesPreparer::Register(ISource& source)
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+
+    Client client;
+    client.source_ = &source;
+    client.activePreparations_ = 0;
+    client.isIdle_ = false;
+    client.wakeups_ = 0;
+    client.isRemoved_ = false;
+    clients_.push_back(client);
+
+    changed_.notify_all();
+  }
+
+
+  void HttpBodiesPreparer::Unregister(ISource& source)
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+
+    for (Clients::iterator it = clients_.begin(); it != clients_.end(); ++it)
+    {
+      if (it->source_ == &source)
+      {
+        it->isRemoved_ = true;
+
+        while (it->activePreparations_ > 0)
+        {
+          changed_.wait(lock);
+        }
+
+        clients_.erase(it);
+        return;
+      }
+    }
+
+    throw Orthanc::OrthancException(Orthanc::ErrorCode_InexistentItem);
+  }
+
+
+  void HttpBodiesPreparer::Wake(ISource& source)
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+
+    for (Clients::iterator it = clients_.begin(); it != clients_.end(); ++it)
+    {
+      if (it->source_ == &source)
+      {
+        it->isIdle_ = false;
+        it->wakeups_ ++;
+        changed_.notify_one();
+        return;
+      }
+    }
+  }
+}
@@ -0,0 +1,96 @@
+/**
+ * Transfers accelerator plugin for Orthanc
+ * Copyright (C) 2018-2021 Osimis S.A., Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Affero General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+
+#pragma once
+
+#include <boost/noncopyable.hpp>
+#include <boost/thread.hpp>
+
+#include <list>
+#include <vector>
+
+
+namespace OrthancPlugins
+{
+  /**
+   * CPU stage of the HTTP queries: Plugin-wide pool of threads that
+   * read and compress the bodies of the next queries of the
+   * registered queues, while the network threads are sending the
+   * previous ones. The queues are served in turn, so that all the
+   * running transfers share the same threads.
+   **/
+  class HttpBodiesPreparer : public boost::noncopyable
+  {
+  public:
+    class ISource : public boost::noncopyable
+    {
+    public:
+      virtual ~ISource()
+      {
+      }
+
+      // Returns "false" if no body can be prepared for now. Must
+      // never wait, as the threads are shared by all the sources.
+      virtual bool PrepareOneBody() = 0;
+    };
+
+  private:
+    struct Client
+    {
+      ISource*           source_;
+      size_t             activePreparations_;
+      bool               isIdle_;     // Nothing to prepare at the last attempt
+      unsigned int       wakeups_;    // Incremented each time a body is consumed
+      bool               isRemoved_;
+    };
+
+    typedef std::list<Client>  Clients;
+
+    boost::mutex                  mutex_;
+    boost::condition_variable     changed_;
+    Clients                       clients_;
+    bool                          continue_;
+    std::vector<boost::thread*>   workers_;
+
+    Client* PickClient();
+
+    static void Worker(HttpBodiesPreparer* that);
+
+  public:
+    explicit HttpBodiesPreparer(size_t threadsCount);
+
+    ~HttpBodiesPreparer();
+
+    size_t GetThreadsCount() const
+    {
+      return workers_.size();
+    }
+
+    void Register(ISource& source);
+
+    // Waits for the running preparations of this source to complete
+    void Unregister(ISource& source);
+
+    // Called by the source when one of its bodies has been consumed
+    // by a network thread, which frees a slot for a new body. Does
+    // nothing if the source is not registered.
+    void Wake(ISource& source);
+  };
+}
@@ -0,0 +1,267 @@
+/**
+ * Transfers accelerator plugin for Orthanc
+ * Copyright (C) 2018-2021 Osimis S.A., Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Affero General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+
+#include "HttpQueriesPool.h"
+
+#include "HttpQueriesRunner.h"
+
+#include <Logging.h>
+#include <OrthancException.h>
+
+
+namespace OrthancPlugins
+{
+  HttpQueriesPool::Client* HttpQueriesPool::PickClient(const boost::posix_time::ptime& now)
+  {
+    // Start-time fair queuing: The runner with the smallest virtual
+    // time is served first, and its virtual time grows inversely to
+    // its weight. The peers with less running queries are preferred.
+    Client* best = NULL;
+    size_t bestPeerQueries = 0;
+
+    for (Clients::iterator it = clients_.begin(); it != clients_.end(); ++it)
+    {
+      if (!it->isDone_ &&
+          !it->isRemoved_ &&
+          (it->notBefore_.is_not_a_date_time() ||
+           it->notBefore_ <= now) &&
+          !breaker_.IsOpen(it->peer_))
+      {
+        size_t peerQueries = activePeers_[it->peer_];
+        unsigned int maxPeerQueries = limits_.GetMaxConcurrentQueries(it->peer_);
+
+        if (maxPeerQueries != 0 &&
+            peerQueries >= maxPeerQueries)
+        {
+          continue;  // This peer is saturated
+        }
+
+        if (limits_.GetThrottleDelay(it->peer_) > 0)
+        {
+          continue;  // This peer has exceeded its upload or download rate
+        }
+
+        if (best == NULL ||
+            peerQueries < bestPeerQueries ||
+            (peerQueries == bestPeerQueries &&
+             it->virtualTime_ < best->virtualTime_))
+        {
+          best = &(*it);
+          bestPeerQueries = peerQueries;
+        }
+      }
+    }
+
+    return best;
+  }
+
+
+  void HttpQueriesPool::Worker(HttpQueriesPool* that)
+  {
+    for (;;)
+    {
+      Client* client = NULL;
+
+      {
+        boost::mutex::scoped_lock lock(that->mutex_);
+
+        while (that->continue_ &&
+               (client = that->PickClient(boost::posix_time::microsec_clock::universal_time())) == NULL)
+        {
+          // Timed wait, as the circuit breaker of a peer closes, the
+          // throttling of a peer and the backoff of the failed
+          // queries end, without any notification
+          that->changed_.timed_wait(lock, boost::posix_time::milliseconds(100));
+        }
+
+        if (!that->continue_)
+        {
+          return;
+        }
+
+        client->activeQueries_ ++;
+        client->virtualTime_ += 1.0 / static_cast<double>(client->weight_);
+        that->virtualTime_ = client->virtualTime_;
+        that->activePeers_[client->peer_] ++;
+      }
+
+      bool hasMore;
+      boost::posix_time::ptime notBefore;
+
+      try
+      {
+        hasMore = client->runner_->ExecuteOneQuery(notBefore);
+      }
+      catch (Orthanc::OrthancException& e)
+      {
+        LOG(ERROR) << "Unhandled exception in the pool of HTTP queries: " << e.What();
+        hasMore = false;
+      }
+      catch (...)
+      {
+        LOG(ERROR) << "Native exception in the pool of HTTP queries";
+        hasMore = false;
+      }
+
+      {
+        boost::mutex::scoped_lock lock(that->mutex_);
+
+        client->activeQueries_ --;
+        that->activePeers_[client->peer_] --;
+
+        if (!hasMore)
+        {
+          // No more pending query (either failure, or success)
+          client->isDone_ = true;
+        }
+        else
+        {
+          client->notBefore_ = notBefore;
+        }
+
+        that->changed_.notify_all();
+      }
+    }
+  }
+
+
+  HttpQueriesPool::HttpQueriesPool(size_t threadsCount) :
+    virtualTime_(0),
+    continue_(true),
+    maxRequeues_(3)
+  {
+    if (threadsCount == 0)
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
+    }
+      
+    workers_.resize(threadsCount);
+
+    for (size_t i = 0; i < threadsCount; i++)
+    {
+      workers_[i] = new boost::thread(Worker, this);
+    }
+  }
+
+
+  HttpQueriesPool::~HttpQueriesPool()
+  {
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+      continue_ = false;
+      changed_.notify_all();
+    }
+
+    for (size_t i = 0; i < workers_.size(); i++)
+    {
+      if (workers_[i] != NULL)
+      {
+        if (workers_[i]->joinable())
+        {
+          workers_[i]->join();
+        }
+
+        delete workers_[i];
+      }
+    }
+
+    if (!clients_.empty())
+    {
+      LOG(ERROR) << "Some HTTP queries runners are still registered in the pool";
+    }
+  }
+
+
+  void HttpQueriesPool::SetMaxRequeues(unsigned int maxRequeues)
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    maxRequeues_ = maxRequeues;
+  }
+
+
+  unsigned int HttpQueriesPool::GetMaxRequeues()
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    return maxRequeues_;
+  }
+
+
+  void HttpQueriesPool::Register(HttpQueriesRunner& runner,
+                                 const std::string& peer,
+                                 unsigned int weight)
+  {
+    if (weight == 0)
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
+    }
+
+    boost::mutex::scoped_lock lock(mutex_);
+
+    Client client;
+    client.runner_ = &runner;
+    client.peer_ = peer;
+    client.weight_ = weight;
+    client.virtualTime_ = virtualTime_;  // Don't take precedence over the running transfers
+    client.activeQueries_ = 0;
+    client.notBefore_ = boost::posix_time::not_a_date_time;
+    client.isDone_ = false;
+    client.isRemoved_ = false;
+    clients_.push_back(client);
+
+    changed_.notify_all();
+  }
+
+
+  void HttpQueriesPool::Unregister(HttpQueriesRunner& runner)
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+
+    for (Clients::iterator it = clients_.begin(); it != clients_.end(); ++it)
+    {
+      if (it->runner_ == &runner)
+      {
+        it->isRemoved_ = true;
+
+        while (it->activeQueries_ > 0)
+        {
+          changed_.wait(lock);
+        }
+
+        clients_.erase(it);
+        return;
+      }
+    }
+
+    throw Orthanc::OrthancException(Orthanc::ErrorCode_InexistentItem);
+  }
+
+
+  unsigned int HttpQueriesPool::GetWeight(int jobPriority)
+  {
+    if (jobPriority <= 0)
+    {
+      return 1;
+    }
+    else
+    {
+      return static_cast<unsigned int>(jobPriority) + 1;
+    }
+  }
+}
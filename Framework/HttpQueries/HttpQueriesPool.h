@@ -0,0 +1,120 @@
+/**
+ * Transfers accelerator plugin for Orthanc
+ * Copyright (C) 2018-2021 Osimis S.A., Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Affero General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+
+#pragma once
+
+#include "CircuitBreaker.h"
+#include "PeerLimits.h"
+
+#include <boost/noncopyable.hpp>
+#include <boost/thread.hpp>
+
+#include <list>
+#include <map>
+#include <string>
+#include <vector>
+
+
+namespace OrthancPlugins
+{
+  class HttpQueriesRunner;
+
+  /**
+   * Plugin-wide pool of threads that execute the HTTP queries of all
+   * the running transfers. Each runner receives a share of the pool
+   * that is proportional to its weight. The peers are served in turn,
+   * so that a slow peer cannot hold all the threads, and never get
+   * more concurrent queries than their "MaxConcurrentQueries" limit,
+   * nor new queries while they are above their maximum rates.
+   **/
+  class HttpQueriesPool : public boost::noncopyable
+  {
+  private:
+    struct Client
+    {
+      HttpQueriesRunner*        runner_;
+      std::string               peer_;
+      unsigned int              weight_;
+      double                    virtualTime_;
+      size_t                    activeQueries_;
+      boost::posix_time::ptime  notBefore_;  // Only waiting for the backoff of failed queries
+      bool                      isDone_;
+      bool                      isRemoved_;
+    };
+
+    typedef std::list<Client>                Clients;
+    typedef std::map<std::string, size_t>    ActivePeers;
+
+    boost::mutex                  mutex_;
+    boost::condition_variable     changed_;
+    Clients                       clients_;
+    ActivePeers                   activePeers_;
+    double                        virtualTime_;
+    bool                          continue_;
+    std::vector<boost::thread*>   workers_;
+    CircuitBreaker                breaker_;
+    PeerLimits                    limits_;
+    unsigned int                  maxRequeues_;
+
+    Client* PickClient(const boost::posix_time::ptime& now);
+
+    static void Worker(HttpQueriesPool* that);
+
+  public:
+    explicit HttpQueriesPool(size_t threadsCount);
+
+    ~HttpQueriesPool();
+
+    size_t GetThreadsCount() const
+    {
+      return workers_.size();
+    }
+
+    // Shared by all the transfers, so that the workers stop sending
+    // queries to a peer that is down
+    CircuitBreaker& GetCircuitBreaker()
+    {
+      return breaker_;
+    }
+
+    // Shared by all the transfers, so that the limits of a peer apply
+    // to all the jobs that are sending queries to this peer
+    PeerLimits& GetPeerLimits()
+    {
+      return limits_;
+    }
+
+    // Number of times a query that has exhausted its retries is put
+    // back at the end of the queue of its transfer
+    void SetMaxRequeues(unsigned int maxRequeues);
+
+    unsigned int GetMaxRequeues();
+
+    void Register(HttpQueriesRunner& runner,
+                  const std::string& peer,
+                  unsigned int weight);
+
+    // Waits for the running queries of this runner to complete
+    void Unregister(HttpQueriesRunner& runner);
+
+    // The jobs with a higher priority get a larger share of the pool
+    static unsigned int GetWeight(int jobPriority);
+  };
+}
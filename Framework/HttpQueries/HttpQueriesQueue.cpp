@@ -19,11 +19,31 @@
 
 #include "HttpQueriesQueue.h"
 
+#include "PeerAnswer.h"
+
+#include "../TransferToolbox.h"
+
 #include <Logging.h>
 #include <OrthancException.h>
 
+#include <algorithm>
+
 namespace OrthancPlugins
 {
+  // Default number of times a query that has exhausted its retries
+  // is put back at the end of the queue
+  static const unsigned int DEFAULT_MAX_REQUEUES = 3;
+
+  // Number of consecutive failures after which a source of a
+  // multi-source transfer is not used anymore
+  static const unsigned int MAX_SOURCE_FAILURES = 3;
+
+  // When the only pending queries are being sent by other threads,
+  // the queue is polled again after this delay, in case one of them
+  // fails and is requeued
+  static const unsigned int IDLE_POLLING_MS = 100;
+
+
   HttpQueriesQueue::Status HttpQueriesQueue::GetStatusInternal() const
   {
     if (successQueries_ == queries_.size())
@@ -41,8 +61,110 @@ namespace OrthancPlugins
   }
 
 
+  void HttpQueriesQueue::ClearPreparedBodies()
+  {
+    for (PreparedBodies::iterator it = preparedBodies_.begin(); it != preparedBodies_.end(); ++it)
+    {
+      delete it->second;
+    }
+
+    preparedBodies_.clear();
+  }
+
+
+  void HttpQueriesQueue::ClearDelayedQueries()
+  {
+    for (DelayedQueries::iterator it = delayed_.begin(); it != delayed_.end(); ++it)
+    {
+      delete it->second.body_;
+    }
+
+    delayed_.clear();
+  }
+
+
+  bool HttpQueriesQueue::TakePreparedBody(std::string& body,
+                                          size_t index)
+  {
+    std::unique_ptr<std::string> prepared;
+    HttpBodiesPreparer* preparer = NULL;
+
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+
+      if (prefetchSize_ == 0)
+      {
+        return false;
+      }
+
+      for (;;)
+      {
+        PreparedBodies::iterator found = preparedBodies_.find(index);
+
+        if (found != preparedBodies_.end())
+        {
+          prepared.reset(found->second);
+          preparedBodies_.erase(found);
+          preparer = preparer_;
+          break;
+        }
+        else if (isFailure_)
+        {
+          return false;
+        }
+        else if (index == preparePosition_)
+        {
+          // The preparers are late: The network thread prepares this
+          // body by itself
+          preparePosition_ ++;
+          return false;
+        }
+        else
+        {
+          if (preparingBodies_.find(index) != preparingBodies_.end())
+          {
+            // A preparer is working on this body: Rather than waiting
+            // for it, which would block a thread of the shared pool,
+            // the network thread prepares the body by itself, and the
+            // result of the preparer will be dropped
+            skippedBodies_.insert(index);
+          }
+
+          // Otherwise, the body was already consumed (the query is
+          // retried), and is read again
+          return false;
+        }
+      }
+    }
+
+    if (preparer != NULL)
+    {
+      // A slot is free (the mutex of the queue must not be held, as
+      // the preparer locks its own mutex before the one of the queue)
+      preparer->Wake(*this);
+    }
+
+    if (prepared.get() == NULL)
+    {
+      return false;  // The preparation has failed, read the body again
+    }
+    else
+    {
+      body.swap(*prepared);
+      return true;
+    }
+  }
+
+
   HttpQueriesQueue::HttpQueriesQueue() :
-    maxRetries_(0)
+    timeout_(0),
+    maxRetries_(0),
+    maxRequeues_(DEFAULT_MAX_REQUEUES),
+    breaker_(NULL),
+    limits_(NULL),
+    statistics_(boost::posix_time::microsec_clock::universal_time()),
+    prefetchSize_(0),
+    preparer_(NULL)
   {
     Reset();
   }
@@ -50,6 +172,9 @@ namespace OrthancPlugins
     
   HttpQueriesQueue::~HttpQueriesQueue()
   {
+    ClearPreparedBodies();
+    ClearDelayedQueries();
+
     for (size_t i = 0; i < queries_.size(); i++)
     {
       assert(queries_[i] != NULL);
@@ -58,6 +183,13 @@ namespace OrthancPlugins
   }
 
     
+  void HttpQueriesQueue::SetTimeout(unsigned int timeout)
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    timeout_ = timeout;
+  }
+
+
   unsigned int HttpQueriesQueue::GetMaxRetries()
   {
     boost::mutex::scoped_lock lock(mutex_);
@@ -71,11 +203,170 @@ namespace OrthancPlugins
     maxRetries_ = maxRetries;
   }
 
+
+  void HttpQueriesQueue::SetMaxRequeues(unsigned int maxRequeues)
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    maxRequeues_ = maxRequeues;
+  }
+
+
+  void HttpQueriesQueue::SetSources(const std::vector<std::string>& sources)
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+
+    sources_.clear();
+
+    if (sources.size() > 1)
+    {
+      for (size_t i = 0; i < sources.size(); i++)
+      {
+        Source source;
+        source.failures_ = 0;
+        source.isDisabled_ = false;
+        sources_[sources[i]] = source;
+      }
+    }
+  }
+
+
+  void HttpQueriesQueue::GetDisabledSources(std::set<std::string>& target)
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+
+    target.clear();
+    for (Sources::const_iterator it = sources_.begin(); it != sources_.end(); ++it)
+    {
+      if (it->second.isDisabled_)
+      {
+        target.insert(it->first);
+      }
+    }
+  }
+
+
+  void HttpQueriesQueue::SetCircuitBreaker(CircuitBreaker& breaker)
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    breaker_ = &breaker;
+  }
+
+
+  void HttpQueriesQueue::SetPeerLimits(PeerLimits& limits)
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    limits_ = &limits;
+  }
+
+
+  size_t HttpQueriesQueue::GetRetriesBudgetInternal() const
+  {
+    // Each query may use all of its own retries, and on top of this,
+    // 10% of the queries may be retried once
+    return maxRetries_ + queries_.size() / 10;
+  }
+
+
+  size_t HttpQueriesQueue::GetRequeuesBudgetInternal() const
+  {
+    // A flaky network may cost a few queries, but if more than 5% of
+    // the queries fail, the peer is most probably unusable
+    return 5 + queries_.size() / 20;
+  }
+
+    
+  void HttpQueriesQueue::EnablePrefetch(HttpBodiesPreparer& preparer,
+                                        size_t count)
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    preparer_ = &preparer;
+    prefetchSize_ = count;
+  }
+
+
+  bool HttpQueriesQueue::PrepareOneBody()
+  {
+    size_t index;
+    IHttpQuery* query = NULL;
+
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+
+      if (prefetchSize_ == 0 ||
+          isFailure_ ||
+          preparePosition_ == queries_.size() ||
+          preparePosition_ >= position_ + prefetchSize_ /* enough bodies are waiting */)
+      {
+        return false;
+      }
+
+      index = preparePosition_;
+      query = queries_[index];
+      preparePosition_ ++;
+      preparingBodies_.insert(index);
+    }
+
+    std::unique_ptr<std::string> body;
+
+    if (query->GetMethod() == Orthanc::HttpMethod_Post ||
+        query->GetMethod() == Orthanc::HttpMethod_Put)
+    {
+      try
+      {
+        body.reset(new std::string);
+        query->ReadBody(*body);
+      }
+      catch (Orthanc::OrthancException& e)
+      {
+        LOG(WARNING) << "Cannot prepare the body of an HTTP query: " << e.What();
+        body.reset(NULL);
+      }
+      catch (std::exception& e)
+      {
+        LOG(WARNING) << "Cannot prepare the body of an HTTP query: " << e.what();
+        body.reset(NULL);
+      }
+      catch (...)
+      {
+        LOG(WARNING) << "Native exception while preparing the body of an HTTP query";
+        body.reset(NULL);
+      }
+    }
+    else
+    {
+      body.reset(new std::string);
+    }
+
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+
+      std::set<size_t>::iterator skipped = skippedBodies_.find(index);
+
+      if (skipped != skippedBodies_.end())
+      {
+        // Too late, the network thread has not waited for this body
+        skippedBodies_.erase(skipped);
+      }
+      else if (preparingBodies_.find(index) != preparingBodies_.end())
+      {
+        preparedBodies_[index] = body.release();
+      }
+
+      // If the index is not found, the queue was reset in the
+      // meantime, and this body is outdated
+      preparingBodies_.erase(index);
+    }
+
+    return true;
+  }
+
     
   void HttpQueriesQueue::Reserve(size_t size)
   {
     boost::mutex::scoped_lock lock(mutex_);
     queries_.reserve(size);
+    requeues_.reserve(size);
+    failovers_.reserve(size);
   }
 
     
@@ -87,6 +378,27 @@ namespace OrthancPlugins
     uploadedSize_ = 0;
     successQueries_ = 0;
     isFailure_ = false;
+    isPermanentFailure_ = false;
+    retriesCount_ = 0;
+    activeQueries_ = 0;
+    requeued_.clear();
+    ClearDelayedQueries();
+    requeuesCount_ = 0;
+    std::fill(requeues_.begin(), requeues_.end(), 0);
+    std::fill(failovers_.begin(), failovers_.end(), 0);
+
+    for (Sources::iterator it = sources_.begin(); it != sources_.end(); ++it)
+    {
+      it->second.failures_ = 0;
+      it->second.isDisabled_ = false;
+    }
+
+    preparePosition_ = 0;
+    ClearPreparedBodies();
+    preparingBodies_.clear();
+    skippedBodies_.clear();
+
+    statistics_.Reset(boost::posix_time::microsec_clock::universal_time());
   }
     
 
@@ -100,138 +412,408 @@ namespace OrthancPlugins
     {
       boost::mutex::scoped_lock lock(mutex_);
       queries_.push_back(query);
+      requeues_.push_back(0);
+      failovers_.push_back(0);
     }
   }
     
 
-  bool HttpQueriesQueue::ExecuteOneQuery(size_t& networkTraffic)
+  bool HttpQueriesQueue::FailoverInternal(size_t index,
+                                          bool isPermanent,
+                                          const std::string& source)
+  {
+    Sources::iterator failed = sources_.find(source);
+    if (failed == sources_.end() ||
+        failed->second.isDisabled_ ||
+        failovers_[index] >= sources_.size())  // The query fails everywhere
+    {
+      return false;
+    }
+
+    size_t enabled = 0;
+    for (Sources::const_iterator it = sources_.begin(); it != sources_.end(); ++it)
+    {
+      if (!it->second.isDisabled_)
+      {
+        enabled ++;
+      }
+    }
+
+    if (enabled < 2)
+    {
+      return false;  // This is the last source
+    }
+
+    failed->second.failures_ ++;
+
+    if (isPermanent ||
+        failed->second.failures_ >= MAX_SOURCE_FAILURES)
+    {
+      LOG(WARNING) << "Peer \"" << source << "\" is failing, its queries are sent to the other peers";
+      failed->second.isDisabled_ = true;
+    }
+
+    // This failure is not charged to the budget of the transfer
+    failovers_[index] ++;
+    requeued_.push_front(index);
+    return true;
+  }
+
+
+  void HttpQueriesQueue::HandleFailure(size_t index,
+                                       bool isPermanent,
+                                       const std::string& source)
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+
+    assert(activeQueries_ > 0);
+    activeQueries_ --;
+
+    if (isFailure_)
+    {
+      // Another query has already failed the whole queue
+    }
+    else if (FailoverInternal(index, isPermanent, source))
+    {
+      // Another source will run this query
+    }
+    else if (isPermanent)
+    {
+      isFailure_ = true;
+      isPermanentFailure_ = true;
+    }
+    else if (requeues_[index] >= maxRequeues_)
+    {
+      LOG(ERROR) << "HTTP query to " << queries_[index]->GetUri()
+                 << " has failed too many times, giving up";
+      isFailure_ = true;
+    }
+    else if (requeuesCount_ >= GetRequeuesBudgetInternal())
+    {
+      LOG(ERROR) << "Too many HTTP queries have failed in this transfer, giving up";
+      isFailure_ = true;
+    }
+    else
+    {
+      LOG(WARNING) << "HTTP query to " << queries_[index]->GetUri()
+                   << " has failed, it is scheduled again at the end of the transfer";
+      requeues_[index] ++;
+      requeuesCount_ ++;
+      requeued_.push_back(index);
+    }
+
+    // Wake up the threads that wait for requeued queries
+    completed_.notify_all();
+  }
+
+
+  bool HttpQueriesQueue::CanContinue(const std::string& peer)
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+
+    if (isFailure_)
+    {
+      return false;
+    }
+    else
+    {
+      Sources::const_iterator found = sources_.find(peer);
+      return (found == sources_.end() ||
+              !found->second.isDisabled_);
+    }
+  }
+
+
+  bool HttpQueriesQueue::ExecuteOneQuery(size_t& networkTraffic,
+                                         boost::posix_time::ptime& notBefore,
+                                         const std::string& peer)
   {
     networkTraffic = 0;
+    notBefore = boost::posix_time::not_a_date_time;
       
     unsigned int maxRetries;
+    CircuitBreaker* breaker;
+    PeerLimits* limits;
+    size_t index;
+    unsigned int retry = 0;
+    bool isRequeued = false;
+    std::unique_ptr<std::string> delayedBody;
     IHttpQuery* query = NULL;
 
     {
       boost::mutex::scoped_lock lock(mutex_);
 
       maxRetries = maxRetries_;
+      breaker = breaker_;
+      limits = limits_;
         
-      if (position_ == queries_.size() ||
-          isFailure_)
+      Sources::const_iterator source = sources_.find(peer);
+
+      if (isFailure_ ||
+          (source != sources_.end() &&
+           source->second.isDisabled_))
       {
         return false;
       }
-      else
+      else if (!delayed_.empty() &&
+               delayed_.begin()->first <= boost::posix_time::microsec_clock::universal_time())
+      {
+        // The backoff of a failed query is over
+        index = delayed_.begin()->second.index_;
+        retry = delayed_.begin()->second.retry_;
+        delayedBody.reset(delayed_.begin()->second.body_);
+        delayed_.erase(delayed_.begin());
+      }
+      else if (position_ < queries_.size())
       {
-        query = queries_[position_];
+        index = position_;
         position_ ++;
       }
+      else if (!requeued_.empty())
+      {
+        index = requeued_.front();
+        isRequeued = true;
+        requeued_.pop_front();
+      }
+      else if (activeQueries_ == 0)
+      {
+        if (delayed_.empty())
+        {
+          return false;  // All the queries are over
+        }
+        else
+        {
+          // Only waiting for the backoff of some queries
+          notBefore = delayed_.begin()->first;
+          return true;
+        }
+      }
+      else
+      {
+        // The queries that are still running might fail and be
+        // requeued: Give the thread back to the caller, and ask to
+        // be polled again later
+        notBefore = (boost::posix_time::microsec_clock::universal_time() +
+                     boost::posix_time::milliseconds(IDLE_POLLING_MS));
+
+        if (!delayed_.empty() &&
+            delayed_.begin()->first < notBefore)
+        {
+          notBefore = delayed_.begin()->first;
+        }
+
+        return true;
+      }
+
+      query = queries_[index];
+      activeQueries_ ++;
     }
 
     std::string body;
 
-    if (query->GetMethod() == Orthanc::HttpMethod_Post ||
-        query->GetMethod() == Orthanc::HttpMethod_Put)
+    if (delayedBody.get() != NULL)
+    {
+      body.swap(*delayedBody);
+    }
+    else if (query->GetMethod() == Orthanc::HttpMethod_Post ||
+             query->GetMethod() == Orthanc::HttpMethod_Put)
     {
-      query->ReadBody(body);              
-    }       
+      // The bodies of the requeued queries were discarded by the
+      // preparers, they must be read again
+      if (isRequeued ||
+          !TakePreparedBody(body, index))
+      {
+        try
+        {
+          query->ReadBody(body);
+        }
+        catch (Orthanc::OrthancException& e)
+        {
+          // Local error (typically, the disk), that won't be fixed by retrying
+          LOG(ERROR) << "Cannot read the body of an HTTP query: " << e.What();
+          HandleFailure(index, true /* permanent */, "" /* not caused by the peer */);
+          return false;
+        }
+      }
+    }
 
-    unsigned int retry = 0;
+    HttpHeaders headers;
+    query->GetHeaders(headers);
 
-    for (;;)
-    {
-      MemoryBuffer answer;
+    const std::string target = (peer.empty() ? query->GetPeer() : peer);
 
-      bool success;
+    PeerAnswer answer;
+    uint16_t status = 0;
 
-      try
+    boost::posix_time::ptime start;
+
+    bool success;
+
+    try
+    {
+      if (limits != NULL &&
+          !body.empty())
       {
-        switch (query->GetMethod())
-        {
-          case Orthanc::HttpMethod_Get:
-            success = peers_.DoGet(answer, query->GetPeer(), query->GetUri());
-            break;
+        limits->ReportUpload(target, body.size());
+      }
 
-          case Orthanc::HttpMethod_Post:
-            success = peers_.DoPost(answer, query->GetPeer(), query->GetUri(), body);
-            break;
+      // The latency is measured from the actual sending of the query
+      start = boost::posix_time::microsec_clock::universal_time();
 
-          case Orthanc::HttpMethod_Put:
-            success = peers_.DoPut(query->GetPeer(), query->GetUri(), body);
-            break;
+      success = CallPeer(answer, status, handle_, target,
+                         query->GetMethod(), query->GetUri(), headers, body, timeout_);
+    }
+    catch (Orthanc::OrthancException& e)
+    {
+      LOG(ERROR) << "Unhandled exception during an HTTP query to peer \"" 
+                 << target << "\": " << e.What();
+      success = false;
+    }
 
-          case Orthanc::HttpMethod_Delete:
-            success = peers_.DoDelete(query->GetPeer(), query->GetUri());
-            break;
+    if (breaker != NULL)
+    {
+      // Only the network errors and the server errors indicate
+      // that the peer is down
+      if (success ||
+          (status != 0 && status < 500))
+      {
+        breaker->ReportSuccess(target);
+      }
+      else
+      {
+        breaker->ReportFailure(target);
+      }
+    }
 
-          default:
-            throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
-        }
+    size_t downloaded = 0;
+    size_t uploaded = 0;
+
+    if (success &&
+        (query->GetMethod() == Orthanc::HttpMethod_Get ||
+         query->GetMethod() == Orthanc::HttpMethod_Post))
+    {
+      try
+      {
+        query->HandleAnswer(answer.GetData(), answer.GetSize());
+        downloaded = answer.GetSize();
       }
       catch (Orthanc::OrthancException& e)
       {
-        LOG(ERROR) << "Unhandled exception during an HTTP query to peer \"" 
-                   << query->GetPeer() << "\": " << e.What();
+        // Corrupted answer (e.g. bad MD5 or truncated bucket): Same
+        // as a network error, the query is sent once again
+        LOG(ERROR) << "Cannot handle the answer from peer \"" << target
+                   << "\" to " << query->GetUri() << ": " << e.What();
         success = false;
+        status = 0;
+      }
+    }
+
+    if (success)
+    {
+      if (query->GetMethod() == Orthanc::HttpMethod_Put ||
+          query->GetMethod() == Orthanc::HttpMethod_Post)
+      {
+        uploaded = body.size();
       }
+          
+      networkTraffic = downloaded + uploaded;
 
-      if (success)
       {
-        size_t downloaded = 0;
-        size_t uploaded = 0;
+        const boost::posix_time::ptime now = boost::posix_time::microsec_clock::universal_time();
+        statistics_.AddQuery(networkTraffic, static_cast<unsigned int>((now - start).total_milliseconds()), now);
+      }
 
-        if (query->GetMethod() == Orthanc::HttpMethod_Get ||
-            query->GetMethod() == Orthanc::HttpMethod_Post)
+      if (limits != NULL &&
+          downloaded > 0)
+      {
+        // The answer is already received, but this delays the next
+        // queries to the same peer
+        limits->ReportDownload(target, downloaded);
+      }
+            
+      {
+        boost::mutex::scoped_lock lock(mutex_);
+        downloadedSize_ += downloaded;
+        uploadedSize_ += uploaded;
+        successQueries_ ++;
+        activeQueries_ --;
+
+        Sources::iterator source = sources_.find(target);
+        if (source != sources_.end())
         {
-          query->HandleAnswer(answer.GetData(), answer.GetSize());
-          downloaded = answer.GetSize();
+          source->second.failures_ = 0;
         }
 
-        if (query->GetMethod() == Orthanc::HttpMethod_Put ||
-            query->GetMethod() == Orthanc::HttpMethod_Post)
+        if (successQueries_ == queries_.size())
         {
-          uploaded = body.size();
+          completed_.notify_all();
         }
-          
-        networkTraffic = downloaded + uploaded;
-            
-        {
-          boost::mutex::scoped_lock lock(mutex_);
-          downloadedSize_ += downloaded;
-          uploadedSize_ += uploaded;
-          successQueries_ ++;
 
-          if (successQueries_ == queries_.size())
-          {
-            completed_.notify_all();
-          }
+        return true;
+      }
+    }
+    else
+    {
+      // Error: Let's retry, unless the error is permanent
+      bool canRetry;
 
-          return true;
-        }
+      if (!IsRetriableHttpStatus(status))
+      {
+        LOG(ERROR) << "Peer \"" << target << "\" answered to "
+                   << query->GetUri() << " with HTTP status " << status;
+        HandleFailure(index, true /* permanent */, target);
+        return CanContinue(target);
+      }
+      else if (retry >= maxRetries)
+      {
+        LOG(INFO) << "Reached the maximum number of retries for a HTTP query";
+        canRetry = false;
       }
       else
       {
-        // Error: Let's retry
-        retry ++;
+        boost::mutex::scoped_lock lock(mutex_);
 
-        if (retry <= maxRetries)
+        if (retriesCount_ >= GetRetriesBudgetInternal())
         {
-          // Wait 1 second before retrying
-          boost::this_thread::sleep(boost::posix_time::seconds(1));
+          LOG(INFO) << "The budget of retries of this transfer is exhausted";
+          canRetry = false;
         }
         else
         {
-          LOG(INFO) << "Reached the maximum number of retries for a HTTP query";
-
-          {
-            boost::mutex::scoped_lock lock(mutex_);
-            isFailure_ = true;
-            completed_.notify_all();
-          }
-
-          return false;
+          retriesCount_ ++;
+          canRetry = !isFailure_;
         }
       }
+
+      if (canRetry)
+      {
+        // Don't sleep during the backoff, as this thread can send
+        // the other queries in the meantime (it typically belongs to
+        // the plugin-wide pool)
+        const unsigned int delay = ComputeRetryDelay(
+          retry, (breaker == NULL ? 0 : breaker->GetRemainingOpenTime(target)));
+
+        DelayedQuery delayed;
+        delayed.index_ = index;
+        delayed.retry_ = retry + 1;
+        delayed.body_ = new std::string;
+        delayed.body_->swap(body);
+
+        boost::mutex::scoped_lock lock(mutex_);
+        assert(activeQueries_ > 0);
+        activeQueries_ --;
+        delayed_.insert(std::make_pair(boost::posix_time::microsec_clock::universal_time() +
+                                       boost::posix_time::milliseconds(delay), delayed));
+        completed_.notify_all();
+        return true;
+      }
+      else
+      {
+        // The other queries go on, this one will be tried again
+        // once the rest of the queue is processed
+        HandleFailure(index, false /* not permanent */, target);
+        return CanContinue(target);
+      }
     }
   }
 
@@ -265,15 +847,70 @@ namespace OrthancPlugins
   }
 
 
+  bool HttpQueriesQueue::IsPermanentFailure()
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    return isPermanentFailure_;
+  }
+
+
   void HttpQueriesQueue::GetStatistics(size_t& scheduledQueriesCount,
                                        size_t& successQueriesCount,
+                                       size_t& requeuedQueriesCount,
                                        uint64_t& downloadedSize,
                                        uint64_t& uploadedSize)
   {
     boost::mutex::scoped_lock lock(mutex_);
     scheduledQueriesCount = queries_.size();
     successQueriesCount = successQueries_;
+    requeuedQueriesCount = requeuesCount_;
     downloadedSize = downloadedSize_;
     uploadedSize = uploadedSize_;
   }
+
+
+  void HttpQueriesQueue::GetActivity(size_t& activeQueriesCount,
+                                     size_t& retriesCount)
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    activeQueriesCount = activeQueries_;
+    retriesCount = retriesCount_;
+  }
+
+
+  void HttpQueriesQueue::FormatActivity(Json::Value& target,
+                                        const std::vector<HttpQueriesQueue*>& queues)
+  {
+    size_t totalActive = 0, totalRetries = 0;
+    float speed5s = 0, speed60s = 0;
+    unsigned int latency50 = 0, latency95 = 0, latency99 = 0;
+
+    const boost::posix_time::ptime now = boost::posix_time::microsec_clock::universal_time();
+
+    for (size_t i = 0; i < queues.size(); i++)
+    {
+      assert(queues[i] != NULL);
+
+      size_t activeQueriesCount, retriesCount;
+      queues[i]->GetActivity(activeQueriesCount, retriesCount);
+      totalActive += activeQueriesCount;
+      totalRetries += retriesCount;
+
+      QueriesStatistics& recent = queues[i]->GetRecentStatistics();
+      speed5s += recent.GetSpeed(5, now);
+      speed60s += recent.GetSpeed(60, now);
+      latency50 = std::max(latency50, recent.GetLatencyPercentile(50));
+      latency95 = std::max(latency95, recent.GetLatencyPercentile(95));
+      latency99 = std::max(latency99, recent.GetLatencyPercentile(99));
+    }
+
+    target = Json::objectValue;
+    target["ActiveHttpQueries"] = static_cast<unsigned int>(totalActive);
+    target["RetriedHttpQueries"] = static_cast<unsigned int>(totalRetries);
+    target["NetworkSpeedKBs5s"] = static_cast<unsigned int>(speed5s);
+    target["NetworkSpeedKBs60s"] = static_cast<unsigned int>(speed60s);
+    target["LatencyP50MS"] = latency50;
+    target["LatencyP95MS"] = latency95;
+    target["LatencyP99MS"] = latency99;
+  }
 }
@@ -19,17 +19,27 @@
 
 #pragma once
 
+#include "CircuitBreaker.h"
+#include "HttpBodiesPreparer.h"
 #include "IHttpQuery.h"
+#include "PeerLimits.h"
+#include "PeersHandle.h"
+#include "QueriesStatistics.h"
 
 #include "../../Resources/Orthanc/Plugins/OrthancPluginCppWrapper.h"
 
+#include <boost/date_time/posix_time/posix_time.hpp>
 #include <boost/thread/mutex.hpp>
 #include <boost/thread/condition_variable.hpp>
 
+#include <deque>
+#include <map>
+#include <set>
+
 
 namespace OrthancPlugins
 {
-  class HttpQueriesQueue : public boost::noncopyable
+  class HttpQueriesQueue : public HttpBodiesPreparer::ISource
   {
   public:
     enum Status
@@ -40,50 +50,194 @@ namespace OrthancPlugins
     };
 
   private:
-    OrthancPeers                  peers_;
+    // Query that is waiting for the end of its backoff before being
+    // retried, with the body that was already read
+    struct DelayedQuery
+    {
+      size_t        index_;
+      unsigned int  retry_;
+      std::string*  body_;
+    };
+
+    typedef std::multimap<boost::posix_time::ptime, DelayedQuery>  DelayedQueries;
+
+    // Source of a transfer whose queries are spread over several peers
+    struct Source
+    {
+      unsigned int  failures_;     // Consecutive failures
+      bool          isDisabled_;
+    };
+
+    typedef std::map<std::string, Source>  Sources;
+
+    PeersHandle                   handle_;
+    unsigned int                  timeout_;
     boost::mutex                  mutex_;
     boost::condition_variable     completed_;
     std::vector<IHttpQuery*>      queries_;
+    std::vector<unsigned int>     requeues_;         // Number of requeues of each query
+    std::vector<unsigned int>     failovers_;        // Number of times each query was given to another source
     unsigned int                  maxRetries_;
+    unsigned int                  maxRequeues_;
+    CircuitBreaker*               breaker_;
+    PeerLimits*                   limits_;
 
     size_t                        position_;
     uint64_t                      downloadedSize_;   // GET answers + POST answers
     uint64_t                      uploadedSize_;     // PUT body + POST body
     size_t                        successQueries_;
     bool                          isFailure_;
+    bool                          isPermanentFailure_;  // A peer has rejected a query
+    size_t                        retriesCount_;
+    size_t                        activeQueries_;
+    std::deque<size_t>            requeued_;         // Failed queries, run after the others
+    DelayedQueries                delayed_;          // Queries to be retried, by time of the retry
+    size_t                        requeuesCount_;
+    QueriesStatistics             statistics_;
+    Sources                       sources_;          // Empty if only one source
+
+    // Bodies that are prepared ahead of the network threads (NULL if
+    // the preparation has failed)
+    typedef std::map<size_t, std::string*>  PreparedBodies;
+
+    size_t                        prefetchSize_;     // 0 means no prefetching
+    HttpBodiesPreparer*           preparer_;         // Woken up when a body is consumed
+    size_t                        preparePosition_;
+    PreparedBodies                preparedBodies_;
+    std::set<size_t>              preparingBodies_;  // Being read by the preparers
+    std::set<size_t>              skippedBodies_;    // Subset of "preparingBodies_" read by the network threads
 
 
     Status GetStatusInternal() const;
 
+    // Total number of retries that are allowed for the whole queue,
+    // so that a transfer that is failing everywhere is not retried
+    // for hours
+    size_t GetRetriesBudgetInternal() const;
+
+    // Total number of queries that can be requeued after having
+    // exhausted their retries, before the whole queue fails
+    size_t GetRequeuesBudgetInternal() const;
+
+    // The mutex must be locked! Gives a query that has failed on one
+    // source to the other sources, without charging the budget of
+    // requeues. The source is disabled if it fails permanently or
+    // repeatedly. Returns "false" if no other source is available.
+    bool FailoverInternal(size_t index,
+                          bool isPermanent,
+                          const std::string& source);
+
+    // Puts a failed query at the back of the queue, or marks the
+    // queue as failed if the failure threshold is reached. "source"
+    // is empty if the failure is not caused by the peer.
+    void HandleFailure(size_t index,
+                       bool isPermanent,
+                       const std::string& source);
+
+    // Whether the thread that has sent the query to this peer can
+    // go on with the other queries
+    bool CanContinue(const std::string& peer);
+
+    void ClearPreparedBodies();
+
+    void ClearDelayedQueries();
+
+    bool TakePreparedBody(std::string& body,
+                          size_t index);
+
   public:
     HttpQueriesQueue();
 
-    ~HttpQueriesQueue();
+    virtual ~HttpQueriesQueue();
 
-    OrthancPeers& GetOrthancPeers()
-    {
-      return peers_;
-    }
+    // Timeout of the HTTP queries in seconds (0 means the default
+    // timeout of Orthanc)
+    void SetTimeout(unsigned int timeout);
 
     unsigned int GetMaxRetries();
 
     void SetMaxRetries(unsigned int maxRetries);
 
+    // Number of times a query that has exhausted its retries is put
+    // back at the end of the queue, before the whole queue fails
+    void SetMaxRequeues(unsigned int maxRequeues);
+
+    // The queries are spread over these peers (through the "peer"
+    // argument of "ExecuteOneQuery()"). A query that fails on one
+    // peer is run by the other ones. A peer that answers with a
+    // permanent error, or that fails several times in a row, is not
+    // used anymore, as long as another peer is available.
+    void SetSources(const std::vector<std::string>& sources);
+
+    void GetDisabledSources(std::set<std::string>& target);
+
+    // The breaker is not owned, and must outlive the queue
+    void SetCircuitBreaker(CircuitBreaker& breaker);
+
+    // The limits are not owned, and must outlive the queue
+    void SetPeerLimits(PeerLimits& limits);
+
+    // The bodies of the PUT/POST queries will be prepared by the
+    // given preparer (once the queue is registered into it), at most
+    // "count" queries ahead of the network threads
+    void EnablePrefetch(HttpBodiesPreparer& preparer,
+                        size_t count);
+
+    // Returns "false" if no body can be prepared for now, either
+    // because enough bodies are waiting for the network threads, or
+    // because there is no more body to be prepared
+    virtual bool PrepareOneBody();
+
     void Reserve(size_t size);
 
     void Reset();
 
     void Enqueue(IHttpQuery* query);  // Takes ownership
 
-    bool ExecuteOneQuery(size_t& networkTraffic);
+    // If "peer" is not empty, the query is sent to this peer instead
+    // of its own one: This is used to pull the same buckets from
+    // several mirrors, as the URIs do not depend on the peer. The
+    // failed queries are not retried by the calling thread: They are
+    // rescheduled after their backoff delay. If the only pending
+    // queries are waiting for their backoff, "notBefore" is set to
+    // the time of the next retry, before which the caller should do
+    // something else (otherwise, it is "not_a_date_time").
+    bool ExecuteOneQuery(size_t& networkTraffic,
+                         boost::posix_time::ptime& notBefore,
+                         const std::string& peer);
 
     Status WaitComplete(unsigned int timeoutMS);
     
     void WaitComplete();
 
+    // Whether the queue has failed because a peer has answered to a
+    // query with an error that is not worth retrying (as opposed to
+    // the network errors and the timeouts)
+    bool IsPermanentFailure();
+
     void GetStatistics(size_t& scheduledQueriesCount,
                        size_t& successQueriesCount,
+                       size_t& requeuedQueriesCount,
                        uint64_t& downloadedSize,
                        uint64_t& uploadedSize);
+
+    // Number of queries that are being sent, and total number of
+    // retries since the beginning of the transfer
+    void GetActivity(size_t& activeQueriesCount,
+                     size_t& retriesCount);
+
+    // Throughput and latency of the recent queries
+    QueriesStatistics& GetRecentStatistics()
+    {
+      return statistics_;
+    }
+
+    // Fills the "ActiveHttpQueries", "RetriedHttpQueries",
+    // "NetworkSpeedKBs5s", "NetworkSpeedKBs60s" and "LatencyP*MS"
+    // fields of the status of a job. The counts and the throughputs
+    // are summed over the queues, whereas the latencies of the
+    // slowest queue are reported.
+    static void FormatActivity(Json::Value& target,
+                               const std::vector<HttpQueriesQueue*>& queues);
   };
 }
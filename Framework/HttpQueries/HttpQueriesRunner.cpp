@@ -30,19 +30,42 @@ namespace OrthancPlugins
   {
     while (that->continue_)
     {
-      size_t size;
-        
-      if (that->queue_.ExecuteOneQuery(size))
-      {
-        boost::mutex::scoped_lock lock(that->mutex_);
-        that->totalTraffic_ += size;
-        that->lastUpdate_ = boost::posix_time::microsec_clock::local_time();
-      }
-      else
+      boost::posix_time::ptime notBefore;
+
+      if (!that->ExecuteOneQuery(notBefore))
       {
         // We're done (either failure, or no more pending queries)
         return;
       }
+      else if (!notBefore.is_not_a_date_time())
+      {
+        // The dedicated threads have nothing else to do than waiting
+        // for the backoff of the failed queries
+        const boost::posix_time::ptime now = boost::posix_time::microsec_clock::universal_time();
+        if (notBefore > now)
+        {
+          boost::this_thread::sleep(std::min(notBefore - now, boost::posix_time::time_duration(
+                                               boost::posix_time::milliseconds(100))));
+        }
+      }
+    }
+  }
+
+
+  bool HttpQueriesRunner::ExecuteOneQuery(boost::posix_time::ptime& notBefore)
+  {
+    size_t size;
+        
+    if (queue_.ExecuteOneQuery(size, notBefore, peer_))
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+      totalTraffic_ += size;
+      lastUpdate_ = boost::posix_time::microsec_clock::local_time();
+      return true;
+    }
+    else
+    {
+      return false;
     }
   }
 
@@ -50,6 +73,7 @@ namespace OrthancPlugins
   HttpQueriesRunner::HttpQueriesRunner(HttpQueriesQueue& queue,
                                        size_t threadsCount) :
     queue_(queue),
+    pool_(NULL),
     continue_(true),
     start_(boost::posix_time::microsec_clock::local_time()),
     totalTraffic_(0),
@@ -69,10 +93,31 @@ namespace OrthancPlugins
   }
 
 
+  HttpQueriesRunner::HttpQueriesRunner(HttpQueriesQueue& queue,
+                                       HttpQueriesPool& pool,
+                                       const std::string& peer,
+                                       unsigned int weight) :
+    queue_(queue),
+    pool_(&pool),
+    peer_(peer),
+    continue_(true),
+    start_(boost::posix_time::microsec_clock::local_time()),
+    totalTraffic_(0),
+    lastUpdate_(start_)
+  {
+    pool.Register(*this, peer, weight);
+  }
+
+
   HttpQueriesRunner::~HttpQueriesRunner()
   {
     continue_ = false;
 
+    if (pool_ != NULL)
+    {
+      pool_->Unregister(*this);
+    }
+
     for (size_t i = 0; i < workers_.size(); i++)
     {
       if (workers_[i] != NULL)
@@ -19,6 +19,7 @@
 
 #pragma once
 
+#include "HttpQueriesPool.h"
 #include "HttpQueriesQueue.h"
 
 #include <boost/thread.hpp>
@@ -30,6 +31,8 @@ namespace OrthancPlugins
   {
   private:
     HttpQueriesQueue&            queue_;
+    HttpQueriesPool*             pool_;     // Only set if sharing the threads of a pool
+    std::string                  peer_;     // Only set if sharing the threads of a pool
     std::vector<boost::thread*>  workers_;
     bool                         continue_;
     boost::posix_time::ptime     start_;
@@ -41,11 +44,30 @@ namespace OrthancPlugins
     static void Worker(HttpQueriesRunner* that);
 
   public:
+    // Runs the queries with dedicated threads (the maximum rates of
+    // the peers are only enforced by the pool). This is needed by the
+    // queries that must not wait for the pool: The detection of the
+    // plugin on the remote peers answers a REST call within a short
+    // timeout, whereas the threads of the pool can be busy with the
+    // transfers, and skip the peers whose circuit breaker is open
+    // (i.e. exactly the peers whose status must be reported). This
+    // also allows to test the queues without an Orthanc context.
     HttpQueriesRunner(HttpQueriesQueue& queue,
                       size_t threadsCount);
 
+    // Runs the queries with the threads of the plugin-wide pool. The
+    // "weight" is the share of the pool that is given to this runner.
+    HttpQueriesRunner(HttpQueriesQueue& queue,
+                      HttpQueriesPool& pool,
+                      const std::string& peer,
+                      unsigned int weight);
+
     ~HttpQueriesRunner();
 
+    // Returns "false" if there is no more query to be executed. If
+    // "notBefore" is set, no query is ready before this time.
+    bool ExecuteOneQuery(boost::posix_time::ptime& notBefore);
+
     void GetSpeed(float& kilobytesPerSecond);
   };
 }
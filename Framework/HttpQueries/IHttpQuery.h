@@ -23,6 +23,9 @@
 
 #include <boost/noncopyable.hpp>
 
+#include <map>
+#include <string>
+
 
 namespace OrthancPlugins
 {
@@ -41,6 +44,12 @@ namespace OrthancPlugins
 
     virtual void ReadBody(std::string& body) const = 0;   // Only for PUT/POST
 
+    // Additional HTTP headers of the query (none by default)
+    virtual void GetHeaders(std::map<std::string, std::string>& headers) const
+    {
+      headers.clear();
+    }
+
     virtual void HandleAnswer(const void* answer,
                               size_t size) = 0;
   };
@@ -0,0 +1,312 @@
+/**
+ * Transfers accelerator plugin for Orthanc
+ * Copyright (C) 2018-2021 Osimis S.A., Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Affero General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+
+#include "NativeHttpClient.h"
+
+#include <Compatibility.h>  // For std::unique_ptr
+#include <Logging.h>
+#include <OrthancException.h>
+
+
+static const size_t MAX_IDLE_CONNECTIONS = 32;  // Per peer
+
+
+namespace OrthancPlugins
+{
+  static NativeHttpClient*  globalInstance_ = NULL;
+
+
+  class NativeHttpClient::Peer : public boost::noncopyable
+  {
+  private:
+    Orthanc::WebServiceParameters      parameters_;
+    std::vector<Orthanc::HttpClient*>  idle_;
+
+  public:
+    explicit Peer(const Orthanc::WebServiceParameters& parameters) :
+      parameters_(parameters)
+    {
+    }
+
+    ~Peer()
+    {
+      for (size_t i = 0; i < idle_.size(); i++)
+      {
+        assert(idle_[i] != NULL);
+        delete idle_[i];
+      }
+    }
+
+    const Orthanc::WebServiceParameters& GetParameters() const
+    {
+      return parameters_;
+    }
+
+    std::vector<Orthanc::HttpClient*>& GetIdleConnections()
+    {
+      return idle_;
+    }
+  };
+
+
+  Orthanc::HttpClient* NativeHttpClient::Acquire(Peer*& peer,
+                                                 const std::string& name)
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+
+    Peers::iterator found = peers_.find(name);
+    if (found == peers_.end())
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_InexistentItem);
+    }
+
+    assert(found->second != NULL);
+    peer = found->second;
+
+    std::vector<Orthanc::HttpClient*>& idle = peer->GetIdleConnections();
+    if (idle.empty())
+    {
+      return new Orthanc::HttpClient(peer->GetParameters(), "");
+    }
+    else
+    {
+      Orthanc::HttpClient* client = idle.back();
+      idle.pop_back();
+      return client;
+    }
+  }
+
+
+  void NativeHttpClient::Release(Peer& peer,
+                                 Orthanc::HttpClient* client)
+  {
+    std::unique_ptr<Orthanc::HttpClient> protection(client);
+
+    boost::mutex::scoped_lock lock(mutex_);
+
+    if (peer.GetIdleConnections().size() < MAX_IDLE_CONNECTIONS)
+    {
+      peer.GetIdleConnections().push_back(protection.release());
+    }
+  }
+
+
+  NativeHttpClient::NativeHttpClient()
+  {
+  }
+
+
+  NativeHttpClient::~NativeHttpClient()
+  {
+    for (Peers::iterator it = peers_.begin(); it != peers_.end(); ++it)
+    {
+      assert(it->second != NULL);
+      delete it->second;
+    }
+  }
+
+
+  void NativeHttpClient::AddPeer(const std::string& name,
+                                 const Orthanc::WebServiceParameters& parameters)
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+
+    if (peers_.find(name) != peers_.end())
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_BadSequenceOfCalls);
+    }
+
+    peers_[name] = new Peer(parameters);
+  }
+
+
+  void NativeHttpClient::LoadPeers(const Json::Value& configuration)
+  {
+    if (configuration.type() != Json::objectValue)
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_BadFileFormat);
+    }
+
+    Json::Value::Members members = configuration.getMemberNames();
+
+    for (size_t i = 0; i < members.size(); i++)
+    {
+      try
+      {
+        AddPeer(members[i], Orthanc::WebServiceParameters(configuration[members[i]]));
+      }
+      catch (Orthanc::OrthancException& e)
+      {
+        LOG(WARNING) << "Bad configuration of peer \"" << members[i]
+                     << "\", its queries will go through the Orthanc core: " << e.What();
+      }
+    }
+  }
+
+
+  bool NativeHttpClient::HasPeer(const std::string& name)
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    return peers_.find(name) != peers_.end();
+  }
+
+
+  size_t NativeHttpClient::GetIdleConnectionsCount(const std::string& name)
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+
+    Peers::iterator found = peers_.find(name);
+    if (found == peers_.end())
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_InexistentItem);
+    }
+    else
+    {
+      return found->second->GetIdleConnections().size();
+    }
+  }
+
+
+  bool NativeHttpClient::Call(std::string& answer,
+                              uint16_t& httpStatus,
+                              const std::string& peer,
+                              Orthanc::HttpMethod method,
+                              const std::string& uri,
+                              const HttpHeaders& headers,
+                              const std::string& body,
+                              unsigned int timeout)
+  {
+    httpStatus = 0;
+    answer.clear();
+
+    Peer* item = NULL;
+    std::unique_ptr<Orthanc::HttpClient> client(Acquire(item, peer));
+    assert(item != NULL);
+
+    // The URL of the peer always ends with a slash
+    if (!uri.empty() &&
+        uri[0] == '/')
+    {
+      client->SetUrl(item->GetParameters().GetUrl() + uri.substr(1));
+    }
+    else
+    {
+      client->SetUrl(item->GetParameters().GetUrl() + uri);
+    }
+
+    client->SetMethod(method);
+    client->SetTimeout(timeout);
+    client->ClearHeaders();
+
+    for (HttpHeaders::const_iterator it = headers.begin(); it != headers.end(); ++it)
+    {
+      client->AddHeader(it->first, it->second);
+    }
+
+    if (method == Orthanc::HttpMethod_Post ||
+        method == Orthanc::HttpMethod_Put)
+    {
+      client->AssignBody(body);
+    }
+    else
+    {
+      client->ClearBody();
+    }
+
+    try
+    {
+      client->Apply(answer);
+    }
+    catch (Orthanc::OrthancException& e)
+    {
+      // The connection is dropped, as it might be broken
+      LOG(INFO) << "Cannot reach peer \"" << peer << "\": " << e.What();
+      return false;
+    }
+
+    const int status = static_cast<int>(client->GetLastStatus());
+    if (status > 0)
+    {
+      httpStatus = static_cast<uint16_t>(status);
+    }
+
+    Release(*item, client.release());
+
+    return IsSuccessHttpStatus(httpStatus);
+  }
+
+
+  void NativeHttpClient::GlobalInitialize(const Json::Value& orthancConfiguration)
+  {
+    if (globalInstance_ != NULL)
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_BadSequenceOfCalls);
+    }
+
+    Orthanc::HttpClient::GlobalInitialize();
+
+    bool httpsVerifyPeers = true;
+    std::string httpsCACertificates;
+
+    if (orthancConfiguration.isMember("HttpsVerifyPeers") &&
+        orthancConfiguration["HttpsVerifyPeers"].type() == Json::booleanValue)
+    {
+      httpsVerifyPeers = orthancConfiguration["HttpsVerifyPeers"].asBool();
+    }
+
+    if (orthancConfiguration.isMember("HttpsCACertificates") &&
+        orthancConfiguration["HttpsCACertificates"].type() == Json::stringValue)
+    {
+      httpsCACertificates = orthancConfiguration["HttpsCACertificates"].asString();
+    }
+
+    Orthanc::HttpClient::ConfigureSsl(httpsVerifyPeers, httpsCACertificates);
+
+    std::unique_ptr<NativeHttpClient> client(new NativeHttpClient);
+
+    if (orthancConfiguration.isMember("OrthancPeers"))
+    {
+      client->LoadPeers(orthancConfiguration["OrthancPeers"]);
+    }
+
+    LOG(WARNING) << "Transfers accelerator will use its native HTTP client for "
+                 << client->peers_.size() << " peer(s)";
+
+    globalInstance_ = client.release();
+  }
+
+
+  void NativeHttpClient::GlobalFinalize()
+  {
+    if (globalInstance_ != NULL)
+    {
+      delete globalInstance_;
+      globalInstance_ = NULL;
+
+      Orthanc::HttpClient::GlobalFinalize();
+    }
+  }
+
+
+  NativeHttpClient* NativeHttpClient::GetGlobalInstance()
+  {
+    return globalInstance_;
+  }
+}
@@ -0,0 +1,94 @@
+/**
+ * Transfers accelerator plugin for Orthanc
+ * Copyright (C) 2018-2021 Osimis S.A., Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Affero General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+
+#pragma once
+
+#include "../TransferToolbox.h"
+
+#include <HttpClient.h>  // Requires the "ENABLE_WEB_CLIENT" option of the Orthanc framework
+#include <WebServiceParameters.h>
+
+#include <boost/thread/mutex.hpp>
+
+#include <json/value.h>
+#include <map>
+#include <stdint.h>
+#include <vector>
+
+
+namespace OrthancPlugins
+{
+  /**
+   * HTTP client that sends the queries to the Orthanc peers without
+   * going through the Orthanc core. It keeps a pool of idle
+   * connections for each peer, so that the successive buckets reuse
+   * the same TCP/TLS sessions. Only the peers that are defined in the
+   * "OrthancPeers" configuration option are known by this client.
+   **/
+  class NativeHttpClient : public boost::noncopyable
+  {
+  private:
+    class Peer;
+
+    typedef std::map<std::string, Peer*>  Peers;
+
+    boost::mutex  mutex_;
+    Peers         peers_;
+
+    Orthanc::HttpClient* Acquire(Peer*& peer,
+                                 const std::string& name);
+
+    void Release(Peer& peer,
+                 Orthanc::HttpClient* client);
+
+  public:
+    NativeHttpClient();
+
+    ~NativeHttpClient();
+
+    void AddPeer(const std::string& name,
+                 const Orthanc::WebServiceParameters& parameters);
+
+    // Parses the "OrthancPeers" configuration option of Orthanc
+    void LoadPeers(const Json::Value& configuration);
+
+    bool HasPeer(const std::string& name);
+
+    size_t GetIdleConnectionsCount(const std::string& name);
+
+    // Same contract as "CallPeer()"
+    bool Call(std::string& answer,
+              uint16_t& httpStatus,
+              const std::string& peer,
+              Orthanc::HttpMethod method,
+              const std::string& uri,
+              const HttpHeaders& headers,
+              const std::string& body,
+              unsigned int timeout);
+
+    // Install a client that is shared by all the transfers (NULL if
+    // the queries go through the Orthanc core)
+    static void GlobalInitialize(const Json::Value& orthancConfiguration);
+
+    static void GlobalFinalize();
+
+    static NativeHttpClient* GetGlobalInstance();
+  };
+}
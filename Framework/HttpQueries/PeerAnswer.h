@@ -0,0 +1,95 @@
+/**
+ * Transfers accelerator plugin for Orthanc
+ * Copyright (C) 2018-2021 Osimis S.A., Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Affero General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+
+#pragma once
+
+#include "../../Resources/Orthanc/Plugins/OrthancPluginCppWrapper.h"
+
+#include <Toolbox.h>
+
+
+namespace OrthancPlugins
+{
+  /**
+   * Answer of an HTTP query to a peer. It is either stored in a buffer
+   * that is allocated by the Orthanc core, or in a string if the query
+   * was sent by the native HTTP client of the plugin.
+   **/
+  class PeerAnswer : public boost::noncopyable
+  {
+  private:
+    MemoryBuffer  buffer_;
+    std::string   native_;
+    bool          isNative_;
+
+  public:
+    PeerAnswer() :
+      isNative_(false)
+    {
+    }
+
+    MemoryBuffer& GetBuffer()
+    {
+      native_.clear();
+      isNative_ = false;
+      return buffer_;
+    }
+
+    std::string& GetString()
+    {
+      buffer_.Clear();
+      isNative_ = true;
+      return native_;
+    }
+
+    const char* GetData() const
+    {
+      if (!isNative_)
+      {
+        return buffer_.GetData();
+      }
+      else if (native_.empty())
+      {
+        return NULL;
+      }
+      else
+      {
+        return native_.c_str();
+      }
+    }
+
+    size_t GetSize() const
+    {
+      return (isNative_ ? native_.size() : buffer_.GetSize());
+    }
+
+    void ToJson(Json::Value& target) const
+    {
+      if (!isNative_)
+      {
+        buffer_.ToJson(target);
+      }
+      else if (!Orthanc::Toolbox::ReadJson(target, native_))
+      {
+        throw Orthanc::OrthancException(Orthanc::ErrorCode_BadFileFormat);
+      }
+    }
+  };
+}
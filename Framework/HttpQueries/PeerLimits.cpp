@@ -0,0 +1,211 @@
+/**
+ * Transfers accelerator plugin for Orthanc
+ * Copyright (C) 2018-2021 Osimis S.A., Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Affero General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+
+#include "PeerLimits.h"
+
+#include "../TransferToolbox.h"
+
+#include "../../Resources/Orthanc/Plugins/OrthancPluginCppWrapper.h"
+
+#include <Logging.h>
+#include <OrthancException.h>
+
+#include <boost/lexical_cast.hpp>
+
+
+namespace OrthancPlugins
+{
+  TokenBucket::TokenBucket(uint64_t rate) :
+    rate_(rate),
+    tokens_(static_cast<double>(rate)),
+    last_(boost::posix_time::microsec_clock::universal_time())
+  {
+  }
+
+
+  void TokenBucket::SetRate(uint64_t rate)
+  {
+    if (rate != rate_)
+    {
+      rate_ = rate;
+      tokens_ = std::min(tokens_, static_cast<double>(rate));
+    }
+  }
+
+
+  unsigned int TokenBucket::Consume(size_t size,
+                                    const boost::posix_time::ptime& now)
+  {
+    if (rate_ == 0)
+    {
+      return 0;
+    }
+
+    const double rate = static_cast<double>(rate_);
+
+    if (now > last_)
+    {
+      const double elapsed = static_cast<double>((now - last_).total_microseconds()) / 1000000.0;
+      tokens_ = std::min(rate, tokens_ + elapsed * rate);
+      last_ = now;
+    }
+
+    tokens_ -= static_cast<double>(size);
+
+    if (tokens_ >= 0)
+    {
+      return 0;
+    }
+    else
+    {
+      return static_cast<unsigned int>(-tokens_ * 1000.0 / rate) + 1;
+    }
+  }
+
+
+  static bool LookupUnsignedProperty(uint64_t& target,
+                                     const OrthancPeers& peers,
+                                     const std::string& peer,
+                                     const std::string& key)
+  {
+    std::string value;
+    if (!peers.LookupUserProperty(value, peer, key))
+    {
+      return false;
+    }
+
+    try
+    {
+      target = boost::lexical_cast<uint64_t>(value);
+      return true;
+    }
+    catch (boost::bad_lexical_cast&)
+    {
+      LOG(ERROR) << "The \"" << key << "\" property of peer \"" << peer
+                 << "\" must be a non-negative integer, found: " << value;
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
+    }
+  }
+
+
+  void PeerLimits::Report(const std::string& peer,
+                          size_t size,
+                          bool isUpload)
+  {
+    const boost::posix_time::ptime now = boost::posix_time::microsec_clock::universal_time();
+      
+    boost::mutex::scoped_lock lock(mutex_);
+
+    Peers::iterator found = peers_.find(peer);
+    if (found != peers_.end())
+    {
+      if (isUpload)
+      {
+        found->second.upload_.Consume(size, now);
+      }
+      else
+      {
+        found->second.download_.Consume(size, now);
+      }
+    }
+  }
+
+
+  unsigned int PeerLimits::GetThrottleDelay(const std::string& peer)
+  {
+    const boost::posix_time::ptime now = boost::posix_time::microsec_clock::universal_time();
+      
+    boost::mutex::scoped_lock lock(mutex_);
+
+    Peers::iterator found = peers_.find(peer);
+    if (found == peers_.end())
+    {
+      return 0;
+    }
+    else
+    {
+      // Consuming no byte only refills the buckets, and gives the
+      // time before they are out of debt
+      return std::max(found->second.upload_.Consume(0, now),
+                      found->second.download_.Consume(0, now));
+    }
+  }
+
+
+  void PeerLimits::Configure(const std::string& peer,
+                             unsigned int maxConcurrentQueries,
+                             uint64_t maxUploadRate,
+                             uint64_t maxDownloadRate)
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+
+    Peer& item = peers_[peer];
+    item.maxConcurrentQueries_ = maxConcurrentQueries;
+    item.upload_.SetRate(maxUploadRate);
+    item.download_.SetRate(maxDownloadRate);
+  }
+
+
+  void PeerLimits::LoadConfiguration()
+  {
+    OrthancPeers peers;
+
+    for (size_t i = 0; i < peers.GetPeersCount(); i++)
+    {
+      const std::string peer = peers.GetPeerName(i);
+
+      uint64_t maxConcurrentQueries = 0;
+      uint64_t maxUploadRate = 0;
+      uint64_t maxDownloadRate = 0;
+
+      LookupUnsignedProperty(maxConcurrentQueries, peers, peer, KEY_MAX_CONCURRENT_QUERIES);
+      LookupUnsignedProperty(maxUploadRate, peers, peer, KEY_MAX_UPLOAD_RATE);
+      LookupUnsignedProperty(maxDownloadRate, peers, peer, KEY_MAX_DOWNLOAD_RATE);
+
+      if (maxConcurrentQueries != 0 ||
+          maxUploadRate != 0 ||
+          maxDownloadRate != 0)
+      {
+        LOG(INFO) << "Limits of peer \"" << peer << "\": " << maxConcurrentQueries
+                  << " concurrent queries, upload " << maxUploadRate
+                  << "KB/s, download " << maxDownloadRate << "KB/s (0 means no limit)";
+      }
+
+      Configure(peer, static_cast<unsigned int>(maxConcurrentQueries),
+                maxUploadRate * 1024, maxDownloadRate * 1024);
+    }
+  }
+
+
+  unsigned int PeerLimits::GetMaxConcurrentQueries(const std::string& peer)
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+
+    Peers::const_iterator found = peers_.find(peer);
+    if (found == peers_.end())
+    {
+      return 0;
+    }
+    else
+    {
+      return found->second.maxConcurrentQueries_;
+    }
+  }
+}
@@ -0,0 +1,131 @@
+/**
+ * Transfers accelerator plugin for Orthanc
+ * Copyright (C) 2018-2021 Osimis S.A., Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Affero General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+
+#pragma once
+
+#include <boost/date_time/posix_time/posix_time.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/thread/mutex.hpp>
+
+#include <map>
+#include <stdint.h>
+#include <string>
+
+
+namespace OrthancPlugins
+{
+  /**
+   * Token bucket limiting a rate in bytes per second. The bucket
+   * holds at most one second of traffic. Consuming more bytes than
+   * available puts the bucket in debt, and no more traffic should
+   * then be sent for the returned delay, which spreads the traffic
+   * over time.
+   **/
+  class TokenBucket
+  {
+  private:
+    uint64_t                  rate_;    // Bytes per second, 0 means no limit
+    double                    tokens_;
+    boost::posix_time::ptime  last_;
+
+  public:
+    explicit TokenBucket(uint64_t rate);
+
+    uint64_t GetRate() const
+    {
+      return rate_;
+    }
+
+    void SetRate(uint64_t rate);
+
+    // Returns the number of milliseconds to wait before sending more
+    unsigned int Consume(size_t size,
+                         const boost::posix_time::ptime& now);
+  };
+
+
+  /**
+   * Limits that apply to all the transfers to one given peer: The
+   * maximum number of concurrent HTTP queries, and the maximum upload
+   * and download rates. They are read from the user properties of
+   * the Orthanc peers. The rates are enforced by the pool of HTTP
+   * queries, that doesn't send new queries to a peer as long as it
+   * is throttled, instead of delaying the threads.
+   **/
+  class PeerLimits : public boost::noncopyable
+  {
+  private:
+    struct Peer
+    {
+      unsigned int  maxConcurrentQueries_;   // 0 means no limit
+      TokenBucket   upload_;
+      TokenBucket   download_;
+
+      Peer() :
+        maxConcurrentQueries_(0),
+        upload_(0),
+        download_(0)
+      {
+      }
+    };
+
+    typedef std::map<std::string, Peer>  Peers;
+
+    boost::mutex  mutex_;
+    Peers         peers_;
+
+    void Report(const std::string& peer,
+                size_t size,
+                bool isUpload);
+
+  public:
+    // The rates are expressed in bytes per second
+    void Configure(const std::string& peer,
+                   unsigned int maxConcurrentQueries,
+                   uint64_t maxUploadRate,
+                   uint64_t maxDownloadRate);
+
+    // Reads the "MaxConcurrentQueries", "MaxUploadRate" and
+    // "MaxDownloadRate" (in KB/s) user properties of all the Orthanc
+    // peers at once. This lists the peers through the Orthanc core,
+    // so this is done once per job, not once per HTTP client.
+    void LoadConfiguration();
+
+    unsigned int GetMaxConcurrentQueries(const std::string& peer);
+
+    // Accounts for the body of a query that is about to be sent
+    void ReportUpload(const std::string& peer,
+                      size_t size)
+    {
+      Report(peer, size, true);
+    }
+
+    // Accounts for the answer of a query that was received
+    void ReportDownload(const std::string& peer,
+                        size_t size)
+    {
+      Report(peer, size, false);
+    }
+
+    // Number of milliseconds before the next query can be sent to
+    // this peer without exceeding its rates (0 if not throttled)
+    unsigned int GetThrottleDelay(const std::string& peer);
+  };
+}
@@ -0,0 +1,114 @@
+/**
+ * Transfers accelerator plugin for Orthanc
+ * Copyright (C) 2018-2021 Osimis S.A., Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Affero General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+
+#pragma once
+
+#include "../../Resources/Orthanc/Plugins/OrthancPluginCppWrapper.h"
+
+#include <OrthancException.h>
+
+#include <boost/thread/mutex.hpp>
+#include <map>
+
+
+namespace OrthancPlugins
+{
+  /**
+   * List of the Orthanc peers that is resolved once by the Orthanc
+   * core, then shared by all the HTTP queries of a transfer, so that
+   * the peers are not listed again at each query. The peers are only
+   * resolved at the first lookup, as the queries that are sent by the
+   * native HTTP client don't need them.
+   **/
+  class PeersHandle : public boost::noncopyable
+  {
+  private:
+    typedef std::map<std::string, uint32_t>  Indices;
+
+    mutable boost::mutex          mutex_;
+    mutable OrthancPluginPeers*   peers_;
+    mutable Indices               indices_;
+
+    void Resolve() const
+    {
+      // The mutex must be locked by the caller
+      if (peers_ == NULL)
+      {
+        peers_ = OrthancPluginGetPeers(GetGlobalContext());
+
+        if (peers_ == NULL)
+        {
+          throw Orthanc::OrthancException(Orthanc::ErrorCode_InternalError);
+        }
+
+        uint32_t count = OrthancPluginGetPeersCount(GetGlobalContext(), peers_);
+
+        for (uint32_t i = 0; i < count; i++)
+        {
+          const char* s = OrthancPluginGetPeerName(GetGlobalContext(), peers_, i);
+          if (s != NULL)
+          {
+            indices_[s] = i;
+          }
+        }
+      }
+    }
+
+  public:
+    PeersHandle() :
+      peers_(NULL)
+    {
+    }
+
+    ~PeersHandle()
+    {
+      if (peers_ != NULL)
+      {
+        OrthancPluginFreePeers(GetGlobalContext(), peers_);
+      }
+    }
+
+    OrthancPluginPeers* GetPeers() const
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+      Resolve();
+      return peers_;
+    }
+
+    bool LookupName(uint32_t& index,
+                    const std::string& name) const
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+      Resolve();
+
+      Indices::const_iterator found = indices_.find(name);
+
+      if (found == indices_.end())
+      {
+        return false;
+      }
+      else
+      {
+        index = found->second;
+        return true;
+      }
+    }
+  };
+}
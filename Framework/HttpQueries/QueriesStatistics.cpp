@@ -0,0 +1,156 @@
+/**
+ * Transfers accelerator plugin for Orthanc
+ * Copyright (C) 2018-2021 Osimis S.A., Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Affero General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+
+#include "QueriesStatistics.h"
+
+#include <OrthancException.h>
+
+#include <algorithm>
+
+
+namespace OrthancPlugins
+{
+  int64_t QueriesStatistics::GetSecond(const boost::posix_time::ptime& time)
+  {
+    static const boost::posix_time::ptime epoch(boost::gregorian::date(1970, 1, 1));
+    return (time - epoch).total_seconds();
+  }
+
+
+  QueriesStatistics::QueriesStatistics(const boost::posix_time::ptime& now) :
+    start_(GetSecond(now)),
+    latenciesPosition_(0)
+  {
+  }
+
+
+  void QueriesStatistics::Reset(const boost::posix_time::ptime& now)
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    start_ = GetSecond(now);
+    traffic_.clear();
+    latencies_.clear();
+    latenciesPosition_ = 0;
+  }
+
+
+  void QueriesStatistics::AddQuery(size_t traffic,
+                                   unsigned int latencyMS,
+                                   const boost::posix_time::ptime& now)
+  {
+    const int64_t second = GetSecond(now);
+
+    boost::mutex::scoped_lock lock(mutex_);
+
+    if (traffic_.empty() ||
+        traffic_.back().second_ < second)
+    {
+      Second item;
+      item.second_ = second;
+      item.traffic_ = traffic;
+      traffic_.push_back(item);
+    }
+    else
+    {
+      // Clock going backward, or same second
+      traffic_.back().traffic_ += traffic;
+    }
+
+    while (traffic_.front().second_ + static_cast<int64_t>(MAX_WINDOW) <= second)
+    {
+      traffic_.pop_front();
+    }
+
+    if (latencies_.size() < MAX_LATENCIES)
+    {
+      latencies_.push_back(latencyMS);
+    }
+    else
+    {
+      latencies_[latenciesPosition_] = latencyMS;
+      latenciesPosition_ = (latenciesPosition_ + 1) % MAX_LATENCIES;
+    }
+  }
+
+
+  float QueriesStatistics::GetSpeed(unsigned int seconds,
+                                    const boost::posix_time::ptime& now)
+  {
+    if (seconds == 0 ||
+        seconds > MAX_WINDOW)
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
+    }
+
+    const int64_t second = GetSecond(now);
+
+    boost::mutex::scoped_lock lock(mutex_);
+
+    uint64_t traffic = 0;
+
+    for (std::deque<Second>::const_iterator it = traffic_.begin(); it != traffic_.end(); ++it)
+    {
+      if (it->second_ + static_cast<int64_t>(seconds) > second)
+      {
+        traffic += it->traffic_;
+      }
+    }
+
+    // At the beginning of the transfer, the window is shorter
+    int64_t window = std::min(static_cast<int64_t>(seconds), second - start_ + 1);
+    if (window <= 0)
+    {
+      window = 1;
+    }
+
+    return static_cast<float>(static_cast<double>(traffic) / (1024.0 /*KB*/ * static_cast<double>(window)));
+  }
+
+
+  unsigned int QueriesStatistics::GetLatencyPercentile(unsigned int percentile)
+  {
+    if (percentile > 100)
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
+    }
+
+    std::vector<unsigned int> sorted;
+
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+      sorted = latencies_;
+    }
+
+    if (sorted.empty())
+    {
+      return 0;
+    }
+
+    // Nearest-rank method
+    size_t rank = (percentile * sorted.size() + 99) / 100;
+    if (rank == 0)
+    {
+      rank = 1;
+    }
+
+    std::nth_element(sorted.begin(), sorted.begin() + (rank - 1), sorted.end());
+    return sorted[rank - 1];
+  }
+}
@@ -0,0 +1,77 @@
+/**
+ * Transfers accelerator plugin for Orthanc
+ * Copyright (C) 2018-2021 Osimis S.A., Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Affero General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+
+#pragma once
+
+#include <boost/date_time/posix_time/posix_time.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/thread/mutex.hpp>
+
+#include <deque>
+#include <stdint.h>
+#include <vector>
+
+
+namespace OrthancPlugins
+{
+  /**
+   * Statistics about the recent HTTP queries of a transfer: The
+   * throughput is computed over a sliding window (one counter per
+   * second, for the last minute), and the latencies of the last
+   * queries are kept to compute percentiles.
+   **/
+  class QueriesStatistics : public boost::noncopyable
+  {
+  private:
+    struct Second
+    {
+      int64_t   second_;
+      uint64_t  traffic_;
+    };
+
+    boost::mutex               mutex_;
+    int64_t                    start_;
+    std::deque<Second>         traffic_;
+    std::vector<unsigned int>  latencies_;   // Circular buffer
+    size_t                     latenciesPosition_;
+
+    static int64_t GetSecond(const boost::posix_time::ptime& time);
+
+  public:
+    static const unsigned int MAX_WINDOW = 60;      // In seconds
+    static const size_t MAX_LATENCIES = 1000;
+
+    explicit QueriesStatistics(const boost::posix_time::ptime& now);
+
+    // Forgets the previous queries, as if the transfer was starting now
+    void Reset(const boost::posix_time::ptime& now);
+
+    void AddQuery(size_t traffic,
+                  unsigned int latencyMS,
+                  const boost::posix_time::ptime& now);
+
+    // Average speed in KB/s over the last "seconds" (at most 60)
+    float GetSpeed(unsigned int seconds,
+                   const boost::posix_time::ptime& now);
+
+    // Returns 0 if no query has been completed yet
+    unsigned int GetLatencyPercentile(unsigned int percentile);
+  };
+}
@@ -0,0 +1,205 @@
+/**
+ * Transfers accelerator plugin for Orthanc
+ * Copyright (C) 2018-2021 Osimis S.A., Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Affero General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+#include "IncrementalMD5.h"
+
+#include <cassert>
+#include <string.h>
+
+
+namespace OrthancPlugins
+{
+  static const uint32_t MD5_SINES[64] = {
+    0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee,
+    0xf57c0faf, 0x4787c62a, 0xa8304613, 0xfd469501,
+    0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be,
+    0x6b901122, 0xfd987193, 0xa679438e, 0x49b40821,
+    0xf61e2562, 0xc040b340, 0x265e5a51, 0xe9b6c7aa,
+    0xd62f105d, 0x02441453, 0xd8a1e681, 0xe7d3fbc8,
+    0x21e1cde6, 0xc33707d6, 0xf4d50d87, 0x455a14ed,
+    0xa9e3e905, 0xfcefa3f8, 0x676f02d9, 0x8d2a4c8a,
+    0xfffa3942, 0x8771f681, 0x6d9d6122, 0xfde5380c,
+    0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70,
+    0x289b7ec6, 0xeaa127fa, 0xd4ef3085, 0x04881d05,
+    0xd9d4d039, 0xe6db99e5, 0x1fa27cf8, 0xc4ac5665,
+    0xf4292244, 0x432aff97, 0xab9423a7, 0xfc93a039,
+    0x655b59c3, 0x8f0ccc92, 0xffeff47d, 0x85845dd1,
+    0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1,
+    0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391
+  };
+
+  static const unsigned int MD5_SHIFTS[64] = {
+    7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22,
+    5,  9, 14, 20, 5,  9, 14, 20, 5,  9, 14, 20, 5,  9, 14, 20,
+    4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23,
+    6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21
+  };
+
+
+  void IncrementalMD5::Transform(const uint8_t* block)
+  {
+    uint32_t words[16];
+    for (unsigned int i = 0; i < 16; i++)
+    {
+      words[i] = (static_cast<uint32_t>(block[4 * i]) |
+                  (static_cast<uint32_t>(block[4 * i + 1]) << 8) |
+                  (static_cast<uint32_t>(block[4 * i + 2]) << 16) |
+                  (static_cast<uint32_t>(block[4 * i + 3]) << 24));
+    }
+
+    uint32_t a = state_[0];
+    uint32_t b = state_[1];
+    uint32_t c = state_[2];
+    uint32_t d = state_[3];
+
+    for (unsigned int i = 0; i < 64; i++)
+    {
+      uint32_t f;
+      unsigned int g;
+
+      if (i < 16)
+      {
+        f = (b & c) | (~b & d);
+        g = i;
+      }
+      else if (i < 32)
+      {
+        f = (d & b) | (~d & c);
+        g = (5 * i + 1) % 16;
+      }
+      else if (i < 48)
+      {
+        f = b ^ c ^ d;
+        g = (3 * i + 5) % 16;
+      }
+      else
+      {
+        f = c ^ (b | ~d);
+        g = (7 * i) % 16;
+      }
+
+      const uint32_t x = a + f + MD5_SINES[i] + words[g];
+      a = d;
+      d = c;
+      c = b;
+      b = b + ((x << MD5_SHIFTS[i]) | (x >> (32 - MD5_SHIFTS[i])));
+    }
+
+    state_[0] += a;
+    state_[1] += b;
+    state_[2] += c;
+    state_[3] += d;
+  }
+
+
+  IncrementalMD5::IncrementalMD5()
+  {
+    Reset();
+  }
+
+
+  void IncrementalMD5::Reset()
+  {
+    state_[0] = 0x67452301;
+    state_[1] = 0xefcdab89;
+    state_[2] = 0x98badcfe;
+    state_[3] = 0x10325476;
+    size_ = 0;
+  }
+
+
+  void IncrementalMD5::Append(const void* data,
+                              size_t size)
+  {
+    const uint8_t* p = reinterpret_cast<const uint8_t*>(data);
+    size_t buffered = static_cast<size_t>(size_ % 64);
+
+    size_ += size;
+
+    if (buffered != 0)
+    {
+      // Complete the pending partial block
+      size_t toCopy = 64 - buffered;
+      if (toCopy > size)
+      {
+        toCopy = size;
+      }
+
+      memcpy(buffer_ + buffered, p, toCopy);
+      p += toCopy;
+      size -= toCopy;
+
+      if (buffered + toCopy < 64)
+      {
+        return;
+      }
+
+      Transform(buffer_);
+    }
+
+    while (size >= 64)
+    {
+      Transform(p);
+      p += 64;
+      size -= 64;
+    }
+
+    if (size > 0)
+    {
+      memcpy(buffer_, p, size);
+    }
+  }
+
+
+  void IncrementalMD5::GetDigest(std::string& md5) const
+  {
+    // Work on a copy of the state, so that "Append()" can still be called
+    IncrementalMD5 tmp;
+    memcpy(tmp.state_, state_, sizeof(state_));
+    memcpy(tmp.buffer_, buffer_, sizeof(buffer_));
+    tmp.size_ = size_;
+
+    const uint64_t bits = size_ * 8;
+
+    uint8_t padding[72];
+    memset(padding, 0, sizeof(padding));
+    padding[0] = 0x80;
+
+    size_t buffered = static_cast<size_t>(size_ % 64);
+    size_t paddingSize = (buffered < 56 ? 56 - buffered : 120 - buffered);
+
+    for (unsigned int i = 0; i < 8; i++)
+    {
+      padding[paddingSize + i] = static_cast<uint8_t>(bits >> (8 * i));
+    }
+
+    tmp.Append(padding, paddingSize + 8);
+    assert(tmp.size_ % 64 == 0);
+
+    static const char HEX[] = "0123456789abcdef";
+    
+    md5.resize(32);
+    for (unsigned int i = 0; i < 16; i++)
+    {
+      uint8_t byte = static_cast<uint8_t>(tmp.state_[i / 4] >> (8 * (i % 4)));
+      md5[2 * i] = HEX[byte >> 4];
+      md5[2 * i + 1] = HEX[byte & 0x0f];
+    }
+  }
+}
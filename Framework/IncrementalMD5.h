@@ -0,0 +1,64 @@
+/**
+ * Transfers accelerator plugin for Orthanc
+ * Copyright (C) 2018-2021 Osimis S.A., Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Affero General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+#pragma once
+
+#include <boost/noncopyable.hpp>
+#include <stdint.h>
+#include <string>
+
+namespace OrthancPlugins
+{
+  /**
+   * MD5 sum that is computed as the data arrives (RFC 1321). The
+   * result is formatted the same way as by
+   * "Orthanc::Toolbox::ComputeMD5()", i.e. as lowercase hexadecimal.
+   **/
+  class IncrementalMD5 : public boost::noncopyable
+  {
+  private:
+    uint32_t  state_[4];
+    uint64_t  size_;
+    uint8_t   buffer_[64];
+
+    void Transform(const uint8_t* block);
+
+  public:
+    IncrementalMD5();
+
+    void Reset();
+
+    void Append(const void* data,
+                size_t size);
+
+    void Append(const std::string& data)
+    {
+      Append(data.empty() ? NULL : data.c_str(), data.size());
+    }
+
+    // Number of bytes that have been appended so far
+    uint64_t GetSize() const
+    {
+      return size_;
+    }
+
+    // Does not modify the state, so that more data can be appended
+    void GetDigest(std::string& md5) const;
+  };
+}
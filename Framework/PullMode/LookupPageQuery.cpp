@@ -0,0 +1,119 @@
+/**
+ * Transfers accelerator plugin for Orthanc
+ * Copyright (C) 2018-2021 Osimis S.A., Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Affero General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+
+#include "LookupPageQuery.h"
+
+#include "../TransferToolbox.h"
+
+#include <Logging.h>
+#include <OrthancException.h>
+#include <Toolbox.h>
+
+#include <boost/lexical_cast.hpp>
+
+
+namespace OrthancPlugins
+{
+  LookupPageQuery::LookupPageQuery(std::vector<DicomInstanceInfo>& instances,
+                                   const std::string& peer,
+                                   const std::string& resources,
+                                   size_t since,
+                                   size_t limit,
+                                   size_t totalInstances,
+                                   const std::string& originator,
+                                   const std::string& token) :
+    instances_(instances),
+    peer_(peer),
+    uri_(std::string(URI_LOOKUP) + "?since=" + boost::lexical_cast<std::string>(since) +
+         "&limit=" + boost::lexical_cast<std::string>(limit) + "&token=" + token),
+    body_(resources),
+    totalInstances_(totalInstances),
+    originator_(originator),
+    reportedTotal_(NULL)
+  {
+  }
+
+
+  bool LookupPageQuery::ParsePage(std::vector<DicomInstanceInfo>& instances,
+                                  size_t& totalInstances,
+                                  std::string& originator,
+                                  const Json::Value& page)
+  {
+    if (page.type() != Json::objectValue ||
+        !page.isMember(KEY_INSTANCES) ||
+        !page.isMember(KEY_ORIGINATOR_UUID) ||
+        page[KEY_INSTANCES].type() != Json::arrayValue ||
+        page[KEY_ORIGINATOR_UUID].type() != Json::stringValue ||
+        (page.isMember(KEY_TOTAL_INSTANCES) &&
+         page[KEY_TOTAL_INSTANCES].type() != Json::intValue &&
+         page[KEY_TOTAL_INSTANCES].type() != Json::uintValue))
+    {
+      return false;
+    }
+
+    std::vector<DicomInstanceInfo> tmp;
+    tmp.reserve(page[KEY_INSTANCES].size());
+
+    for (Json::Value::ArrayIndex i = 0; i < page[KEY_INSTANCES].size(); i++)
+    {
+      tmp.push_back(DicomInstanceInfo(page[KEY_INSTANCES][i]));
+    }
+
+    instances.swap(tmp);
+    totalInstances = (page.isMember(KEY_TOTAL_INSTANCES) ?
+                      page[KEY_TOTAL_INSTANCES].asUInt() : 0);
+    originator = page[KEY_ORIGINATOR_UUID].asString();
+    return true;
+  }
+
+
+  void LookupPageQuery::HandleAnswer(const void* answer,
+                                     size_t size)
+  {
+    Json::Value page;
+    std::vector<DicomInstanceInfo> instances;
+    size_t totalInstances;
+    std::string originator;
+
+    if (!Orthanc::Toolbox::ReadJson(page, answer, size) ||
+        !ParsePage(instances, totalInstances, originator, page))
+    {
+      LOG(ERROR) << "Bad network protocol from peer: " << peer_;
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_NetworkProtocol);
+    }
+
+    if ((!originator_.empty() &&
+         originator != originator_) ||
+        (totalInstances_ != 0 &&
+         totalInstances != totalInstances_))
+    {
+      LOG(ERROR) << "The resources have changed on peer \"" << peer_
+                 << "\" during the lookup of the instances to pull";
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_NetworkProtocol);
+    }
+
+    instances_.swap(instances);
+
+    if (reportedTotal_ != NULL)
+    {
+      *reportedTotal_ = totalInstances;
+    }
+  }
+}
@@ -0,0 +1,99 @@
+/**
+ * Transfers accelerator plugin for Orthanc
+ * Copyright (C) 2018-2021 Osimis S.A., Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Affero General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+
+#pragma once
+
+#include "../DicomInstanceInfo.h"
+#include "../HttpQueries/IHttpQuery.h"
+
+#include <vector>
+
+
+namespace OrthancPlugins
+{
+  /**
+   * Reads one page of the lookup of the instances to be pulled
+   * ("/transfers/lookup" with the "since" and "limit" GET arguments).
+   * If "totalInstances" is zero and "originator" is empty, the answer
+   * is not checked against the first page (lookup on a mirror). All
+   * the pages of one lookup share the same token, so that the peer
+   * only expands the resources once.
+   **/
+  class LookupPageQuery : public IHttpQuery
+  {
+  private:
+    std::vector<DicomInstanceInfo>&  instances_;
+    std::string                      peer_;
+    std::string                      uri_;
+    std::string                      body_;
+    size_t                           totalInstances_;
+    std::string                      originator_;
+    size_t*                          reportedTotal_;
+
+  public:
+    LookupPageQuery(std::vector<DicomInstanceInfo>& instances /* out */,
+                    const std::string& peer,
+                    const std::string& resources,
+                    size_t since,
+                    size_t limit,
+                    size_t totalInstances,
+                    const std::string& originator,
+                    const std::string& token);
+
+    // Stores the total number of instances that is reported by the
+    // peer, if the answer is not checked against the first page
+    void SetReportedTotal(size_t& target /* out */)
+    {
+      reportedTotal_ = &target;
+    }
+
+    virtual Orthanc::HttpMethod GetMethod() const
+    {
+      return Orthanc::HttpMethod_Post;
+    }
+
+    virtual const std::string& GetPeer() const
+    {
+      return peer_;
+    }
+
+    virtual const std::string& GetUri() const
+    {
+      return uri_;
+    }
+
+    virtual void ReadBody(std::string& body) const
+    {
+      body = body_;
+    }
+
+    virtual void HandleAnswer(const void* answer,
+                              size_t size);
+
+    // Returns "false" if the answer does not follow the protocol. If
+    // the peer runs an older version of the plugin, that ignores the
+    // GET arguments and answers with all the instances at once,
+    // "totalInstances" is set to zero.
+    static bool ParsePage(std::vector<DicomInstanceInfo>& instances,
+                          size_t& totalInstances,
+                          std::string& originator,
+                          const Json::Value& page);
+  };
+}
@@ -0,0 +1,51 @@
+/**
+ * Transfers accelerator plugin for Orthanc
+ * Copyright (C) 2018-2021 Osimis S.A., Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Affero General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+
+#include "PlainLookupQuery.h"
+
+#include <OrthancException.h>
+#include <Toolbox.h>
+
+
+namespace OrthancPlugins
+{
+  PlainLookupQuery::PlainLookupQuery(std::string& md5,
+                                     const std::string& peer,
+                                     const std::string& instanceId) :
+    md5_(md5),
+    peer_(peer),
+    uri_("/instances/" + instanceId + "/attachments/dicom/uncompressed-md5")
+  {
+  }
+
+
+  void PlainLookupQuery::ReadBody(std::string& body) const
+  {
+    throw Orthanc::OrthancException(Orthanc::ErrorCode_InternalError);
+  }
+
+  
+  void PlainLookupQuery::HandleAnswer(const void* answer,
+                                      size_t size)
+  {
+    // An empty MD5 is reported as an error by the pull job
+    md5_ = Orthanc::Toolbox::StripSpaces(std::string(reinterpret_cast<const char*>(answer), size));
+  }
+}
@@ -0,0 +1,71 @@
+/**
+ * Transfers accelerator plugin for Orthanc
+ * Copyright (C) 2018-2021 Osimis S.A., Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Affero General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+
+#include "PlainPullQuery.h"
+
+#include <boost/lexical_cast.hpp>
+
+
+namespace OrthancPlugins
+{
+  PlainPullQuery::PlainPullQuery(DownloadArea& area,
+                                 const TransferBucket& bucket,
+                                 const std::string& peer) :
+    area_(area),
+    bucket_(bucket),
+    peer_(peer)
+  {
+    if (bucket_.GetChunksCount() != 1)
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
+    }
+
+    uri_ = "/instances/" + bucket_.GetChunkInstanceId(0) + "/file";
+  }
+
+
+  void PlainPullQuery::ReadBody(std::string& body) const
+  {
+    throw Orthanc::OrthancException(Orthanc::ErrorCode_InternalError);
+  }
+
+
+  void PlainPullQuery::GetHeaders(std::map<std::string, std::string>& headers) const
+  {
+    headers.clear();
+
+    // If the peer ignores the "Range" header, it sends the whole
+    // instance, which only happens if the instance was not split
+    const size_t size = bucket_.GetChunkSize(0);
+    if (size != 0)
+    {
+      const size_t offset = bucket_.GetChunkOffset(0);
+      headers["Range"] = ("bytes=" + boost::lexical_cast<std::string>(offset) + "-" +
+                          boost::lexical_cast<std::string>(offset + size - 1));
+    }
+  }
+
+  
+  void PlainPullQuery::HandleAnswer(const void* answer,
+                                    size_t size)
+  {
+    area_.WriteBucket(bucket_, answer, size, BucketCompression_None);
+  }
+}
@@ -20,37 +20,108 @@
 #include "PullJob.h"
 
 #include "BucketPullQuery.h"
+#include "LookupPageQuery.h"
+#include "PlainLookupQuery.h"
+#include "PlainPullQuery.h"
 #include "../HttpQueries/HttpQueriesRunner.h"
+#include "../HttpQueries/PeerAnswer.h"
 #include "../TransferScheduler.h"
 
 #include <Compatibility.h>  // For std::unique_ptr
 #include <Logging.h>
 
+#include <boost/filesystem.hpp>
+#include <boost/lexical_cast.hpp>
+#include <boost/thread.hpp>
+#include <limits>
+#include <map>
+#include <set>
+
 
 namespace OrthancPlugins
 {
+  // Number of instances in each page of the lookup, which bounds the
+  // time that is needed by the peer to answer one page
+  static const size_t LOOKUP_PAGE_SIZE = 1000;
+
+  // Period of the attempts of a job that waits for temporary storage,
+  // if no storage is released by the other transfers (in seconds)
+  static const unsigned int STORAGE_RETRY_PERIOD = 30;
+
+
+  void PullJob::UpdateCommitInfo(JobInfo& info,
+                                 DownloadArea& area)
+  {
+    size_t committedInstancesCount;
+    uint64_t committedSize;
+    float instancesPerSecond;
+    area.GetCommitStatistics(committedInstancesCount, committedSize, instancesPerSecond);
+
+    info.SetContent("CommittedInstances", static_cast<unsigned int>(committedInstancesCount));
+    info.SetContent("CommittedSizeMB", ConvertToMegabytes(committedSize));
+    info.SetContent("CommitInstancesPerSecond", instancesPerSecond);
+  }
+
+  
   class PullJob::CommitState : public IState
   {
   private:
-    const PullJob&               job_;
+    const PullJob&                 job_;
+    JobInfo&                       info_;
     std::unique_ptr<DownloadArea>  area_;
+    bool                           isRunning_;
 
   public:
     CommitState(const PullJob& job,
+                JobInfo& info,
                 DownloadArea* area /* takes ownership */) :
       job_(job),
-      area_(area)
+      info_(info),
+      area_(area),
+      isRunning_(false)
     {
     }
 
     virtual StateUpdate* Step()
     {
-      area_->Commit();
-      return StateUpdate::Success();
+      if (!isRunning_)
+      {
+        // If the instances were committed in streaming mode while
+        // downloading, this only enqueues the remaining instances
+        area_->StartCommit();
+        isRunning_ = true;
+      }
+
+      DownloadArea::CommitStatus status = area_->WaitCommit(200);
+
+      UpdateCommitInfo(info_, *area_);
+      area_->SaveState(false);
+
+      switch (status)
+      {
+        case DownloadArea::CommitStatus_Running:
+          return StateUpdate::Continue();
+
+        case DownloadArea::CommitStatus_Success:
+          area_.reset();
+          job_.RemoveWorkDirectory();
+          return StateUpdate::Success();
+
+        case DownloadArea::CommitStatus_Failure:
+          return StateUpdate::Failure();
+
+        default:
+          throw Orthanc::OrthancException(Orthanc::ErrorCode_InternalError);
+      }
     }
 
     virtual void Stop(OrthancPluginJobStopReason reason)
     {
+      // Wait for the batches that are being imported, the remaining
+      // instances are committed if the job is resumed
+      area_->StopCommit();
+      area_->SaveState(true);
+      isRunning_ = false;
     }
   };
 
@@ -61,23 +132,79 @@ namespace OrthancPlugins
     const PullJob&                    job_;
     JobInfo&                          info_;
     HttpQueriesQueue                  queue_;
-    std::unique_ptr<DownloadArea>       area_;
-    std::unique_ptr<HttpQueriesRunner>  runner_;
+    std::unique_ptr<DownloadArea>     area_;
+    std::vector<std::string>          sources_;
+    std::vector<HttpQueriesRunner*>   runners_;   // One per source, sharing the same queue
+
+    void ClearRunners()
+    {
+      for (size_t i = 0; i < runners_.size(); i++)
+      {
+        assert(runners_[i] != NULL);
+        delete runners_[i];
+      }
+
+      runners_.clear();
+    }
 
     void UpdateInfo()
     {
-      size_t scheduledQueriesCount, completedQueriesCount;
+      size_t scheduledQueriesCount, completedQueriesCount, requeuedQueriesCount;
       uint64_t uploadedSize, downloadedSize;
-      queue_.GetStatistics(scheduledQueriesCount, completedQueriesCount, downloadedSize, uploadedSize);
+      queue_.GetStatistics(scheduledQueriesCount, completedQueriesCount, requeuedQueriesCount,
+                           downloadedSize, uploadedSize);
 
       info_.SetContent("DownloadedSizeMB", ConvertToMegabytes(downloadedSize));
       info_.SetContent("CompletedHttpQueries", static_cast<unsigned int>(completedQueriesCount));
+      info_.SetContent("RequeuedHttpQueries", static_cast<unsigned int>(requeuedQueriesCount));
+
+      if (!runners_.empty())
+      {
+        // The buckets are spread over the sources by the threads that
+        // become available, which gives more buckets to the fastest sources
+        Json::Value sources = Json::objectValue;
+        float total = 0;
+
+        for (size_t i = 0; i < runners_.size(); i++)
+        {
+          float speed;
+          runners_[i]->GetSpeed(speed);
+          sources[sources_[i]] = static_cast<unsigned int>(speed);
+          total += speed;
+        }
+
+        info_.SetContent("NetworkSpeedKBs", static_cast<unsigned int>(total));
+
+        if (runners_.size() > 1)
+        {
+          info_.SetContent("SourcesSpeedKBs", sources);
+
+          std::set<std::string> disabled;
+          queue_.GetDisabledSources(disabled);
+
+          if (!disabled.empty())
+          {
+            Json::Value items = Json::arrayValue;
+            for (std::set<std::string>::const_iterator it = disabled.begin(); it != disabled.end(); ++it)
+            {
+              items.append(*it);
+            }
+
+            info_.SetContent("DisabledSources", items);
+          }
+        }
+      }
 
-      if (runner_.get() != NULL)
       {
-        float speed;
-        runner_->GetSpeed(speed);
-        info_.SetContent("NetworkSpeedKBs", static_cast<unsigned int>(speed));
+        std::vector<HttpQueriesQueue*> queues(1, &queue_);
+        Json::Value activity;
+        HttpQueriesQueue::FormatActivity(activity, queues);
+        info_.MergeContent(activity);
+      }
+
+      if (job_.streamingCommit_)
+      {
+        UpdateCommitInfo(info_, *area_);
       }
             
       // The "2" below corresponds to the "LookupInstancesState"
@@ -89,41 +216,121 @@ namespace OrthancPlugins
   public:
     PullBucketsState(const PullJob&  job,
                      JobInfo& info,
-                     const TransferScheduler& scheduler) :
+                     const TransferScheduler& scheduler,
+                     Mode mode,
+                     const std::vector<std::string>& sources) :
       job_(job),
       info_(info),
-      area_(new DownloadArea(scheduler))
+      sources_(sources)
     {
-      const std::string baseUrl = job.peers_.GetPeerUrl(job.query_.GetPeer());
+      if (sources.empty())
+      {
+        throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
+      }
+
+      // The length of the URIs is limited by the longest URL of the sources
+      std::string baseUrl;
+      for (size_t i = 0; i < sources.size(); i++)
+      {
+        std::string url = job.peers_.GetPeerUrl(sources[i]);
+        if (url.size() > baseUrl.size())
+        {
+          baseUrl.swap(url);
+        }
+      }
 
       std::vector<TransferBucket> buckets;
-      scheduler.ComputePullBuckets(buckets, job.targetBucketSize_, 2 * job.targetBucketSize_,
-                                   baseUrl, job.query_.GetCompression());
-      area_.reset(new DownloadArea(scheduler));
+
+      switch (mode)
+      {
+        case Mode_Accelerated:
+          scheduler.ComputePullBuckets(buckets, job.targetBucketSize_, 2 * job.targetBucketSize_,
+                                       baseUrl, job.query_.GetCompression());
+          break;
+
+        case Mode_Plain:
+          // A stock Orthanc can only send whole instances: No grouping, no splitting
+          scheduler.ComputePullBuckets(buckets, 0, std::numeric_limits<size_t>::max(),
+                                       baseUrl, BucketCompression_None);
+          break;
+
+        case Mode_PlainWithRanges:
+          scheduler.ComputePullBuckets(buckets, 0, 2 * job.targetBucketSize_,
+                                       baseUrl, BucketCompression_None);
+          break;
+
+        default:
+          throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
+      }
+
+      area_.reset(new DownloadArea(scheduler, job.storage_, job.workDirectory_));
+      area_->SetCommitThreadsCount(job.commitThreadsCount_);
+      area_->SetCommitBatchSize(job.commitBatchSize_);
 
       queue_.SetMaxRetries(job.maxHttpRetries_);
+      queue_.SetMaxRequeues(job.pool_.GetMaxRequeues());
+      queue_.SetCircuitBreaker(job.pool_.GetCircuitBreaker());
+      queue_.SetPeerLimits(job.pool_.GetPeerLimits());
+      queue_.SetSources(sources);
       queue_.Reserve(buckets.size());
         
       for (size_t i = 0; i < buckets.size(); i++)
       {
-        queue_.Enqueue(new BucketPullQuery(*area_, buckets[i], job.query_.GetPeer(), job.query_.GetCompression()));
+        // Skip the buckets that were received before the job was
+        // interrupted
+        if (area_->IsBucketReceived(buckets[i]))
+        {
+          continue;
+        }
+        else if (mode == Mode_Accelerated)
+        {
+          queue_.Enqueue(new BucketPullQuery(*area_, buckets[i], job.query_.GetPeer(), job.query_.GetCompression()));
+        }
+        else
+        {
+          queue_.Enqueue(new PlainPullQuery(*area_, buckets[i], job.query_.GetPeer()));
+        }
       }
 
       info_.SetContent("TotalInstances", static_cast<unsigned int>(scheduler.GetInstancesCount()));
       info_.SetContent("TotalSizeMB", ConvertToMegabytes(scheduler.GetTotalSize()));
+      info_.SetContent("InMemorySizeMB", ConvertToMegabytes(area_->GetMemorySize()));
+      info_.SetContent("ResumedSizeMB", ConvertToMegabytes(area_->GetResumedSize()));
       UpdateInfo();
     }
+
+    virtual ~PullBucketsState()
+    {
+      ClearRunners();
+    }
       
     virtual StateUpdate* Step()
     {
-      if (runner_.get() == NULL)
+      if (runners_.empty())
       {
-        runner_.reset(new HttpQueriesRunner(queue_, job_.threadsCount_));
+        if (job_.streamingCommit_)
+        {
+          // Import each instance as soon as it is fully received
+          area_->StartStreamingCommit();
+        }
+
+        for (size_t i = 0; i < sources_.size(); i++)
+        {
+          runners_.push_back(new HttpQueriesRunner(queue_, job_.pool_, sources_[i],
+                                                   HttpQueriesPool::GetWeight(job_.query_.GetPriority())));
+        }
       }
 
       HttpQueriesQueue::Status status = queue_.WaitComplete(200);
 
       UpdateInfo();
+      area_->SaveState(false);
+
+      if (job_.streamingCommit_ &&
+          area_->WaitCommit(0) == DownloadArea::CommitStatus_Failure)
+      {
+        return StateUpdate::Failure();
+      }
 
       switch (status)
       {
@@ -131,7 +338,7 @@ namespace OrthancPlugins
           return StateUpdate::Continue();
 
         case HttpQueriesQueue::Status_Success:
-          return StateUpdate::Next(new CommitState(job_, area_.release()));
+          return StateUpdate::Next(new CommitState(job_, info_, area_.release()));
 
         case HttpQueriesQueue::Status_Failure:
           return StateUpdate::Failure();
@@ -144,113 +351,912 @@ namespace OrthancPlugins
     virtual void Stop(OrthancPluginJobStopReason reason)
     {
       // Cancel the running download threads
-      runner_.reset();
+      ClearRunners();
+
+      if (job_.streamingCommit_)
+      {
+        area_->StopCommit();
+      }
+
+      area_->SaveState(true);
     }
   };
     
 
-  class PullJob::LookupInstancesState : public IState
+  class PullJob::WaitStorageState : public IState
   {
   private:
-    const PullJob&  job_;
-    JobInfo&        info_;
+    const PullJob&            job_;
+    JobInfo&                  info_;
+    TransferScheduler         scheduler_;
+    Mode                      mode_;
+    std::vector<std::string>  sources_;
+    size_t                    minimalDiskSize_;
+    uint64_t                  releasesCount_;
+    boost::posix_time::ptime  lastAttempt_;
+
+    bool IsRetryNeeded()
+    {
+      // Creating the download area reads the state of the work
+      // directory and reserves the storage: Only try again once
+      // enough quota is available, and if some storage has been
+      // released since the last attempt. The free space of the
+      // filesystem can also change outside of the plugin, hence the
+      // periodic attempts.
+      if (!job_.storage_.IsDiskAvailable(minimalDiskSize_, 0))
+      {
+        return false;
+      }
+
+      const uint64_t releasesCount = job_.storage_.GetReleasesCount();
+      const boost::posix_time::ptime now = boost::posix_time::microsec_clock::universal_time();
+
+      if (releasesCount != releasesCount_ ||
+          now - lastAttempt_ >= boost::posix_time::seconds(STORAGE_RETRY_PERIOD))
+      {
+        releasesCount_ = releasesCount;
+        lastAttempt_ = now;
+        return true;
+      }
+      else
+      {
+        return false;
+      }
+    }
 
   public:
-    LookupInstancesState(const PullJob& job,
-                         JobInfo& info) :
+    WaitStorageState(const PullJob& job,
+                     JobInfo& info,
+                     const TransferScheduler& scheduler,
+                     Mode mode,
+                     const std::vector<std::string>& sources,
+                     uint64_t releasesCount) :
       job_(job),
-      info_(info)
+      info_(info),
+      mode_(mode),
+      sources_(sources),
+      releasesCount_(releasesCount),
+      lastAttempt_(boost::posix_time::microsec_clock::universal_time())
     {
-      if (job_.query_.HasOriginator())
+      std::vector<DicomInstanceInfo> instances;
+      scheduler.ListInstances(instances);
+
+      for (size_t i = 0; i < instances.size(); i++)
       {
-        info_.SetContent("Originator", job_.query_.GetOriginator());  
+        scheduler_.AddInstance(instances[i]);
+      }
+
+      // If the transfer cannot be assembled in RAM, all of its
+      // instances are stored on the disk
+      minimalDiskSize_ = (job.storage_.IsMemoryAllowed(scheduler.GetTotalSize()) ?
+                          0 : scheduler.GetTotalSize());
+    }
+
+    static StateUpdate* CreatePullBucketsState(const PullJob& job,
+                                               JobInfo& info,
+                                               const TransferScheduler& scheduler,
+                                               Mode mode,
+                                               const std::vector<std::string>& sources)
+    {
+      // Read before the attempt, so that no release is missed
+      const uint64_t releasesCount = job.storage_.GetReleasesCount();
+
+      try
+      {
+        return StateUpdate::Next(new PullBucketsState(job, info, scheduler, mode, sources));
+      }
+      catch (Orthanc::OrthancException& e)
+      {
+        if (e.GetErrorCode() != Orthanc::ErrorCode_FullStorage)
+        {
+          throw;
+        }
+      }
+
+      // Not enough temporary storage for the moment
+      if (job.storage_.IsDiskAllowed(scheduler.GetTotalSize()))
+      {
+        LOG(WARNING) << "Pull job is waiting for other transfers to release some temporary storage";
+        info.SetContent("WaitingForStorage", true);
+        return StateUpdate::Next(new WaitStorageState(job, info, scheduler, mode, sources, releasesCount));
+      }
+      else
+      {
+        LOG(ERROR) << "The transfer is larger than the disk quota of the transfers accelerator ("
+                   << ConvertToMegabytes(scheduler.GetTotalSize()) << "MB)";
+        return StateUpdate::Failure();
+      }
+    }
+
+    virtual StateUpdate* Step()
+    {
+      boost::this_thread::sleep(boost::posix_time::seconds(1));
+
+      if (!IsRetryNeeded())
+      {
+        return StateUpdate::Continue();
+      }
+
+      try
+      {
+        std::unique_ptr<IState> next(new PullBucketsState(job_, info_, scheduler_, mode_, sources_));
+        info_.SetContent("WaitingForStorage", false);
+        return StateUpdate::Next(next.release());
+      }
+      catch (Orthanc::OrthancException& e)
+      {
+        if (e.GetErrorCode() == Orthanc::ErrorCode_FullStorage)
+        {
+          return StateUpdate::Continue();
+        }
+        else
+        {
+          throw;
+        }
+      }
+    }
+
+    virtual void Stop(OrthancPluginJobStopReason reason)
+    {
+    }
+  };
+
+
+  StatefulOrthancJob::StateUpdate* PullJob::SchedulePullBuckets(const PullJob& job,
+                                                                 JobInfo& info,
+                                                                 TransferScheduler& scheduler,
+                                                                 Mode mode,
+                                                                 const std::vector<std::string>& sources)
+  {
+    size_t skippedSize;
+    size_t skipped = scheduler.RemoveStoredInstances(skippedSize, job.pool_.GetThreadsCount());
+    info.SetContent("SkippedInstances", static_cast<unsigned int>(skipped));
+    info.SetContent("SkippedSizeMB", ConvertToMegabytes(skippedSize));
+
+    if (skipped != 0)
+    {
+      LOG(INFO) << "Skipping " << skipped << " instance(s) already stored by Orthanc ("
+                << ConvertToMegabytes(skippedSize) << "MB)";
+    }
+
+    if (scheduler.GetInstancesCount() == 0)
+    {
+      // We're already done: No instance to be retrieved
+      job.RemoveWorkDirectory();
+      return StateUpdate::Success();
+    }
+    else
+    {
+      return WaitStorageState::CreatePullBucketsState(job, info, scheduler, mode, sources);
+    }
+  }
+
+
+  class PullJob::LookupPlainInstancesState : public IState
+  {
+  private:
+    const PullJob&                      job_;
+    JobInfo&                            info_;
+    std::vector<std::string>            instances_;
+    std::vector<size_t>                 sizes_;
+    std::vector<std::string>            md5_;
+    HttpQueriesQueue                    queue_;
+    std::unique_ptr<HttpQueriesRunner>  runner_;   // Reset if the job is paused
+    bool                                isListed_;
+
+    bool AddInstance(std::set<std::string>& done,
+                     const Json::Value& instance)
+    {
+      if (instance.type() != Json::objectValue ||
+          !instance.isMember("ID") ||
+          !instance.isMember("FileSize") ||
+          instance["ID"].type() != Json::stringValue ||
+          (instance["FileSize"].type() != Json::uintValue &&
+           instance["FileSize"].type() != Json::intValue))
+      {
+        LOG(ERROR) << "Bad network protocol from peer: " << job_.query_.GetPeer();
+        return false;
+      }
+
+      const std::string id = instance["ID"].asString();
+
+      if (done.find(id) == done.end())
+      {
+        done.insert(id);
+        instances_.push_back(id);
+        sizes_.push_back(static_cast<size_t>(instance["FileSize"].asUInt64()));
+      }
+
+      return true;
+    }
+
+    bool ListInstances()
+    {
+      const Json::Value& resources = job_.query_.GetResources();
+      std::set<std::string> done;
+
+      for (Json::Value::ArrayIndex i = 0; i < resources.size(); i++)
+      {
+        const std::string id = resources[i][KEY_ID].asString();
+
+        std::string uri;
+        switch (Orthanc::StringToResourceType(resources[i][KEY_LEVEL].asCString()))
+        {
+          case Orthanc::ResourceType_Patient:
+            uri = "/patients/" + id + "/instances";
+            break;
+
+          case Orthanc::ResourceType_Study:
+            uri = "/studies/" + id + "/instances";
+            break;
+
+          case Orthanc::ResourceType_Series:
+            uri = "/series/" + id + "/instances";
+            break;
+
+          case Orthanc::ResourceType_Instance:
+            uri = "/instances/" + id;
+            break;
+
+          default:
+            throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
+        }
+
+        Json::Value answer;
+        if (!DoGetPeer(answer, job_.peers_, job_.peerIndex_, uri, job_.maxHttpRetries_))
+        {
+          LOG(ERROR) << "Cannot list the instances of resource " << id
+                     << " on peer \"" << job_.query_.GetPeer() << "\"";
+          return false;
+        }
+
+        if (answer.type() == Json::arrayValue)
+        {
+          for (Json::Value::ArrayIndex j = 0; j < answer.size(); j++)
+          {
+            if (!AddInstance(done, answer[j]))
+            {
+              return false;
+            }
+          }
+        }
+        else if (!AddInstance(done, answer))
+        {
+          return false;
+        }
+      }
+
+      return true;
+    }
+
+    bool HasRangeRequests(const TransferScheduler& scheduler) const
+    {
+      std::vector<DicomInstanceInfo> instances;
+      scheduler.ListInstances(instances);
+
+      // Look for the smallest instance, as it is entirely downloaded
+      // if the peer does not support the "Range" header
+      const DicomInstanceInfo* smallest = NULL;
+      bool hasLarge = false;
+
+      for (size_t i = 0; i < instances.size(); i++)
+      {
+        if (instances[i].GetSize() >= 2 * job_.targetBucketSize_)
+        {
+          hasLarge = true;
+        }
+
+        if (instances[i].GetSize() > 0 &&
+            (smallest == NULL ||
+             instances[i].GetSize() < smallest->GetSize()))
+        {
+          smallest = &instances[i];
+        }
+      }
+
+      if (!hasLarge ||
+          smallest == NULL)
+      {
+        return false;  // No need to split the instances
+      }
+
+      HttpHeaders headers;
+      headers["Range"] = "bytes=0-0";
+
+      try
+      {
+        PeerAnswer answer;
+        uint16_t status;
+        return (CallPeer(answer, status, job_.peers_, job_.query_.GetPeer(), Orthanc::HttpMethod_Get,
+                         "/instances/" + smallest->GetId() + "/file", headers, "") &&
+                status == 206 &&
+                answer.GetSize() == 1);
+      }
+      catch (Orthanc::OrthancException&)
+      {
+        return false;
+      }
+    }
+
+  public:
+    LookupPlainInstancesState(const PullJob& job,
+                              JobInfo& info) :
+      job_(job),
+      info_(info),
+      isListed_(false)
+    {
+      info_.SetContent("PlainMode", true);
+    }
+
+    virtual StateUpdate* Step()
+    {
+      if (!isListed_)
+      {
+        if (!ListInstances())
+        {
+          return StateUpdate::Failure();
+        }
+
+        // The MD5 of the instances are read in parallel
+        md5_.resize(instances_.size());
+
+        queue_.SetMaxRetries(job_.maxHttpRetries_);
+        queue_.SetMaxRequeues(job_.pool_.GetMaxRequeues());
+        queue_.SetCircuitBreaker(job_.pool_.GetCircuitBreaker());
+        queue_.SetPeerLimits(job_.pool_.GetPeerLimits());
+        queue_.Reserve(instances_.size());
+
+        for (size_t i = 0; i < instances_.size(); i++)
+        {
+          queue_.Enqueue(new PlainLookupQuery(md5_[i], job_.query_.GetPeer(), instances_[i]));
+        }
+
+        isListed_ = true;
+      }
+
+      if (runner_.get() == NULL)
+      {
+        runner_.reset(new HttpQueriesRunner(queue_, job_.pool_, job_.query_.GetPeer(),
+                                            HttpQueriesPool::GetWeight(job_.query_.GetPriority())));
+      }
+
+      switch (queue_.WaitComplete(200))
+      {
+        case HttpQueriesQueue::Status_Running:
+          return StateUpdate::Continue();
+
+        case HttpQueriesQueue::Status_Success:
+          break;
+
+        case HttpQueriesQueue::Status_Failure:
+          LOG(ERROR) << "Cannot read the MD5 of the instances on peer \"" << job_.query_.GetPeer()
+                     << "\" (check that its \"StoreMD5ForAttachments\" option is enabled)";
+          return StateUpdate::Failure();
+
+        default:
+          throw Orthanc::OrthancException(Orthanc::ErrorCode_InternalError);
+      }
+
+      runner_.reset();
+
+      TransferScheduler scheduler;
+
+      for (size_t i = 0; i < instances_.size(); i++)
+      {
+        if (md5_[i].empty())
+        {
+          LOG(ERROR) << "No MD5 for instance " << instances_[i] << " on peer \"" << job_.query_.GetPeer() << "\"";
+          return StateUpdate::Failure();
+        }
+
+        scheduler.AddInstance(DicomInstanceInfo(instances_[i], sizes_[i], md5_[i]));
+      }
+
+      const bool ranges = HasRangeRequests(scheduler);
+      info_.SetContent("RangeRequests", ranges);
+
+      // The mirrors are only used by the accelerated mode
+      return SchedulePullBuckets(job_, info_, scheduler, ranges ? Mode_PlainWithRanges : Mode_Plain,
+                                 std::vector<std::string>(1, job_.query_.GetPeer()));
+    }
+
+    virtual void Stop(OrthancPluginJobStopReason reason)
+    {
+      runner_.reset();
+    }
+  };
+
+
+  class PullJob::LookupMirrorsState : public IState
+  {
+  private:
+    typedef std::vector<DicomInstanceInfo>  Page;
+
+    struct Mirror : public boost::noncopyable
+    {
+      std::string                         peer_;
+      std::vector<Page>                   pages_;
+      std::vector<size_t>                 totals_;   // Number of instances reported by each page
+      HttpQueriesQueue                    queue_;
+      std::unique_ptr<HttpQueriesRunner>  runner_;   // Reset if the job is paused
+      bool                                isDone_;
+    };
+
+    const PullJob&            job_;
+    JobInfo&                  info_;
+    TransferScheduler         scheduler_;
+    std::vector<Mirror*>      mirrors_;
+    std::vector<std::string>  sources_;
+
+    // A mirror is only used if it stores exactly the same instances
+    // as the main peer, with the same content
+    bool IsValidMirror(const Mirror& mirror) const
+    {
+      std::vector<DicomInstanceInfo> instances;
+      scheduler_.ListInstances(instances);
+
+      // The pages were computed from the number of instances of the
+      // main peer, they cannot be compared if the mirror has more
+      // (the older mirrors report no total, but answer with all their
+      // instances in each page)
+      for (size_t i = 0; i < mirror.totals_.size(); i++)
+      {
+        if (mirror.totals_[i] != 0 &&
+            mirror.totals_[i] != instances.size())
+        {
+          LOG(WARNING) << "Mirror \"" << mirror.peer_ << "\" stores " << mirror.totals_[i]
+                       << " instances instead of " << instances.size() << ", it will not be used";
+          return false;
+        }
+      }
+
+      std::map<std::string, const DicomInstanceInfo*> index;
+
+      for (size_t i = 0; i < mirror.pages_.size(); i++)
+      {
+        for (size_t j = 0; j < mirror.pages_[i].size(); j++)
+        {
+          index[mirror.pages_[i][j].GetId()] = &mirror.pages_[i][j];
+        }
+      }
+
+      if (index.size() != instances.size())
+      {
+        LOG(WARNING) << "Mirror \"" << mirror.peer_ << "\" does not store the same instances, it will not be used";
+        return false;
+      }
+
+      for (size_t i = 0; i < instances.size(); i++)
+      {
+        std::map<std::string, const DicomInstanceInfo*>::const_iterator found = index.find(instances[i].GetId());
+
+        if (found == index.end() ||
+            found->second->GetSize() != instances[i].GetSize() ||
+            found->second->GetMD5() != instances[i].GetMD5())
+        {
+          LOG(WARNING) << "Mirror \"" << mirror.peer_ << "\" does not store the same version of instance "
+                       << instances[i].GetId() << ", it will not be used";
+          return false;
+        }
+      }
+
+      return true;
+    }
+
+  public:
+    LookupMirrorsState(const PullJob& job,
+                       JobInfo& info,
+                       const TransferScheduler& scheduler) :
+      job_(job),
+      info_(info),
+      sources_(1, job.query_.GetPeer())
+    {
+      std::vector<DicomInstanceInfo> instances;
+      scheduler.ListInstances(instances);
+
+      for (size_t i = 0; i < instances.size(); i++)
+      {
+        scheduler_.AddInstance(instances[i]);
+      }
+
+      std::string lookup;
+      Orthanc::Toolbox::WriteFastJson(lookup, job_.query_.GetResources());
+
+      const size_t countPages = (instances.size() + LOOKUP_PAGE_SIZE - 1) / LOOKUP_PAGE_SIZE;
+      const std::string token = Orthanc::Toolbox::GenerateUuid();
+
+      for (size_t i = 0; i < job_.query_.GetMirrors().size(); i++)
+      {
+        std::unique_ptr<Mirror> mirror(new Mirror);
+        mirror->peer_ = job_.query_.GetMirrors()[i];
+        mirror->isDone_ = false;
+        mirror->pages_.resize(countPages);
+        mirror->totals_.resize(countPages);
+
+        mirror->queue_.SetMaxRetries(job_.maxHttpRetries_);
+        mirror->queue_.SetMaxRequeues(job_.pool_.GetMaxRequeues());
+        mirror->queue_.SetCircuitBreaker(job_.pool_.GetCircuitBreaker());
+        mirror->queue_.SetPeerLimits(job_.pool_.GetPeerLimits());
+        mirror->queue_.Reserve(countPages);
+
+        for (size_t j = 0; j < countPages; j++)
+        {
+          std::unique_ptr<LookupPageQuery> query(
+            new LookupPageQuery(mirror->pages_[j], mirror->peer_, lookup,
+                                j * LOOKUP_PAGE_SIZE, LOOKUP_PAGE_SIZE, 0, "", token));
+          query->SetReportedTotal(mirror->totals_[j]);
+          mirror->queue_.Enqueue(query.release());
+        }
+
+        mirrors_.push_back(mirror.release());
+      }
+    }
+
+    virtual ~LookupMirrorsState()
+    {
+      for (size_t i = 0; i < mirrors_.size(); i++)
+      {
+        assert(mirrors_[i] != NULL);
+        delete mirrors_[i];
       }
-      info_.SetContent("Resources", job_.query_.GetResources());
-      info_.SetContent("Peer", job_.query_.GetPeer());
-      info_.SetContent("Compression", EnumerationToString(job_.query_.GetCompression()));
     }
 
     virtual StateUpdate* Step()
+    {
+      // The mirrors are looked up in parallel. The runners are
+      // created again if the job is resumed after a pause.
+      for (size_t i = 0; i < mirrors_.size(); i++)
+      {
+        if (!mirrors_[i]->isDone_ &&
+            mirrors_[i]->runner_.get() == NULL)
+        {
+          mirrors_[i]->runner_.reset(new HttpQueriesRunner(mirrors_[i]->queue_, job_.pool_, mirrors_[i]->peer_,
+                                                           HttpQueriesPool::GetWeight(job_.query_.GetPriority())));
+        }
+      }
+
+      bool isRunning = false;
+
+      for (size_t i = 0; i < mirrors_.size(); i++)
+      {
+        Mirror& mirror = *mirrors_[i];
+
+        if (mirror.isDone_)
+        {
+          continue;  // Already handled
+        }
+
+        switch (mirror.queue_.WaitComplete(isRunning ? 0 : 200))
+        {
+          case HttpQueriesQueue::Status_Running:
+            isRunning = true;
+            break;
+
+          case HttpQueriesQueue::Status_Success:
+            mirror.runner_.reset();
+            mirror.isDone_ = true;
+
+            if (IsValidMirror(mirror))
+            {
+              sources_.push_back(mirror.peer_);
+            }
+            break;
+
+          case HttpQueriesQueue::Status_Failure:
+            // A mirror that is unavailable does not prevent the transfer
+            LOG(WARNING) << "Cannot lookup the instances on mirror \"" << mirror.peer_
+                         << "\", it will not be used";
+            mirror.runner_.reset();
+            mirror.isDone_ = true;
+            break;
+
+          default:
+            throw Orthanc::OrthancException(Orthanc::ErrorCode_InternalError);
+        }
+      }
+
+      if (isRunning)
+      {
+        return StateUpdate::Continue();
+      }
+
+      Json::Value sources = Json::arrayValue;
+      for (size_t i = 0; i < sources_.size(); i++)
+      {
+        sources.append(sources_[i]);
+      }
+
+      info_.SetContent("Sources", sources);
+
+      return SchedulePullBuckets(job_, info_, scheduler_, Mode_Accelerated, sources_);
+    }
+
+    virtual void Stop(OrthancPluginJobStopReason reason)
+    {
+      for (size_t i = 0; i < mirrors_.size(); i++)
+      {
+        mirrors_[i]->runner_.reset();
+      }
+    }
+  };
+
+
+  class PullJob::LookupInstancesState : public IState
+  {
+  private:
+    typedef std::vector<DicomInstanceInfo>  Page;
+
+    const PullJob&                      job_;
+    JobInfo&                            info_;
+    TransferScheduler                   scheduler_;
+    std::vector<Page>                   pages_;
+    HttpQueriesQueue                    queue_;
+    std::unique_ptr<HttpQueriesRunner>  runner_;   // Reset if the job is paused
+    std::string                         token_;    // Shared by the pages of this lookup
+    bool                                hasFirstPage_;
+
+    void AddPage(const Page& page)
+    {
+      for (size_t i = 0; i < page.size(); i++)
+      {
+        scheduler_.AddInstance(page[i]);
+      }
+    }
+
+    StateUpdate* ScheduleAccelerated()
+    {
+      if (job_.query_.GetMirrors().empty())
+      {
+        return SchedulePullBuckets(job_, info_, scheduler_, Mode_Accelerated,
+                                   std::vector<std::string>(1, job_.query_.GetPeer()));
+      }
+      else
+      {
+        return StateUpdate::Next(new LookupMirrorsState(job_, info_, scheduler_));
+      }
+    }
+
+    StateUpdate* LookupFirstPage()
     {
       std::string lookup;
       Orthanc::Toolbox::WriteFastJson(lookup, job_.query_.GetResources());
 
+      // The peers running an older version of the plugin ignore the
+      // GET arguments, and answer with all the instances at once
+      const std::string uri = (std::string(URI_LOOKUP) + "?since=0&limit=" +
+                               boost::lexical_cast<std::string>(LOOKUP_PAGE_SIZE) + "&token=" + token_);
+
       Json::Value answer;
-      if (!DoPostPeer(answer, job_.peers_, job_.peerIndex_, URI_LOOKUP, lookup, job_.maxHttpRetries_))
+      if (!DoPostPeer(answer, job_.peers_, job_.peerIndex_, uri, lookup, job_.maxHttpRetries_))
       {
+        // This pull was not requested by the peer, which might be a
+        // stock Orthanc: Download the DICOM files one by one, but
+        // only if the peer states that the plugin is not installed
+        // (a network error must not silently disable the accelerator)
+        if (!job_.query_.HasOriginator() &&
+            GetPeerStatus(job_.peers_, job_.peerIndex_, std::string(URI_PLUGINS) + "/" + PLUGIN_NAME,
+                          job_.maxHttpRetries_) == 404)
+        {
+          LOG(WARNING) << "Peer \"" << job_.query_.GetPeer() << "\" does not run the transfers "
+                       << "accelerator, falling back to the REST API of Orthanc";
+          return StateUpdate::Next(new LookupPlainInstancesState(job_, info_));
+        }
+
         LOG(ERROR) << "Cannot retrieve the list of instances to pull from peer \"" 
                    << job_.query_.GetPeer()
                    << "\" (check that it has the transfers accelerator plugin installed)";
         return StateUpdate::Failure();
       } 
 
-      if (answer.type() != Json::objectValue ||
-          !answer.isMember(KEY_INSTANCES) ||
-          !answer.isMember(KEY_ORIGINATOR_UUID) ||
-          answer[KEY_INSTANCES].type() != Json::arrayValue ||
-          answer[KEY_ORIGINATOR_UUID].type() != Json::stringValue)
+      Page firstPage;
+      size_t total;
+      std::string originator;
+
+      if (!LookupPageQuery::ParsePage(firstPage, total, originator, answer))
       {
         LOG(ERROR) << "Bad network protocol from peer: " << job_.query_.GetPeer();
         return StateUpdate::Failure();
       }
 
       if (job_.query_.HasOriginator() &&
-          job_.query_.GetOriginator() != answer[KEY_ORIGINATOR_UUID].asString())
+          job_.query_.GetOriginator() != originator)
       {
         LOG(ERROR) << "Invalid originator, check out the \"" << KEY_REMOTE_SELF
                    << "\" configuration option of peer: " << job_.query_.GetPeer();
         return StateUpdate::Failure();
       }
 
-      TransferScheduler  scheduler;
+      AddPage(firstPage);
 
-      for (Json::Value::ArrayIndex i = 0; i < answer[KEY_INSTANCES].size(); i++)
+      if (total <= LOOKUP_PAGE_SIZE)
       {
-        DicomInstanceInfo instance(answer[KEY_INSTANCES][i]);
-        scheduler.AddInstance(instance);
+        // Everything was received in one single page
+        return ScheduleAccelerated();
       }
 
-      if (scheduler.GetInstancesCount() == 0)
+      // The other pages are read in parallel, which distributes the
+      // computation of the MD5 over the threads of the peer
+      pages_.resize((total - 1) / LOOKUP_PAGE_SIZE);  // Minus the first page
+
+      queue_.SetMaxRetries(job_.maxHttpRetries_);
+      queue_.SetMaxRequeues(job_.pool_.GetMaxRequeues());
+      queue_.SetCircuitBreaker(job_.pool_.GetCircuitBreaker());
+      queue_.SetPeerLimits(job_.pool_.GetPeerLimits());
+      queue_.Reserve(pages_.size());
+
+      for (size_t i = 0; i < pages_.size(); i++)
       {
-        // We're already done: No instance to be retrieved
-        return StateUpdate::Success();
+        queue_.Enqueue(new LookupPageQuery(pages_[i], job_.query_.GetPeer(), lookup,
+                                           (i + 1) * LOOKUP_PAGE_SIZE, LOOKUP_PAGE_SIZE, total, originator, token_));
       }
-      else
+
+      LOG(INFO) << "Looking up " << total << " instances on peer \"" << job_.query_.GetPeer()
+                << "\" using " << (pages_.size() + 1) << " pages";
+      info_.SetContent("LookupPages", static_cast<unsigned int>(pages_.size() + 1));
+
+      hasFirstPage_ = true;
+      return StateUpdate::Continue();
+    }
+
+  public:
+    LookupInstancesState(const PullJob& job,
+                         JobInfo& info) :
+      job_(job),
+      info_(info),
+      token_(Orthanc::Toolbox::GenerateUuid()),
+      hasFirstPage_(false)
+    {
+      if (job_.query_.HasOriginator())
       {
-        return StateUpdate::Next(new PullBucketsState(job_, info_, scheduler));
+        info_.SetContent("Originator", job_.query_.GetOriginator());  
       }
+      info_.SetContent("Resources", job_.query_.GetResources());
+      info_.SetContent("Peer", job_.query_.GetPeer());
+      info_.SetContent("Compression", EnumerationToString(job_.query_.GetCompression()));
+    }
+
+    virtual StateUpdate* Step()
+    {
+      if (!hasFirstPage_)
+      {
+        return LookupFirstPage();
+      }
+
+      if (runner_.get() == NULL)
+      {
+        runner_.reset(new HttpQueriesRunner(queue_, job_.pool_, job_.query_.GetPeer(),
+                                            HttpQueriesPool::GetWeight(job_.query_.GetPriority())));
+      }
+
+      switch (queue_.WaitComplete(200))
+      {
+        case HttpQueriesQueue::Status_Running:
+          return StateUpdate::Continue();
+
+        case HttpQueriesQueue::Status_Success:
+          break;
+
+        case HttpQueriesQueue::Status_Failure:
+          LOG(ERROR) << "Cannot retrieve the list of instances to pull from peer \"" 
+                     << job_.query_.GetPeer() << "\"";
+          return StateUpdate::Failure();
+
+        default:
+          throw Orthanc::OrthancException(Orthanc::ErrorCode_InternalError);
+      }
+
+      runner_.reset();
+
+      for (size_t i = 0; i < pages_.size(); i++)
+      {
+        AddPage(pages_[i]);
+      }
+
+      return ScheduleAccelerated();
     }
 
     virtual void Stop(OrthancPluginJobStopReason reason)
     {
+      runner_.reset();
     }
   };
 
 
+  void PullJob::RemoveWorkDirectory() const
+  {
+    boost::system::error_code error;
+    boost::filesystem::remove_all(workDirectory_, error);
+
+    if (error)
+    {
+      LOG(WARNING) << "Cannot remove the work directory of a pull job: " << workDirectory_;
+    }
+  }
+
+
+  void PullJob::UpdateSerializedInternal()
+  {
+    Json::Value serialized;
+    query_.Serialize(serialized);
+    serialized[KEY_WORK_DIRECTORY] = workDirectory_;
+    UpdateSerialized(serialized);
+  }
+
+
   StatefulOrthancJob::StateUpdate* PullJob::CreateInitialState(JobInfo& info)
   {
+    // The limits of the mirrors are also needed, so all the peers are loaded
+    pool_.GetPeerLimits().LoadConfiguration();
     return StateUpdate::Next(new LookupInstancesState(*this, info));
   }
     
     
   PullJob::PullJob(const TransferQuery& query,
-                   size_t threadsCount,
+                   TemporaryStorage& storage,
+                   HttpQueriesPool& pool,
                    size_t targetBucketSize,
-                   unsigned int maxHttpRetries) :
+                   unsigned int maxHttpRetries,
+                   size_t commitThreadsCount,
+                   size_t commitBatchSize,
+                   bool streamingCommit) :
     StatefulOrthancJob(JOB_TYPE_PULL),
     query_(query),
-    threadsCount_(threadsCount),
+    storage_(storage),
+    pool_(pool),
     targetBucketSize_(targetBucketSize),
-    maxHttpRetries_(maxHttpRetries)
+    maxHttpRetries_(maxHttpRetries),
+    commitThreadsCount_(commitThreadsCount),
+    commitBatchSize_(commitBatchSize),
+    streamingCommit_(streamingCommit),
+    workDirectory_(storage.CreateWorkDirectoryPath())
   {
+    if (query_.GetPeers().size() != 1)
+    {
+      LOG(ERROR) << "Pull jobs have one single peer, use the \"" << KEY_MIRRORS
+                 << "\" field to pull from several peers";
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
+    }
+
     if (!peers_.LookupName(peerIndex_, query_.GetPeer()))
     {
       LOG(ERROR) << "Unknown Orthanc peer: " << query_.GetPeer();
       throw Orthanc::OrthancException(Orthanc::ErrorCode_UnknownResource);
     }
 
-    Json::Value serialized;
-    query.Serialize(serialized);
-    UpdateSerialized(serialized);
+    for (size_t i = 0; i < query_.GetMirrors().size(); i++)
+    {
+      size_t index;
+      if (!peers_.LookupName(index, query_.GetMirrors()[i]))
+      {
+        LOG(ERROR) << "Unknown Orthanc peer: " << query_.GetMirrors()[i];
+        throw Orthanc::OrthancException(Orthanc::ErrorCode_UnknownResource);
+      }
+    }
+
+    UpdateSerializedInternal();
+  }
+
+
+  void PullJob::SetWorkDirectory(const std::string& path)
+  {
+    if (!storage_.IsWorkDirectoryPath(path))
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange,
+                                      "Not a work directory of the transfers accelerator: " + path);
+    }
+
+    workDirectory_ = path;
+    UpdateSerializedInternal();
+  }
+
+
+  void PullJob::Stop(OrthancPluginJobStopReason reason)
+  {
+    StatefulOrthancJob::Stop(reason);
+
+    if (reason == OrthancPluginJobStopReason_Canceled)
+    {
+      RemoveWorkDirectory();
+    }
   }
 }
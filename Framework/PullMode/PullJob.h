@@ -19,32 +19,75 @@
 
 #pragma once
 
+#include "../HttpQueries/HttpQueriesPool.h"
 #include "../StatefulOrthancJob.h"
+#include "../TemporaryStorage.h"
 #include "../TransferQuery.h"
 
 
 namespace OrthancPlugins
 {
+  class DownloadArea;
+  class TransferScheduler;
+  
   class PullJob : public StatefulOrthancJob
   {
   private:
+    enum Mode
+    {
+      Mode_Accelerated,      // The peer runs the transfers accelerator
+      Mode_Plain,            // Stock Orthanc peer, one query per instance
+      Mode_PlainWithRanges   // Stock Orthanc peer, large instances are split
+    };
+
     class LookupInstancesState;
+    class LookupMirrorsState;
+    class LookupPlainInstancesState;
     class PullBucketsState;
+    class WaitStorageState;
     class CommitState;
 
-    TransferQuery  query_;
-    size_t         threadsCount_;
-    size_t         targetBucketSize_;
-    OrthancPeers   peers_;
-    size_t         peerIndex_;
-    unsigned int   maxHttpRetries_;
+    TransferQuery      query_;
+    TemporaryStorage&  storage_;
+    HttpQueriesPool&   pool_;
+    size_t             targetBucketSize_;
+    OrthancPeers       peers_;
+    size_t             peerIndex_;
+    unsigned int       maxHttpRetries_;
+    size_t             commitThreadsCount_;
+    size_t             commitBatchSize_;
+    bool               streamingCommit_;
+    std::string        workDirectory_;
+
+    static void UpdateCommitInfo(JobInfo& info,
+                                 DownloadArea& area);
+
+    static StateUpdate* SchedulePullBuckets(const PullJob& job,
+                                            JobInfo& info,
+                                            TransferScheduler& scheduler,
+                                            Mode mode,
+                                            const std::vector<std::string>& sources);
+
+    void RemoveWorkDirectory() const;
+
+    void UpdateSerializedInternal();
 
     virtual StateUpdate* CreateInitialState(JobInfo& info);    
     
   public:
     PullJob(const TransferQuery& query,
-            size_t threadsCount,
+            TemporaryStorage& storage,
+            HttpQueriesPool& pool,
             size_t targetBucketSize,
-            unsigned int maxHttpRetries);
+            unsigned int maxHttpRetries,
+            size_t commitThreadsCount,
+            size_t commitBatchSize,
+            bool streamingCommit);
+
+    // Used when unserializing the job, in order to resume the
+    // transfer from the files that were already received
+    void SetWorkDirectory(const std::string& path);
+
+    virtual void Stop(OrthancPluginJobStopReason reason);
   };
 }
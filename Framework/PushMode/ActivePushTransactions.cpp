@@ -21,7 +21,6 @@
 
 #include "../DownloadArea.h"
 
-#include <Compatibility.h>  // For std::unique_ptr
 #include <Logging.h>
 
 
@@ -33,14 +32,32 @@ namespace OrthancPlugins
     DownloadArea                 area_;
     std::vector<TransferBucket>  buckets_;
     BucketCompression            compression_;
+    boost::mutex                 mutex_;   // Protects "stored_" and the flags below
+    std::vector<bool>            stored_;
+    bool                         isCommitting_;
+    bool                         isCommitted_;
+
+    void CheckNotCommitted()
+    {
+      // The mutex must be locked
+      if (isCommitting_ ||
+          isCommitted_)
+      {
+        throw Orthanc::OrthancException(Orthanc::ErrorCode_BadSequenceOfCalls);
+      }
+    }
 
   public:
     Transaction(const std::vector<DicomInstanceInfo>& instances,
                 const std::vector<TransferBucket>& buckets,
-                BucketCompression compression) :
-      area_(instances),
+                BucketCompression compression,
+                TemporaryStorage& storage) :
+      area_(instances, storage),
       buckets_(buckets),
-      compression_(compression)
+      compression_(compression),
+      stored_(buckets.size(), false),
+      isCommitting_(false),
+      isCommitted_(false)
     {
     }
 
@@ -70,31 +87,142 @@ namespace OrthancPlugins
                const void* data,
                size_t size)
     {
-      area_.WriteBucket(GetBucket(bucketIndex), data, size, compression_);
+      const TransferBucket& bucket = GetBucket(bucketIndex);
+
+      {
+        boost::mutex::scoped_lock lock(mutex_);
+        CheckNotCommitted();
+      }
+
+      // The download area can be written by several threads at once,
+      // and it ignores the chunks of the instances already committed
+      area_.WriteBucket(bucket, data, size, compression_);
+
+      boost::mutex::scoped_lock lock(mutex_);
+      stored_[bucketIndex] = true;
+    }
+
+    void Commit()
+    {
+      {
+        // Rejects the concurrent commits of the same transaction
+        boost::mutex::scoped_lock lock(mutex_);
+        CheckNotCommitted();
+        isCommitting_ = true;
+      }
+
+      // The import into Orthanc is not done while holding the mutex,
+      // so that it doesn't block the queries on the stored buckets
+      try
+      {
+        area_.Commit();
+      }
+      catch (...)
+      {
+        boost::mutex::scoped_lock lock(mutex_);
+        isCommitting_ = false;
+        throw;
+      }
+
+      boost::mutex::scoped_lock lock(mutex_);
+      isCommitting_ = false;
+      isCommitted_ = true;
+    }
+
+    void GetStoredBuckets(std::vector<size_t>& target)
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+
+      target.clear();
+
+      for (size_t i = 0; i < stored_.size(); i++)
+      {
+        if (stored_[i])
+        {
+          target.push_back(i);
+        }
+      }
+    }
+
+    size_t GetBucketsCount() const
+    {
+      return buckets_.size();
     }
   };
     
 
-  void ActivePushTransactions::FinalizeTransaction(const std::string& transactionUuid,
-                                                   bool commit)
+  void ActivePushTransactions::RemoveExpiredTransactionsInternal(const boost::posix_time::ptime& now)
+  {
+    if (timeout_ == 0)
+    {
+      return;
+    }
+
+    // The index is sorted by time of the last query
+    while (!index_.IsEmpty() &&
+           index_.GetOldestPayload() + boost::posix_time::seconds(timeout_) <= now)
+    {
+      std::string oldest = index_.RemoveOldest();
+
+      // The queries that are still writing to this transaction keep
+      // it alive until they are done
+      content_.erase(oldest);
+
+      LOG(WARNING) << "A push transaction has been discarded after " << timeout_
+                   << " seconds of inactivity: " << oldest;
+    }
+  }
+
+
+  ActivePushTransactions::TransactionHandle ActivePushTransactions::Lookup(const std::string& transactionUuid)
   {
+    const boost::posix_time::ptime now = boost::posix_time::microsec_clock::universal_time();
+
     boost::mutex::scoped_lock  lock(mutex_);
 
+    RemoveExpiredTransactionsInternal(now);
+
     Content::iterator found = content_.find(transactionUuid);
     if (found == content_.end())
     {
       throw Orthanc::OrthancException(Orthanc::ErrorCode_UnknownResource);
     }
+      
+    assert(found->second.get() != NULL);
+
+    index_.MakeMostRecent(transactionUuid, now);
+
+    return found->second;
+  }
+
+
+  void ActivePushTransactions::FinalizeTransaction(const std::string& transactionUuid,
+                                                   bool commit)
+  {
+    TransactionHandle transaction = Lookup(transactionUuid);
 
-    assert(found->second != NULL);
     if (commit)
     {
-      found->second->GetDownloadArea().Commit();
+      // The import into Orthanc doesn't block the other transactions.
+      // If it fails, the transaction is kept, so that it can be
+      // committed again or discarded.
+      transaction->Commit();
     }
 
-    delete found->second;
-    content_.erase(found);
-    index_.Invalidate(transactionUuid);
+    {
+      boost::mutex::scoped_lock  lock(mutex_);
+
+      Content::iterator found = content_.find(transactionUuid);
+      if (found != content_.end() &&
+          found->second == transaction)
+      {
+        content_.erase(found);
+        index_.Invalidate(transactionUuid);
+      }
+    }
+
+    // The transaction is deleted once the last pending query on it
+    // has released its handle
   }
 
 
@@ -104,17 +232,32 @@ namespace OrthancPlugins
     {
       LOG(WARNING) << "Discarding an uncommitted push transaction "
                    << "in the transfers accelerator: " << it->first;
-        
-      assert(it->second != NULL);
-      delete it->second;
     }
   }
     
 
+  void ActivePushTransactions::SetTimeout(unsigned int seconds)
+  {
+    boost::mutex::scoped_lock  lock(mutex_);
+    timeout_ = seconds;
+  }
+
+
+  void ActivePushTransactions::RemoveExpiredTransactions(const boost::posix_time::ptime& now)
+  {
+    boost::mutex::scoped_lock  lock(mutex_);
+    RemoveExpiredTransactionsInternal(now);
+  }
+
+
   void ActivePushTransactions::ListTransactions(std::vector<std::string>& target)
   {
+    const boost::posix_time::ptime now = boost::posix_time::microsec_clock::universal_time();
+
     boost::mutex::scoped_lock  lock(mutex_);
 
+    RemoveExpiredTransactionsInternal(now);
+
     target.clear();
     target.reserve(content_.size());
 
@@ -128,10 +271,24 @@ namespace OrthancPlugins
   
   std::string ActivePushTransactions::CreateTransaction(const std::vector<DicomInstanceInfo>& instances,
                                                         const std::vector<TransferBucket>& buckets,
-                                                        BucketCompression compression)
+                                                        BucketCompression compression,
+                                                        bool streamingCommit)
   {
+    const boost::posix_time::ptime now = boost::posix_time::microsec_clock::universal_time();
+
+    // Release the storage of the expired transactions before
+    // reserving the one of the new transaction
+    RemoveExpiredTransactions(now);
+
     std::string uuid = Orthanc::Toolbox::GenerateUuid();
-    std::unique_ptr<Transaction> tmp(new Transaction(instances, buckets, compression));
+    TransactionHandle tmp(new Transaction(instances, buckets, compression, storage_));
+    tmp->GetDownloadArea().SetCommitThreadsCount(commitThreadsCount_);
+    tmp->GetDownloadArea().SetCommitBatchSize(commitBatchSize_);
+
+    if (streamingCommit)
+    {
+      tmp->GetDownloadArea().StartStreamingCommit();
+    }
 
     LOG(INFO) << "Creating transaction to receive " << instances.size()
               << " instances (" << ConvertToMegabytes(tmp->GetDownloadArea().GetTotalSize())
@@ -147,16 +304,17 @@ namespace OrthancPlugins
 
         Content::iterator transaction = content_.find(oldest);
         assert(transaction != content_.end() &&
-               transaction->second != NULL);
+               transaction->second.get() != NULL);
 
-        delete transaction->second;
+        // The queries that are still writing to this transaction
+        // keep it alive until they are done
         content_.erase(transaction);
 
         LOG(WARNING) << "An inactive push transaction has been discarded: " << oldest;
       }
 
-      index_.Add(uuid);
-      content_[uuid] = tmp.release();
+      index_.Add(uuid, now);
+      content_[uuid] = tmp;
     }
 
     return uuid;
@@ -168,18 +326,20 @@ namespace OrthancPlugins
                                      const void* data,
                                      size_t size)
   {
-    boost::mutex::scoped_lock  lock(mutex_);
+    // Only the lookup is done while holding the registry lock
+    Lookup(transactionUuid)->Store(bucketIndex, data, size);
+  }
 
-    Content::iterator found = content_.find(transactionUuid);
-    if (found == content_.end())
-    {
-      throw Orthanc::OrthancException(Orthanc::ErrorCode_UnknownResource);
-    }
-      
-    assert(found->second != NULL);
 
-    index_.MakeMostRecent(transactionUuid);
-      
-    found->second->Store(bucketIndex, data, size);
+  void ActivePushTransactions::GetStoredBuckets(std::vector<size_t>& storedBuckets,
+                                                size_t& bucketsCount,
+                                                const std::string& transactionUuid)
+  {
+    // The lookup marks the transaction as recently used, as it is
+    // about to be resumed
+    TransactionHandle transaction = Lookup(transactionUuid);
+
+    transaction->GetStoredBuckets(storedBuckets);
+    bucketsCount = transaction->GetBucketsCount();
   }
 }
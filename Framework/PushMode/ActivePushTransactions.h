@@ -19,10 +19,13 @@
 
 #pragma once
 
+#include "../TemporaryStorage.h"
 #include "../TransferBucket.h"
 
 #include <Cache/LeastRecentlyUsedIndex.h>
 
+#include <boost/date_time/posix_time/posix_time.hpp>
+#include <boost/shared_ptr.hpp>
 #include <boost/thread/mutex.hpp>
 
 namespace OrthancPlugins
@@ -32,36 +35,76 @@ namespace OrthancPlugins
   private:
     class Transaction;
     
-    typedef Orthanc::LeastRecentlyUsedIndex<std::string>  Index;
-    typedef std::map<std::string, Transaction*>           Content;
+    // The transactions are reference-counted, so that the mutex of
+    // the registry is only held during the lookups: The buckets are
+    // decompressed and written without blocking the other queries
+    typedef boost::shared_ptr<Transaction>                TransactionHandle;
+    typedef std::map<std::string, TransactionHandle>      Content;
 
-    boost::mutex  mutex_;
-    Content       content_;
-    Index         index_;
-    size_t        maxSize_;
+    // The payload is the time of the last query on the transaction
+    typedef Orthanc::LeastRecentlyUsedIndex<std::string, boost::posix_time::ptime>  Index;
+
+    boost::mutex       mutex_;
+    Content            content_;
+    Index              index_;
+    size_t             maxSize_;
+    TemporaryStorage&  storage_;
+    size_t             commitThreadsCount_;
+    size_t             commitBatchSize_;
+    unsigned int       timeout_;   // In seconds, 0 means no expiration
+
+    // The mutex must be locked
+    void RemoveExpiredTransactionsInternal(const boost::posix_time::ptime& now);
+
+    TransactionHandle Lookup(const std::string& transactionUuid);
 
     void FinalizeTransaction(const std::string& transactionUuid,
                              bool commit);
 
   public:
-    explicit ActivePushTransactions(size_t maxSize) :
-      maxSize_(maxSize)
+    ActivePushTransactions(size_t maxSize,
+                           TemporaryStorage& storage,
+                           size_t commitThreadsCount,
+                           size_t commitBatchSize) :
+      maxSize_(maxSize),
+      storage_(storage),
+      commitThreadsCount_(commitThreadsCount),
+      commitBatchSize_(commitBatchSize),
+      timeout_(0)
     {
     }
 
     ~ActivePushTransactions();
+
+    // The transactions that receive no query for this number of
+    // seconds are discarded, which releases their storage if their
+    // sender never resumes them (0 means never)
+    void SetTimeout(unsigned int seconds);
+
+    void RemoveExpiredTransactions(const boost::posix_time::ptime& now);
     
     void ListTransactions(std::vector<std::string>& target);
 
+    // If "streamingCommit" is true, the instances are imported into
+    // Orthanc as soon as they are received: They are not rolled back
+    // if the transaction is discarded afterwards. This is only done
+    // if the sender asks for it.
     std::string CreateTransaction(const std::vector<DicomInstanceInfo>& instances,
                                   const std::vector<TransferBucket>& buckets,
-                                  BucketCompression compression);
+                                  BucketCompression compression,
+                                  bool streamingCommit);
 
     void Store(const std::string& transactionUuid,
                size_t bucketIndex,
                const void* data,
                size_t size);
 
+    // Lists the buckets that were already received, so that an
+    // interrupted push job can resume the transaction
+    void GetStoredBuckets(std::vector<size_t>& storedBuckets,
+                          size_t& bucketsCount,
+                          const std::string& transactionUuid);
+
     void Commit(const std::string& transactionUuid)
     {
       FinalizeTransaction(transactionUuid, true);
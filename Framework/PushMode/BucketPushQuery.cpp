@@ -19,6 +19,8 @@
 
 #include "BucketPushQuery.h"
 
+#include "PushBodiesCache.h"
+
 #include <ChunkedBuffer.h>
 #include <Compression/GzipCompressor.h>
 
@@ -37,12 +39,28 @@ namespace OrthancPlugins
     bucket_(bucket),
     peer_(peer),
     uri_(transactionUri + "/" + boost::lexical_cast<std::string>(bucketIndex)),
-    compression_(compression)
+    bucketIndex_(bucketIndex),
+    compression_(compression),
+    bodies_(NULL),
+    consumer_(0)
   {
   }
 
 
   void BucketPushQuery::ReadBody(std::string& body) const
+  {
+    if (bodies_ == NULL)
+    {
+      ReadBucket(body);
+    }
+    else
+    {
+      bodies_->GetBody(body, bucketIndex_, consumer_, *this);
+    }
+  }
+
+
+  void BucketPushQuery::ReadBucket(std::string& body) const
   {
     Orthanc::ChunkedBuffer buffer;
 
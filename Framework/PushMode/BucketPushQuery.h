@@ -21,17 +21,23 @@
 
 #include "../HttpQueries/IHttpQuery.h"
 #include "../OrthancInstancesCache.h"
+#include "PushBodiesCache.h"
 
 namespace OrthancPlugins
 {
-  class BucketPushQuery : public IHttpQuery
+  class BucketPushQuery :
+    public IHttpQuery,
+    public PushBodiesCache::IBucketReader
   {
   private:
     OrthancInstancesCache&  cache_;
     TransferBucket          bucket_;
     std::string             peer_;
     std::string             uri_;
+    size_t                  bucketIndex_;
     BucketCompression       compression_;
+    PushBodiesCache*        bodies_;
+    size_t                  consumer_;
 
   public:
     BucketPushQuery(OrthancInstancesCache& cache,
@@ -41,6 +47,17 @@ namespace OrthancPlugins
                     size_t bucketIndex,
                     BucketCompression compression);
 
+    // The bodies are not owned, and must outlive the query.
+    // "consumer" is the index of the destination of the query.
+    void SetBodiesCache(PushBodiesCache& bodies,
+                        size_t consumer)
+    {
+      bodies_ = &bodies;
+      consumer_ = consumer;
+    }
+
+    virtual void ReadBucket(std::string& body) const;
+
     virtual Orthanc::HttpMethod GetMethod() const
     {
       return Orthanc::HttpMethod_Put;
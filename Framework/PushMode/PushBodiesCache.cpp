@@ -0,0 +1,184 @@
+/**
+ * Transfers accelerator plugin for Orthanc
+ * Copyright (C) 2018-2021 Osimis S.A., Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Affero General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+
+#include "PushBodiesCache.h"
+
+#include <OrthancException.h>
+
+
+namespace OrthancPlugins
+{
+  void PushBodiesCache::ReleaseConsumer(Body& body,
+                                        size_t consumer)
+  {
+    // Retried queries may read the same body several times, which
+    // must not be counted twice
+    if (body.isPending_[consumer])
+    {
+      body.isPending_[consumer] = false;
+      body.pendingConsumers_ --;
+    }
+
+    if (body.pendingConsumers_ == 0 &&
+        body.content_ != NULL)
+    {
+      // All the destinations have got this body
+      memorySize_ -= body.content_->size();
+      delete body.content_;
+      body.content_ = NULL;
+    }
+  }
+
+
+  PushBodiesCache::PushBodiesCache(size_t bucketsCount,
+                                   size_t consumersCount,
+                                   size_t maxMemorySize) :
+    consumersCount_(consumersCount),
+    memorySize_(0),
+    maxMemorySize_(maxMemorySize)
+  {
+    bodies_.resize(bucketsCount);
+
+    for (size_t i = 0; i < bucketsCount; i++)
+    {
+      bodies_[i].content_ = NULL;
+      bodies_[i].isPending_.resize(consumersCount, true);
+      bodies_[i].pendingConsumers_ = consumersCount;
+      bodies_[i].isReading_ = false;
+    }
+  }
+
+
+  PushBodiesCache::~PushBodiesCache()
+  {
+    for (size_t i = 0; i < bodies_.size(); i++)
+    {
+      delete bodies_[i].content_;
+    }
+  }
+
+
+  void PushBodiesCache::Skip(size_t bucketIndex,
+                             size_t consumer)
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+
+    if (bucketIndex >= bodies_.size() ||
+        consumer >= consumersCount_)
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
+    }
+
+    ReleaseConsumer(bodies_[bucketIndex], consumer);
+  }
+
+
+  void PushBodiesCache::DropConsumer(size_t consumer)
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+
+    if (consumer >= consumersCount_)
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
+    }
+
+    for (size_t i = 0; i < bodies_.size(); i++)
+    {
+      ReleaseConsumer(bodies_[i], consumer);
+    }
+  }
+
+
+  void PushBodiesCache::GetBody(std::string& target,
+                                size_t bucketIndex,
+                                size_t consumer,
+                                const IBucketReader& reader)
+  {
+    bool isFirstReader;
+
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+
+      if (bucketIndex >= bodies_.size() ||
+          consumer >= consumersCount_)
+      {
+        throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
+      }
+
+      Body& body = bodies_[bucketIndex];
+
+      if (body.content_ != NULL)
+      {
+        target = *body.content_;
+        ReleaseConsumer(body, consumer);
+        return;
+      }
+
+      // If another destination is reading this body, don't wait for
+      // it: The callers belong to the shared pools of threads
+      isFirstReader = !body.isReading_;
+      body.isReading_ = true;
+    }
+
+    try
+    {
+      reader.ReadBucket(target);
+    }
+    catch (...)
+    {
+      if (isFirstReader)
+      {
+        boost::mutex::scoped_lock lock(mutex_);
+        bodies_[bucketIndex].isReading_ = false;
+      }
+
+      throw;
+    }
+
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+
+      Body& body = bodies_[bucketIndex];
+
+      if (isFirstReader)
+      {
+        body.isReading_ = false;
+
+        // Only keep the body if some other destination will need it
+        if (body.content_ == NULL &&
+            body.pendingConsumers_ > (body.isPending_[consumer] ? 1 : 0) &&
+            memorySize_ + target.size() <= maxMemorySize_)
+        {
+          body.content_ = new std::string(target);
+          memorySize_ += target.size();
+        }
+      }
+
+      ReleaseConsumer(body, consumer);
+    }
+  }
+
+
+  size_t PushBodiesCache::GetMemorySize()
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    return memorySize_;
+  }
+}
@@ -0,0 +1,98 @@
+/**
+ * Transfers accelerator plugin for Orthanc
+ * Copyright (C) 2018-2021 Osimis S.A., Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Affero General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+
+#pragma once
+
+#include <boost/noncopyable.hpp>
+#include <boost/thread/mutex.hpp>
+
+#include <string>
+#include <vector>
+
+
+namespace OrthancPlugins
+{
+  /**
+   * Shares the bodies of the buckets between the destinations of a
+   * fan-out push: Each bucket is read and compressed once, and kept
+   * in RAM until all the destinations have sent it. If the memory
+   * budget is exhausted (typically, because one destination is much
+   * slower than the others), the late destinations read the bucket
+   * once again. The callers never wait for each other: If a bucket
+   * is being read for another destination, it is read once more.
+   **/
+  class PushBodiesCache : public boost::noncopyable
+  {
+  public:
+    class IBucketReader
+    {
+    public:
+      virtual ~IBucketReader()
+      {
+      }
+
+      // Reads and compresses the bucket, without using the cache
+      virtual void ReadBucket(std::string& body) const = 0;
+    };
+
+  private:
+    struct Body
+    {
+      std::string*       content_;
+      std::vector<bool>  isPending_;         // For each consumer
+      size_t             pendingConsumers_;
+      bool               isReading_;
+    };
+
+    boost::mutex               mutex_;
+    std::vector<Body>          bodies_;
+    size_t                     consumersCount_;
+    size_t                     memorySize_;
+    size_t                     maxMemorySize_;
+
+    // The mutex must be locked!
+    void ReleaseConsumer(Body& body,
+                         size_t consumer);
+
+  public:
+    // Each of the "consumersCount" destinations will send all the
+    // buckets, except those that are skipped
+    PushBodiesCache(size_t bucketsCount,
+                    size_t consumersCount,
+                    size_t maxMemorySize);
+
+    ~PushBodiesCache();
+
+    // The bucket was already received by this destination
+    void Skip(size_t bucketIndex,
+              size_t consumer);
+
+    // The destination has failed, and will not read its remaining
+    // buckets, which must not be kept for it
+    void DropConsumer(size_t consumer);
+
+    void GetBody(std::string& target,
+                 size_t bucketIndex,
+                 size_t consumer,
+                 const IBucketReader& reader);
+
+    size_t GetMemorySize();
+  };
+}
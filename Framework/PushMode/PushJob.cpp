@@ -20,11 +20,14 @@
 #include "PushJob.h"
 
 #include "BucketPushQuery.h"
+#include "PushBodiesCache.h"
+#include "../HttpQueries/HttpBodiesPreparer.h"
 #include "../HttpQueries/HttpQueriesRunner.h"
 #include "../TransferScheduler.h"
 
 #include <Compatibility.h>  // For std::unique_ptr
 #include <Logging.h>
+#include <SystemToolbox.h>
 
 
 namespace OrthancPlugins
@@ -32,48 +35,67 @@ namespace OrthancPlugins
   class PushJob::FinalState : public IState
   {
   private:
-    const PushJob&  job_;
-    JobInfo&        info_;
-    std::string     transactionUri_;
-    bool            isCommit_;
+    PushJob&                  job_;
+    JobInfo&                  info_;
+    std::vector<Transaction>  transactions_;
+    bool                      hasFailure_;
       
   public:
-    FinalState(const PushJob& job,
+    FinalState(PushJob& job,
                JobInfo& info,
-               const std::string& transactionUri,
-               bool isCommit) :
+               const std::vector<Transaction>& transactions,
+               bool hasFailure) :
       job_(job),
       info_(info),
-      transactionUri_(transactionUri),
-      isCommit_(isCommit)
+      transactions_(transactions),
+      hasFailure_(hasFailure)
     {
     }
 
     virtual StateUpdate* Step()
     {
-      Json::Value answer;
-      bool success = false;
+      bool success = !hasFailure_;
 
-      if (isCommit_)
-      {
-        success = DoPostPeer(answer, job_.peers_, job_.peerIndex_, transactionUri_ + "/commit", "", job_.maxHttpRetries_);
-      }
-      else
+      for (size_t i = 0; i < transactions_.size(); i++)
       {
-        success = DoDeletePeer(job_.peers_, job_.peerIndex_, transactionUri_, job_.maxHttpRetries_);
-      }
-        
-      if (!success)
-      {
-        if (isCommit_)
+        const Transaction& transaction = transactions_[i];
+        const size_t peerIndex = job_.peerIndexes_[transaction.destination_];
+
+        if (transaction.isSuccess_)
         {
-          LOG(ERROR) << "Cannot commit push transaction on remote peer: "
-                     << job_.query_.GetPeer();
+          // Commit transaction on remote peer
+          Json::Value answer;
+          if (!DoPostPeer(answer, job_.peers_, peerIndex, transaction.uri_ + "/commit", "", job_.maxHttpRetries_))
+          {
+            LOG(ERROR) << "Cannot commit push transaction on remote peer: "
+                       << job_.query_.GetPeers() [transaction.destination_];
+            success = false;
+          }
+          else
+          {
+            job_.MarkCommitted(transaction.destination_);
+          }
         }
-          
-        return StateUpdate::Failure();
-      } 
-      else if (isCommit_)
+        else if (transaction.canResume_)
+        {
+          // The transaction is left open on the remote peer, so that
+          // the buckets it has received are not sent again if the job
+          // is resubmitted. The peer drops it after a period of
+          // inactivity, which releases its storage.
+          LOG(WARNING) << "Leaving push transaction open on peer \""
+                       << job_.query_.GetPeers() [transaction.destination_] << "\": " << transaction.uri_;
+          success = false;
+        }
+        else
+        {
+          // The peer has rejected the buckets, a resubmit would fail
+          // the same way
+          job_.DiscardTransaction(transaction);
+          success = false;
+        }
+      }
+
+      if (success)
       {
         return StateUpdate::Success();
       }
@@ -85,6 +107,13 @@ namespace OrthancPlugins
 
     virtual void Stop(OrthancPluginJobStopReason reason)
     {
+      if (reason == OrthancPluginJobStopReason_Canceled)
+      {
+        for (size_t i = 0; i < transactions_.size(); i++)
+        {
+          job_.DiscardTransaction(transactions_[i]);
+        }
+      }
     }
   };
 
@@ -92,88 +121,339 @@ namespace OrthancPlugins
   class PushJob::PushBucketsState : public IState
   {
   private:
-    const PushJob&                    job_;
-    JobInfo&                          info_;
-    std::string                       transactionUri_;
-    HttpQueriesQueue                  queue_;
-    std::unique_ptr<HttpQueriesRunner>  runner_;
+    struct Destination : public boost::noncopyable
+    {
+      Transaction                         transaction_;
+      HttpQueriesQueue                    queue_;
+      std::unique_ptr<HttpQueriesRunner>  runner_;        // Reset if the job is paused
+      bool                                isPreparing_;   // Registered in the bodies preparer
+      HttpQueriesQueue::Status            status_;
+      size_t                              resumedBuckets_;
+    };
+
+    PushJob&                              job_;
+    JobInfo&                              info_;
+    bool                                  hasFailure_;
+    std::unique_ptr<PushBodiesCache>      bodies_;   // Only set in fan-out
+    std::vector<Destination*>             destinations_;
+    size_t                                bucketsCount_;
+
+    void StopPreparing(Destination& destination)
+    {
+      if (destination.isPreparing_)
+      {
+        job_.preparer_.Unregister(destination.queue_);
+        destination.isPreparing_ = false;
+      }
+    }
+
+    void StopThreads()
+    {
+      // Cancel the running upload threads, then the threads that
+      // prepare their bodies
+      for (size_t i = 0; i < destinations_.size(); i++)
+      {
+        destinations_[i]->runner_.reset();
+      }
+
+      for (size_t i = 0; i < destinations_.size(); i++)
+      {
+        StopPreparing(*destinations_[i]);
+      }
+    }
+
+    // Called at the first step, and when the job is resumed after a
+    // pause: The threads of the destinations that are still running
+    // are created again
+    void StartThreads()
+    {
+      for (size_t i = 0; i < destinations_.size(); i++)
+      {
+        Destination& destination = *destinations_[i];
+
+        if (destination.status_ == HttpQueriesQueue::Status_Running)
+        {
+          if (!destination.isPreparing_)
+          {
+            job_.preparer_.Register(destination.queue_);
+            destination.isPreparing_ = true;
+          }
+
+          if (destination.runner_.get() == NULL)
+          {
+            destination.runner_.reset(
+              new HttpQueriesRunner(destination.queue_, job_.pool_,
+                                    job_.query_.GetPeers() [destination.transaction_.destination_],
+                                    HttpQueriesPool::GetWeight(job_.query_.GetPriority())));
+          }
+        }
+      }
+    }
 
     void UpdateInfo()
     {
-      size_t scheduledQueriesCount, completedQueriesCount;
-      uint64_t uploadedSize, downloadedSize;
-      queue_.GetStatistics(scheduledQueriesCount, completedQueriesCount, downloadedSize, uploadedSize);
+      size_t totalCompleted = 0, totalRequeued = 0, totalResumed = 0;
+      uint64_t totalUploaded = 0;
+      float speed = 0;
+      Json::Value destinations = Json::objectValue;
+      std::vector<HttpQueriesQueue*> queues;
+
+      for (size_t i = 0; i < destinations_.size(); i++)
+      {
+        Destination& destination = *destinations_[i];
+
+        size_t scheduledQueriesCount, completedQueriesCount, requeuedQueriesCount;
+        uint64_t uploadedSize, downloadedSize;
+        destination.queue_.GetStatistics(scheduledQueriesCount, completedQueriesCount, requeuedQueriesCount,
+                                         downloadedSize, uploadedSize);
+
+        totalCompleted += completedQueriesCount;
+        totalRequeued += requeuedQueriesCount;
+        totalUploaded += uploadedSize;
+        totalResumed += destination.resumedBuckets_;
+        queues.push_back(&destination.queue_);
+
+        if (destination.runner_.get() != NULL)
+        {
+          float s;
+          destination.runner_->GetSpeed(s);
+          speed += s;
+        }
+
+        Json::Value item = Json::objectValue;
+        item["UploadedSizeMB"] = ConvertToMegabytes(uploadedSize);
+        item["CompletedHttpQueries"] = static_cast<unsigned int>(completedQueriesCount);
+
+        switch (destination.status_)
+        {
+          case HttpQueriesQueue::Status_Running:
+            item["Status"] = "Running";
+            break;
+
+          case HttpQueriesQueue::Status_Success:
+            item["Status"] = "Success";
+            break;
+
+          default:
+            item["Status"] = "Failure";
+            break;
+        }
+
+        destinations[job_.query_.GetPeers() [destination.transaction_.destination_]] = item;
+      }
+
+      info_.SetContent("UploadedSizeMB", ConvertToMegabytes(totalUploaded));
+      info_.SetContent("CompletedHttpQueries", static_cast<unsigned int>(totalCompleted));
+      info_.SetContent("RequeuedHttpQueries", static_cast<unsigned int>(totalRequeued));
+      info_.SetContent("NetworkSpeedKBs", static_cast<unsigned int>(speed));
 
-      info_.SetContent("UploadedSizeMB", ConvertToMegabytes(uploadedSize));
-      info_.SetContent("CompletedHttpQueries", static_cast<unsigned int>(completedQueriesCount));
+      {
+        // The latencies of the slowest destination are reported
+        Json::Value activity;
+        HttpQueriesQueue::FormatActivity(activity, queues);
+        info_.MergeContent(activity);
+      }
+
+      if (totalResumed > 0)
+      {
+        info_.SetContent("ResumedBuckets", static_cast<unsigned int>(totalResumed));
+      }
+
+      if (job_.query_.GetPeers().size() > 1)
+      {
+        info_.SetContent("Destinations", destinations);
+      }
 
-      if (runner_.get() != NULL)
+      if (bodies_.get() != NULL)
       {
-        float speed;
-        runner_->GetSpeed(speed);
-        info_.SetContent("NetworkSpeedKBs", static_cast<unsigned int>(speed));
+        info_.SetContent("SharedBodiesSizeMB", ConvertToMegabytes(bodies_->GetMemorySize()));
       }
             
-      // The "2" below corresponds to the "CreateTransactionState"
-      // and "FinalState" steps (which prevents division by zero)
-      info_.SetProgress(static_cast<float>(1 /* CreateTransactionState */ + completedQueriesCount) / 
-                        static_cast<float>(2 + scheduledQueriesCount));
+      info_.SetProgress(ComputeProgress(totalCompleted, totalResumed, destinations_.size(), bucketsCount_));
     }
 
   public:
-    PushBucketsState(const PushJob&  job,
+    PushBucketsState(PushJob& job,
                      JobInfo& info,
-                     const std::string& transactionUri,
+                     const std::vector<Transaction>& transactions,
+                     bool hasFailure,
                      const std::vector<TransferBucket>& buckets) :
       job_(job),
       info_(info),
-      transactionUri_(transactionUri)
+      hasFailure_(hasFailure),
+      bucketsCount_(buckets.size())
     {
-      queue_.SetMaxRetries(job.maxHttpRetries_);
-      queue_.Reserve(buckets.size());
-        
-      for (size_t i = 0; i < buckets.size(); i++)
+      if (transactions.size() > 1)
       {
-        queue_.Enqueue(new BucketPushQuery(job.cache_, buckets[i], job.query_.GetPeer(),
-                                           transactionUri_, i, job.query_.GetCompression()));
+        // Fan-out: Read and compress each bucket only once for all
+        // the destinations, while bounding the memory that is used
+        bodies_.reset(new PushBodiesCache(buckets.size(), transactions.size(),
+                                          2 * job.pool_.GetThreadsCount() * job.targetBucketSize_));
+      }
+
+      // Skip the buckets that were already received by the
+      // transactions that are resumed
+      std::vector< std::vector<bool> > skipped(transactions.size());
+
+      for (size_t i = 0; i < transactions.size(); i++)
+      {
+        skipped[i].resize(buckets.size(), false);
+
+        for (size_t j = 0; j < transactions[i].storedBuckets_.size(); j++)
+        {
+          const size_t bucket = transactions[i].storedBuckets_[j];
+          if (bucket < buckets.size() &&
+              !skipped[i][bucket])
+          {
+            skipped[i][bucket] = true;
+
+            if (bodies_.get() != NULL)
+            {
+              bodies_->Skip(bucket, i);
+            }
+          }
+        }
+      }
+
+      for (size_t i = 0; i < transactions.size(); i++)
+      {
+        std::unique_ptr<Destination> destination(new Destination);
+        destination->transaction_ = transactions[i];
+        destination->isPreparing_ = false;
+        destination->status_ = HttpQueriesQueue::Status_Running;
+        destination->resumedBuckets_ = 0;
+
+        const std::string& peer = job.query_.GetPeers() [transactions[i].destination_];
+
+        HttpQueriesQueue& queue = destination->queue_;
+        queue.SetMaxRetries(job.maxHttpRetries_);
+        queue.SetMaxRequeues(job.pool_.GetMaxRequeues());
+        queue.SetCircuitBreaker(job.pool_.GetCircuitBreaker());
+        queue.SetPeerLimits(job.pool_.GetPeerLimits());
+        queue.Reserve(buckets.size());
+
+        // Keep enough compressed buckets ready to feed all the network
+        // threads, while bounding the memory that is used. In fan-out,
+        // the bodies are shared by the destinations through the cache.
+        queue.EnablePrefetch(job.preparer_, 2 * job.pool_.GetThreadsCount());
+        
+        for (size_t j = 0; j < buckets.size(); j++)
+        {
+          if (skipped[i][j])
+          {
+            destination->resumedBuckets_++;
+            continue;
+          }
+
+          std::unique_ptr<BucketPushQuery> query(
+            new BucketPushQuery(job.cache_, buckets[j], peer, transactions[i].uri_,
+                                j, job.query_.GetCompression()));
+
+          if (bodies_.get() != NULL)
+          {
+            query->SetBodiesCache(*bodies_, i);
+          }
+
+          queue.Enqueue(query.release());
+        }
+
+        destinations_.push_back(destination.release());
       }
 
       UpdateInfo();
     }
+
+    virtual ~PushBucketsState()
+    {
+      StopThreads();
+
+      for (size_t i = 0; i < destinations_.size(); i++)
+      {
+        assert(destinations_[i] != NULL);
+        delete destinations_[i];
+      }
+    }
       
     virtual StateUpdate* Step()
     {
-      if (runner_.get() == NULL)
+      StartThreads();
+
+      bool isRunning = false;
+
+      for (size_t i = 0; i < destinations_.size(); i++)
       {
-        runner_.reset(new HttpQueriesRunner(queue_, job_.threadsCount_));
-      }
+        Destination& destination = *destinations_[i];
 
-      HttpQueriesQueue::Status status = queue_.WaitComplete(200);
+        if (destination.status_ == HttpQueriesQueue::Status_Running)
+        {
+          destination.status_ = destination.queue_.WaitComplete(isRunning ? 0 : 200);
+
+          switch (destination.status_)
+          {
+            case HttpQueriesQueue::Status_Running:
+              isRunning = true;
+              break;
+
+            case HttpQueriesQueue::Status_Success:
+              destination.runner_.reset();
+              StopPreparing(destination);
+              break;
+
+            case HttpQueriesQueue::Status_Failure:
+              // The other destinations go on, and the shared bodies
+              // are not kept anymore for this one
+              LOG(ERROR) << "Cannot send the buckets to peer \""
+                         << job_.query_.GetPeers() [destination.transaction_.destination_] << "\"";
+              destination.runner_.reset();
+              StopPreparing(destination);
+
+              if (bodies_.get() != NULL)
+              {
+                bodies_->DropConsumer(i);
+              }
+              break;
+
+            default:
+              throw Orthanc::OrthancException(Orthanc::ErrorCode_InternalError);
+          }
+        }
+      }
 
       UpdateInfo();
 
-      switch (status)
+      if (isRunning)
       {
-        case HttpQueriesQueue::Status_Running:
-          return StateUpdate::Continue();
+        return StateUpdate::Continue();
+      }
 
-        case HttpQueriesQueue::Status_Success:
-          // Commit transaction on remote peer
-          return StateUpdate::Next(new FinalState(job_, info_, transactionUri_, true));
+      std::vector<Transaction> transactions;
+      transactions.reserve(destinations_.size());
+
+      for (size_t i = 0; i < destinations_.size(); i++)
+      {
+        Transaction transaction = destinations_[i]->transaction_;
+        transaction.isSuccess_ = (destinations_[i]->status_ == HttpQueriesQueue::Status_Success);
 
-        case HttpQueriesQueue::Status_Failure:
-          // Discard transaction on remote peer
-          return StateUpdate::Next(new FinalState(job_, info_, transactionUri_, false));
+        // Only the network failures are worth resuming
+        transaction.canResume_ = !destinations_[i]->queue_.IsPermanentFailure();
+        transactions.push_back(transaction);
+      }
 
-        default:
-          throw Orthanc::OrthancException(Orthanc::ErrorCode_InternalError);
-      }        
+      return StateUpdate::Next(new FinalState(job_, info_, transactions, hasFailure_));
     }
 
     virtual void Stop(OrthancPluginJobStopReason reason)
     {
-      // Cancel the running download threads
-      runner_.reset();
+      StopThreads();
+
+      if (reason == OrthancPluginJobStopReason_Canceled)
+      {
+        // The transactions are only kept open if the job is paused
+        for (size_t i = 0; i < destinations_.size(); i++)
+        {
+          job_.DiscardTransaction(destinations_[i]->transaction_);
+        }
+      }
     }
   };
 
@@ -181,13 +461,61 @@ namespace OrthancPlugins
   class PushJob::CreateTransactionState : public IState
   {
   private:
-    const PushJob&                job_;
+    PushJob&                      job_;
     JobInfo&                      info_;
     std::string                   createTransaction_;
+    std::string                   contentMD5_;
     std::vector<TransferBucket>   buckets_;
 
+    enum ResumeStatus
+    {
+      ResumeStatus_Resumed,
+      ResumeStatus_Vanished,     // A new transaction must be created
+      ResumeStatus_Unavailable   // The remote peer cannot be reached
+    };
+
+    ResumeStatus ResumeTransaction(Transaction& transaction,
+                                   const std::string& uri) const
+    {
+      const std::string& peer = job_.query_.GetPeers() [transaction.destination_];
+      const size_t peerIndex = job_.peerIndexes_[transaction.destination_];
+
+      Json::Value answer;
+      if (!DoGetPeer(answer, job_.peers_, peerIndex, uri, job_.maxHttpRetries_))
+      {
+        // Only give up on the transaction if the peer explicitly
+        // states that it doesn't know it anymore (it was committed,
+        // discarded or dropped, or the peer has been restarted)
+        if (GetPeerStatus(job_.peers_, peerIndex, uri, 0) == 404)
+        {
+          LOG(INFO) << "Cannot resume push transaction on peer \"" << peer << "\": " << uri;
+          return ResumeStatus_Vanished;
+        }
+        else
+        {
+          LOG(ERROR) << "Cannot get the status of push transaction on peer \"" << peer << "\": " << uri;
+          return ResumeStatus_Unavailable;
+        }
+      }
+
+      if (!ParseStoredBuckets(transaction.storedBuckets_, answer, buckets_.size()))
+      {
+        LOG(WARNING) << "Discarding a push transaction that cannot be resumed on peer \""
+                     << peer << "\": " << uri;
+        DoDeletePeer(job_.peers_, peerIndex, uri, job_.maxHttpRetries_);
+        return ResumeStatus_Vanished;
+      }
+
+      transaction.uri_ = uri;
+
+      LOG(WARNING) << "Resuming push transaction on peer \"" << peer << "\", "
+                   << transaction.storedBuckets_.size() << " out of " << buckets_.size()
+                   << " buckets were already sent: " << uri;
+      return ResumeStatus_Resumed;
+    }
+
   public:
-    CreateTransactionState(const PushJob& job,
+    CreateTransactionState(PushJob& job,
                            JobInfo& info) :
       job_(job),
       info_(info)
@@ -200,37 +528,129 @@ namespace OrthancPlugins
                                       job.targetBucketSize_, 2 * job.targetBucketSize_,
                                       job_.query_.GetCompression());
 
+      if (job_.query_.IsStreamingCommit())
+      {
+        // The remote peers are allowed to import the instances before
+        // the transaction is committed
+        push[KEY_STREAMING_COMMIT] = true;
+      }
+
       Orthanc::Toolbox::WriteFastJson(createTransaction_, push);
 
+      // Fingerprint of the transaction, so as not to resume a
+      // transaction whose content has changed in the meantime
+      Orthanc::Toolbox::ComputeMD5(contentMD5_, createTransaction_);
+
       info_.SetContent("Resources", job_.query_.GetResources());
       info_.SetContent("Peer", job_.query_.GetPeer());
       info_.SetContent("Compression", EnumerationToString(job_.query_.GetCompression()));
       info_.SetContent("TotalInstances", static_cast<unsigned int>(scheduler.GetInstancesCount()));
       info_.SetContent("TotalSizeMB", ConvertToMegabytes(scheduler.GetTotalSize()));
+
+      if (job_.query_.GetPeers().size() > 1)
+      {
+        Json::Value peers = Json::arrayValue;
+        for (size_t i = 0; i < job_.query_.GetPeers().size(); i++)
+        {
+          peers.append(job_.query_.GetPeers() [i]);
+        }
+
+        info_.SetContent("Peers", peers);
+      }
     }
 
     virtual StateUpdate* Step()
     {
-      Json::Value answer;
-      if (!DoPostPeer(answer, job_.peers_, job_.peerIndex_, URI_PUSH, createTransaction_, job_.maxHttpRetries_))
-      {
-        LOG(ERROR) << "Cannot create a push transaction to peer \"" 
-                   << job_.query_.GetPeer()
-                   << "\" (check that it has the transfers accelerator plugin installed)";
-        return StateUpdate::Failure();
-      } 
+      std::vector<Transaction> transactions;
+      bool hasFailure = false;
+      size_t committedCount = 0;
 
-      if (answer.type() != Json::objectValue ||
-          !answer.isMember(KEY_PATH) ||
-          answer[KEY_PATH].type() != Json::stringValue)
+      for (size_t i = 0; i < job_.query_.GetPeers().size(); i++)
       {
-        LOG(ERROR) << "Bad network protocol from peer: " << job_.query_.GetPeer();
-        return StateUpdate::Failure();
+        const std::string& peer = job_.query_.GetPeers() [i];
+
+        Transaction transaction;
+        transaction.destination_ = i;
+        transaction.isSuccess_ = false;
+        transaction.canResume_ = true;
+
+        std::string uri;
+        bool isCommitted;
+        if (LookupPreviousTransaction(uri, isCommitted, job_.transactions_, peer, contentMD5_))
+        {
+          if (isCommitted)
+          {
+            LOG(WARNING) << "The push transaction to peer \"" << peer
+                         << "\" was already committed by a previous execution of the job";
+            committedCount++;
+            continue;
+          }
+
+          switch (ResumeTransaction(transaction, uri))
+          {
+            case ResumeStatus_Resumed:
+              transactions.push_back(transaction);
+              continue;
+
+            case ResumeStatus_Unavailable:
+              // Keep the previous transaction, that might still be
+              // resumed by a later execution of the job
+              hasFailure = true;
+              continue;
+
+            case ResumeStatus_Vanished:
+              break;
+
+            default:
+              throw Orthanc::OrthancException(Orthanc::ErrorCode_InternalError);
+          }
+        }
+
+        Json::Value answer;
+        if (!DoPostPeer(answer, job_.peers_, job_.peerIndexes_[i], URI_PUSH, createTransaction_, job_.maxHttpRetries_))
+        {
+          LOG(ERROR) << "Cannot create a push transaction to peer \"" << peer
+                     << "\" (check that it has the transfers accelerator plugin installed)";
+          hasFailure = true;
+        } 
+        else if (answer.type() != Json::objectValue ||
+                 !answer.isMember(KEY_PATH) ||
+                 answer[KEY_PATH].type() != Json::stringValue)
+        {
+          LOG(ERROR) << "Bad network protocol from peer: " << peer;
+          hasFailure = true;
+        }
+        else
+        {
+          transaction.uri_ = answer[KEY_PATH].asString();
+          transactions.push_back(transaction);
+        }
       }
 
-      std::string transactionUri = answer[KEY_PATH].asString();
+      if (transactions.empty())
+      {
+        if (!hasFailure &&
+            committedCount > 0)
+        {
+          // All the destinations were already committed
+          info_.SetProgress(1);
+          return StateUpdate::Success();
+        }
+        else
+        {
+          return StateUpdate::Failure();
+        }
+      }
+      else
+      {
+        // Remember the transactions, so that they can be resumed if
+        // the job is interrupted
+        job_.SaveTransactions(transactions, contentMD5_);
 
-      return StateUpdate::Next(new PushBucketsState(job_, info_, transactionUri, buckets_));
+        // If some destinations have failed, the buckets are still
+        // sent to the others, but the job will be marked as failed
+        return StateUpdate::Next(new PushBucketsState(job_, info_, transactions, hasFailure, buckets_));
+      }
     }
 
     virtual void Stop(OrthancPluginJobStopReason reason)
@@ -239,32 +659,195 @@ namespace OrthancPlugins
   };
 
 
+  void PushJob::UpdateSerializedInternal()
+  {
+    Json::Value serialized;
+    query_.Serialize(serialized);
+
+    if (!transactions_.empty())
+    {
+      serialized[KEY_TRANSACTIONS] = transactions_;
+    }
+
+    UpdateSerialized(serialized);
+  }
+
+
+  void PushJob::SaveTransactions(const std::vector<Transaction>& transactions,
+                                 const std::string& contentMD5)
+  {
+    // The other entries are kept, as they correspond to the
+    // destinations that are already committed or unreachable
+    for (size_t i = 0; i < transactions.size(); i++)
+    {
+      Json::Value item = Json::objectValue;
+      item[KEY_PATH] = transactions[i].uri_;
+      item[KEY_CONTENT_MD5] = contentMD5;
+      transactions_[query_.GetPeers() [transactions[i].destination_]] = item;
+    }
+
+    UpdateSerializedInternal();
+  }
+
+
+  void PushJob::MarkCommitted(size_t destination)
+  {
+    const std::string& peer = query_.GetPeers() [destination];
+
+    if (transactions_.isMember(peer))
+    {
+      transactions_[peer][KEY_COMMITTED] = true;
+      UpdateSerializedInternal();
+    }
+  }
+
+
+  void PushJob::DiscardTransaction(const Transaction& transaction)
+  {
+    const std::string& peer = query_.GetPeers() [transaction.destination_];
+
+    LOG(WARNING) << "Discarding push transaction on peer \"" << peer << "\": " << transaction.uri_;
+
+    if (!DoDeletePeer(peers_, peerIndexes_[transaction.destination_], transaction.uri_, maxHttpRetries_))
+    {
+      LOG(ERROR) << "Cannot discard push transaction on peer \"" << peer << "\", "
+                 << "it will be dropped after a period of inactivity: " << transaction.uri_;
+    }
+
+    if (transactions_.isMember(peer))
+    {
+      transactions_.removeMember(peer);
+      UpdateSerializedInternal();
+    }
+  }
+
+
   StatefulOrthancJob::StateUpdate* PushJob::CreateInitialState(JobInfo& info)
   {
+    pool_.GetPeerLimits().LoadConfiguration();
     return StateUpdate::Next(new CreateTransactionState(*this, info));
   }
     
     
   PushJob::PushJob(const TransferQuery& query,
                    OrthancInstancesCache& cache,
-                   size_t threadsCount,
+                   HttpQueriesPool& pool,
+                   HttpBodiesPreparer& preparer,
                    size_t targetBucketSize,
                    unsigned int maxHttpRetries) :
     StatefulOrthancJob(JOB_TYPE_PUSH),
     cache_(cache),
     query_(query),
-    threadsCount_(threadsCount),
+    pool_(pool),
+    preparer_(preparer),
     targetBucketSize_(targetBucketSize),
-    maxHttpRetries_(maxHttpRetries)
+    maxHttpRetries_(maxHttpRetries),
+    transactions_(Json::objectValue)
   {
-    if (!peers_.LookupName(peerIndex_, query_.GetPeer()))
+    peerIndexes_.resize(query_.GetPeers().size());
+
+    for (size_t i = 0; i < query_.GetPeers().size(); i++)
     {
-      LOG(ERROR) << "Unknown Orthanc peer: " << query_.GetPeer();
-      throw Orthanc::OrthancException(Orthanc::ErrorCode_UnknownResource);
+      if (!peers_.LookupName(peerIndexes_[i], query_.GetPeers() [i]))
+      {
+        LOG(ERROR) << "Unknown Orthanc peer: " << query_.GetPeers() [i];
+        throw Orthanc::OrthancException(Orthanc::ErrorCode_UnknownResource);
+      }
     }
 
-    Json::Value serialized;
-    query.Serialize(serialized);
-    UpdateSerialized(serialized);
+    UpdateSerializedInternal();
+  }
+
+
+  void PushJob::SetPreviousTransactions(const Json::Value& transactions)
+  {
+    if (transactions.type() != Json::objectValue)
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_BadFileFormat);
+    }
+
+    transactions_ = transactions;
+    UpdateSerializedInternal();
+  }
+
+
+  bool PushJob::LookupPreviousTransaction(std::string& uri,
+                                          bool& isCommitted,
+                                          const Json::Value& transactions,
+                                          const std::string& peer,
+                                          const std::string& contentMD5)
+  {
+    if (transactions.type() == Json::objectValue &&
+        transactions.isMember(peer))
+    {
+      const Json::Value& transaction = transactions[peer];
+
+      if (transaction.type() == Json::objectValue &&
+          transaction.isMember(KEY_PATH) &&
+          transaction.isMember(KEY_CONTENT_MD5) &&
+          transaction[KEY_PATH].type() == Json::stringValue &&
+          transaction[KEY_CONTENT_MD5].type() == Json::stringValue &&
+          transaction[KEY_CONTENT_MD5].asString() == contentMD5)
+      {
+        uri = transaction[KEY_PATH].asString();
+        isCommitted = (transaction.isMember(KEY_COMMITTED) &&
+                       transaction[KEY_COMMITTED].type() == Json::booleanValue &&
+                       transaction[KEY_COMMITTED].asBool());
+        return true;
+      }
+    }
+
+    return false;
+  }
+
+
+  bool PushJob::ParseStoredBuckets(std::vector<size_t>& target,
+                                   const Json::Value& answer,
+                                   size_t bucketsCount)
+  {
+    if (answer.type() != Json::objectValue ||
+        !answer.isMember(KEY_TOTAL_BUCKETS) ||
+        !answer.isMember(KEY_STORED_BUCKETS) ||
+        (answer[KEY_TOTAL_BUCKETS].type() != Json::intValue &&
+         answer[KEY_TOTAL_BUCKETS].type() != Json::uintValue) ||
+        answer[KEY_STORED_BUCKETS].type() != Json::arrayValue ||
+        answer[KEY_TOTAL_BUCKETS].asUInt() != bucketsCount)
+    {
+      return false;
+    }
+
+    const Json::Value& stored = answer[KEY_STORED_BUCKETS];
+
+    target.clear();
+    target.reserve(stored.size());
+
+    for (Json::Value::ArrayIndex i = 0; i < stored.size(); i++)
+    {
+      if ((stored[i].type() == Json::intValue ||
+           stored[i].type() == Json::uintValue) &&
+          stored[i].asInt64() >= 0 &&
+          stored[i].asUInt64() < bucketsCount)
+      {
+        target.push_back(static_cast<size_t>(stored[i].asUInt64()));
+      }
+    }
+
+    return true;
+  }
+
+
+  float PushJob::ComputeProgress(size_t completedQueries,
+                                 size_t resumedBuckets,
+                                 size_t destinationsCount,
+                                 size_t bucketsCount)
+  {
+    // The "2" below corresponds to the "CreateTransactionState"
+    // and "FinalState" steps (which prevents division by zero),
+    // and the buckets of a resumed transaction count as sent
+    const float completed = (destinationsCount == 0 ? 0.0f :
+                             static_cast<float>(completedQueries + resumedBuckets) /
+                             static_cast<float>(destinationsCount));
+    return (1.0f /* CreateTransactionState */ + completed) / 
+      static_cast<float>(2 + bucketsCount);
   }
 }
@@ -19,6 +19,8 @@
 
 #pragma once
 
+#include "../HttpQueries/HttpBodiesPreparer.h"
+#include "../HttpQueries/HttpQueriesPool.h"
 #include "../OrthancInstancesCache.h"
 #include "../StatefulOrthancJob.h"
 #include "../TransferQuery.h"
@@ -32,21 +34,70 @@ namespace OrthancPlugins
     class PushBucketsState;
     class FinalState;
 
+    // Push transaction that is opened on one of the destinations
+    struct Transaction
+    {
+      size_t       destination_;   // Index in "query_.GetPeers()"
+      std::string  uri_;
+      bool         isSuccess_;     // Whether all the buckets were sent
+      bool         canResume_;     // If not a success, whether a resubmit can go on with it
+      std::vector<size_t>  storedBuckets_;  // Already received, if resumed
+    };
+
     OrthancInstancesCache&   cache_;
     TransferQuery            query_;
-    size_t                   threadsCount_;
+    HttpQueriesPool&         pool_;
+    HttpBodiesPreparer&      preparer_;
     size_t                   targetBucketSize_;
     OrthancPeers             peers_;
-    size_t                   peerIndex_;
+    std::vector<size_t>      peerIndexes_;   // One per destination
     unsigned int             maxHttpRetries_;
+    Json::Value              transactions_;  // Opened transactions, indexed by peer
+
+    void UpdateSerializedInternal();
+
+    void SaveTransactions(const std::vector<Transaction>& transactions,
+                          const std::string& contentMD5);
+
+    // Remembers that the transaction of this destination was
+    // committed, so that it is not sent again if the job is resubmitted
+    void MarkCommitted(size_t destination);
+
+    // Deletes the transaction on the remote peer, which releases its
+    // storage, and forgets it
+    void DiscardTransaction(const Transaction& transaction);
  
     virtual StateUpdate* CreateInitialState(JobInfo& info);
     
   public:
     PushJob(const TransferQuery& query,
             OrthancInstancesCache& cache,
-            size_t threadsCount,
+            HttpQueriesPool& pool,
+            HttpBodiesPreparer& preparer,
             size_t targetBucketSize,
             unsigned int maxHttpRetries);
+
+    // Resumes the push transactions of a previous execution of this
+    // job, if they are still active on the remote peers
+    void SetPreviousTransactions(const Json::Value& transactions);
+
+    // Looks for the transaction that was opened on "peer" by a
+    // previous execution of the job, for the same content
+    static bool LookupPreviousTransaction(std::string& uri,
+                                          bool& isCommitted,
+                                          const Json::Value& transactions,
+                                          const std::string& peer,
+                                          const std::string& contentMD5);
+
+    // Parses the answer to "GET /transfers/push/{id}". Returns "false"
+    // if the transaction does not match the "bucketsCount" buckets.
+    static bool ParseStoredBuckets(std::vector<size_t>& target,
+                                   const Json::Value& answer,
+                                   size_t bucketsCount);
+
+    static float ComputeProgress(size_t completedQueries,
+                                 size_t resumedBuckets,
+                                 size_t destinationsCount,
+                                 size_t bucketsCount);
   };
 }
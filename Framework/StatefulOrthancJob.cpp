@@ -38,6 +38,23 @@ namespace OrthancPlugins
     updated_ = true;
   }
 
+
+  void StatefulOrthancJob::JobInfo::MergeContent(const Json::Value& content)
+  {
+    if (content.type() != Json::objectValue)
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
+    }
+
+    Json::Value::Members members = content.getMemberNames();
+    for (size_t i = 0; i < members.size(); i++)
+    {
+      content_[members[i]] = content[members[i]];
+    }
+
+    updated_ = true;
+  }
+
   
   void StatefulOrthancJob::JobInfo::Update()
   {
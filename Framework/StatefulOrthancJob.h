@@ -52,6 +52,9 @@ namespace OrthancPlugins
       void SetContent(const std::string& key,
                       const Json::Value& value);
 
+      // Sets all the members of the given JSON object
+      void MergeContent(const Json::Value& content);
+
       void Update();
     };
     
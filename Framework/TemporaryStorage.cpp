@@ -0,0 +1,445 @@
+/**
+ * Transfers accelerator plugin for Orthanc
+ * Copyright (C) 2018-2021 Osimis S.A., Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Affero General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+#include "TemporaryStorage.h"
+
+#include "TransferToolbox.h"
+
+#include <Logging.h>
+#include <OrthancException.h>
+#include <SystemToolbox.h>
+#include <Toolbox.h>
+
+#include <boost/filesystem.hpp>
+#include <ctime>
+
+
+namespace OrthancPlugins
+{
+  static const char* const MARKER_FILENAME = ".transfers-accelerator";
+  static const char* const PROCESS_DIRECTORY_PREFIX = "process-";
+
+
+  // Name of the folders that are created by the plugin: The work
+  // directories of the pull jobs, and the folders of the processes
+  static bool IsOwnedFilename(const std::string& filename)
+  {
+    const std::string prefix(PROCESS_DIRECTORY_PREFIX);
+
+    return (Orthanc::Toolbox::IsUuid(filename) ||
+            (filename.size() == prefix.size() + 36 &&
+             filename.compare(0, prefix.size(), prefix) == 0 &&
+             Orthanc::Toolbox::IsUuid(filename.substr(prefix.size()))));
+  }
+
+
+  // Time of the most recent modification of the folder, of its marker
+  // or of the files it contains (the files are not modified for long
+  // while they are used by a transfer)
+  static bool GetLastModification(std::time_t& target,
+                                   const boost::filesystem::path& directory)
+  {
+    boost::system::error_code error;
+    target = boost::filesystem::last_write_time(directory, error);
+
+    if (error)
+    {
+      return false;
+    }
+
+    for (boost::filesystem::directory_iterator it(directory, error);
+         !error && it != boost::filesystem::directory_iterator(); it.increment(error))
+    {
+      boost::system::error_code error2;
+      const std::time_t time = boost::filesystem::last_write_time(it->path(), error2);
+
+      if (error2)
+      {
+        return false;
+      }
+      else if (time > target)
+      {
+        target = time;
+      }
+    }
+
+    return !error;
+  }
+
+
+  TemporaryStorage::TemporaryStorage() :
+    processUuid_(Orthanc::Toolbox::GenerateUuid()),
+    maxMemoryTransferSize_(0),
+    maxMemorySize_(0),
+    memorySize_(0),
+    directory_((boost::filesystem::temp_directory_path() / "OrthancTransfers").string()),
+    maxDiskSize_(0),
+    diskSize_(0),
+    unallocatedSize_(0),
+    releasesCount_(0),
+    singleFileLayout_(false)
+  {
+  }
+
+
+  TemporaryStorage::~TemporaryStorage()
+  {
+    if (memorySize_ != 0)
+    {
+      LOG(ERROR) << "Some download area is still using memory while the transfers accelerator stops";
+    }
+
+    if (diskSize_ != 0)
+    {
+      LOG(ERROR) << "Some download area is still using the disk while the transfers accelerator stops";
+    }
+
+    // All the temporary files are removed by now
+    boost::system::error_code error;
+    boost::filesystem::remove_all(GetProcessDirectoryInternal(), error);
+  }
+
+
+  void TemporaryStorage::SetMemoryLimits(size_t maxTransferSize,
+                                         size_t maxMemorySize)
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    maxMemoryTransferSize_ = maxTransferSize;
+    maxMemorySize_ = maxMemorySize;
+  }
+
+
+  bool TemporaryStorage::IsMemoryAllowed(size_t transferSize)
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    return (maxMemorySize_ != 0 &&
+            transferSize <= maxMemoryTransferSize_);
+  }
+
+
+  bool TemporaryStorage::ReserveMemory(size_t size)
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+
+    if (memorySize_ + size <= maxMemorySize_)
+    {
+      memorySize_ += size;
+      return true;
+    }
+    else
+    {
+      // Not enough RAM: The caller must spill to the disk
+      return false;
+    }
+  }
+
+
+  void TemporaryStorage::ReleaseMemory(size_t size)
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+
+    if (size > memorySize_)
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_InternalError);
+    }
+    else
+    {
+      memorySize_ -= size;
+      releasesCount_++;
+    }
+  }
+
+
+  size_t TemporaryStorage::GetMemorySize()
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    return memorySize_;
+  }
+
+
+  void TemporaryStorage::SetDirectory(const std::string& path)
+  {
+    if (path.empty())
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
+    }
+
+    boost::mutex::scoped_lock lock(mutex_);
+    directory_ = path;
+  }
+
+
+  std::string TemporaryStorage::GetDirectory()
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    return directory_;
+  }
+
+
+  std::string TemporaryStorage::CreateWorkDirectoryPath()
+  {
+    boost::filesystem::path path(GetDirectory());
+    path /= Orthanc::Toolbox::GenerateUuid();
+    return path.string();
+  }
+
+
+  bool TemporaryStorage::IsWorkDirectoryPath(const std::string& path)
+  {
+    boost::filesystem::path p(path);
+    return (p.parent_path() == boost::filesystem::path(GetDirectory()) &&
+            Orthanc::Toolbox::IsUuid(p.filename().string()));
+  }
+
+
+  void TemporaryStorage::CreateDirectory(const std::string& path)
+  {
+    boost::filesystem::create_directories(path);
+    Orthanc::SystemToolbox::WriteFile("", (boost::filesystem::path(path) / MARKER_FILENAME).string());
+  }
+
+
+  std::string TemporaryStorage::GetProcessDirectoryInternal() const
+  {
+    // The mutex must be locked, or the object being destructed
+    return (boost::filesystem::path(directory_) / (PROCESS_DIRECTORY_PREFIX + processUuid_)).string();
+  }
+
+
+  std::string TemporaryStorage::GetProcessDirectory()
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    return GetProcessDirectoryInternal();
+  }
+
+
+  Orthanc::TemporaryFile* TemporaryStorage::CreateTemporaryFile()
+  {
+    // Rewriting the marker shows to the other processes that the
+    // folder is still in use (it is also recreated if it was removed)
+    const std::string directory = GetProcessDirectory();
+    CreateDirectory(directory);
+    return new Orthanc::TemporaryFile(directory, "");
+  }
+
+
+  void TemporaryStorage::RemoveStaleFiles(unsigned int maxAge)
+  {
+    const boost::filesystem::path directory(GetDirectory());
+
+    boost::system::error_code error;
+    if (!boost::filesystem::is_directory(directory, error))
+    {
+      return;
+    }
+
+    const std::time_t now = std::time(NULL);
+    const std::string ownDirectory = boost::filesystem::path(GetProcessDirectory()).filename().string();
+    size_t count = 0;
+
+    for (boost::filesystem::directory_iterator it(directory, error);
+         !error && it != boost::filesystem::directory_iterator(); it.increment(error))
+    {
+      const boost::filesystem::path path = it->path();
+      const std::string filename = path.filename().string();
+
+      boost::system::error_code error2;
+      bool remove = false;
+
+      // Only the folders that were created by the plugin are removed,
+      // if they were not used for long by any process
+      std::time_t time;
+      if (filename != ownDirectory &&
+          IsOwnedFilename(filename) &&
+          boost::filesystem::is_directory(path, error2) &&
+          boost::filesystem::is_regular_file(path / MARKER_FILENAME, error2) &&
+          GetLastModification(time, path))
+      {
+        remove = (time + static_cast<std::time_t>(maxAge) < now);
+      }
+
+      if (remove)
+      {
+        boost::filesystem::remove_all(path, error2);
+
+        if (error2)
+        {
+          LOG(WARNING) << "Cannot remove a stale file of the transfers accelerator: " << path.string();
+        }
+        else
+        {
+          count++;
+        }
+      }
+    }
+
+    if (count != 0)
+    {
+      LOG(WARNING) << "Removed " << count << " stale temporary folder(s) of the transfers accelerator in: "
+                   << directory.string();
+    }
+  }
+
+
+  void TemporaryStorage::SetSingleFileLayout(bool enabled)
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    singleFileLayout_ = enabled;
+  }
+
+
+  bool TemporaryStorage::IsSingleFileLayout()
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    return singleFileLayout_;
+  }
+
+
+  void TemporaryStorage::SetMaxDiskSize(size_t size)
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    maxDiskSize_ = size;
+  }
+
+
+  bool TemporaryStorage::IsDiskAllowed(size_t transferSize)
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    return (maxDiskSize_ == 0 ||
+            transferSize <= maxDiskSize_);
+  }
+
+
+  bool TemporaryStorage::IsDiskAvailableInternal(size_t size,
+                                                 size_t newSize)
+  {
+    // The mutex must be locked by the caller
+
+    if (newSize > size)
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
+    }
+
+    if (maxDiskSize_ != 0 &&
+        diskSize_ + size > maxDiskSize_)
+    {
+      LOG(WARNING) << "Transfer of " << ConvertToMegabytes(size) << "MB exceeds the quota of the transfers accelerator ("
+                   << ConvertToMegabytes(diskSize_) << "MB used out of " << ConvertToMegabytes(maxDiskSize_) << "MB)";
+      return false;
+    }
+
+    if (newSize != 0)
+    {
+      // The files of the other transfers are only preallocated when
+      // their first chunk is received: The space they have reserved
+      // but not allocated yet is not free anymore
+      boost::filesystem::create_directories(directory_);
+      boost::filesystem::space_info info = boost::filesystem::space(directory_);
+
+      if (info.available < unallocatedSize_ ||
+          info.available - unallocatedSize_ < newSize)
+      {
+        LOG(WARNING) << "Not enough free space for a transfer of " << ConvertToMegabytes(newSize)
+                     << "MB in: " << directory_ << " (" << ConvertToMegabytes(unallocatedSize_)
+                     << "MB are reserved by other transfers)";
+        return false;
+      }
+    }
+
+    return true;
+  }
+
+
+  bool TemporaryStorage::ReserveDisk(size_t size,
+                                     size_t newSize)
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+
+    if (IsDiskAvailableInternal(size, newSize))
+    {
+      diskSize_ += size;
+      unallocatedSize_ += newSize;
+      return true;
+    }
+    else
+    {
+      return false;
+    }
+  }
+
+
+  bool TemporaryStorage::IsDiskAvailable(size_t size,
+                                         size_t newSize)
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    return IsDiskAvailableInternal(size, newSize);
+  }
+
+
+  void TemporaryStorage::ReleaseUnallocatedDisk(size_t size)
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+
+    if (size > unallocatedSize_)
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_InternalError);
+    }
+    else
+    {
+      unallocatedSize_ -= size;
+    }
+  }
+
+
+  void TemporaryStorage::ReleaseDisk(size_t size)
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+
+    if (size > diskSize_)
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_InternalError);
+    }
+    else
+    {
+      diskSize_ -= size;
+      releasesCount_++;
+    }
+  }
+
+
+  size_t TemporaryStorage::GetDiskSize()
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    return diskSize_;
+  }
+
+
+  size_t TemporaryStorage::GetUnallocatedDiskSize()
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    return unallocatedSize_;
+  }
+
+
+  uint64_t TemporaryStorage::GetReleasesCount()
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    return releasesCount_;
+  }
+}
@@ -0,0 +1,149 @@
+/**
+ * Transfers accelerator plugin for Orthanc
+ * Copyright (C) 2018-2021 Osimis S.A., Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Affero General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+#pragma once
+
+#include <TemporaryFile.h>
+
+#include <boost/noncopyable.hpp>
+#include <boost/thread/mutex.hpp>
+#include <string>
+
+namespace OrthancPlugins
+{
+  /**
+   * Bookkeeping of the RAM and of the disk space that are used by the
+   * download areas to assemble the received DICOM instances. The
+   * files are written in a configurable directory, that also contains
+   * the work directories of the pull jobs. This object is shared by
+   * all the pull jobs and push transactions of the plugin.
+   *
+   * As several Orthanc processes may share the same directory, the
+   * temporary files of each process are written in a subfolder of
+   * its own, and each folder that is created by the plugin contains
+   * a marker file, which is refreshed while the folder is in use.
+   **/
+  class TemporaryStorage : public boost::noncopyable
+  {
+  private:
+    boost::mutex  mutex_;
+    std::string   processUuid_;
+    size_t        maxMemoryTransferSize_;
+    size_t        maxMemorySize_;
+    size_t        memorySize_;
+    std::string   directory_;
+    size_t        maxDiskSize_;
+    size_t        diskSize_;
+    size_t        unallocatedSize_;  // Reserved, but not preallocated on the filesystem yet
+    uint64_t      releasesCount_;
+    bool          singleFileLayout_;
+
+    bool IsDiskAvailableInternal(size_t size,
+                                 size_t newSize);
+
+    std::string GetProcessDirectoryInternal() const;
+
+  public:
+    TemporaryStorage();
+
+    ~TemporaryStorage();
+
+    // Transfers whose total size is below "maxTransferSize" are
+    // assembled in RAM, as long as the overall memory used by the
+    // download areas stays below "maxMemorySize". Setting any of
+    // those two values to zero disables in-memory download areas.
+    void SetMemoryLimits(size_t maxTransferSize,
+                         size_t maxMemorySize);
+
+    bool IsMemoryAllowed(size_t transferSize);
+
+    bool ReserveMemory(size_t size);
+
+    void ReleaseMemory(size_t size);
+
+    size_t GetMemorySize();
+
+    // Directory of the temporary files, and root of the work
+    // directories where the pull jobs keep the instances they are
+    // receiving, so that they can be resumed
+    void SetDirectory(const std::string& path);
+
+    std::string GetDirectory();
+
+    std::string CreateWorkDirectoryPath();
+
+    // Prevents a serialized job from referring to arbitrary folders
+    bool IsWorkDirectoryPath(const std::string& path);
+
+    // Creates a directory, with the marker file that allows
+    // "RemoveStaleFiles()" to remove it once it is not used anymore
+    static void CreateDirectory(const std::string& path);
+
+    // Subfolder where this process writes its temporary files
+    std::string GetProcessDirectory();
+
+    Orthanc::TemporaryFile* CreateTemporaryFile();
+
+    // Removes the leftovers of the previous executions of Orthanc:
+    // The work directories and the temporary files of the processes
+    // that were not modified for "maxAge" seconds. The more recent
+    // folders are kept, as they might belong to another running
+    // process, or to a pull job that might still be resumed. Only the
+    // folders that contain the marker file are removed.
+    void RemoveStaleFiles(unsigned int maxAge);
+
+    // If enabled, the instances of a download area that are stored on
+    // the disk share one single file, instead of one file per
+    // instance, which avoids creating lots of small files
+    void SetSingleFileLayout(bool enabled);
+
+    bool IsSingleFileLayout();
+
+    // Global quota on the disk space of the download areas (zero
+    // means no limit)
+    void SetMaxDiskSize(size_t size);
+
+    // Whether a transfer of this size could ever fit in the quota
+    bool IsDiskAllowed(size_t transferSize);
+
+    // Reserves "size" bytes in the quota, out of which "newSize" bytes
+    // are not allocated on the disk yet and must be available on the
+    // filesystem. Returns "false" if there is not enough space.
+    bool ReserveDisk(size_t size,
+                     size_t newSize);
+
+    // Same check as "ReserveDisk()", without reserving anything
+    bool IsDiskAvailable(size_t size,
+                         size_t newSize);
+
+    // The given bytes out of the "newSize" of "ReserveDisk()" are now
+    // preallocated on the filesystem, or will never be
+    void ReleaseUnallocatedDisk(size_t size);
+
+    void ReleaseDisk(size_t size);
+
+    size_t GetDiskSize();
+
+    size_t GetUnallocatedDiskSize();
+
+    // Incremented each time some RAM or some disk space is released,
+    // so that the transfers waiting for storage know when to retry
+    uint64_t GetReleasesCount();
+  };
+}
@@ -21,6 +21,8 @@
 
 #include <OrthancException.h>
 
+#include <algorithm>
+
 
 namespace OrthancPlugins
 {
@@ -31,16 +33,67 @@ namespace OrthancPlugins
         !body.isMember(KEY_PEER) ||
         !body.isMember(KEY_COMPRESSION) ||
         body[KEY_RESOURCES].type() != Json::arrayValue ||
-        body[KEY_PEER].type() != Json::stringValue ||
+        (body[KEY_PEER].type() != Json::stringValue &&
+         body[KEY_PEER].type() != Json::arrayValue) ||
         body[KEY_COMPRESSION].type() != Json::stringValue)
     {
       throw Orthanc::OrthancException(Orthanc::ErrorCode_BadFileFormat);
     }
 
-    peer_ = body[KEY_PEER].asString();
+    if (body[KEY_PEER].type() == Json::stringValue)
+    {
+      peers_.push_back(body[KEY_PEER].asString());
+    }
+    else
+    {
+      for (Json::Value::ArrayIndex i = 0; i < body[KEY_PEER].size(); i++)
+      {
+        if (body[KEY_PEER][i].type() != Json::stringValue)
+        {
+          throw Orthanc::OrthancException(Orthanc::ErrorCode_BadFileFormat);
+        }
+
+        const std::string peer = body[KEY_PEER][i].asString();
+
+        if (std::find(peers_.begin(), peers_.end(), peer) == peers_.end())
+        {
+          peers_.push_back(peer);
+        }
+      }
+
+      if (peers_.empty())
+      {
+        throw Orthanc::OrthancException(Orthanc::ErrorCode_BadFileFormat);
+      }
+    }
+
     resources_ = body[KEY_RESOURCES];
     compression_ = StringToBucketCompression(body[KEY_COMPRESSION].asString());
 
+    if (body.isMember(KEY_MIRRORS))
+    {
+      if (body[KEY_MIRRORS].type() != Json::arrayValue)
+      {
+        throw Orthanc::OrthancException(Orthanc::ErrorCode_BadFileFormat);
+      }
+
+      for (Json::Value::ArrayIndex i = 0; i < body[KEY_MIRRORS].size(); i++)
+      {
+        if (body[KEY_MIRRORS][i].type() != Json::stringValue)
+        {
+          throw Orthanc::OrthancException(Orthanc::ErrorCode_BadFileFormat);
+        }
+
+        const std::string mirror = body[KEY_MIRRORS][i].asString();
+
+        if (mirror != GetPeer() &&
+            std::find(mirrors_.begin(), mirrors_.end(), mirror) == mirrors_.end())
+        {
+          mirrors_.push_back(mirror);
+        }
+      }
+    }
+
     if (body.isMember(KEY_ORIGINATOR_UUID))
     {
       if (body[KEY_ORIGINATOR_UUID].type() != Json::stringValue)
@@ -74,6 +127,22 @@ namespace OrthancPlugins
     {
       priority_ = 0;
     }
+
+    if (body.isMember(KEY_STREAMING_COMMIT))
+    {
+      if (body[KEY_STREAMING_COMMIT].type() != Json::booleanValue)
+      {
+        throw Orthanc::OrthancException(Orthanc::ErrorCode_BadFileFormat);
+      }
+      else
+      {
+        streamingCommit_ = body[KEY_STREAMING_COMMIT].asBool();
+      }
+    }
+    else
+    {
+      streamingCommit_ = false;
+    }
   }
 
 
@@ -93,13 +162,40 @@ namespace OrthancPlugins
   void TransferQuery::Serialize(Json::Value& target) const
   {
     target = Json::objectValue;
-    target[KEY_PEER] = peer_;
+    if (peers_.size() == 1)
+    {
+      target[KEY_PEER] = peers_[0];
+    }
+    else
+    {
+      target[KEY_PEER] = Json::arrayValue;
+
+      for (size_t i = 0; i < peers_.size(); i++)
+      {
+        target[KEY_PEER].append(peers_[i]);
+      }
+    }
     target[KEY_RESOURCES] = resources_;
     target[KEY_COMPRESSION] = EnumerationToString(compression_);
+
+    if (!mirrors_.empty())
+    {
+      target[KEY_MIRRORS] = Json::arrayValue;
+
+      for (size_t i = 0; i < mirrors_.size(); i++)
+      {
+        target[KEY_MIRRORS].append(mirrors_[i]);
+      }
+    }
       
     if (hasOriginator_)
     {
       target[KEY_ORIGINATOR_UUID] = originator_;
     }
+
+    if (streamingCommit_)
+    {
+      target[KEY_STREAMING_COMMIT] = true;
+    }
   }
 }
@@ -22,25 +22,43 @@
 #include "TransferToolbox.h"
 
 #include <json/value.h>
+#include <vector>
 
 namespace OrthancPlugins
 {
   class TransferQuery
   {
   private:
-    std::string        peer_;
-    Json::Value        resources_;
-    BucketCompression  compression_;
-    bool               hasOriginator_;
-    std::string        originator_;
-    int                priority_;
+    std::vector<std::string>   peers_;
+    std::vector<std::string>   mirrors_;
+    Json::Value                resources_;
+    BucketCompression          compression_;
+    bool                       hasOriginator_;
+    std::string                originator_;
+    int                        priority_;
+    bool                       streamingCommit_;
 
   public:
     explicit TransferQuery(const Json::Value& body);
 
+    // The first peer, if several peers are given
     const std::string& GetPeer() const
     {
-      return peer_;
+      return peers_.front();
+    }
+
+    // In push mode, the "Peer" field can list several destinations,
+    // that receive the same buckets
+    const std::vector<std::string>& GetPeers() const
+    {
+      return peers_;
+    }
+
+    // Other peers that store the same resources, and from which the
+    // buckets can be pulled as well (only in pull mode)
+    const std::vector<std::string>& GetMirrors() const
+    {
+      return mirrors_;
     }
 
     BucketCompression GetCompression() const
@@ -65,6 +83,13 @@ namespace OrthancPlugins
       return priority_;
     }
 
+    // In push mode, whether the remote peers may import the instances
+    // before the transaction is committed (which cannot be rolled back)
+    bool IsStreamingCommit() const
+    {
+      return streamingCommit_;
+    }
+
     void Serialize(Json::Value& target) const;
   };
 }
@@ -24,12 +24,15 @@
 #include <Logging.h>
 #include <OrthancException.h>
 
+#include <algorithm>
+#include <boost/thread.hpp>
+
 
 namespace OrthancPlugins
 {
-  void TransferScheduler::AddResource(OrthancInstancesCache& cache, 
-                                      Orthanc::ResourceType level,
-                                      const std::string& id)
+  static void ListChildInstances(std::vector<std::string>& target,
+                                 Orthanc::ResourceType level,
+                                 const std::string& id)
   {
     Json::Value resource;
 
@@ -68,7 +71,7 @@ namespace OrthancPlugins
           throw Orthanc::OrthancException(Orthanc::ErrorCode_InternalError);
         }
 
-        AddInstance(cache, resource[i][KEY_ID].asString());
+        target.push_back(resource[i][KEY_ID].asString());
       }
     }
     else
@@ -81,6 +84,33 @@ namespace OrthancPlugins
   }
 
 
+  static void ValidateResource(const Json::Value& resource)
+  {
+    if (resource.type() != Json::objectValue ||
+        !resource.isMember(KEY_LEVEL) ||
+        !resource.isMember(KEY_ID) ||
+        resource[KEY_LEVEL].type() != Json::stringValue ||
+        resource[KEY_ID].type() != Json::stringValue)
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_BadFileFormat);
+    }
+  }
+
+
+  void TransferScheduler::AddResource(OrthancInstancesCache& cache, 
+                                      Orthanc::ResourceType level,
+                                      const std::string& id)
+  {
+    std::vector<std::string> instances;
+    ListChildInstances(instances, level, id);
+
+    for (size_t i = 0; i < instances.size(); i++)
+    {
+      AddInstance(cache, instances[i]);
+    }
+  }
+
+
   void TransferScheduler::ComputeBucketsInternal(std::vector<TransferBucket>& target,
                                                  size_t groupThreshold,
                                                  size_t separateThreshold,
@@ -222,40 +252,86 @@ namespace OrthancPlugins
 
     for (Json::Value::ArrayIndex i = 0; i < resources.size(); i++)
     {
-      if (resources[i].type() != Json::objectValue ||
-          !resources[i].isMember(KEY_LEVEL) ||
-          !resources[i].isMember(KEY_ID) ||
-          resources[i][KEY_LEVEL].type() != Json::stringValue ||
-          resources[i][KEY_ID].type() != Json::stringValue)
+      ValidateResource(resources[i]);
+
+      Orthanc::ResourceType level = Orthanc::StringToResourceType(resources[i][KEY_LEVEL].asCString());
+
+      switch (level)
       {
-        throw Orthanc::OrthancException(Orthanc::ErrorCode_BadFileFormat);
+        case Orthanc::ResourceType_Patient:
+          AddPatient(cache, resources[i][KEY_ID].asString());
+          break;
+
+        case Orthanc::ResourceType_Study:
+          AddStudy(cache, resources[i][KEY_ID].asString());
+          break;
+
+        case Orthanc::ResourceType_Series:
+          AddSeries(cache, resources[i][KEY_ID].asString());
+          break;
+
+        case Orthanc::ResourceType_Instance:
+          AddInstance(cache, resources[i][KEY_ID].asString());
+          break;
+
+        default:
+          throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
+      }
+    }
+  }
+
+
+  void TransferScheduler::ExpandListOfResources(std::vector<std::string>& target,
+                                                const Json::Value& resources)
+  {
+    if (resources.type() != Json::arrayValue)
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_BadFileFormat);
+    }
+
+    std::vector<std::string> instances;
+
+    for (Json::Value::ArrayIndex i = 0; i < resources.size(); i++)
+    {
+      ValidateResource(resources[i]);
+
+      Orthanc::ResourceType level = Orthanc::StringToResourceType(resources[i][KEY_LEVEL].asCString());
+
+      if (level == Orthanc::ResourceType_Instance)
+      {
+        instances.push_back(resources[i][KEY_ID].asString());
       }
       else
       {
-        Orthanc::ResourceType level = Orthanc::StringToResourceType(resources[i][KEY_LEVEL].asCString());
+        ListChildInstances(instances, level, resources[i][KEY_ID].asString());
+      }
+    }
 
-        switch (level)
-        {
-          case Orthanc::ResourceType_Patient:
-            AddPatient(cache, resources[i][KEY_ID].asString());
-            break;
+    // Sorting makes the pagination of the lookups consistent
+    std::sort(instances.begin(), instances.end());
+    instances.erase(std::unique(instances.begin(), instances.end()), instances.end());
 
-          case Orthanc::ResourceType_Study:
-            AddStudy(cache, resources[i][KEY_ID].asString());
-            break;
+    target.swap(instances);
+  }
 
-          case Orthanc::ResourceType_Series:
-            AddSeries(cache, resources[i][KEY_ID].asString());
-            break;
 
-          case Orthanc::ResourceType_Instance:
-            AddInstance(cache, resources[i][KEY_ID].asString());
-            break;
+  void TransferScheduler::ExtractPage(std::vector<std::string>& target,
+                                      const std::vector<std::string>& instances,
+                                      size_t since,
+                                      size_t limit)
+  {
+    target.clear();
 
-          default:
-            throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
-        }
+    if (since < instances.size())
+    {
+      size_t end = instances.size();
+      if (limit != 0 &&
+          limit < end - since)
+      {
+        end = since + limit;
       }
+
+      target.assign(instances.begin() + since, instances.begin() + end);
     }
   }
 
@@ -274,6 +350,141 @@ namespace OrthancPlugins
   }
 
 
+  namespace
+  {
+    // Reads the MD5 of the DICOM files that are stored by Orthanc,
+    // with several REST calls in parallel
+    class StoredMD5Lookup : public boost::noncopyable
+    {
+    private:
+      typedef std::map<std::string, std::string>  Results;
+
+      boost::mutex                     mutex_;
+      const std::vector<std::string>&  instances_;
+      size_t                           next_;
+      Results&                         results_;
+
+      bool DequeueInstance(std::string& instance)
+      {
+        boost::mutex::scoped_lock lock(mutex_);
+
+        if (next_ < instances_.size())
+        {
+          instance = instances_[next_];
+          next_++;
+          return true;
+        }
+        else
+        {
+          return false;
+        }
+      }
+
+      static void Worker(StoredMD5Lookup* that)
+      {
+        std::string instance;
+
+        while (that->DequeueInstance(instance))
+        {
+          /**
+           * The MD5 of the DICOM file is read from the index of
+           * Orthanc, without accessing the storage area. This fails
+           * if the instance is missing, or if the
+           * "StoreMD5ForAttachments" option of Orthanc is disabled:
+           * The instance is downloaded in both cases.
+           **/
+          std::string md5;
+          if (RestApiGetString(md5, "/instances/" + instance + "/attachments/dicom/uncompressed-md5", false))
+          {
+            boost::mutex::scoped_lock lock(that->mutex_);
+            that->results_[instance] = md5;
+          }
+        }
+      }
+
+    public:
+      StoredMD5Lookup(Results& results,
+                      const std::vector<std::string>& instances) :
+        instances_(instances),
+        next_(0),
+        results_(results)
+      {
+      }
+
+      void Run(size_t threadsCount)
+      {
+        if (threadsCount <= 1 ||
+            instances_.size() <= 1)
+        {
+          Worker(this);
+        }
+        else
+        {
+          std::vector<boost::thread*> threads(std::min(threadsCount, instances_.size()));
+
+          for (size_t i = 0; i < threads.size(); i++)
+          {
+            threads[i] = new boost::thread(Worker, this);
+          }
+
+          for (size_t i = 0; i < threads.size(); i++)
+          {
+            threads[i]->join();
+            delete threads[i];
+          }
+        }
+      }
+    };
+  }
+
+
+  size_t TransferScheduler::RemoveStoredInstances(size_t& removedSize,
+                                                  size_t threadsCount)
+  {
+    std::vector<std::string> instances;
+    instances.reserve(instances_.size());
+
+    for (Instances::const_iterator it = instances_.begin(); it != instances_.end(); ++it)
+    {
+      instances.push_back(it->first);
+    }
+
+    std::map<std::string, std::string> storedMD5;
+    StoredMD5Lookup lookup(storedMD5, instances);
+    lookup.Run(threadsCount);
+
+    return RemoveInstances(removedSize, storedMD5);
+  }
+
+
+  size_t TransferScheduler::RemoveInstances(size_t& removedSize,
+                                            const std::map<std::string, std::string>& storedMD5)
+  {
+    size_t count = 0;
+    removedSize = 0;
+
+    Instances::iterator it = instances_.begin();
+    while (it != instances_.end())
+    {
+      std::map<std::string, std::string>::const_iterator found = storedMD5.find(it->first);
+
+      if (found != storedMD5.end() &&
+          found->second == it->second.GetMD5())
+      {
+        count++;
+        removedSize += it->second.GetSize();
+        instances_.erase(it++);
+      }
+      else
+      {
+        ++it;
+      }
+    }
+
+    return count;
+  }
+
+
   size_t TransferScheduler::GetTotalSize() const
   {
     size_t size = 0;
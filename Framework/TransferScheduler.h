@@ -69,8 +69,33 @@ namespace OrthancPlugins
     void ParseListOfResources(OrthancInstancesCache& cache, 
                               const Json::Value& resources);
 
+    // Lists the identifiers of the instances of a list of resources,
+    // sorted and without duplicates. Contrarily to
+    // "ParseListOfResources()", the instances are not read, which
+    // is fast even for huge resources.
+    static void ExpandListOfResources(std::vector<std::string>& target,
+                                      const Json::Value& resources);
+
+    // Extracts the page of the instances that starts at "since" and
+    // that contains at most "limit" instances (no limit if zero)
+    static void ExtractPage(std::vector<std::string>& target,
+                            const std::vector<std::string>& instances,
+                            size_t since,
+                            size_t limit);
+
     void ListInstances(std::vector<DicomInstanceInfo>& target) const;
 
+    // Removes the instances that are already stored by the local
+    // Orthanc with the same MD5, and returns their count. The index
+    // of Orthanc is queried by "threadsCount" concurrent threads.
+    size_t RemoveStoredInstances(size_t& removedSize,
+                                 size_t threadsCount);
+
+    // Removes the instances whose MD5 is the one in "storedMD5"
+    // (indexed by instance ID), and returns their count
+    size_t RemoveInstances(size_t& removedSize,
+                           const std::map<std::string, std::string>& storedMD5);
+
     size_t GetInstancesCount() const
     {
       return instances_.size();
@@ -19,12 +19,18 @@
 
 #include "TransferToolbox.h"
 
+#include "HttpQueries/NativeHttpClient.h"
+#include "HttpQueries/PeerAnswer.h"
+#include "HttpQueries/PeersHandle.h"
+
 #include "../Resources/Orthanc/Plugins/OrthancPluginCppWrapper.h"
 
 #include <Logging.h>
 #include <OrthancException.h>
 
 #include <boost/math/special_functions/round.hpp>
+#include <boost/random/mersenne_twister.hpp>
+#include <boost/random/uniform_int_distribution.hpp>
 #include <boost/thread/thread.hpp>
 
 
@@ -78,20 +84,171 @@ namespace OrthancPlugins
   }
 
 
-  bool DoPostPeer(Json::Value& answer,
-                  const OrthancPeers& peers,
-                  size_t peerIndex,
-                  const std::string& uri,
-                  const std::string& body,
-                  unsigned int maxRetries)
+  bool CallPeer(PeerAnswer& answer,
+                uint16_t& httpStatus,
+                const OrthancPeers& peers,
+                const std::string& peerName,
+                Orthanc::HttpMethod method,
+                const std::string& uri,
+                const HttpHeaders& headers,
+                const std::string& body)
+  {
+    PeersHandle handle;  // Only resolved if not sent by the native HTTP client
+    return CallPeer(answer, httpStatus, handle, peerName, method, uri, headers, body, peers.GetTimeout());
+  }
+
+
+  bool CallPeer(PeerAnswer& answer,
+                uint16_t& httpStatus,
+                const PeersHandle& handle,
+                const std::string& peerName,
+                Orthanc::HttpMethod method,
+                const std::string& uri,
+                const HttpHeaders& headers,
+                const std::string& body,
+                unsigned int timeout)
+  {
+    /**
+     * "OrthancPeers" does not give access to the HTTP status, which
+     * is needed to tell the permanent errors apart from the transient
+     * ones. Its configuration (timeout) is reused.
+     **/
+
+    httpStatus = 0;
+
+    NativeHttpClient* client = NativeHttpClient::GetGlobalInstance();
+    if (client != NULL &&
+        client->HasPeer(peerName))
+    {
+      return client->Call(answer.GetString(), httpStatus, peerName, method, uri, headers, body, timeout);
+    }
+
+    OrthancPluginHttpMethod m;
+    switch (method)
+    {
+      case Orthanc::HttpMethod_Get:
+        m = OrthancPluginHttpMethod_Get;
+        break;
+
+      case Orthanc::HttpMethod_Post:
+        m = OrthancPluginHttpMethod_Post;
+        break;
+
+      case Orthanc::HttpMethod_Put:
+        m = OrthancPluginHttpMethod_Put;
+        break;
+
+      case Orthanc::HttpMethod_Delete:
+        m = OrthancPluginHttpMethod_Delete;
+        break;
+
+      default:
+        throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
+    }
+
+    uint32_t index;
+    if (!handle.LookupName(index, peerName))
+    {
+      LOG(ERROR) << "Unknown Orthanc peer: " << peerName;
+      return false;
+    }
+
+    std::vector<const char*> keys, values;
+    keys.reserve(headers.size());
+    values.reserve(headers.size());
+
+    for (HttpHeaders::const_iterator it = headers.begin(); it != headers.end(); ++it)
+    {
+      keys.push_back(it->first.c_str());
+      values.push_back(it->second.c_str());
+    }
+
+    MemoryBuffer tmp;
+    OrthancPluginErrorCode code = OrthancPluginCallPeerApi
+      (GetGlobalContext(), *tmp, NULL, &httpStatus, handle.GetPeers(), index, m, uri.c_str(),
+       static_cast<uint32_t>(headers.size()), keys.empty() ? NULL : &keys[0], values.empty() ? NULL : &values[0],
+       body.empty() ? NULL : body.c_str(), body.size(), timeout);
+
+    if (code == OrthancPluginErrorCode_Success)
+    {
+      answer.GetBuffer().Swap(tmp);
+      return IsSuccessHttpStatus(httpStatus);
+    }
+    else
+    {
+      return false;
+    }
+  }
+
+
+  bool IsSuccessHttpStatus(uint16_t httpStatus)
+  {
+    return (httpStatus == 200 ||
+            httpStatus == 206 /* Partial Content, answer to a "Range" request */);
+  }
+
+
+  bool IsRetriableHttpStatus(uint16_t httpStatus)
+  {
+    return (httpStatus < 400 ||
+            httpStatus >= 500 ||
+            httpStatus == 408 /* Request Timeout */ ||
+            httpStatus == 429 /* Too Many Requests */);
+  }
+
+
+  unsigned int ComputeRetryDelay(unsigned int retry,
+                                 unsigned int minimumDelayMS)
+  {
+    static const unsigned int BASE_DELAY_MS = 500;
+    static const unsigned int MAX_DELAY_MS = 30000;
+
+    unsigned int delay = MAX_DELAY_MS;
+    if (retry < 6)
+    {
+      delay = std::min(MAX_DELAY_MS, BASE_DELAY_MS << retry);
+    }
+
+    {
+      static boost::mutex mutex;
+      static boost::random::mt19937 generator(static_cast<uint32_t>(time(NULL)));
+
+      boost::mutex::scoped_lock lock(mutex);
+      boost::random::uniform_int_distribution<unsigned int> jitter(0, delay / 2);
+      delay = delay - delay / 4 + jitter(generator);
+    }
+
+    return std::max(delay, minimumDelayMS);
+  }
+
+
+  void WaitBeforeRetry(unsigned int retry,
+                       unsigned int minimumDelayMS)
+  {
+    boost::this_thread::sleep(boost::posix_time::milliseconds(ComputeRetryDelay(retry, minimumDelayMS)));
+  }
+
+
+  static bool CallPeerWithRetries(PeerAnswer& answer,
+                                  uint16_t& status,
+                                  const OrthancPeers& peers,
+                                  size_t peerIndex,
+                                  Orthanc::HttpMethod method,
+                                  const std::string& uri,
+                                  const std::string& body,
+                                  unsigned int maxRetries)
   {
+    const std::string peerName = peers.GetPeerName(peerIndex);
+
     unsigned int retry = 0;
 
     for (;;)
     {
+      status = 0;
+
       try
       {
-        if (peers.DoPost(answer, peerIndex, uri, body))
+        if (CallPeer(answer, status, peers, peerName, method, uri, HttpHeaders(), body))
         {
           return true;
         }
@@ -99,21 +256,75 @@ namespace OrthancPlugins
       catch (Orthanc::OrthancException&)
       {
       }
-
-      if (retry >= maxRetries)
+      
+      if (status == 404)
+      {
+        // Not necessarily an error, the caller decides
+        LOG(INFO) << "Peer \"" << peerName << "\" answered to " << uri << " with HTTP status 404";
+        return false;
+      }
+      else if (!IsRetriableHttpStatus(status))
+      {
+        LOG(ERROR) << "Peer \"" << peerName << "\" answered to " << uri << " with HTTP status " << status;
+        return false;
+      }
+      else if (retry >= maxRetries)
       {
         return false;
       }
       else
       {
-        // Wait 1 second before retrying
-        boost::this_thread::sleep(boost::posix_time::seconds(1));
+        WaitBeforeRetry(retry, 0);
         retry++;
       }
     }
   }
 
 
+  static bool ParseJsonAnswer(Json::Value& target,
+                              const PeerAnswer& answer,
+                              const std::string& uri)
+  {
+    try
+    {
+      answer.ToJson(target);
+      return true;
+    }
+    catch (Orthanc::OrthancException&)
+    {
+      LOG(ERROR) << "Bad JSON answer from a peer to: " << uri;
+      return false;
+    }
+  }
+
+
+  bool DoGetPeer(Json::Value& answer,
+                 const OrthancPeers& peers,
+                 size_t peerIndex,
+                 const std::string& uri,
+                 unsigned int maxRetries)
+  {
+    PeerAnswer buffer;
+    uint16_t status;
+    return (CallPeerWithRetries(buffer, status, peers, peerIndex, Orthanc::HttpMethod_Get, uri, "", maxRetries) &&
+            ParseJsonAnswer(answer, buffer, uri));
+  }
+
+
+  bool DoPostPeer(Json::Value& answer,
+                  const OrthancPeers& peers,
+                  size_t peerIndex,
+                  const std::string& uri,
+                  const std::string& body,
+                  unsigned int maxRetries)
+  {
+    PeerAnswer buffer;
+    uint16_t status;
+    return (CallPeerWithRetries(buffer, status, peers, peerIndex, Orthanc::HttpMethod_Post, uri, body, maxRetries) &&
+            ParseJsonAnswer(answer, buffer, uri));
+  }
+
+
   bool DoPostPeer(Json::Value& answer,
                   const OrthancPeers& peers,
                   const std::string& peerName,
@@ -133,31 +344,20 @@ namespace OrthancPlugins
                     const std::string& uri,
                     unsigned int maxRetries)
   {
-    unsigned int retry = 0;
+    PeerAnswer buffer;
+    uint16_t status;
+    return CallPeerWithRetries(buffer, status, peers, peerIndex, Orthanc::HttpMethod_Delete, uri, "", maxRetries);
+  }
 
-    for (;;)
-    {
-      try
-      {
-        if (peers.DoDelete(peerIndex, uri))
-        {
-          return true;
-        }
-      }
-      catch (Orthanc::OrthancException&)
-      {
-      }
-      
-      if (retry >= maxRetries)
-      {
-        return false;
-      }
-      else
-      {
-        // Wait 1 second before retrying
-        boost::this_thread::sleep(boost::posix_time::seconds(1));
-        retry++;
-      }
-    }
+
+  uint16_t GetPeerStatus(const OrthancPeers& peers,
+                         size_t peerIndex,
+                         const std::string& uri,
+                         unsigned int maxRetries)
+  {
+    PeerAnswer buffer;
+    uint16_t status;
+    CallPeerWithRetries(buffer, status, peers, peerIndex, Orthanc::HttpMethod_Get, uri, "", maxRetries);
+    return status;
   }
 }
@@ -19,6 +19,9 @@
 
 #pragma once
 
+#include <Enumerations.h>
+
+#include <map>
 #include <stdint.h>
 #include <string>
 #include <json/value.h>
@@ -32,21 +35,34 @@ static const char* const JOB_TYPE_PUSH = "PushTransfer";
 static const char* const PLUGIN_NAME = "transfers";
 
 static const char* const KEY_BUCKETS = "Buckets";
+static const char* const KEY_COMMITTED = "Committed";
 static const char* const KEY_COMPRESSION = "Compression";
+static const char* const KEY_CONTENT_MD5 = "ContentMD5";
 static const char* const KEY_ID = "ID";
 static const char* const KEY_INSTANCES = "Instances";
 static const char* const KEY_LEVEL = "Level";
+static const char* const KEY_MAX_CONCURRENT_QUERIES = "MaxConcurrentQueries";
+static const char* const KEY_MAX_DOWNLOAD_RATE = "MaxDownloadRate";
+static const char* const KEY_MAX_UPLOAD_RATE = "MaxUploadRate";
+static const char* const KEY_MIRRORS = "Mirrors";
 static const char* const KEY_OFFSET = "Offset";
 static const char* const KEY_ORIGINATOR_UUID = "Originator";
 static const char* const KEY_PATH = "Path";
 static const char* const KEY_PEER = "Peer";
 static const char* const KEY_PLUGIN_CONFIGURATION = "Transfers";
 static const char* const KEY_PRIORITY = "Priority";
+static const char* const KEY_RANGES = "Ranges";
 static const char* const KEY_REMOTE_JOB = "RemoteJob";
 static const char* const KEY_REMOTE_SELF = "RemoteSelf";
 static const char* const KEY_RESOURCES = "Resources";
 static const char* const KEY_SIZE = "Size";
+static const char* const KEY_STREAMING_COMMIT = "StreamingCommit";
+static const char* const KEY_STORED_BUCKETS = "StoredBuckets";
+static const char* const KEY_TOTAL_BUCKETS = "TotalBuckets";
+static const char* const KEY_TOTAL_INSTANCES = "TotalInstances";
+static const char* const KEY_TRANSACTIONS = "Transactions";
 static const char* const KEY_URL = "URL";
+static const char* const KEY_WORK_DIRECTORY = "WorkDirectory";
 
 static const char* const URI_CHUNKS = "/transfers/chunks";
 static const char* const URI_JOBS = "/jobs";
@@ -61,6 +77,10 @@ static const char* const URI_SEND = "/transfers/send";
 namespace OrthancPlugins
 {
   class OrthancPeers;
+  class PeerAnswer;
+  class PeersHandle;
+
+  typedef std::map<std::string, std::string>  HttpHeaders;
   
   enum BucketCompression
   {
@@ -76,6 +96,52 @@ namespace OrthancPlugins
 
   const char* EnumerationToString(BucketCompression compression);
 
+  // Same as the "Do*()" methods of "OrthancPeers", but also reports
+  // the HTTP status of the answer (0 if the peer cannot be reached).
+  // Returns "true" iff the HTTP status is 200 or 206. The query is
+  // sent by the native HTTP client if it is enabled and knows the peer.
+  bool CallPeer(PeerAnswer& answer,
+                uint16_t& httpStatus,
+                const OrthancPeers& peers,
+                const std::string& peerName,
+                Orthanc::HttpMethod method,
+                const std::string& uri,
+                const HttpHeaders& headers,
+                const std::string& body);
+
+  // Same as above, but reuses the peers that were already resolved
+  // by the caller ("timeout" in seconds, 0 means the default one)
+  bool CallPeer(PeerAnswer& answer,
+                uint16_t& httpStatus,
+                const PeersHandle& handle,
+                const std::string& peerName,
+                Orthanc::HttpMethod method,
+                const std::string& uri,
+                const HttpHeaders& headers,
+                const std::string& body,
+                unsigned int timeout);
+
+  bool IsSuccessHttpStatus(uint16_t httpStatus);
+
+  // 4xx errors are permanent, except for timeouts and throttling
+  bool IsRetriableHttpStatus(uint16_t httpStatus);
+
+  // Exponential backoff with jitter: The delay doubles after each
+  // retry, up to 30 seconds, and is randomized by +/- 25% so that the
+  // threads of the plugin don't retry in lockstep
+  unsigned int ComputeRetryDelay(unsigned int retry,
+                                 unsigned int minimumDelayMS);
+
+  // Sleeps for "ComputeRetryDelay()" milliseconds
+  void WaitBeforeRetry(unsigned int retry,
+                       unsigned int minimumDelayMS);
+
+  bool DoGetPeer(Json::Value& answer,
+                 const OrthancPeers& peers,
+                 size_t peerIndex,
+                 const std::string& uri,
+                 unsigned int maxRetries);
+
   bool DoPostPeer(Json::Value& answer,
                   const OrthancPeers& peers,
                   size_t peerIndex,
@@ -94,4 +160,11 @@ namespace OrthancPlugins
                     size_t peerIndex,
                     const std::string& uri,
                     unsigned int maxRetries);
+
+  // Sends a GET request, and returns the HTTP status of the answer
+  // (0 if the peer cannot be reached, even after the retries)
+  uint16_t GetPeerStatus(const OrthancPeers& peers,
+                         size_t peerIndex,
+                         const std::string& uri,
+                         unsigned int maxRetries);
 }
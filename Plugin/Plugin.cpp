@@ -18,6 +18,7 @@
 
 #include "PluginContext.h"
 #include "../Framework/HttpQueries/DetectTransferPlugin.h"
+#include "../Framework/HttpQueries/NativeHttpClient.h"
 #include "../Framework/PullMode/PullJob.h"
 #include "../Framework/PushMode/PushJob.h"
 #include "../Framework/TransferScheduler.h"
@@ -31,6 +32,11 @@
 #include <Toolbox.h>
 
 
+// Work directories that were not modified for one week are considered
+// as abandoned when the plugin starts
+static const unsigned int STALE_WORK_DIRECTORY_AGE = 7 * 24 * 3600;  // In seconds
+
+
 static bool DisplayPerformanceWarning()
 {
   (void) DisplayPerformanceWarning;   // Disable warning about unused function
@@ -215,11 +221,64 @@ void LookupInstances(OrthancPluginRestOutput* output,
   {
     return;
   }
+
+  // The lookup of huge resources can be paginated with the "since"
+  // and "limit" GET arguments, so that the peer can read the pages
+  // in parallel, each within the HTTP timeout
+  bool isPaginated = false;
+  size_t since = 0;
+  size_t limit = 0;
+  std::string token;
+
+  for (uint32_t i = 0; i < request->getCount; i++)
+  {
+    std::string key(request->getKeys[i]);
+
+    if (key == "since")
+    {
+      since = ReadSizeArgument(request, i);
+      isPaginated = true;
+    }
+    else if (key == "limit")
+    {
+      limit = ReadSizeArgument(request, i);
+      isPaginated = true;
+    }
+    else if (key == "token")
+    {
+      // Identifies the pages of one lookup
+      token = request->getValues[i];
+    }
+    else
+    {
+      LOG(INFO) << "Ignored GET argument: " << key;
+    }
+  }
   
   OrthancPlugins::TransferScheduler scheduler;
-  scheduler.ParseListOfResources(context.GetCache(), resources);
-
   Json::Value answer = Json::objectValue;
+
+  if (isPaginated)
+  {
+    // The resources are only expanded once for all the pages
+    std::vector<std::string> instances;
+    context.GetExpandedResourcesCache().Expand(instances, resources, token);
+
+    std::vector<std::string> page;
+    OrthancPlugins::TransferScheduler::ExtractPage(page, instances, since, limit);
+
+    for (size_t i = 0; i < page.size(); i++)
+    {
+      scheduler.AddInstance(context.GetCache(), page[i]);
+    }
+
+    answer[KEY_TOTAL_INSTANCES] = static_cast<uint32_t>(instances.size());
+  }
+  else
+  {
+    scheduler.ParseListOfResources(context.GetCache(), resources);
+  }
+
   answer[KEY_INSTANCES] = Json::arrayValue;
   answer[KEY_ORIGINATOR_UUID] = context.GetPluginUuid();
   answer["CountInstances"] = static_cast<uint32_t>(scheduler.GetInstancesCount());
@@ -273,9 +332,14 @@ void SchedulePull(OrthancPluginRestOutput* output,
 
   OrthancPlugins::TransferQuery query(body);
 
-  SubmitJob(output, new OrthancPlugins::PullJob(query, context.GetThreadsCount(),
+  SubmitJob(output, new OrthancPlugins::PullJob(query,
+                                                context.GetTemporaryStorage(),
+                                                context.GetHttpQueriesPool(),
                                                 context.GetTargetBucketSize(),
-                                                context.GetMaxHttpRetries()),
+                                                context.GetMaxHttpRetries(),
+                                                context.GetCommitThreadsCount(),
+                                                context.GetCommitBatchSize(),
+                                                context.IsStreamingCommit()),
             query.GetPriority());
 }
 
@@ -324,9 +388,22 @@ void CreatePush(OrthancPluginRestOutput* output,
 
   OrthancPlugins::BucketCompression compression =
     OrthancPlugins::StringToBucketCompression(query[KEY_COMPRESSION].asString());
+
+  // The instances are only imported before the commit of the
+  // transaction if the sender explicitly accepts it
+  bool streamingCommit = false;
+  if (query.isMember(KEY_STREAMING_COMMIT))
+  {
+    if (query[KEY_STREAMING_COMMIT].type() != Json::booleanValue)
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_BadFileFormat);
+    }
+
+    streamingCommit = query[KEY_STREAMING_COMMIT].asBool();
+  }
                                               
   std::string id = context.GetActivePushTransactions().CreateTransaction
-    (instances, buckets, compression);
+    (instances, buckets, compression, streamingCommit);
   
   Json::Value result = Json::objectValue;
   result[KEY_ID] = id;
@@ -395,25 +472,49 @@ void CommitPush(OrthancPluginRestOutput* output,
 }
 
 
-void DiscardPush(OrthancPluginRestOutput* output,
-                 const char* url,
-                 const OrthancPluginHttpRequest* request)
+void ServePushTransaction(OrthancPluginRestOutput* output,
+                          const char* url,
+                          const OrthancPluginHttpRequest* request)
 {
   OrthancPlugins::PluginContext& context = OrthancPlugins::PluginContext::GetInstance();
   
-  if (request->method != OrthancPluginHttpMethod_Delete)
+  if (request->method != OrthancPluginHttpMethod_Get &&
+      request->method != OrthancPluginHttpMethod_Delete)
   {
-    OrthancPluginSendMethodNotAllowed(OrthancPlugins::GetGlobalContext(), output, "DELETE");
+    OrthancPluginSendMethodNotAllowed(OrthancPlugins::GetGlobalContext(), output, "GET,DELETE");
     return;
   }
 
   assert(request->groupsCount == 1);
   std::string transaction(request->groups[0]);
 
-  context.
-    GetActivePushTransactions().Discard(transaction);
+  std::string s;
+
+  if (request->method == OrthancPluginHttpMethod_Get)
+  {
+    // Status of the transaction, used to resume an interrupted push job
+    std::vector<size_t> stored;
+    size_t bucketsCount;
+    context.GetActivePushTransactions().GetStoredBuckets(stored, bucketsCount, transaction);
+
+    Json::Value result = Json::objectValue;
+    result[KEY_ID] = transaction;
+    result[KEY_TOTAL_BUCKETS] = static_cast<unsigned int>(bucketsCount);
+    result[KEY_STORED_BUCKETS] = Json::arrayValue;
+
+    for (size_t i = 0; i < stored.size(); i++)
+    {
+      result[KEY_STORED_BUCKETS].append(static_cast<unsigned int>(stored[i]));
+    }
+
+    Orthanc::Toolbox::WriteFastJson(s, result);
+  }
+  else
+  {
+    context.GetActivePushTransactions().Discard(transaction);
+    s = "{}";
+  }
 
-  std::string s = "{}";
   OrthancPluginAnswerBuffer(OrthancPlugins::GetGlobalContext(), output, s.c_str(), s.size(), "application/json");
 }
 
@@ -436,10 +537,18 @@ void ScheduleSend(OrthancPluginRestOutput* output,
   OrthancPlugins::OrthancPeers peers;
   
   std::string remoteSelf;  // For pull mode
-  bool pullMode = peers.LookupUserProperty(remoteSelf, query.GetPeer(), KEY_REMOTE_SELF);
+  bool pullMode = (query.GetPeers().size() == 1 &&  // Sending to several peers is always a push
+                   peers.LookupUserProperty(remoteSelf, query.GetPeer(), KEY_REMOTE_SELF));
 
-  LOG(INFO) << "Sending resources to peer \"" << query.GetPeer() << "\" using "
-            << (pullMode ? "pull" : "push") << " mode";
+  if (query.GetPeers().size() == 1)
+  {
+    LOG(INFO) << "Sending resources to peer \"" << query.GetPeer() << "\" using "
+              << (pullMode ? "pull" : "push") << " mode";
+  }
+  else
+  {
+    LOG(INFO) << "Sending resources to " << query.GetPeers().size() << " peers using push mode";
+  }
 
   if (pullMode)
   {
@@ -480,7 +589,8 @@ void ScheduleSend(OrthancPluginRestOutput* output,
   else
   {
     SubmitJob(output, new OrthancPlugins::PushJob(query, context.GetCache(),
-                                                  context.GetThreadsCount(),
+                                                  context.GetHttpQueriesPool(),
+                                                  context.GetBodiesPreparer(),
                                                   context.GetTargetBucketSize(),
                                                   context.GetMaxHttpRetries()),
               query.GetPriority());
@@ -520,18 +630,44 @@ OrthancPluginJob* Unserializer(const char* jobType,
 
       if (type == JOB_TYPE_PULL)
       {
-        job.reset(new OrthancPlugins::PullJob(query,
-                                              context.GetThreadsCount(),
-                                              context.GetTargetBucketSize(),
-                                              context.GetMaxHttpRetries()));
+        std::unique_ptr<OrthancPlugins::PullJob> pull(
+          new OrthancPlugins::PullJob(query,
+                                      context.GetTemporaryStorage(),
+                                      context.GetHttpQueriesPool(),
+                                      context.GetTargetBucketSize(),
+                                      context.GetMaxHttpRetries(),
+                                      context.GetCommitThreadsCount(),
+                                      context.GetCommitBatchSize(),
+                                      context.IsStreamingCommit()));
+
+        if (source.isMember(KEY_WORK_DIRECTORY) &&
+            source[KEY_WORK_DIRECTORY].type() == Json::stringValue &&
+            context.GetTemporaryStorage().IsWorkDirectoryPath(source[KEY_WORK_DIRECTORY].asString()))
+        {
+          // Resume the transfer from the previously received files
+          pull->SetWorkDirectory(source[KEY_WORK_DIRECTORY].asString());
+        }
+
+        job.reset(pull.release());
       }
       else if (type == JOB_TYPE_PUSH)
       {
-        job.reset(new OrthancPlugins::PushJob(query,
-                                              context.GetCache(),
-                                              context.GetThreadsCount(),
-                                              context.GetTargetBucketSize(),
-                                              context.GetMaxHttpRetries()));
+        std::unique_ptr<OrthancPlugins::PushJob> push(
+          new OrthancPlugins::PushJob(query,
+                                      context.GetCache(),
+                                      context.GetHttpQueriesPool(),
+                                      context.GetBodiesPreparer(),
+                                      context.GetTargetBucketSize(),
+                                      context.GetMaxHttpRetries()));
+
+        if (source.isMember(KEY_TRANSACTIONS) &&
+            source[KEY_TRANSACTIONS].type() == Json::objectValue)
+        {
+          // Resume the transactions that are still active on the remote peers
+          push->SetPreviousTransactions(source[KEY_TRANSACTIONS]);
+        }
+
+        job.reset(push.release());
       }
 
       if (job.get() == NULL)
@@ -645,8 +781,19 @@ extern "C"
       size_t threadsCount = 4;
       size_t targetBucketSize = 4096;  // In KB
       size_t maxPushTransactions = 4;
+      unsigned int pushTransactionTimeout = 3600;  // In seconds
       size_t memoryCacheSize = 512;    // In MB
       unsigned int maxHttpRetries = 0;
+      unsigned int maxHttpRequeues = 3;
+      size_t inMemoryTransferSize = 64;  // In MB
+      size_t inMemoryTotalSize = 256;    // In MB
+      size_t maxDiskSize = 0;            // In MB, no quota by default
+      size_t commitThreadsCount = 4;
+      size_t commitBatchSize = 1;        // No ZIP batching by default
+      bool streamingCommit = false;
+      bool singleFileLayout = false;
+      bool nativeHttpClient = false;
+      std::string workDirectory;
     
       {
         OrthancPlugins::OrthancConfiguration config;
@@ -660,12 +807,69 @@ extern "C"
           targetBucketSize = plugin.GetUnsignedIntegerValue("BucketSize", targetBucketSize);
           memoryCacheSize = plugin.GetUnsignedIntegerValue("CacheSize", memoryCacheSize);
           maxPushTransactions = plugin.GetUnsignedIntegerValue("MaxPushTransactions", maxPushTransactions);
+          pushTransactionTimeout = plugin.GetUnsignedIntegerValue("PushTransactionTimeout", pushTransactionTimeout);
           maxHttpRetries = plugin.GetUnsignedIntegerValue("MaxHttpRetries", maxHttpRetries);
+          maxHttpRequeues = plugin.GetUnsignedIntegerValue("MaxHttpRequeues", maxHttpRequeues);
+          inMemoryTransferSize = plugin.GetUnsignedIntegerValue("InMemoryTransferSize", inMemoryTransferSize);
+          inMemoryTotalSize = plugin.GetUnsignedIntegerValue("InMemoryTotalSize", inMemoryTotalSize);
+          maxDiskSize = plugin.GetUnsignedIntegerValue("MaxDiskSize", maxDiskSize);
+          commitThreadsCount = plugin.GetUnsignedIntegerValue("CommitThreads", commitThreadsCount);
+          commitBatchSize = plugin.GetUnsignedIntegerValue("CommitBatchSize", commitBatchSize);
+          streamingCommit = plugin.GetBooleanValue("StreamingCommit", streamingCommit);
+          singleFileLayout = plugin.GetBooleanValue("SingleFileLayout", singleFileLayout);
+          nativeHttpClient = plugin.GetBooleanValue("NativeHttpClient", nativeHttpClient);
+          plugin.LookupStringValue(workDirectory, "WorkDirectory");
         }
       }
 
+      if (commitThreadsCount == 0)
+      {
+        commitThreadsCount = 1;
+      }
+
+      if (commitBatchSize == 0)
+      {
+        commitBatchSize = 1;
+      }
+      else if (commitBatchSize > 1 &&
+               !OrthancPlugins::CheckMinimalOrthancVersion(1, 8, 2))
+      {
+        LOG(WARNING) << "Importing ZIP archives requires Orthanc >= 1.8.2, "
+                     << "ignoring the \"CommitBatchSize\" option of the transfers accelerator";
+        commitBatchSize = 1;
+      }
+
       OrthancPlugins::PluginContext::Initialize(threadsCount, targetBucketSize * KB, maxPushTransactions,
-                                                memoryCacheSize * MB, maxHttpRetries);
+                                                memoryCacheSize * MB, maxHttpRetries,
+                                                inMemoryTransferSize * MB, inMemoryTotalSize * MB, maxDiskSize * MB,
+                                                commitThreadsCount, commitBatchSize, streamingCommit);
+
+      if (!workDirectory.empty())
+      {
+        OrthancPlugins::PluginContext::GetInstance().GetTemporaryStorage().SetDirectory(workDirectory);
+      }
+
+      OrthancPlugins::PluginContext::GetInstance().GetTemporaryStorage().SetSingleFileLayout(singleFileLayout);
+      OrthancPlugins::PluginContext::GetInstance().GetHttpQueriesPool().SetMaxRequeues(maxHttpRequeues);
+      OrthancPlugins::PluginContext::GetInstance().GetActivePushTransactions().SetTimeout(pushTransactionTimeout);
+
+      // The jobs of the previous execution are not unserialized yet:
+      // Only remove the work directories that were left for long
+      OrthancPlugins::PluginContext::GetInstance().GetTemporaryStorage().RemoveStaleFiles(STALE_WORK_DIRECTORY_AGE);
+
+      LOG(INFO) << "Transfers accelerator will keep the files of the pull jobs in: "
+                << OrthancPlugins::PluginContext::GetInstance().GetTemporaryStorage().GetDirectory();
+
+      if (singleFileLayout)
+      {
+        LOG(INFO) << "Transfers accelerator will store each transfer in one single file";
+      }
+
+      if (nativeHttpClient)
+      {
+        OrthancPlugins::OrthancConfiguration config;
+        OrthancPlugins::NativeHttpClient::GlobalInitialize(config.GetJson());
+      }
     
       OrthancPlugins::RegisterRestCallback<ServeChunks>
         (std::string(URI_CHUNKS) + "/([.0-9a-f-]+)", true);
@@ -694,7 +898,7 @@ extern "C"
         OrthancPlugins::RegisterRestCallback<CommitPush>
           (std::string(URI_PUSH) + "/([.0-9a-f-]+)/commit", true);
     
-        OrthancPlugins::RegisterRestCallback<DiscardPush>
+        OrthancPlugins::RegisterRestCallback<ServePushTransaction>
           (std::string(URI_PUSH) + "/([.0-9a-f-]+)", true);
       }
 
@@ -723,6 +927,7 @@ extern "C"
     try
     {
       OrthancPlugins::PluginContext::Finalize();
+      OrthancPlugins::NativeHttpClient::GlobalFinalize();
     }
     catch (Orthanc::OrthancException& e)
     {
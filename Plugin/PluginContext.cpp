@@ -21,25 +21,58 @@
 
 #include <Compatibility.h>  // For std::unique_ptr
 #include <Logging.h>
+#include <SystemToolbox.h>
 
 
 namespace OrthancPlugins
 {
+  // The expanded resources of a paginated lookup are kept for one
+  // minute after the last page was read, for at most 16 lookups
+  static const unsigned int LOOKUPS_CACHE_TTL = 60;  // In seconds
+  static const size_t LOOKUPS_CACHE_SIZE = 16;
+
+
+  static size_t GetPreparerThreadsCount(size_t threadsCount)
+  {
+    // Compressing the bodies is CPU-bound: Enough threads to feed the
+    // network threads, but no more than the number of cores
+    size_t count = std::min(static_cast<size_t>(Orthanc::SystemToolbox::GetHardwareConcurrency()),
+                            2 * threadsCount);
+    return std::max(static_cast<size_t>(1), count);
+  }
+
+
   PluginContext::PluginContext(size_t threadsCount,
                                size_t targetBucketSize,
                                size_t maxPushTransactions,
                                size_t memoryCacheSize,
-                               unsigned int maxHttpRetries) :
-    pushTransactions_(maxPushTransactions),
+                               unsigned int maxHttpRetries,
+                               size_t inMemoryTransferSize,
+                               size_t inMemoryTotalSize,
+                               size_t maxDiskSize,
+                               size_t commitThreadsCount,
+                               size_t commitBatchSize,
+                               bool streamingCommit) :
+    lookups_(LOOKUPS_CACHE_TTL, LOOKUPS_CACHE_SIZE),
+    pushTransactions_(maxPushTransactions, storage_, commitThreadsCount, commitBatchSize),
     semaphore_(threadsCount),
+    pool_(threadsCount),
+    preparer_(GetPreparerThreadsCount(threadsCount)),
     pluginUuid_(Orthanc::Toolbox::GenerateUuid()),
     threadsCount_(threadsCount),
     targetBucketSize_(targetBucketSize),
-    maxHttpRetries_(maxHttpRetries)
+    maxHttpRetries_(maxHttpRetries),
+    commitThreadsCount_(commitThreadsCount),
+    commitBatchSize_(commitBatchSize),
+    streamingCommit_(streamingCommit)
   {
     cache_.SetMaxMemorySize(memoryCacheSize);
+    storage_.SetMemoryLimits(inMemoryTransferSize, inMemoryTotalSize);
+    storage_.SetMaxDiskSize(maxDiskSize);
 
-    LOG(INFO) << "Transfers accelerator will use " << threadsCount_ << " thread(s) to run HTTP queries";
+    LOG(INFO) << "Transfers accelerator will use " << threadsCount_
+              << " thread(s) to run the HTTP queries of all the transfers, and "
+              << preparer_.GetThreadsCount() << " thread(s) to prepare their bodies";
     LOG(INFO) << "Transfers accelerator will use keep local DICOM files in a memory cache of size: "
               << OrthancPlugins::ConvertToMegabytes(memoryCacheSize) << " MB";
     LOG(INFO) << "Transfers accelerator will aim at HTTP queries of size: "
@@ -48,6 +81,33 @@ namespace OrthancPlugins
               << maxPushTransactions << " push transaction(s) at once";
     LOG(INFO) << "Transfers accelerator will retry "
               << maxHttpRetries_ << " time(s) if some HTTP query fails";
+    LOG(INFO) << "Transfers accelerator will receive transfers below "
+              << OrthancPlugins::ConvertToMegabytes(inMemoryTransferSize) << " MB in RAM (using at most "
+              << OrthancPlugins::ConvertToMegabytes(inMemoryTotalSize) << " MB)";
+
+    if (maxDiskSize == 0)
+    {
+      LOG(INFO) << "Transfers accelerator has no quota on its temporary files";
+    }
+    else
+    {
+      LOG(INFO) << "Transfers accelerator will use at most "
+                << OrthancPlugins::ConvertToMegabytes(maxDiskSize) << " MB of temporary files";
+    }
+
+    LOG(INFO) << "Transfers accelerator will use " << commitThreadsCount_
+              << " thread(s) to import the received instances into Orthanc";
+
+    if (commitBatchSize_ > 1)
+    {
+      LOG(INFO) << "Transfers accelerator will import the received instances by ZIP archives of "
+                << commitBatchSize_ << " instances";
+    }
+
+    if (streamingCommit_)
+    {
+      LOG(INFO) << "Transfers accelerator will import each pulled instance as soon as it is received";
+    }
   }
 
 
@@ -62,10 +122,18 @@ namespace OrthancPlugins
                                  size_t targetBucketSize,
                                  size_t maxPushTransactions,
                                  size_t memoryCacheSize,
-                                 unsigned int maxHttpRetries)
+                                 unsigned int maxHttpRetries,
+                                 size_t inMemoryTransferSize,
+                                 size_t inMemoryTotalSize,
+                                 size_t maxDiskSize,
+                                 size_t commitThreadsCount,
+                                 size_t commitBatchSize,
+                                 bool streamingCommit)
   {
     GetSingleton().reset(new PluginContext(threadsCount, targetBucketSize,
-                                           maxPushTransactions, memoryCacheSize, maxHttpRetries));
+                                           maxPushTransactions, memoryCacheSize, maxHttpRetries,
+                                           inMemoryTransferSize, inMemoryTotalSize, maxDiskSize,
+                                           commitThreadsCount, commitBatchSize, streamingCommit));
   }
 
   
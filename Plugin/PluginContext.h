@@ -19,8 +19,12 @@
 
 #pragma once
 
+#include "../Framework/ExpandedResourcesCache.h"
+#include "../Framework/HttpQueries/HttpBodiesPreparer.h"
+#include "../Framework/HttpQueries/HttpQueriesPool.h"
 #include "../Framework/OrthancInstancesCache.h"
 #include "../Framework/PushMode/ActivePushTransactions.h"
+#include "../Framework/TemporaryStorage.h"
 
 #include <Compatibility.h>  // For std::unique_ptr
 #include <MultiThreading/Semaphore.h>
@@ -34,20 +38,33 @@ namespace OrthancPlugins
   private:
     // Runtime structures
     OrthancInstancesCache    cache_;
+    ExpandedResourcesCache   lookups_;
+    TemporaryStorage         storage_;  // Must be declared before "pushTransactions_"
     ActivePushTransactions   pushTransactions_;
     Orthanc::Semaphore       semaphore_;
+    HttpQueriesPool          pool_;
+    HttpBodiesPreparer       preparer_;
     std::string              pluginUuid_;
 
     // Configuration
     size_t                   threadsCount_;
     size_t                   targetBucketSize_;
     unsigned int             maxHttpRetries_;
+    size_t                   commitThreadsCount_;
+    size_t                   commitBatchSize_;
+    bool                     streamingCommit_;
   
     PluginContext(size_t threadsCount,
                   size_t targetBucketSize,
                   size_t maxPushTransactions,
                   size_t memoryCacheSize,
-                  unsigned int maxHttpRetries);
+                  unsigned int maxHttpRetries,
+                  size_t inMemoryTransferSize,
+                  size_t inMemoryTotalSize,
+                  size_t maxDiskSize,
+                  size_t commitThreadsCount,
+                  size_t commitBatchSize,
+                  bool streamingCommit);
 
     static std::unique_ptr<PluginContext>& GetSingleton();
   
@@ -57,6 +74,16 @@ namespace OrthancPlugins
       return cache_;
     }
 
+    ExpandedResourcesCache& GetExpandedResourcesCache()
+    {
+      return lookups_;
+    }
+
+    TemporaryStorage& GetTemporaryStorage()
+    {
+      return storage_;
+    }
+
     ActivePushTransactions& GetActivePushTransactions()
     {
       return pushTransactions_;
@@ -67,6 +94,16 @@ namespace OrthancPlugins
       return semaphore_;
     }
 
+    HttpQueriesPool& GetHttpQueriesPool()
+    {
+      return pool_;
+    }
+
+    HttpBodiesPreparer& GetBodiesPreparer()
+    {
+      return preparer_;
+    }
+
     const std::string& GetPluginUuid() const
     {
       return pluginUuid_;
@@ -87,11 +124,32 @@ namespace OrthancPlugins
       return maxHttpRetries_;
     }
 
+    size_t GetCommitThreadsCount() const
+    {
+      return commitThreadsCount_;
+    }
+
+    size_t GetCommitBatchSize() const
+    {
+      return commitBatchSize_;
+    }
+
+    bool IsStreamingCommit() const
+    {
+      return streamingCommit_;
+    }
+
     static void Initialize(size_t threadsCount,
                            size_t targetBucketSize,
                            size_t maxPushTransactions,
                            size_t memoryCacheSize,
-                           unsigned int maxHttpRetries);
+                           unsigned int maxHttpRetries,
+                           size_t inMemoryTransferSize,
+                           size_t inMemoryTotalSize,
+                           size_t maxDiskSize,
+                           size_t commitThreadsCount,
+                           size_t commitBatchSize,
+                           bool streamingCommit);
   
     static PluginContext& GetInstance();
 
@@ -17,13 +17,42 @@
  **/
 
 
+#include "../Framework/ByteRanges.h"
 #include "../Framework/DownloadArea.h"
+#include "../Framework/ExpandedResourcesCache.h"
+#include "../Framework/FileRegionReader.h"
+#include "../Framework/HttpQueries/CircuitBreaker.h"
+#include "../Framework/HttpQueries/HttpBodiesPreparer.h"
+#include "../Framework/HttpQueries/HttpQueriesRunner.h"
+#include "../Framework/HttpQueries/NativeHttpClient.h"
+#include "../Framework/HttpQueries/PeerLimits.h"
+#include "../Framework/HttpQueries/QueriesStatistics.h"
+#include "../Framework/IncrementalMD5.h"
+#include "../Framework/PullMode/LookupPageQuery.h"
+#include "../Framework/PushMode/ActivePushTransactions.h"
+#include "../Framework/PushMode/PushBodiesCache.h"
+#include "../Framework/PushMode/PushJob.h"
+#include "../Framework/TransferQuery.h"
+#include "../Framework/TransferToolbox.h"
 
 #include <Compression/GzipCompressor.h>
 #include <Logging.h>
 #include <OrthancException.h>
+#include <SystemToolbox.h>
 #include <gtest/gtest.h>
 
+#include <boost/algorithm/string/predicate.hpp>
+#include <boost/filesystem.hpp>
+#include <boost/thread.hpp>
+#include <stdexcept>
+
+#if !defined(_WIN32)
+#  include <arpa/inet.h>
+#  include <netinet/in.h>
+#  include <sys/socket.h>
+#  include <unistd.h>
+#endif
+
 
 TEST(Toolbox, Enumerations)
 {
@@ -46,6 +75,523 @@ TEST(Toolbox, Conversions)
 }
 
 
+TEST(Toolbox, IncrementalMD5)
+{
+  std::string s;
+  for (size_t i = 0; i < 300; i++)
+  {
+    s.push_back(static_cast<char>(i * 7));
+  }
+
+  for (size_t size = 0; size < s.size(); size += 13)
+  {
+    std::string expected;
+    Orthanc::Toolbox::ComputeMD5(expected, s.substr(0, size));
+
+    OrthancPlugins::IncrementalMD5 md5;
+
+    size_t pos = 0;
+    for (size_t step = 1; pos < size; step += 5)
+    {
+      size_t count = std::min(step, size - pos);
+      md5.Append(s.c_str() + pos, count);
+      pos += count;
+    }
+
+    std::string actual;
+    md5.GetDigest(actual);
+    ASSERT_EQ(expected, actual);
+    ASSERT_EQ(size, md5.GetSize());
+  }
+
+  {
+    OrthancPlugins::IncrementalMD5 md5;
+    std::string actual;
+    md5.GetDigest(actual);
+    ASSERT_EQ("d41d8cd98f00b204e9800998ecf8427e", actual);
+
+    md5.Append("abc");
+    md5.GetDigest(actual);
+    ASSERT_EQ("900150983cd24fb0d6963f7d28e17f72", actual);
+  }
+}
+
+
+TEST(Toolbox, ByteRanges)
+{
+  OrthancPlugins::ByteRanges r;
+  ASSERT_EQ(0u, r.GetCoveredSize());
+  ASSERT_TRUE(r.IsCovered(10, 0));
+  ASSERT_FALSE(r.IsCovered(0, 1));
+
+  r.Add(10, 10);
+  r.Add(30, 10);
+  r.Add(5, 0);
+  ASSERT_EQ(2u, r.GetRangesCount());
+  ASSERT_EQ(20u, r.GetCoveredSize());
+  ASSERT_TRUE(r.IsCovered(10, 10));
+  ASSERT_TRUE(r.IsCovered(32, 5));
+  ASSERT_FALSE(r.IsCovered(15, 10));
+  ASSERT_FALSE(r.IsCovered(0, 15));
+
+  r.Add(12, 5);  // Already covered
+  ASSERT_EQ(2u, r.GetRangesCount());
+  ASSERT_EQ(20u, r.GetCoveredSize());
+
+  r.Add(20, 10);  // Fills the gap
+  ASSERT_EQ(1u, r.GetRangesCount());
+  ASSERT_EQ(30u, r.GetCoveredSize());
+  ASSERT_TRUE(r.IsCovered(10, 30));
+
+  r.Add(0, 50);  // Overlaps everything
+  ASSERT_EQ(1u, r.GetRangesCount());
+  ASSERT_EQ(50u, r.GetCoveredSize());
+
+  r.Add(60, 10);
+  r.Add(55, 10);
+  r.Add(45, 12);
+  ASSERT_EQ(1u, r.GetRangesCount());
+  ASSERT_EQ(70u, r.GetCoveredSize());
+
+  r.Clear();
+  ASSERT_EQ(0u, r.GetRangesCount());
+  ASSERT_EQ(0u, r.GetCoveredSize());
+}
+
+
+TEST(Toolbox, RetryPolicy)
+{
+  ASSERT_TRUE(OrthancPlugins::IsRetriableHttpStatus(0));  // Peer unreachable
+  ASSERT_TRUE(OrthancPlugins::IsRetriableHttpStatus(408));
+  ASSERT_TRUE(OrthancPlugins::IsRetriableHttpStatus(429));
+  ASSERT_TRUE(OrthancPlugins::IsRetriableHttpStatus(500));
+  ASSERT_TRUE(OrthancPlugins::IsRetriableHttpStatus(503));
+  ASSERT_FALSE(OrthancPlugins::IsRetriableHttpStatus(400));
+  ASSERT_FALSE(OrthancPlugins::IsRetriableHttpStatus(401));
+  ASSERT_FALSE(OrthancPlugins::IsRetriableHttpStatus(404));
+
+  // Backoff of 500ms doubled at each retry, +/- 25%, at most 30 seconds
+  for (unsigned int i = 0; i < 10; i++)
+  {
+    ASSERT_GE(OrthancPlugins::ComputeRetryDelay(0, 0), 375u);
+    ASSERT_LE(OrthancPlugins::ComputeRetryDelay(0, 0), 625u);
+    ASSERT_GE(OrthancPlugins::ComputeRetryDelay(2, 0), 1500u);
+    ASSERT_LE(OrthancPlugins::ComputeRetryDelay(2, 0), 2500u);
+    ASSERT_LE(OrthancPlugins::ComputeRetryDelay(100, 0), 37500u);
+    ASSERT_EQ(60000u, OrthancPlugins::ComputeRetryDelay(0, 60000));
+  }
+
+  OrthancPlugins::CircuitBreaker breaker;
+  ASSERT_THROW(breaker.SetFailuresThreshold(0), Orthanc::OrthancException);
+  breaker.SetFailuresThreshold(2);
+
+  ASSERT_FALSE(breaker.IsOpen("a"));
+  breaker.ReportFailure("a");
+  ASSERT_FALSE(breaker.IsOpen("a"));
+  breaker.ReportSuccess("a");
+  breaker.ReportFailure("a");
+  ASSERT_FALSE(breaker.IsOpen("a"));  // The success has reset the counter
+
+  breaker.ReportFailure("a");
+  ASSERT_TRUE(breaker.IsOpen("a"));
+  ASSERT_FALSE(breaker.IsOpen("b"));
+  ASSERT_GT(breaker.GetRemainingOpenTime("a"), 0u);
+  ASSERT_LE(breaker.GetRemainingOpenTime("a"), 1001u);
+  ASSERT_EQ(0u, breaker.GetRemainingOpenTime("b"));
+
+  breaker.ReportSuccess("a");
+  ASSERT_FALSE(breaker.IsOpen("a"));
+}
+
+
+TEST(Toolbox, PeerLimits)
+{
+  OrthancPlugins::TokenBucket unlimited(0);
+  OrthancPlugins::TokenBucket bucket(1000);  // 1000 bytes per second
+
+  const boost::posix_time::ptime start = boost::posix_time::microsec_clock::universal_time();
+
+  ASSERT_EQ(0u, unlimited.Consume(1000000, start));
+  ASSERT_EQ(0u, bucket.Consume(600, start));
+  ASSERT_EQ(0u, bucket.Consume(400, start));
+  ASSERT_EQ(501u, bucket.Consume(500, start));  // In debt by 500 bytes
+  ASSERT_EQ(251u, bucket.Consume(0, start + boost::posix_time::milliseconds(250)));
+  ASSERT_EQ(0u, bucket.Consume(400, start + boost::posix_time::milliseconds(1000)));
+
+  // The bucket never holds more than one second of traffic
+  ASSERT_EQ(0u, bucket.Consume(1000, start + boost::posix_time::seconds(100)));
+  ASSERT_LT(0u, bucket.Consume(100, start + boost::posix_time::seconds(100)));
+
+  bucket.SetRate(0);
+  ASSERT_EQ(0u, bucket.Consume(100000, start + boost::posix_time::seconds(100)));
+
+  OrthancPlugins::PeerLimits limits;
+  ASSERT_EQ(0u, limits.GetMaxConcurrentQueries("a"));
+  limits.Configure("a", 2, 0, 0);
+  ASSERT_EQ(2u, limits.GetMaxConcurrentQueries("a"));
+  ASSERT_EQ(0u, limits.GetMaxConcurrentQueries("b"));
+  limits.ReportUpload("a", 1000000);    // No rate limit
+  limits.ReportDownload("b", 1000000);  // Unknown peer
+  ASSERT_EQ(0u, limits.GetThrottleDelay("a"));
+  ASSERT_EQ(0u, limits.GetThrottleDelay("b"));
+
+  // The traffic is only accounted for, the peer is then throttled
+  limits.Configure("c", 0, 1000, 2000);
+  ASSERT_EQ(0u, limits.GetThrottleDelay("c"));
+  limits.ReportUpload("c", 1500);
+  ASSERT_GT(limits.GetThrottleDelay("c"), 1000u);
+  ASSERT_LE(limits.GetThrottleDelay("c"), 1501u);
+
+  limits.Configure("d", 0, 0, 1000);
+  limits.ReportDownload("d", 3000);
+  ASSERT_GT(limits.GetThrottleDelay("d"), 1500u);
+  ASSERT_EQ(0u, limits.GetThrottleDelay("a"));
+}
+
+
+TEST(Toolbox, QueriesStatistics)
+{
+  const boost::posix_time::ptime start = boost::posix_time::microsec_clock::universal_time();
+
+  OrthancPlugins::QueriesStatistics statistics(start);
+  ASSERT_FLOAT_EQ(0.0f, statistics.GetSpeed(5, start));
+  ASSERT_EQ(0u, statistics.GetLatencyPercentile(50));
+  ASSERT_THROW(statistics.GetSpeed(0, start), Orthanc::OrthancException);
+  ASSERT_THROW(statistics.GetSpeed(61, start), Orthanc::OrthancException);
+
+  for (unsigned int i = 1; i <= 100; i++)
+  {
+    statistics.AddQuery(1024, i, start);
+  }
+
+  // The window is shorter at the beginning of the transfer
+  ASSERT_FLOAT_EQ(100.0f, statistics.GetSpeed(5, start));
+  ASSERT_FLOAT_EQ(20.0f, statistics.GetSpeed(5, start + boost::posix_time::seconds(4)));
+  ASSERT_FLOAT_EQ(0.0f, statistics.GetSpeed(5, start + boost::posix_time::seconds(10)));
+  ASSERT_FLOAT_EQ(100.0f / 60.0f, statistics.GetSpeed(60, start + boost::posix_time::seconds(59)));
+
+  ASSERT_EQ(50u, statistics.GetLatencyPercentile(50));
+  ASSERT_EQ(95u, statistics.GetLatencyPercentile(95));
+  ASSERT_EQ(99u, statistics.GetLatencyPercentile(99));
+  ASSERT_EQ(100u, statistics.GetLatencyPercentile(100));
+
+  // Only the most recent latencies are kept
+  for (size_t i = 0; i < OrthancPlugins::QueriesStatistics::MAX_LATENCIES; i++)
+  {
+    statistics.AddQuery(0, 5, start + boost::posix_time::seconds(120));
+  }
+
+  ASSERT_EQ(5u, statistics.GetLatencyPercentile(99));
+  ASSERT_FLOAT_EQ(0.0f, statistics.GetSpeed(60, start + boost::posix_time::seconds(120)));
+
+  // Resetting a queue (e.g. when a job is resumed) forgets the
+  // previous queries
+  const boost::posix_time::ptime restart = start + boost::posix_time::seconds(130);
+  statistics.AddQuery(1024, 10, restart);
+  statistics.Reset(restart);
+  ASSERT_FLOAT_EQ(0.0f, statistics.GetSpeed(5, restart));
+  ASSERT_EQ(0u, statistics.GetLatencyPercentile(50));
+
+  statistics.AddQuery(1024, 7, restart);
+  ASSERT_FLOAT_EQ(1.0f, statistics.GetSpeed(5, restart));
+  ASSERT_EQ(7u, statistics.GetLatencyPercentile(100));
+}
+
+
+namespace
+{
+  // Source of bodies that are consumed by the test, at most "window"
+  // bodies ahead of the consumer
+  class BodiesSource : public OrthancPlugins::HttpBodiesPreparer::ISource
+  {
+  private:
+    boost::mutex  mutex_;
+    size_t        total_;
+    size_t        window_;
+    size_t        prepared_;
+    size_t        consumed_;
+
+  public:
+    BodiesSource(size_t total,
+                 size_t window) :
+      total_(total),
+      window_(window),
+      prepared_(0),
+      consumed_(0)
+    {
+    }
+
+    virtual bool PrepareOneBody()
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+
+      if (prepared_ == total_ ||
+          prepared_ >= consumed_ + window_)
+      {
+        return false;
+      }
+      else
+      {
+        prepared_++;
+        return true;
+      }
+    }
+
+    bool Consume()
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+
+      if (consumed_ < prepared_)
+      {
+        consumed_++;
+        return true;
+      }
+      else
+      {
+        return false;
+      }
+    }
+
+    size_t GetPrepared()
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+      return prepared_;
+    }
+
+    size_t GetConsumed()
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+      return consumed_;
+    }
+  };
+
+
+  void WaitPrepared(BodiesSource& source,
+                    size_t expected)
+  {
+    for (unsigned int i = 0; i < 1000 && source.GetPrepared() != expected; i++)
+    {
+      boost::this_thread::sleep(boost::posix_time::milliseconds(10));
+    }
+  }
+
+
+  class ThrowingSource : public OrthancPlugins::HttpBodiesPreparer::ISource
+  {
+  private:
+    boost::mutex  mutex_;
+    size_t        calls_;
+
+  public:
+    ThrowingSource() :
+      calls_(0)
+    {
+    }
+
+    virtual bool PrepareOneBody()
+    {
+      {
+        boost::mutex::scoped_lock lock(mutex_);
+        calls_++;
+      }
+
+      throw std::runtime_error("Not an Orthanc exception");
+    }
+
+    size_t GetCalls()
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+      return calls_;
+    }
+  };
+}
+
+
+TEST(HttpBodiesPreparer, Basic)
+{
+  using namespace OrthancPlugins;
+
+  ASSERT_THROW(HttpBodiesPreparer(0), Orthanc::OrthancException);
+
+  HttpBodiesPreparer preparer(2);
+  ASSERT_EQ(2u, preparer.GetThreadsCount());
+
+  BodiesSource a(50, 4);
+  BodiesSource b(3, 4);
+  BodiesSource c(10, 4);
+
+  // The sources of all the transfers share the same threads, and
+  // never get more bodies than their window
+  preparer.Register(a);
+  preparer.Register(b);
+  WaitPrepared(a, 4);
+  WaitPrepared(b, 3);
+  ASSERT_EQ(4u, a.GetPrepared());
+  ASSERT_EQ(3u, b.GetPrepared());
+
+  // Consuming a body wakes the preparer up (the timeout of the
+  // safety net is 100ms, this takes much less than 5 seconds)
+  const boost::posix_time::ptime start = boost::posix_time::microsec_clock::universal_time();
+
+  while (a.GetConsumed() < 50)
+  {
+    if (a.Consume())
+    {
+      preparer.Wake(a);
+    }
+    else
+    {
+      boost::this_thread::sleep(boost::posix_time::milliseconds(1));
+    }
+  }
+
+  ASSERT_EQ(50u, a.GetPrepared());
+  ASSERT_LT((boost::posix_time::microsec_clock::universal_time() - start).total_milliseconds(), 5000);
+
+  preparer.Unregister(a);
+  ASSERT_THROW(preparer.Unregister(a), Orthanc::OrthancException);
+  preparer.Wake(a);  // No effect once unregistered
+
+  // A source that is not registered is never prepared
+  boost::this_thread::sleep(boost::posix_time::milliseconds(200));
+  ASSERT_EQ(0u, c.GetPrepared());
+
+  preparer.Register(c);
+  WaitPrepared(c, 4);
+  ASSERT_EQ(4u, c.GetPrepared());
+
+  preparer.Unregister(b);
+  preparer.Unregister(c);
+}
+
+
+TEST(HttpBodiesPreparer, Exceptions)
+{
+  using namespace OrthancPlugins;
+
+  HttpBodiesPreparer preparer(1);
+
+  // A source that throws a native exception is considered as idle,
+  // and doesn't stop the threads that are shared with the others
+  ThrowingSource failing;
+  preparer.Register(failing);
+
+  for (unsigned int i = 0; i < 1000 && failing.GetCalls() == 0; i++)
+  {
+    boost::this_thread::sleep(boost::posix_time::milliseconds(10));
+  }
+
+  ASSERT_LT(0u, failing.GetCalls());
+
+  BodiesSource source(3, 4);
+  preparer.Register(source);
+  WaitPrepared(source, 3);
+  ASSERT_EQ(3u, source.GetPrepared());
+
+  preparer.Unregister(failing);
+  preparer.Unregister(source);
+}
+
+
+TEST(TransferQuery, Mirrors)
+{
+  Json::Value body = Json::objectValue;
+  body[KEY_PEER] = "a";
+  body[KEY_RESOURCES] = Json::arrayValue;
+  body[KEY_COMPRESSION] = "none";
+
+  {
+    OrthancPlugins::TransferQuery query(body);
+    ASSERT_TRUE(query.GetMirrors().empty());
+  }
+
+  body[KEY_MIRRORS] = Json::arrayValue;
+  body[KEY_MIRRORS].append("b");
+  body[KEY_MIRRORS].append("a");  // Same as the main peer, ignored
+  body[KEY_MIRRORS].append("c");
+  body[KEY_MIRRORS].append("b");
+
+  Json::Value serialized;
+
+  {
+    OrthancPlugins::TransferQuery query(body);
+    ASSERT_EQ(2u, query.GetMirrors().size());
+    ASSERT_EQ("b", query.GetMirrors() [0]);
+    ASSERT_EQ("c", query.GetMirrors() [1]);
+    query.Serialize(serialized);
+  }
+
+  {
+    OrthancPlugins::TransferQuery query(serialized);
+    ASSERT_EQ("a", query.GetPeer());
+    ASSERT_EQ(2u, query.GetMirrors().size());
+  }
+
+  body[KEY_MIRRORS] = "b";
+  ASSERT_THROW(OrthancPlugins::TransferQuery query(body), Orthanc::OrthancException);
+}
+
+TEST(TransferQuery, StreamingCommit)
+{
+  Json::Value body = Json::objectValue;
+  body[KEY_PEER] = "a";
+  body[KEY_RESOURCES] = Json::arrayValue;
+  body[KEY_COMPRESSION] = "none";
+
+  {
+    // Push transactions are never streamed by default
+    OrthancPlugins::TransferQuery query(body);
+    ASSERT_FALSE(query.IsStreamingCommit());
+
+    Json::Value serialized;
+    query.Serialize(serialized);
+    ASSERT_FALSE(serialized.isMember(KEY_STREAMING_COMMIT));
+  }
+
+  body[KEY_STREAMING_COMMIT] = true;
+
+  {
+    OrthancPlugins::TransferQuery query(body);
+    ASSERT_TRUE(query.IsStreamingCommit());
+
+    Json::Value serialized;
+    query.Serialize(serialized);
+    ASSERT_TRUE(OrthancPlugins::TransferQuery(serialized).IsStreamingCommit());
+  }
+
+  body[KEY_STREAMING_COMMIT] = "true";
+  ASSERT_THROW(OrthancPlugins::TransferQuery query(body), Orthanc::OrthancException);
+}
+
+TEST(TransferQuery, SeveralPeers)
+{
+  Json::Value body = Json::objectValue;
+  body[KEY_PEER] = Json::arrayValue;
+  body[KEY_PEER].append("a");
+  body[KEY_PEER].append("b");
+  body[KEY_PEER].append("a");
+  body[KEY_RESOURCES] = Json::arrayValue;
+  body[KEY_COMPRESSION] = "gzip";
+
+  Json::Value serialized;
+
+  {
+    OrthancPlugins::TransferQuery query(body);
+    ASSERT_EQ("a", query.GetPeer());
+    ASSERT_EQ(2u, query.GetPeers().size());
+    ASSERT_EQ("b", query.GetPeers() [1]);
+    query.Serialize(serialized);
+  }
+
+  {
+    OrthancPlugins::TransferQuery query(serialized);
+    ASSERT_EQ(2u, query.GetPeers().size());
+  }
+
+  body[KEY_PEER] = Json::arrayValue;
+  ASSERT_THROW(OrthancPlugins::TransferQuery query(body), Orthanc::OrthancException);
+}
+
 TEST(TransferBucket, Basic)
 {  
   using namespace OrthancPlugins;
@@ -270,6 +816,40 @@ TEST(TransferScheduler, Basic)
 
 
 
+TEST(TransferScheduler, StoredInstances)
+{  
+  using namespace OrthancPlugins;
+
+  TransferScheduler s;
+  s.AddInstance(DicomInstanceInfo("d1", 10, "md1"));
+  s.AddInstance(DicomInstanceInfo("d2", 20, "md2"));
+  s.AddInstance(DicomInstanceInfo("d3", 30, "md3"));
+  s.AddInstance(DicomInstanceInfo("d4", 40, "md4"));
+
+  std::map<std::string, std::string> stored;
+  stored["d1"] = "md1";
+  stored["d2"] = "other";  // Another version of the instance is stored
+  stored["d4"] = "md4";
+  stored["d5"] = "md5";    // Not part of the transfer
+
+  size_t removedSize;
+  ASSERT_EQ(2u, s.RemoveInstances(removedSize, stored));
+  ASSERT_EQ(50u, removedSize);
+  ASSERT_EQ(2u, s.GetInstancesCount());
+  ASSERT_EQ(50u, s.GetTotalSize());
+
+  std::vector<DicomInstanceInfo> i;
+  s.ListInstances(i);
+  ASSERT_EQ(2u, i.size());
+  ASSERT_EQ("d2", i[0].GetId());
+  ASSERT_EQ("d3", i[1].GetId());
+
+  ASSERT_EQ(0u, s.RemoveInstances(removedSize, stored));
+  ASSERT_EQ(0u, removedSize);
+  ASSERT_EQ(2u, s.GetInstancesCount());
+}
+
+
 TEST(TransferScheduler, Grouping)
 {  
   using namespace OrthancPlugins;
@@ -370,6 +950,187 @@ TEST(TransferScheduler, Splitting)
 }
 
 
+TEST(TransferScheduler, Pagination)
+{
+  std::vector<std::string> instances;
+  for (size_t i = 0; i < 5; i++)
+  {
+    instances.push_back("i" + boost::lexical_cast<std::string>(i));
+  }
+
+  std::vector<std::string> page;
+  OrthancPlugins::TransferScheduler::ExtractPage(page, instances, 0, 2);
+  ASSERT_EQ(2u, page.size());
+  ASSERT_EQ("i0", page[0]);
+  ASSERT_EQ("i1", page[1]);
+
+  OrthancPlugins::TransferScheduler::ExtractPage(page, instances, 4, 2);
+  ASSERT_EQ(1u, page.size());
+  ASSERT_EQ("i4", page[0]);
+
+  OrthancPlugins::TransferScheduler::ExtractPage(page, instances, 5, 2);
+  ASSERT_TRUE(page.empty());
+
+  OrthancPlugins::TransferScheduler::ExtractPage(page, instances, 1, 0);  // No limit
+  ASSERT_EQ(4u, page.size());
+  ASSERT_EQ("i1", page[0]);
+
+  OrthancPlugins::TransferScheduler::ExtractPage(page, instances, 2, std::numeric_limits<size_t>::max());
+  ASSERT_EQ(3u, page.size());
+}
+
+
+TEST(TransferScheduler, ExpandedResourcesCache)
+{
+  OrthancPlugins::ExpandedResourcesCache cache(60, 2);
+
+  Json::Value resources = Json::arrayValue;
+  resources.append(Json::objectValue);
+  resources[0]["Level"] = "Study";
+  resources[0]["ID"] = "study";
+
+  // The pages of different lookups of the same resources are kept apart
+  const std::string a = OrthancPlugins::ExpandedResourcesCache::GetKey(resources, "a");
+  const std::string b = OrthancPlugins::ExpandedResourcesCache::GetKey(resources, "b");
+  const std::string c = OrthancPlugins::ExpandedResourcesCache::GetKey(resources, "c");
+  ASSERT_NE(a, b);
+
+  const boost::posix_time::ptime now = boost::posix_time::microsec_clock::universal_time();
+
+  std::vector<std::string> instances, found;
+  instances.push_back("i0");
+  instances.push_back("i1");
+
+  ASSERT_FALSE(cache.Lookup(found, a, now));
+  cache.Store(a, instances, now);
+  ASSERT_TRUE(cache.Lookup(found, a, now + boost::posix_time::seconds(30)));
+  ASSERT_EQ(2u, found.size());
+  ASSERT_EQ("i1", found[1]);
+
+  // Reading a page postpones the expiration
+  ASSERT_TRUE(cache.Lookup(found, a, now + boost::posix_time::seconds(80)));
+
+  // The least recently used lookup is dropped if the cache is full
+  cache.Store(b, instances, now + boost::posix_time::seconds(81));
+  ASSERT_EQ(2u, cache.GetSize());
+  ASSERT_TRUE(cache.Lookup(found, a, now + boost::posix_time::seconds(82)));
+  cache.Store(c, instances, now + boost::posix_time::seconds(83));
+  ASSERT_EQ(2u, cache.GetSize());
+  ASSERT_FALSE(cache.Lookup(found, b, now + boost::posix_time::seconds(84)));
+  ASSERT_TRUE(cache.Lookup(found, a, now + boost::posix_time::seconds(84)));
+
+  // The lookups that are not read anymore expire
+  ASSERT_FALSE(cache.Lookup(found, c, now + boost::posix_time::seconds(200)));
+  ASSERT_EQ(0u, cache.GetSize());
+}
+
+
+TEST(TransferScheduler, LookupPages)
+{
+  std::vector<OrthancPlugins::DicomInstanceInfo> instances;
+  size_t total;
+  std::string originator;
+
+  Json::Value page = Json::objectValue;
+  page["Instances"] = Json::arrayValue;
+  page["Originator"] = "uuid";
+
+  for (size_t i = 0; i < 3; i++)
+  {
+    Json::Value instance;
+    OrthancPlugins::DicomInstanceInfo("i" + boost::lexical_cast<std::string>(i), 10 * i, "md5").Serialize(instance);
+    page["Instances"].append(instance);
+  }
+
+  // Older peers ignore "since" and "limit", and answer with all the
+  // instances without "TotalInstances"
+  ASSERT_TRUE(OrthancPlugins::LookupPageQuery::ParsePage(instances, total, originator, page));
+  ASSERT_EQ(3u, instances.size());
+  ASSERT_EQ("i2", instances[2].GetId());
+  ASSERT_EQ(20u, instances[2].GetSize());
+  ASSERT_EQ(0u, total);
+  ASSERT_EQ("uuid", originator);
+
+  page["TotalInstances"] = 2500;
+  ASSERT_TRUE(OrthancPlugins::LookupPageQuery::ParsePage(instances, total, originator, page));
+  ASSERT_EQ(2500u, total);
+
+  // A page must be checked against the first page of its lookup
+  std::vector<OrthancPlugins::DicomInstanceInfo> target;
+  std::string s;
+  Orthanc::Toolbox::WriteFastJson(s, page);
+
+  {
+    OrthancPlugins::LookupPageQuery query(target, "peer", "[]", 1000, 1000, 2500, "uuid", "token");
+    ASSERT_NE(std::string::npos, query.GetUri().find("since=1000&limit=1000&token=token"));
+    query.HandleAnswer(s.c_str(), s.size());
+    ASSERT_EQ(3u, target.size());
+  }
+
+  {
+    OrthancPlugins::LookupPageQuery query(target, "peer", "[]", 1000, 1000, 3000, "uuid", "token");
+    ASSERT_THROW(query.HandleAnswer(s.c_str(), s.size()), Orthanc::OrthancException);
+  }
+
+  {
+    OrthancPlugins::LookupPageQuery query(target, "peer", "[]", 1000, 1000, 2500, "other", "token");
+    ASSERT_THROW(query.HandleAnswer(s.c_str(), s.size()), Orthanc::OrthancException);
+  }
+
+  {
+    // The pages of the mirrors are not checked
+    OrthancPlugins::LookupPageQuery query(target, "peer", "[]", 1000, 1000, 0, "", "token");
+    query.HandleAnswer(s.c_str(), s.size());
+  }
+
+  page["TotalInstances"] = "nope";
+  ASSERT_FALSE(OrthancPlugins::LookupPageQuery::ParsePage(instances, total, originator, page));
+  page.removeMember("Originator");
+  ASSERT_FALSE(OrthancPlugins::LookupPageQuery::ParsePage(instances, total, originator, page));
+}
+
+TEST(Toolbox, FileRegionReader)
+{
+  using namespace OrthancPlugins;
+
+  // Larger than one page, so that the offset of the mapping is padded
+  std::string content;
+  content.resize(3 * 4096 + 17);
+  for (size_t i = 0; i < content.size(); i++)
+  {
+    content[i] = static_cast<char>(i % 251);
+  }
+
+  Orthanc::TemporaryFile file;
+  file.Write(content);
+
+  {
+    FileRegionReader reader(file.GetPath(), 0, content.size());
+    ASSERT_EQ(content.size(), reader.GetSize());
+    ASSERT_EQ(0, memcmp(content.c_str(), reader.GetData(), content.size()));
+
+#if !defined(_WIN32)
+    // The content is not copied into the heap (e.g. ZIP archives to be imported)
+    ASSERT_TRUE(reader.IsMapped());
+#endif
+  }
+
+  {
+    FileRegionReader reader(file.GetPath(), 4097, 5000);
+    ASSERT_EQ(5000u, reader.GetSize());
+    ASSERT_EQ(0, memcmp(content.c_str() + 4097, reader.GetData(), 5000));
+  }
+
+  {
+    FileRegionReader reader(file.GetPath(), 10, 0);
+    ASSERT_EQ(0u, reader.GetSize());
+    ASSERT_FALSE(reader.IsMapped());
+  }
+
+  ASSERT_THROW(FileRegionReader("/nonexistent", 0, 10), Orthanc::OrthancException);
+}
+
+
 TEST(DownloadArea, Basic)
 {
   using namespace OrthancPlugins;
@@ -429,6 +1190,1737 @@ TEST(DownloadArea, Basic)
 }
 
 
+TEST(ActivePushTransactions, StoredBuckets)
+{
+  using namespace OrthancPlugins;
+
+  std::string s = "Hello, World!";
+
+  std::string md5;
+  Orthanc::Toolbox::ComputeMD5(md5, s);
+
+  std::vector<DicomInstanceInfo> instances;
+  instances.push_back(DicomInstanceInfo("d1", s.size(), md5));
+
+  std::vector<TransferBucket> buckets;
+  buckets.resize(3);
+  buckets[0].AddChunk(instances[0], 0, 5);
+  buckets[1].AddChunk(instances[0], 5, 4);
+  buckets[2].AddChunk(instances[0], 9, 4);
+
+  TemporaryStorage storage;
+  ActivePushTransactions transactions(2, storage, 1, 1);
+
+  std::string id = transactions.CreateTransaction(instances, buckets, BucketCompression_None, false);
+
+  std::vector<size_t> stored;
+  size_t count;
+  transactions.GetStoredBuckets(stored, count, id);
+  ASSERT_EQ(3u, count);
+  ASSERT_TRUE(stored.empty());
+
+  transactions.Store(id, 2, s.c_str() + 9, 4);
+  transactions.Store(id, 0, s.c_str(), 5);
+  ASSERT_THROW(transactions.Store(id, 3, s.c_str(), 5), Orthanc::OrthancException);
+
+  transactions.GetStoredBuckets(stored, count, id);
+  ASSERT_EQ(2u, stored.size());
+  ASSERT_EQ(0u, stored[0]);
+  ASSERT_EQ(2u, stored[1]);
+
+  transactions.Discard(id);
+  ASSERT_THROW(transactions.GetStoredBuckets(stored, count, id), Orthanc::OrthancException);
+}
+
+
+TEST(PushJob, PreviousTransactions)
+{
+  using namespace OrthancPlugins;
+
+  Json::Value transactions = Json::objectValue;
+  transactions["a"][KEY_PATH] = "/transfers/push/1";
+  transactions["a"][KEY_CONTENT_MD5] = "md5";
+  transactions["b"][KEY_PATH] = "/transfers/push/2";
+  transactions["b"][KEY_CONTENT_MD5] = "md5";
+  transactions["b"][KEY_COMMITTED] = true;
+  transactions["c"][KEY_PATH] = "/transfers/push/3";
+  transactions["c"][KEY_CONTENT_MD5] = "other";
+  transactions["d"] = "nope";
+
+  std::string uri;
+  bool isCommitted;
+  ASSERT_TRUE(PushJob::LookupPreviousTransaction(uri, isCommitted, transactions, "a", "md5"));
+  ASSERT_EQ("/transfers/push/1", uri);
+  ASSERT_FALSE(isCommitted);
+
+  ASSERT_TRUE(PushJob::LookupPreviousTransaction(uri, isCommitted, transactions, "b", "md5"));
+  ASSERT_EQ("/transfers/push/2", uri);
+  ASSERT_TRUE(isCommitted);
+
+  // The content of the job has changed since the transaction was opened
+  ASSERT_FALSE(PushJob::LookupPreviousTransaction(uri, isCommitted, transactions, "a", "other"));
+  ASSERT_FALSE(PushJob::LookupPreviousTransaction(uri, isCommitted, transactions, "c", "md5"));
+  ASSERT_FALSE(PushJob::LookupPreviousTransaction(uri, isCommitted, transactions, "d", "md5"));
+  ASSERT_FALSE(PushJob::LookupPreviousTransaction(uri, isCommitted, transactions, "e", "md5"));
+  ASSERT_FALSE(PushJob::LookupPreviousTransaction(uri, isCommitted, Json::nullValue, "a", "md5"));
+}
+
+
+TEST(PushJob, StoredBuckets)
+{
+  using namespace OrthancPlugins;
+
+  Json::Value answer = Json::objectValue;
+  answer[KEY_TOTAL_BUCKETS] = 4;
+  answer[KEY_STORED_BUCKETS] = Json::arrayValue;
+  answer[KEY_STORED_BUCKETS].append(3);
+  answer[KEY_STORED_BUCKETS].append(0);
+  answer[KEY_STORED_BUCKETS].append(4);    // Out of range, ignored
+  answer[KEY_STORED_BUCKETS].append(-1);   // Ignored
+  answer[KEY_STORED_BUCKETS].append("1");  // Ignored
+
+  std::vector<size_t> stored;
+  ASSERT_TRUE(PushJob::ParseStoredBuckets(stored, answer, 4));
+  ASSERT_EQ(2u, stored.size());
+  ASSERT_EQ(3u, stored[0]);
+  ASSERT_EQ(0u, stored[1]);
+
+  // The transaction was created for other buckets
+  ASSERT_FALSE(PushJob::ParseStoredBuckets(stored, answer, 5));
+
+  answer[KEY_STORED_BUCKETS] = Json::arrayValue;
+  ASSERT_TRUE(PushJob::ParseStoredBuckets(stored, answer, 4));
+  ASSERT_TRUE(stored.empty());
+
+  answer.removeMember(KEY_STORED_BUCKETS);
+  ASSERT_FALSE(PushJob::ParseStoredBuckets(stored, answer, 4));
+  ASSERT_FALSE(PushJob::ParseStoredBuckets(stored, Json::arrayValue, 4));
+}
+
+
+TEST(PushJob, Progress)
+{
+  using namespace OrthancPlugins;
+
+  // 8 buckets, plus the creation and the commit of the transactions
+  ASSERT_FLOAT_EQ(1.0f / 10.0f, PushJob::ComputeProgress(0, 0, 1, 8));
+  ASSERT_FLOAT_EQ(5.0f / 10.0f, PushJob::ComputeProgress(4, 0, 1, 8));
+  ASSERT_FLOAT_EQ(9.0f / 10.0f, PushJob::ComputeProgress(8, 0, 1, 8));
+
+  // The resumed buckets count as sent
+  ASSERT_FLOAT_EQ(5.0f / 10.0f, PushJob::ComputeProgress(0, 4, 1, 8));
+  ASSERT_FLOAT_EQ(9.0f / 10.0f, PushJob::ComputeProgress(2, 6, 1, 8));
+
+  // Fan-out to 2 destinations, one of which was resumed
+  ASSERT_FLOAT_EQ(5.0f / 10.0f, PushJob::ComputeProgress(4, 4, 2, 8));
+  ASSERT_FLOAT_EQ(9.0f / 10.0f, PushJob::ComputeProgress(12, 4, 2, 8));
+
+  ASSERT_FLOAT_EQ(1.0f / 2.0f, PushJob::ComputeProgress(0, 0, 0, 0));
+}
+
+
+static void StorePushWorker(OrthancPlugins::ActivePushTransactions* transactions,
+                            const std::vector<std::string>* ids,
+                            const std::vector<OrthancPlugins::TransferBucket>* buckets,
+                            const std::string* content,
+                            size_t start,
+                            size_t step)
+{
+  for (size_t i = start; i < buckets->size(); i += step)
+  {
+    const OrthancPlugins::TransferBucket& bucket = (*buckets)[i];
+
+    for (size_t j = 0; j < ids->size(); j++)
+    {
+      transactions->Store((*ids) [j], i, content->c_str() + bucket.GetChunkOffset(0), bucket.GetTotalSize());
+    }
+  }
+}
+
+
+TEST(ActivePushTransactions, Concurrent)
+{
+  using namespace OrthancPlugins;
+
+  std::string content;
+  content.resize(100000);
+  for (size_t i = 0; i < content.size(); i++)
+  {
+    content[i] = static_cast<char>(i % 251);
+  }
+
+  std::string md5;
+  Orthanc::Toolbox::ComputeMD5(md5, content);
+
+  std::vector<DicomInstanceInfo> instances;
+  instances.push_back(DicomInstanceInfo("d1", content.size(), md5));
+
+  std::vector<TransferBucket> buckets;
+  for (size_t offset = 0; offset < content.size(); offset += 1000)
+  {
+    TransferBucket b;
+    b.AddChunk(instances[0], offset, 1000);
+    buckets.push_back(b);
+  }
+
+  TemporaryStorage storage;
+  ActivePushTransactions transactions(2, storage, 1, 1);
+
+  std::vector<std::string> ids;
+  ids.push_back(transactions.CreateTransaction(instances, buckets, BucketCompression_None, false));
+  ids.push_back(transactions.CreateTransaction(instances, buckets, BucketCompression_None, false));
+
+  // The buckets of both transactions are written in parallel
+  static const size_t THREADS = 8;
+  std::vector<boost::thread*> threads;
+
+  for (size_t i = 0; i < THREADS; i++)
+  {
+    threads.push_back(new boost::thread(StorePushWorker, &transactions, &ids, &buckets, &content, i, THREADS));
+  }
+
+  for (size_t i = 0; i < THREADS; i++)
+  {
+    threads[i]->join();
+    delete threads[i];
+  }
+
+  for (size_t i = 0; i < ids.size(); i++)
+  {
+    std::vector<size_t> stored;
+    size_t count;
+    transactions.GetStoredBuckets(stored, count, ids[i]);
+    ASSERT_EQ(buckets.size(), count);
+    ASSERT_EQ(buckets.size(), stored.size());
+    transactions.Discard(ids[i]);
+  }
+}
+
+
+static void StoreUntilCommitted(OrthancPlugins::ActivePushTransactions* transactions,
+                                const std::string* id,
+                                const std::vector<OrthancPlugins::TransferBucket>* buckets,
+                                const std::string* content,
+                                size_t* rejected)
+{
+  for (size_t i = 0; i < buckets->size(); i++)
+  {
+    const OrthancPlugins::TransferBucket& bucket = (*buckets)[i];
+
+    try
+    {
+      transactions->Store(*id, i, content->c_str() + bucket.GetChunkOffset(0), bucket.GetTotalSize());
+    }
+    catch (Orthanc::OrthancException& e)
+    {
+      // The transaction is being committed
+      ASSERT_EQ(Orthanc::ErrorCode_BadSequenceOfCalls, e.GetErrorCode());
+      (*rejected)++;
+    }
+  }
+}
+
+
+TEST(ActivePushTransactions, Lifecycle)
+{
+  using namespace OrthancPlugins;
+
+  std::string content;
+  content.resize(100000);
+  for (size_t i = 0; i < content.size(); i++)
+  {
+    content[i] = static_cast<char>(i % 251);
+  }
+
+  // The MD5 sum is wrong, so that the commits fail before reaching Orthanc
+  std::vector<DicomInstanceInfo> instances;
+  instances.push_back(DicomInstanceInfo("d1", content.size(), "nope"));
+
+  std::vector<TransferBucket> buckets;
+  for (size_t offset = 0; offset < content.size(); offset += 1000)
+  {
+    TransferBucket b;
+    b.AddChunk(instances[0], offset, 1000);
+    buckets.push_back(b);
+  }
+
+  TemporaryStorage storage;
+  ActivePushTransactions transactions(2, storage, 1, 1);
+
+  std::vector<std::string> listed;
+  std::vector<size_t> stored;
+  size_t count;
+
+  {
+    // Discarding
+    std::string id = transactions.CreateTransaction(instances, buckets, BucketCompression_None, false);
+    transactions.Store(id, 0, content.c_str(), 1000);
+    transactions.Discard(id);
+    ASSERT_THROW(transactions.Store(id, 1, content.c_str() + 1000, 1000), Orthanc::OrthancException);
+    ASSERT_THROW(transactions.Discard(id), Orthanc::OrthancException);
+    ASSERT_THROW(transactions.Commit(id), Orthanc::OrthancException);
+  }
+
+  {
+    // The least recently used transaction is dropped
+    std::string a = transactions.CreateTransaction(instances, buckets, BucketCompression_None, false);
+    std::string b = transactions.CreateTransaction(instances, buckets, BucketCompression_None, false);
+    transactions.GetStoredBuckets(stored, count, a);
+
+    std::string c = transactions.CreateTransaction(instances, buckets, BucketCompression_None, false);
+    transactions.ListTransactions(listed);
+    ASSERT_EQ(2u, listed.size());
+    transactions.GetStoredBuckets(stored, count, a);
+    transactions.GetStoredBuckets(stored, count, c);
+    ASSERT_THROW(transactions.GetStoredBuckets(stored, count, b), Orthanc::OrthancException);
+
+    transactions.Discard(a);
+    transactions.Discard(c);
+    transactions.ListTransactions(listed);
+    ASSERT_TRUE(listed.empty());
+  }
+
+  {
+    // Committing while the buckets are still being stored: The
+    // commit doesn't wait for the stores, and the stores that start
+    // during the commit are rejected
+    std::string id = transactions.CreateTransaction(instances, buckets, BucketCompression_None, false);
+
+    size_t rejected = 0;
+    boost::thread worker(StoreUntilCommitted, &transactions, &id, &buckets, &content, &rejected);
+
+    ASSERT_THROW(transactions.Commit(id), Orthanc::OrthancException);
+    worker.join();
+    ASSERT_LE(rejected, buckets.size());
+
+    // The failed transaction is kept, and can be resumed
+    transactions.GetStoredBuckets(stored, count, id);
+    ASSERT_EQ(buckets.size() - rejected, stored.size());
+    transactions.Store(id, 0, content.c_str(), 1000);
+    ASSERT_THROW(transactions.Commit(id), Orthanc::OrthancException);
+
+    transactions.Discard(id);
+    transactions.ListTransactions(listed);
+    ASSERT_TRUE(listed.empty());
+  }
+
+  {
+    // The transactions that receive no query expire, which releases
+    // their storage
+    transactions.SetTimeout(60);
+    std::string id = transactions.CreateTransaction(instances, buckets, BucketCompression_None, false);
+    transactions.Store(id, 0, content.c_str(), 1000);
+    ASSERT_LT(0u, storage.GetMemorySize() + storage.GetDiskSize());
+
+    const boost::posix_time::ptime now = boost::posix_time::microsec_clock::universal_time();
+    transactions.RemoveExpiredTransactions(now + boost::posix_time::seconds(30));
+    transactions.ListTransactions(listed);
+    ASSERT_EQ(1u, listed.size());
+
+    transactions.RemoveExpiredTransactions(now + boost::posix_time::seconds(90));
+    transactions.ListTransactions(listed);
+    ASSERT_TRUE(listed.empty());
+    ASSERT_EQ(0u, storage.GetMemorySize() + storage.GetDiskSize());
+    ASSERT_THROW(transactions.Store(id, 0, content.c_str(), 1000), Orthanc::OrthancException);
+
+    transactions.SetTimeout(0);
+  }
+
+  {
+    // The commit of an empty transaction succeeds without Orthanc
+    std::string id = transactions.CreateTransaction(std::vector<DicomInstanceInfo>(),
+                                                    std::vector<TransferBucket>(), BucketCompression_None, false);
+    transactions.Commit(id);
+    ASSERT_THROW(transactions.Commit(id), Orthanc::OrthancException);
+    transactions.ListTransactions(listed);
+    ASSERT_TRUE(listed.empty());
+  }
+}
+
+
+namespace
+{
+  class CountingBucketReader : public OrthancPlugins::PushBodiesCache::IBucketReader
+  {
+  private:
+    std::string      body_;
+    mutable size_t   count_;
+
+  public:
+    explicit CountingBucketReader(const std::string& body) :
+      body_(body),
+      count_(0)
+    {
+    }
+
+    size_t GetCount() const
+    {
+      return count_;
+    }
+
+    virtual void ReadBucket(std::string& body) const
+    {
+      count_++;
+      body = body_;
+    }
+  };
+}
+
+
+TEST(PushBodiesCache, Consumers)
+{
+  using namespace OrthancPlugins;
+
+  CountingBucketReader a("aaaa"), b("bbbb");
+
+  PushBodiesCache cache(2, 3, 100);
+  cache.Skip(1, 2);  // Bucket 1 was already received by destination 2
+
+  std::string s;
+  cache.GetBody(s, 0, 0, a);  ASSERT_EQ("aaaa", s);
+  ASSERT_EQ(1u, a.GetCount());
+  ASSERT_EQ(4u, cache.GetMemorySize());
+
+  // Retrying the query of the same destination doesn't release the
+  // share of the other destinations
+  cache.GetBody(s, 0, 0, a);  ASSERT_EQ("aaaa", s);
+  cache.GetBody(s, 0, 1, a);  ASSERT_EQ("aaaa", s);
+  ASSERT_EQ(1u, a.GetCount());
+  ASSERT_EQ(4u, cache.GetMemorySize());
+  cache.GetBody(s, 0, 2, a);  ASSERT_EQ("aaaa", s);
+  ASSERT_EQ(1u, a.GetCount());
+  ASSERT_EQ(0u, cache.GetMemorySize());
+
+  // Reading the bucket after all the destinations got it
+  cache.GetBody(s, 0, 1, a);  ASSERT_EQ("aaaa", s);
+  ASSERT_EQ(2u, a.GetCount());
+  ASSERT_EQ(0u, cache.GetMemorySize());
+
+  cache.GetBody(s, 1, 1, b);  ASSERT_EQ("bbbb", s);
+  ASSERT_EQ(4u, cache.GetMemorySize());
+  cache.GetBody(s, 1, 0, b);  ASSERT_EQ("bbbb", s);
+  ASSERT_EQ(1u, b.GetCount());
+  ASSERT_EQ(0u, cache.GetMemorySize());
+
+  ASSERT_THROW(cache.GetBody(s, 2, 0, a), Orthanc::OrthancException);
+  ASSERT_THROW(cache.GetBody(s, 0, 3, a), Orthanc::OrthancException);
+  ASSERT_THROW(cache.Skip(0, 3), Orthanc::OrthancException);
+  ASSERT_THROW(cache.DropConsumer(3), Orthanc::OrthancException);
+}
+
+
+TEST(PushBodiesCache, MemoryBudget)
+{
+  using namespace OrthancPlugins;
+
+  CountingBucketReader a("aaaa"), b("bbbb"), c("cccc");
+
+  PushBodiesCache cache(3, 2, 8);
+
+  std::string s;
+  cache.GetBody(s, 0, 0, a);
+  cache.GetBody(s, 1, 0, b);
+  ASSERT_EQ(8u, cache.GetMemorySize());
+
+  // The budget is exhausted: The slow destination reads this bucket again
+  cache.GetBody(s, 2, 0, c);  ASSERT_EQ("cccc", s);
+  ASSERT_EQ(8u, cache.GetMemorySize());
+  cache.GetBody(s, 2, 1, c);  ASSERT_EQ("cccc", s);
+  ASSERT_EQ(2u, c.GetCount());
+
+  cache.GetBody(s, 0, 1, a);  ASSERT_EQ("aaaa", s);
+  cache.GetBody(s, 1, 1, b);  ASSERT_EQ("bbbb", s);
+  ASSERT_EQ(1u, a.GetCount());
+  ASSERT_EQ(1u, b.GetCount());
+  ASSERT_EQ(0u, cache.GetMemorySize());
+}
+
+
+TEST(PushBodiesCache, FailedConsumer)
+{
+  using namespace OrthancPlugins;
+
+  CountingBucketReader a("aaaa"), b("bbbb");
+
+  PushBodiesCache cache(2, 3, 100);
+
+  std::string s;
+  cache.GetBody(s, 0, 0, a);
+  cache.GetBody(s, 1, 0, b);
+  cache.GetBody(s, 0, 1, a);
+  ASSERT_EQ(8u, cache.GetMemorySize());
+
+  // Destination 2 has failed: Its share of the bodies is released,
+  // and the bodies are freed once the other destinations got them
+  cache.DropConsumer(2);
+  ASSERT_EQ(4u, cache.GetMemorySize());
+
+  cache.GetBody(s, 1, 1, b);  ASSERT_EQ("bbbb", s);
+  ASSERT_EQ(1u, b.GetCount());
+  ASSERT_EQ(0u, cache.GetMemorySize());
+
+  // Dropping the same destination twice has no effect
+  cache.DropConsumer(2);
+  ASSERT_EQ(0u, cache.GetMemorySize());
+}
+
+
+TEST(DownloadArea, Gzip)
+{
+  using namespace OrthancPlugins;
+
+  // Larger than the window that receives the inflated bytes
+  std::string s1, s2 = "Hello";
+  s1.resize(1024 * 1024);
+  for (size_t i = 0; i < s1.size(); i++)
+  {
+    s1[i] = static_cast<char>(i % 251);
+  }
+
+  std::string md1, md2;
+  Orthanc::Toolbox::ComputeMD5(md1, s1);
+  Orthanc::Toolbox::ComputeMD5(md2, s2);
+
+  std::vector<DicomInstanceInfo> instances;
+  instances.push_back(DicomInstanceInfo("d1", s1.size(), md1));
+  instances.push_back(DicomInstanceInfo("d2", s2.size(), md2));
+
+  TransferBucket b;
+  b.AddChunk(instances[0] /*d1*/, 0, s1.size());
+  b.AddChunk(instances[1] /*d2*/, 0, s2.size());
+
+  Orthanc::GzipCompressor compressor;
+
+  {
+    std::string t;
+    compressor.Compress(t, (s1 + s2).c_str(), s1.size() + s2.size());
+
+    DownloadArea area(instances);
+    ASSERT_THROW(area.WriteBucket(b, t.c_str(), t.size() / 2, BucketCompression_Gzip), Orthanc::OrthancException);
+    area.WriteBucket(b, t.c_str(), t.size(), BucketCompression_Gzip);
+
+    // The beginning of "d1" was received twice, so its MD5 sum is
+    // only checked at the commit
+    ASSERT_EQ(1u, area.GetVerifiedInstancesCount());
+    area.CheckMD5();
+  }
+
+  {
+    // Too much data in the bucket
+    std::string t;
+    compressor.Compress(t, (s1 + s2 + "!").c_str(), s1.size() + s2.size() + 1);
+
+    DownloadArea area(instances);
+    ASSERT_THROW(area.WriteBucket(b, t.c_str(), t.size(), BucketCompression_Gzip), Orthanc::OrthancException);
+  }
+}
+
+
+TEST(DownloadArea, Memory)
+{
+  using namespace OrthancPlugins;
+  
+  std::string s1 = "Hello";
+  std::string s2 = "Hello, World!";
+
+  std::string md1, md2;
+  Orthanc::Toolbox::ComputeMD5(md1, s1);
+  Orthanc::Toolbox::ComputeMD5(md2, s2);
+  
+  std::vector<DicomInstanceInfo> instances;
+  instances.push_back(DicomInstanceInfo("d1", s1.size(), md1));
+  instances.push_back(DicomInstanceInfo("d2", s2.size(), md2));
+
+  TemporaryStorage storage;
+  ASSERT_FALSE(storage.IsMemoryAllowed(1));
+
+  {
+    // The transfer is too large to be stored in RAM
+    storage.SetMemoryLimits(10, 100);
+    DownloadArea area(instances, storage);
+    ASSERT_EQ(0u, area.GetMemorySize());
+    ASSERT_EQ(0u, storage.GetMemorySize());
+  }
+
+  {
+    // Not enough RAM for "d2", which spills to the disk
+    storage.SetMemoryLimits(100, 10);
+    DownloadArea area(instances, storage);
+    ASSERT_EQ(s1.size(), area.GetMemorySize());
+    ASSERT_EQ(s1.size(), storage.GetMemorySize());
+
+    area.WriteInstance("d1", s1.c_str(), s1.size());
+    area.WriteInstance("d2", s2.c_str(), s2.size());
+    area.CheckMD5();
+  }
+
+  ASSERT_EQ(0u, storage.GetMemorySize());
+
+  {
+    storage.SetMemoryLimits(100, 100);
+    DownloadArea area(instances, storage);
+    ASSERT_EQ(s1.size() + s2.size(), area.GetMemorySize());
+    ASSERT_THROW(area.CheckMD5(), Orthanc::OrthancException);
+  }
+
+  {
+    DownloadArea area(instances, storage);
+
+    {
+      TransferBucket b;
+      b.AddChunk(instances[0] /*d1*/, 0, 5);
+      b.AddChunk(instances[1] /*d2*/, 0, 4);
+      std::string s = s1 + s2.substr(0, 4);
+      area.WriteBucket(b, s.c_str(), s.size(), BucketCompression_None);
+    }
+
+    {
+      TransferBucket b;
+      b.AddChunk(instances[1] /*d2*/, 4, 9);
+      std::string s = s2.substr(4);
+      area.WriteBucket(b, s.c_str(), s.size(), BucketCompression_None);
+    }
+
+    area.CheckMD5();
+  }
+
+  ASSERT_EQ(0u, storage.GetMemorySize());
+}
+
+
+TEST(DownloadArea, DiskQuota)
+{
+  using namespace OrthancPlugins;
+  
+  std::string s1 = "Hello";
+  std::string s2 = "Hello, World!";
+
+  std::string md1, md2;
+  Orthanc::Toolbox::ComputeMD5(md1, s1);
+  Orthanc::Toolbox::ComputeMD5(md2, s2);
+  
+  std::vector<DicomInstanceInfo> instances;
+  instances.push_back(DicomInstanceInfo("d1", s1.size(), md1));
+  instances.push_back(DicomInstanceInfo("d2", s2.size(), md2));
+
+  TemporaryStorage storage;
+  storage.SetDirectory((boost::filesystem::temp_directory_path() / Orthanc::Toolbox::GenerateUuid()).string());
+  storage.SetMaxDiskSize(20);
+  ASSERT_TRUE(storage.IsDiskAllowed(s1.size() + s2.size()));
+  ASSERT_FALSE(storage.IsDiskAllowed(21));
+
+  {
+    DownloadArea area(instances, storage);
+    ASSERT_EQ(s1.size() + s2.size(), area.GetDiskSize());
+    ASSERT_EQ(s1.size() + s2.size(), storage.GetDiskSize());
+    ASSERT_EQ(s1.size() + s2.size(), storage.GetUnallocatedDiskSize());
+
+    // The temporary files are only created once some chunk is received
+    ASSERT_EQ(0, std::distance(boost::filesystem::directory_iterator(storage.GetDirectory()),
+                               boost::filesystem::directory_iterator()));
+
+    // The quota is exhausted by the first transfer
+    try
+    {
+      DownloadArea area2(instances, storage);
+      FAIL();
+    }
+    catch (Orthanc::OrthancException& e)
+    {
+      ASSERT_EQ(Orthanc::ErrorCode_FullStorage, e.GetErrorCode());
+    }
+
+    ASSERT_EQ(s1.size() + s2.size(), storage.GetDiskSize());
+
+    area.WriteInstance("d1", s1.c_str(), s1.size());
+    ASSERT_EQ(1, std::distance(boost::filesystem::directory_iterator(storage.GetDirectory()),
+                               boost::filesystem::directory_iterator()));
+    ASSERT_EQ(s2.size(), storage.GetUnallocatedDiskSize());
+
+    area.WriteInstance("d2", s2.c_str(), s2.size());
+    area.CheckMD5();
+  }
+
+  ASSERT_EQ(0u, storage.GetDiskSize());
+  ASSERT_EQ(0u, storage.GetUnallocatedDiskSize());
+  boost::filesystem::remove_all(storage.GetDirectory());
+}
+
+
+static void CheckResume(bool singleFileLayout)
+{
+  using namespace OrthancPlugins;
+
+  std::string s1 = "Hello";
+  std::string s2 = "Hello, World!";
+
+  std::string md1, md2;
+  Orthanc::Toolbox::ComputeMD5(md1, s1);
+  Orthanc::Toolbox::ComputeMD5(md2, s2);
+
+  TransferScheduler scheduler;
+  scheduler.AddInstance(DicomInstanceInfo("d1", s1.size(), md1));
+  scheduler.AddInstance(DicomInstanceInfo("d2", s2.size(), md2));
+
+  std::vector<DicomInstanceInfo> instances;
+  scheduler.ListInstances(instances);
+  ASSERT_EQ(2u, instances.size());
+  ASSERT_EQ("d1", instances[0].GetId());
+
+  TransferBucket b1, b2, b3;
+  b1.AddChunk(instances[0] /*d1*/, 0, 5);
+  b1.AddChunk(instances[1] /*d2*/, 0, 4);
+  b2.AddChunk(instances[1] /*d2*/, 4, 5);
+  b3.AddChunk(instances[1] /*d2*/, 9, 4);
+
+  TemporaryStorage storage;
+  storage.SetDirectory((boost::filesystem::temp_directory_path() / Orthanc::Toolbox::GenerateUuid()).string());
+  storage.SetSingleFileLayout(singleFileLayout);
+
+  const std::string directory = storage.CreateWorkDirectoryPath();
+  ASSERT_TRUE(storage.IsWorkDirectoryPath(directory));
+  ASSERT_FALSE(storage.IsWorkDirectoryPath(storage.GetDirectory()));
+  ASSERT_FALSE(storage.IsWorkDirectoryPath("/etc/" + Orthanc::Toolbox::GenerateUuid()));
+
+  {
+    DownloadArea area(scheduler, storage, directory);
+    ASSERT_EQ(0u, area.GetResumedSize());
+    ASSERT_FALSE(area.IsBucketReceived(b1));
+
+    std::string s = s1 + s2.substr(0, 4);
+    area.WriteBucket(b1, s.c_str(), s.size(), BucketCompression_None);
+    ASSERT_TRUE(area.IsBucketReceived(b1));
+    ASSERT_FALSE(area.IsBucketReceived(b2));
+
+    // Wrong content for the end of "d2"
+    area.WriteBucket(b3, "Nope", 4, BucketCompression_None);
+  }
+
+  {
+    // Resume the interrupted transfer
+    DownloadArea area(scheduler, storage, directory);
+    ASSERT_EQ(13u, area.GetResumedSize());
+    ASSERT_TRUE(area.IsBucketReceived(b1));
+    ASSERT_FALSE(area.IsBucketReceived(b2));
+    ASSERT_TRUE(area.IsBucketReceived(b3));
+
+    area.WriteBucket(b2, s2.c_str() + 4, 5, BucketCompression_None);
+    ASSERT_THROW(area.CheckMD5(), Orthanc::OrthancException);
+  }
+
+  {
+    // The corrupted instance must be downloaded again
+    DownloadArea area(scheduler, storage, directory);
+    ASSERT_EQ(5u, area.GetResumedSize());
+    ASSERT_FALSE(area.IsBucketReceived(b1));
+    ASSERT_FALSE(area.IsBucketReceived(b2));
+    ASSERT_FALSE(area.IsBucketReceived(b3));
+
+    area.WriteBucket(b1, (s1 + s2.substr(0, 4)).c_str(), 9, BucketCompression_None);
+    area.WriteBucket(b2, s2.c_str() + 4, 5, BucketCompression_None);
+    area.WriteBucket(b3, s2.c_str() + 9, 4, BucketCompression_None);
+    area.CheckMD5();
+  }
+
+  {
+    // The work directory is removed while the area is alive (job
+    // canceled): No state must be written back
+    DownloadArea area(scheduler, storage, directory);
+    boost::filesystem::remove_all(directory);
+  }
+
+  ASSERT_FALSE(boost::filesystem::exists(directory));
+
+  boost::filesystem::remove_all(storage.GetDirectory());
+}
+
+
+TEST(DownloadArea, Resume)
+{
+  CheckResume(true);
+  CheckResume(false);
+}
+
+
+TEST(DownloadArea, ResumeCommitted)
+{
+  using namespace OrthancPlugins;
+
+  std::string s1 = "Hello";
+  std::string s2 = "Hello, World!";
+  std::string s3 = "World";
+
+  std::string md1, md2, md3;
+  Orthanc::Toolbox::ComputeMD5(md1, s1);
+  Orthanc::Toolbox::ComputeMD5(md2, s2);
+  Orthanc::Toolbox::ComputeMD5(md3, s3);
+
+  std::vector<DicomInstanceInfo> instances;
+  instances.push_back(DicomInstanceInfo("d1", s1.size(), md1));
+  instances.push_back(DicomInstanceInfo("d2", s2.size(), md2));
+  instances.push_back(DicomInstanceInfo("d3", s3.size(), md3));
+
+  TransferBucket b1, b2, b3;
+  b1.AddChunk(instances[0] /*d1*/, 0, 5);
+  b2.AddChunk(instances[1] /*d2*/, 0, 9);
+  b3.AddChunk(instances[1] /*d2*/, 9, 4);
+
+  TemporaryStorage storage;
+  storage.SetDirectory((boost::filesystem::temp_directory_path() / Orthanc::Toolbox::GenerateUuid()).string());
+  storage.SetSingleFileLayout(true);
+
+  const std::string directory = storage.CreateWorkDirectoryPath();
+
+  {
+    TransferScheduler scheduler;
+    for (size_t i = 0; i < instances.size(); i++)
+    {
+      scheduler.AddInstance(instances[i]);
+    }
+
+    DownloadArea area(scheduler, storage, directory);
+    area.WriteBucket(b1, s1.c_str(), s1.size(), BucketCompression_None);
+    area.WriteBucket(b2, s2.c_str(), 9, BucketCompression_None);
+  }
+
+  {
+    // "d1" has been committed by the streaming commit before the
+    // interruption, so it is not part of the resumed transfer
+    // anymore: The offset of "d2" in the transfer file must not move
+    TransferScheduler scheduler;
+    scheduler.AddInstance(instances[1]);
+    scheduler.AddInstance(instances[2]);
+
+    DownloadArea area(scheduler, storage, directory);
+    ASSERT_EQ(9u, area.GetResumedSize());
+    ASSERT_TRUE(area.IsBucketReceived(b2));
+    ASSERT_FALSE(area.IsBucketReceived(b3));
+  }
+
+  {
+    // A new instance is appended to the layout of the transfer file
+    DicomInstanceInfo d4("d4", s1.size(), md1);
+
+    TransferScheduler scheduler;
+    scheduler.AddInstance(instances[1]);
+    scheduler.AddInstance(instances[2]);
+    scheduler.AddInstance(d4);
+
+    DownloadArea area(scheduler, storage, directory);
+    ASSERT_EQ(9u, area.GetResumedSize());
+    ASSERT_TRUE(area.IsBucketReceived(b2));
+
+    TransferBucket b4, b5;
+    b4.AddChunk(instances[2] /*d3*/, 0, 5);
+    b5.AddChunk(d4, 0, 5);
+
+    area.WriteBucket(b3, s2.c_str() + 9, 4, BucketCompression_None);
+    area.WriteBucket(b4, s3.c_str(), s3.size(), BucketCompression_None);
+    area.WriteBucket(b5, s1.c_str(), s1.size(), BucketCompression_None);
+    area.CheckMD5();
+  }
+
+  {
+    // Without a state, the transfer file cannot be trusted anymore
+    boost::filesystem::remove(boost::filesystem::path(directory) / "state.json");
+
+    TransferScheduler scheduler;
+    scheduler.AddInstance(instances[1]);
+
+    DownloadArea area(scheduler, storage, directory);
+    ASSERT_EQ(0u, area.GetResumedSize());
+    ASSERT_FALSE(area.IsBucketReceived(b2));
+  }
+
+  boost::filesystem::remove_all(storage.GetDirectory());
+}
+
+
+TEST(TemporaryStorage, Reservations)
+{
+  using namespace OrthancPlugins;
+
+  TemporaryStorage storage;
+  storage.SetDirectory((boost::filesystem::temp_directory_path() / Orthanc::Toolbox::GenerateUuid()).string());
+
+  // The single-file layout must be explicitly enabled
+  ASSERT_FALSE(storage.IsSingleFileLayout());
+
+  boost::filesystem::create_directories(storage.GetDirectory());
+  const size_t available = static_cast<size_t>(boost::filesystem::space(storage.GetDirectory()).available);
+  const size_t large = available / 3 * 2;
+
+  ASSERT_EQ(0u, storage.GetReleasesCount());
+  ASSERT_THROW(storage.ReserveDisk(10, 20), Orthanc::OrthancException);
+
+  ASSERT_TRUE(storage.IsDiskAvailable(large, large));
+  ASSERT_TRUE(storage.ReserveDisk(large, large));
+  ASSERT_EQ(large, storage.GetUnallocatedDiskSize());
+
+  // The first reservation is not preallocated yet, but the space is not free anymore
+  ASSERT_FALSE(storage.IsDiskAvailable(large, large));
+  ASSERT_FALSE(storage.ReserveDisk(large, large));
+  ASSERT_TRUE(storage.ReserveDisk(large, 0));  // Already allocated files
+  ASSERT_EQ(2 * large, storage.GetDiskSize());
+
+  storage.ReleaseDisk(large);
+  ASSERT_EQ(1u, storage.GetReleasesCount());
+
+  // The second one can be reserved once the first one is given back
+  storage.ReleaseUnallocatedDisk(large);
+  ASSERT_EQ(0u, storage.GetUnallocatedDiskSize());
+  ASSERT_THROW(storage.ReleaseUnallocatedDisk(1), Orthanc::OrthancException);
+  ASSERT_TRUE(storage.IsDiskAvailable(large, large));
+
+  storage.ReleaseDisk(large);
+  ASSERT_EQ(0u, storage.GetDiskSize());
+  ASSERT_EQ(2u, storage.GetReleasesCount());
+
+  storage.SetMaxDiskSize(100);
+  ASSERT_FALSE(storage.IsDiskAvailable(101, 0));
+  ASSERT_TRUE(storage.IsDiskAvailable(100, 0));
+
+  boost::filesystem::remove_all(storage.GetDirectory());
+}
+
+
+TEST(TemporaryStorage, RemoveStaleFiles)
+{
+  using namespace OrthancPlugins;
+
+  const std::string root = (boost::filesystem::temp_directory_path() / Orthanc::Toolbox::GenerateUuid()).string();
+
+  TemporaryStorage storage;
+  storage.SetDirectory(root);
+
+  // Nothing to do if the directory doesn't exist yet
+  storage.RemoveStaleFiles(0);
+
+  const std::time_t old = std::time(NULL) - 7200;
+
+  const std::string recent = storage.CreateWorkDirectoryPath();
+  const std::string stale = storage.CreateWorkDirectoryPath();
+  TemporaryStorage::CreateDirectory(recent);
+  TemporaryStorage::CreateDirectory(stale);
+  boost::filesystem::last_write_time(boost::filesystem::path(stale) / ".transfers-accelerator", old);
+  boost::filesystem::last_write_time(stale, old);
+
+  // Folder that looks like a work directory, but without the marker
+  const std::string unmarked = storage.CreateWorkDirectoryPath();
+  boost::filesystem::create_directories(unmarked);
+  boost::filesystem::last_write_time(unmarked, old);
+
+  const std::string other = (boost::filesystem::path(root) / "other").string();
+  Orthanc::SystemToolbox::WriteFile("", other);
+
+  std::string crashed;
+  std::string running;
+
+  {
+    // Another process that has crashed long ago, leaving its
+    // temporary file behind
+    TemporaryStorage storage2;
+    storage2.SetDirectory(root);
+
+    std::unique_ptr<Orthanc::TemporaryFile> file(storage2.CreateTemporaryFile());
+    file->Write("Hello");
+    crashed = storage2.GetProcessDirectory();
+    ASSERT_NE(crashed, storage.GetProcessDirectory());
+
+    boost::filesystem::copy_file(file->GetPath(), (boost::filesystem::path(root) / "crashed.bak").string());
+  }
+
+  TemporaryStorage::CreateDirectory(crashed);
+  boost::filesystem::rename((boost::filesystem::path(root) / "crashed.bak").string(),
+                            (boost::filesystem::path(crashed) / "file").string());
+  boost::filesystem::last_write_time(boost::filesystem::path(crashed) / "file", old);
+  boost::filesystem::last_write_time(boost::filesystem::path(crashed) / ".transfers-accelerator", old);
+  boost::filesystem::last_write_time(crashed, old);
+
+  TemporaryStorage storage3;  // Another process that is still running
+  storage3.SetDirectory(root);
+  std::unique_ptr<Orthanc::TemporaryFile> live(storage3.CreateTemporaryFile());
+  live->Write("Hello");
+
+  std::unique_ptr<Orthanc::TemporaryFile> own(storage.CreateTemporaryFile());
+  own->Write("Hello");
+
+  storage.RemoveStaleFiles(3600);
+  ASSERT_TRUE(boost::filesystem::is_directory(recent));
+  ASSERT_FALSE(boost::filesystem::exists(stale));
+  ASSERT_FALSE(boost::filesystem::exists(crashed));
+  ASSERT_TRUE(boost::filesystem::exists(live->GetPath()));
+  ASSERT_TRUE(boost::filesystem::exists(own->GetPath()));
+  ASSERT_TRUE(boost::filesystem::exists(unmarked));  // Not created by the plugin
+  ASSERT_TRUE(boost::filesystem::exists(other));
+
+  own.reset();
+  live.reset();
+  boost::filesystem::remove_all(root);
+}
+
+
+TEST(DownloadArea, Commit)
+{
+  using namespace OrthancPlugins;
+
+  {
+    std::vector<DicomInstanceInfo> instances;
+    DownloadArea area(instances);
+    ASSERT_THROW(area.SetCommitThreadsCount(0), Orthanc::OrthancException);
+    ASSERT_THROW(area.SetCommitBatchSize(0), Orthanc::OrthancException);
+    ASSERT_THROW(area.WaitCommit(0), Orthanc::OrthancException);
+
+    area.StartCommit();
+    ASSERT_THROW(area.StartCommit(), Orthanc::OrthancException);
+    ASSERT_EQ(DownloadArea::CommitStatus_Success, area.WaitCommit(0));
+    area.StopCommit();
+    area.Commit();
+  }
+
+  {
+    std::vector<DicomInstanceInfo> instances;
+
+    for (size_t i = 0; i < 10; i++)
+    {
+      std::string id = "d" + boost::lexical_cast<std::string>(i);
+      instances.push_back(DicomInstanceInfo(id, 5, "nope"));
+    }
+
+    DownloadArea area(instances);
+    area.SetCommitThreadsCount(4);
+
+    for (size_t i = 0; i < instances.size(); i++)
+    {
+      TransferBucket b;
+      b.AddChunk(instances[i], 0, 5);
+      area.WriteBucket(b, "Hello", 5, BucketCompression_None);
+    }
+
+    // The MD5 sums are wrong, so the commit fails before reaching Orthanc
+    area.StartCommit();
+
+    DownloadArea::CommitStatus status;
+    do
+    {
+      status = area.WaitCommit(100);
+    }
+    while (status == DownloadArea::CommitStatus_Running);
+
+    ASSERT_EQ(DownloadArea::CommitStatus_Failure, status);
+    area.StopCommit();
+
+    size_t count;
+    uint64_t size;
+    float speed;
+    area.GetCommitStatistics(count, size, speed);
+    ASSERT_EQ(0u, count);
+    ASSERT_EQ(0u, size);
+
+    ASSERT_THROW(area.Commit(), Orthanc::OrthancException);
+  }
+
+  {
+    // The ZIP archives of the batches are created in the temporary
+    // storage, and count in its disk quota while they exist
+    std::vector<DicomInstanceInfo> instances;
+
+    for (size_t i = 0; i < 10; i++)
+    {
+      std::string id = "d" + boost::lexical_cast<std::string>(i);
+      instances.push_back(DicomInstanceInfo(id, 5, "nope"));
+    }
+
+    TemporaryStorage storage;
+    storage.SetDirectory((boost::filesystem::temp_directory_path() / Orthanc::Toolbox::GenerateUuid()).string());
+
+    for (size_t quota = 0; quota <= 50; quota += 50)
+    {
+      // With a quota of 50 bytes, there is no room for the archives,
+      // and the instances of the batches are imported one by one
+      storage.SetMaxDiskSize(quota);
+
+      {
+        DownloadArea area(instances, storage);
+        area.SetCommitBatchSize(5);
+
+        for (size_t i = 0; i < instances.size(); i++)
+        {
+          TransferBucket b;
+          b.AddChunk(instances[i], 0, 5);
+          area.WriteBucket(b, "Hello", 5, BucketCompression_None);
+        }
+
+        ASSERT_THROW(area.Commit(), Orthanc::OrthancException);
+        ASSERT_EQ(50u, storage.GetDiskSize());
+        ASSERT_EQ(0u, storage.GetUnallocatedDiskSize());
+      }
+
+      ASSERT_EQ(0u, storage.GetDiskSize());
+    }
+
+    boost::filesystem::remove_all(storage.GetDirectory());
+  }
+
+  {
+    std::string s = "Hello";
+    std::string md5;
+    Orthanc::Toolbox::ComputeMD5(md5, s);
+
+    std::vector<DicomInstanceInfo> instances;
+    instances.push_back(DicomInstanceInfo("d1", s.size(), md5));
+    instances.push_back(DicomInstanceInfo("d2", s.size(), "nope"));
+
+    DownloadArea area(instances);
+    area.StartStreamingCommit();
+    ASSERT_THROW(area.StartStreamingCommit(), Orthanc::OrthancException);
+
+    // Nothing to commit until some instance is complete
+    ASSERT_EQ(DownloadArea::CommitStatus_Running, area.WaitCommit(10));
+
+    {
+      TransferBucket b;
+      b.AddChunk(instances[1] /*d2*/, 0, 3);
+      area.WriteBucket(b, s.c_str(), 3, BucketCompression_None);
+    }
+
+    ASSERT_EQ(DownloadArea::CommitStatus_Running, area.WaitCommit(10));
+
+    {
+      TransferBucket b;
+      b.AddChunk(instances[1] /*d2*/, 3, 2);
+      area.WriteBucket(b, s.c_str() + 3, 2, BucketCompression_None);
+    }
+
+    // "d2" is complete, and its import fails before the end of the transfer
+    DownloadArea::CommitStatus status;
+    do
+    {
+      status = area.WaitCommit(100);
+    }
+    while (status == DownloadArea::CommitStatus_Running);
+
+    ASSERT_EQ(DownloadArea::CommitStatus_Failure, status);
+  }
+}
+
+
+TEST(DownloadArea, IncrementalMD5)
+{
+  using namespace OrthancPlugins;
+  
+  std::string s1 = "Hello, World!";
+  std::string s2 = "Hello";
+
+  std::string md1, md2;
+  Orthanc::Toolbox::ComputeMD5(md1, s1);
+  Orthanc::Toolbox::ComputeMD5(md2, s2);
+  
+  std::vector<DicomInstanceInfo> instances;
+  instances.push_back(DicomInstanceInfo("d1", s1.size(), md1));
+  instances.push_back(DicomInstanceInfo("d2", s2.size(), md2));
+
+  TemporaryStorage storage;
+  storage.SetMemoryLimits(100, 100);
+
+  for (unsigned int inMemory = 0; inMemory < 2; inMemory++)
+  {
+    std::unique_ptr<DownloadArea> area;
+    if (inMemory)
+    {
+      area.reset(new DownloadArea(instances, storage));
+    }
+    else
+    {
+      area.reset(new DownloadArea(instances));
+    }
+
+    ASSERT_EQ(0u, area->GetVerifiedInstancesCount());
+
+    // Out-of-order chunks for "d1"
+    const size_t offsets[] = { 10, 4, 0, 7 };
+    const size_t sizes[] = { 3, 3, 4, 3 };
+
+    for (size_t i = 0; i < 4; i++)
+    {
+      TransferBucket b;
+      b.AddChunk(instances[0] /*d1*/, offsets[i], sizes[i]);
+      std::string s = s1.substr(offsets[i], sizes[i]);
+      area->WriteBucket(b, s.c_str(), s.size(), BucketCompression_None);
+      ASSERT_EQ(i == 3 ? 1u : 0u, area->GetVerifiedInstancesCount());
+    }
+
+    // Corrupted "d2"
+    area->WriteInstance("d2", s2.c_str(), s2.size());
+    ASSERT_EQ(2u, area->GetVerifiedInstancesCount());
+
+    {
+      TransferBucket b;
+      b.AddChunk(instances[1] /*d2*/, 0, 1);
+      area->WriteBucket(b, "h", 1, BucketCompression_None);
+    }
+
+    ASSERT_EQ(1u, area->GetVerifiedInstancesCount());
+    ASSERT_THROW(area->CheckMD5(), Orthanc::OrthancException);
+  }
+}
+
+
+static void WriteBucketsWorker(OrthancPlugins::DownloadArea* area,
+                               const std::vector<OrthancPlugins::TransferBucket>* buckets,
+                               const std::string* content,
+                               size_t start,
+                               size_t step)
+{
+  for (size_t i = start; i < buckets->size(); i += step)
+  {
+    const OrthancPlugins::TransferBucket& bucket = (*buckets)[i];
+    std::string s = content->substr(bucket.GetChunkOffset(0), bucket.GetTotalSize());
+
+    std::string compressed;
+    Orthanc::GzipCompressor compressor;
+    compressor.Compress(compressed, s.c_str(), s.size());
+    area->WriteBucket(bucket, compressed.c_str(), compressed.size(), OrthancPlugins::BucketCompression_Gzip);
+  }
+}
+
+
+TEST(DownloadArea, Concurrent)
+{
+  using namespace OrthancPlugins;
+
+  std::string content;
+  content.resize(1000000);
+  for (size_t i = 0; i < content.size(); i++)
+  {
+    content[i] = static_cast<char>(i % 251);
+  }
+
+  std::string md5;
+  Orthanc::Toolbox::ComputeMD5(md5, content);
+
+  std::vector<DicomInstanceInfo> instances;
+  instances.push_back(DicomInstanceInfo("d1", content.size(), md5));
+
+  std::vector<TransferBucket> buckets;
+  for (size_t offset = 0; offset < content.size(); offset += 10000)
+  {
+    TransferBucket b;
+    b.AddChunk(instances[0], offset, 10000);
+    buckets.push_back(b);
+  }
+
+  DownloadArea area(instances);
+
+  static const size_t THREADS = 8;
+  std::vector<boost::thread*> threads;
+
+  for (size_t i = 0; i < THREADS; i++)
+  {
+    threads.push_back(new boost::thread(WriteBucketsWorker, &area, &buckets, &content, i, THREADS));
+  }
+
+  for (size_t i = 0; i < THREADS; i++)
+  {
+    threads[i]->join();
+    delete threads[i];
+  }
+
+  area.CheckMD5();
+}
+
+
+#if !defined(_WIN32)
+namespace
+{
+  /**
+   * Minimal HTTP/1.1 server on the loopback interface, that echoes the
+   * body of the queries, and that counts the TCP connections. The URIs
+   * under "/missing" are not found, those under "/error/" always fail,
+   * and those under "/flaky/" fail once.
+   **/
+  class LoopbackServer : public boost::noncopyable
+  {
+  private:
+    int            socket_;
+    uint16_t       port_;
+    boost::thread  thread_;
+    boost::mutex   mutex_;
+    size_t         connections_;
+    std::set<std::string>  failed_;
+
+    static bool ReadQuery(std::string& uri,
+                          std::string& range,
+                          std::string& body,
+                          int fd)
+    {
+      std::string buffer;
+      size_t headersEnd;
+
+      while ((headersEnd = buffer.find("\r\n\r\n")) == std::string::npos)
+      {
+        char tmp[4096];
+        ssize_t n = recv(fd, tmp, sizeof(tmp), 0);
+        if (n <= 0)
+        {
+          return false;
+        }
+        buffer.append(tmp, n);
+      }
+
+      size_t length = 0;
+      size_t pos = buffer.find("Content-Length: ");
+      if (pos != std::string::npos &&
+          pos < headersEnd)
+      {
+        length = boost::lexical_cast<size_t>(buffer.substr(pos + 16, buffer.find("\r\n", pos) - pos - 16));
+      }
+
+      range.clear();
+      pos = buffer.find("Range: bytes=");
+      if (pos != std::string::npos &&
+          pos < headersEnd)
+      {
+        range = buffer.substr(pos + 13, buffer.find("\r\n", pos) - pos - 13);
+      }
+
+      body = buffer.substr(headersEnd + 4);
+      while (body.size() < length)
+      {
+        char tmp[4096];
+        ssize_t n = recv(fd, tmp, sizeof(tmp), 0);
+        if (n <= 0)
+        {
+          return false;
+        }
+        body.append(tmp, n);
+      }
+
+      size_t start = buffer.find(' ') + 1;
+      uri = buffer.substr(start, buffer.find(' ', start) - start);
+      return true;
+    }
+
+    static void Worker(LoopbackServer* that)
+    {
+      for (;;)
+      {
+        int fd = accept(that->socket_, NULL, NULL);
+        if (fd < 0)
+        {
+          return;  // The server is closing
+        }
+
+        {
+          boost::mutex::scoped_lock lock(that->mutex_);
+          that->connections_++;
+        }
+
+        std::string uri, range, body;
+        while (ReadQuery(uri, range, body, fd))
+        {
+          std::string answer;
+          bool isFirstFailure;
+
+          {
+            boost::mutex::scoped_lock lock(that->mutex_);
+            isFirstFailure = that->failed_.insert(uri).second;
+          }
+
+          if (boost::starts_with(uri, "/missing"))
+          {
+            answer = "HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\n\r\n";
+          }
+          else if (boost::starts_with(uri, "/error/") ||
+                   (boost::starts_with(uri, "/flaky/") && isFirstFailure))
+          {
+            answer = "HTTP/1.1 500 Internal Server Error\r\nContent-Length: 0\r\n\r\n";
+          }
+          else if (!range.empty())
+          {
+            answer = ("HTTP/1.1 206 Partial Content\r\nContent-Length: " +
+                      boost::lexical_cast<std::string>(range.size()) + "\r\n\r\n" + range);
+          }
+          else
+          {
+            answer = ("HTTP/1.1 200 OK\r\nContent-Length: " + boost::lexical_cast<std::string>(uri.size() + body.size()) +
+                      "\r\n\r\n" + uri + body);
+          }
+
+          if (send(fd, answer.c_str(), answer.size(), 0) != static_cast<ssize_t>(answer.size()))
+          {
+            break;
+          }
+        }
+
+        close(fd);
+      }
+    }
+
+  public:
+    LoopbackServer() :
+      connections_(0)
+    {
+      socket_ = socket(AF_INET, SOCK_STREAM, 0);
+
+      struct sockaddr_in address;
+      memset(&address, 0, sizeof(address));
+      address.sin_family = AF_INET;
+      address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+      address.sin_port = 0;  // Let the system choose the port
+
+      socklen_t length = sizeof(address);
+      if (socket_ < 0 ||
+          bind(socket_, reinterpret_cast<struct sockaddr*>(&address), sizeof(address)) != 0 ||
+          listen(socket_, 16) != 0 ||
+          getsockname(socket_, reinterpret_cast<struct sockaddr*>(&address), &length) != 0)
+      {
+        throw Orthanc::OrthancException(Orthanc::ErrorCode_HttpPortInUse);
+      }
+
+      port_ = ntohs(address.sin_port);
+      thread_ = boost::thread(Worker, this);
+    }
+
+    ~LoopbackServer()
+    {
+      shutdown(socket_, SHUT_RDWR);
+      close(socket_);
+      thread_.join();
+    }
+
+    uint16_t GetPort() const
+    {
+      return port_;
+    }
+
+    size_t GetConnectionsCount()
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+      return connections_;
+    }
+  };
+}
+
+
+TEST(NativeHttpClient, KeepAlive)
+{
+  LoopbackServer server;
+
+  Json::Value peers = Json::objectValue;
+  peers["loopback"] = Json::arrayValue;
+  peers["loopback"].append("http://127.0.0.1:" + boost::lexical_cast<std::string>(server.GetPort()) + "/");
+
+  OrthancPlugins::NativeHttpClient client;
+  client.LoadPeers(peers);
+  ASSERT_TRUE(client.HasPeer("loopback"));
+  ASSERT_FALSE(client.HasPeer("nope"));
+  ASSERT_EQ(0u, client.GetIdleConnectionsCount("loopback"));
+
+  std::string answer;
+  uint16_t status;
+  OrthancPlugins::HttpHeaders headers;
+
+  for (size_t i = 0; i < 5; i++)
+  {
+    ASSERT_TRUE(client.Call(answer, status, "loopback", Orthanc::HttpMethod_Put, "/transfers/push/" +
+                            boost::lexical_cast<std::string>(i), headers, "body", 10));
+    ASSERT_EQ(200, status);
+    ASSERT_EQ("/transfers/push/" + boost::lexical_cast<std::string>(i) + "body", answer);
+  }
+
+  ASSERT_TRUE(client.Call(answer, status, "loopback", Orthanc::HttpMethod_Get, "/hello", headers, "ignored", 10));
+  ASSERT_EQ("/hello", answer);
+
+  headers["Range"] = "bytes=10-19";
+  ASSERT_TRUE(client.Call(answer, status, "loopback", Orthanc::HttpMethod_Get, "/file", headers, "", 10));
+  ASSERT_EQ(206, status);
+  ASSERT_EQ("10-19", answer);
+  headers.clear();
+
+  ASSERT_FALSE(client.Call(answer, status, "loopback", Orthanc::HttpMethod_Delete, "/missing", headers, "", 10));
+  ASSERT_EQ(404, status);
+
+  // All the queries have been sent through one single connection
+  ASSERT_EQ(1u, client.GetIdleConnectionsCount("loopback"));
+  ASSERT_EQ(1u, server.GetConnectionsCount());
+
+  ASSERT_THROW(client.Call(answer, status, "nope", Orthanc::HttpMethod_Get, "/", headers, "", 10), Orthanc::OrthancException);
+}
+
+
+namespace
+{
+  class LoopbackQuery : public OrthancPlugins::IHttpQuery
+  {
+  private:
+    std::string  peer_;
+    std::string  uri_;
+
+  public:
+    explicit LoopbackQuery(const std::string& uri) :
+      peer_("loopback"),
+      uri_(uri)
+    {
+    }
+
+    virtual Orthanc::HttpMethod GetMethod() const
+    {
+      return Orthanc::HttpMethod_Get;
+    }
+
+    virtual const std::string& GetPeer() const
+    {
+      return peer_;
+    }
+
+    virtual const std::string& GetUri() const
+    {
+      return uri_;
+    }
+
+    virtual void ReadBody(std::string& body) const
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_InternalError);
+    }
+
+    virtual void HandleAnswer(const void* answer,
+                              size_t size)
+    {
+      if (std::string(reinterpret_cast<const char*>(answer), size) != uri_)
+      {
+        throw Orthanc::OrthancException(Orthanc::ErrorCode_NetworkProtocol);
+      }
+    }
+  };
+
+
+  // Sends the queries to the given URIs through the native HTTP
+  // client, without any retry so that the failures are immediately
+  // requeued
+  OrthancPlugins::HttpQueriesQueue::Status RunLoopbackQueries(size_t& requeuedQueriesCount,
+                                                              size_t& successQueriesCount,
+                                                              bool& isPermanentFailure,
+                                                              const std::vector<std::string>& uris,
+                                                              unsigned int maxRequeues)
+  {
+    LoopbackServer server;
+
+    Json::Value configuration = Json::objectValue;
+    configuration["OrthancPeers"]["loopback"].append(
+      "http://127.0.0.1:" + boost::lexical_cast<std::string>(server.GetPort()) + "/");
+    OrthancPlugins::NativeHttpClient::GlobalInitialize(configuration);
+
+    OrthancPlugins::HttpQueriesQueue::Status status;
+
+    {
+      OrthancPlugins::HttpQueriesQueue queue;
+      queue.SetTimeout(10);
+      queue.SetMaxRetries(0);
+      queue.SetMaxRequeues(maxRequeues);
+
+      for (size_t i = 0; i < uris.size(); i++)
+      {
+        queue.Enqueue(new LoopbackQuery(uris[i]));
+      }
+
+      {
+        OrthancPlugins::HttpQueriesRunner runner(queue, 1);  // The server is single-threaded
+
+        do
+        {
+          status = queue.WaitComplete(100);
+        }
+        while (status == OrthancPlugins::HttpQueriesQueue::Status_Running);
+      }
+
+      size_t scheduled;
+      uint64_t downloaded, uploaded;
+      queue.GetStatistics(scheduled, successQueriesCount, requeuedQueriesCount, downloaded, uploaded);
+      isPermanentFailure = queue.IsPermanentFailure();
+    }
+
+    OrthancPlugins::NativeHttpClient::GlobalFinalize();
+    return status;
+  }
+}
+
+
+TEST(HttpQueriesQueue, Requeue)
+{
+  std::vector<std::string> uris;
+  for (size_t i = 0; i < 20; i++)
+  {
+    // 5 queries fail once: Within the budget of 5 + 5% requeues
+    uris.push_back((i % 4 == 0 ? "/flaky/" : "/ok/") + boost::lexical_cast<std::string>(i));
+  }
+
+  size_t requeued, success;
+  bool permanent;
+  ASSERT_EQ(OrthancPlugins::HttpQueriesQueue::Status_Success, RunLoopbackQueries(requeued, success, permanent, uris, 1));
+  ASSERT_EQ(5u, requeued);
+  ASSERT_EQ(20u, success);
+
+  // A query that always fails is requeued "maxRequeues" times
+  uris.clear();
+  uris.push_back("/ok/0");
+  uris.push_back("/error/0");
+  ASSERT_EQ(OrthancPlugins::HttpQueriesQueue::Status_Failure, RunLoopbackQueries(requeued, success, permanent, uris, 3));
+  ASSERT_EQ(3u, requeued);
+  ASSERT_EQ(1u, success);
+  ASSERT_FALSE(permanent);
+
+  // A permanent error is never requeued
+  uris.clear();
+  uris.push_back("/missing");
+  ASSERT_EQ(OrthancPlugins::HttpQueriesQueue::Status_Failure, RunLoopbackQueries(requeued, success, permanent, uris, 3));
+  ASSERT_EQ(0u, requeued);
+  ASSERT_TRUE(permanent);
+}
+
+
+TEST(HttpQueriesQueue, RequeuesBudget)
+{
+  std::vector<std::string> uris;
+  for (size_t i = 0; i < 20; i++)
+  {
+    // 7 queries fail once: Above the budget of 6 requeues
+    uris.push_back((i < 7 ? "/flaky/" : "/ok/") + boost::lexical_cast<std::string>(i));
+  }
+
+  size_t requeued, success;
+  bool permanent;
+  ASSERT_EQ(OrthancPlugins::HttpQueriesQueue::Status_Failure, RunLoopbackQueries(requeued, success, permanent, uris, 3));
+  ASSERT_EQ(6u, requeued);
+}
+
+
+TEST(HttpQueriesQueue, FailingSource)
+{
+  // The servers are single-threaded: One server per peer
+  LoopbackServer server, brokenServer;
+
+  // "broken" answers 404 to everything, and nothing listens on "down"
+  Json::Value configuration = Json::objectValue;
+  configuration["OrthancPeers"]["loopback"].append(
+    "http://127.0.0.1:" + boost::lexical_cast<std::string>(server.GetPort()) + "/");
+  configuration["OrthancPeers"]["broken"].append(
+    "http://127.0.0.1:" + boost::lexical_cast<std::string>(brokenServer.GetPort()) + "/missing/");
+  configuration["OrthancPeers"]["down"].append("http://127.0.0.1:1/");
+  OrthancPlugins::NativeHttpClient::GlobalInitialize(configuration);
+
+  for (unsigned int i = 0; i < 2; i++)
+  {
+    const std::string mirror = (i == 0 ? "broken" : "down");
+
+    OrthancPlugins::HttpQueriesQueue queue;
+    queue.SetTimeout(10);
+    queue.SetMaxRetries(0);
+
+    std::vector<std::string> sources;
+    sources.push_back("loopback");
+    sources.push_back(mirror);
+    queue.SetSources(sources);
+
+    for (size_t j = 0; j < 10; j++)
+    {
+      queue.Enqueue(new LoopbackQuery("/ok/" + boost::lexical_cast<std::string>(j)));
+    }
+
+    // The two sources take the queries in turn
+    bool hasMirror = true;
+    size_t mirrorQueries = 0;
+
+    while (queue.WaitComplete(0) == OrthancPlugins::HttpQueriesQueue::Status_Running)
+    {
+      size_t traffic;
+      boost::posix_time::ptime notBefore;
+
+      if (hasMirror)
+      {
+        mirrorQueries++;
+        hasMirror = queue.ExecuteOneQuery(traffic, notBefore, mirror);
+      }
+
+      queue.ExecuteOneQuery(traffic, notBefore, "loopback");
+    }
+
+    // The failing mirror is not used anymore, and its queries are
+    // sent to the main peer without charging the budget of requeues
+    ASSERT_EQ(OrthancPlugins::HttpQueriesQueue::Status_Success, queue.WaitComplete(0));
+    ASSERT_FALSE(hasMirror);
+    ASSERT_EQ(i == 0 ? 1u : 3u, mirrorQueries);
+
+    std::set<std::string> disabled;
+    queue.GetDisabledSources(disabled);
+    ASSERT_EQ(1u, disabled.size());
+    ASSERT_EQ(mirror, *disabled.begin());
+
+    size_t scheduled, success, requeued;
+    uint64_t downloaded, uploaded;
+    queue.GetStatistics(scheduled, success, requeued, downloaded, uploaded);
+    ASSERT_EQ(10u, success);
+    ASSERT_EQ(0u, requeued);
+  }
+
+  {
+    // The last source cannot be disabled
+    OrthancPlugins::HttpQueriesQueue queue;
+    queue.SetTimeout(10);
+    queue.SetMaxRetries(0);
+
+    std::vector<std::string> sources;
+    sources.push_back("broken");
+    sources.push_back("down");
+    queue.SetSources(sources);
+    queue.Enqueue(new LoopbackQuery("/ok/0"));
+
+    size_t traffic;
+    boost::posix_time::ptime notBefore;
+    ASSERT_FALSE(queue.ExecuteOneQuery(traffic, notBefore, "broken"));
+    ASSERT_EQ(OrthancPlugins::HttpQueriesQueue::Status_Running, queue.WaitComplete(0));
+
+    while (queue.WaitComplete(0) == OrthancPlugins::HttpQueriesQueue::Status_Running)
+    {
+      queue.ExecuteOneQuery(traffic, notBefore, "down");
+    }
+
+    ASSERT_EQ(OrthancPlugins::HttpQueriesQueue::Status_Failure, queue.WaitComplete(0));
+  }
+
+  OrthancPlugins::NativeHttpClient::GlobalFinalize();
+}
+
+TEST(HttpQueriesQueue, FormatActivity)
+{
+  OrthancPlugins::HttpQueriesQueue a, b;
+
+  const boost::posix_time::ptime now = boost::posix_time::microsec_clock::universal_time();
+  a.GetRecentStatistics().AddQuery(1024, 10, now);
+  b.GetRecentStatistics().AddQuery(1024, 30, now);
+  b.GetRecentStatistics().AddQuery(1024, 40, now);
+
+  std::vector<OrthancPlugins::HttpQueriesQueue*> queues;
+  queues.push_back(&a);
+  queues.push_back(&b);
+
+  Json::Value activity;
+  OrthancPlugins::HttpQueriesQueue::FormatActivity(activity, queues);
+  ASSERT_EQ(Json::objectValue, activity.type());
+  ASSERT_EQ(7u, activity.size());
+  ASSERT_EQ(0u, activity["ActiveHttpQueries"].asUInt());
+  ASSERT_EQ(0u, activity["RetriedHttpQueries"].asUInt());
+
+  // The latencies of the slowest queue are reported
+  ASSERT_EQ(40u, activity["LatencyP99MS"].asUInt());
+
+  queues.resize(1);
+  OrthancPlugins::HttpQueriesQueue::FormatActivity(activity, queues);
+  ASSERT_EQ(10u, activity["LatencyP99MS"].asUInt());
+}
+#endif
+
+
 
 int main(int argc, char **argv)
 {
@@ -436,9 +2928,11 @@ int main(int argc, char **argv)
   Orthanc::Logging::Initialize();
   Orthanc::Logging::EnableInfoLevel(true);
   Orthanc::Logging::EnableTraceLevel(true);
+  Orthanc::HttpClient::GlobalInitialize();
 
   int result = RUN_ALL_TESTS();
 
+  Orthanc::HttpClient::GlobalFinalize();
   Orthanc::Logging::Finalize();
 
   return result;